@@ -15,560 +15,7044 @@ simplify parsing code while being somewhat extensible.
 
 Header:
     4 byte request code ('drop', et.c.)
-    2 byte request ID (caller specific, non-zero identifier for the request)
+    2 byte signed little endian request ID (caller specific, non-zero identifier for the request)
     2 byte unsigned little endian body length (max 65535 bytes)
 
 Body:
     <length> bytes json encoded object
 
+The 'init' reply body may list optional app capabilities:
+
+    {"capabilities": ["pollBatch"]}
+
+pollBatch - the app accepts 'pall', which returns several completed
+requests in one reply body:
+
+    2 byte unsigned little endian count of completions still pending
+    Repeated for each completion in this reply:
+        2 byte unsigned little endian completion length
+        <length> bytes json encoded completion
+
+notify - the app sends an unsolicited 'note' frame, with request ID zero
+and no body, when there are new completed requests to poll for. The SDK
+then only polls when notified.
+
+Frames can carry a handle for the app. On POSIX, the file descriptor
+is passed along with the frame using SCM_RIGHTS. On Windows, the handle
+is duplicated into the app process, and its value is sent as "handle"
+in the frame body.
+
+sharedMemory - right after 'init', the SDK sends 'shmm' with a handle
+for a shared memory region used for request bodies above the 64 KiB
+frame limit:
+
+    {"size": <region size in bytes>}
+
+Such bodies are then sent as 'sdrp' (shared drop) frames, with a
+reference to the body written into the region:
+
+    8 byte unsigned little endian offset into the region
+    8 byte unsigned little endian body length
+
+The region may be reused once 'sdrp' has been replied to.
+
+stemHandles - before a drop, the SDK may send 'stem' frames with the
+same request ID, each with a handle for the audio data of one stem,
+either a shared memory region or an open file:
+
+    {"name": "<name>", "length": <data length in bytes>}
+
+The drop request then refers to the stem as "stem:<name>".
+
+chunkedStems - apps without stemHandles may take the audio itself.
+Before a drop, the SDK sends 'rsum' with the same request ID for each
+stem, with the hash of the whole stem:
+
+    {"name": "<name>", "length": <data length in bytes>,
+     "chunkSize": <bytes per chunk>, "hash": "xxh64:<16 hex digits>"}
+
+The reply tells how much of the stem the app already has from an earlier
+attempt, a multiple of the chunk size, or zero:
+
+    {"offset": <bytes>}
+
+The rest is sent as 'chnk' frames, in order, each with a chunk size of
+data but the last:
+
+    1 byte stem name length
+    <length> bytes stem name
+    8 byte unsigned little endian offset into the stem
+    8 byte unsigned little endian XXH64 of the chunk data
+    <data>
+
+The app fails a chunk that doesn't match its checksum, which the SDK
+then sends again. The chunk size stays the same for a stem across
+attempts, as long as the frame version does.
+
+Apps may send an unsolicited 'prog' frame, with the request ID of a
+drop in progress, to report on their handling of it:
+
+    8 byte unsigned little endian work done
+    8 byte unsigned little endian total work
+    <remaining bytes> stage name, up to 15 bytes
+
+frameV2 - right after 'init', the SDK sends 'vers', listing the body
+encodings it supports:
+
+    {"version": 2, "encodings": ["cbor"]}
+
+The reply lists the encodings the app accepts, in the same format. All
+frames after 'vers', in both directions, then have a version 2 header:
+
+    4 byte request code
+    2 byte unsigned little endian request ID
+    1 byte header version (2)
+    1 byte flags, bit 0 set for a CBOR encoded body
+    4 byte unsigned little endian body length
+
+Request bodies may then be up to AHMaxLargeRequestBody bytes, but reply
+bodies are still limited to AHMaxRequestBody bytes.
+
+cbor - once accepted, drops built from AHDropRequest fields are sent as
+CBOR, with the same structure as their JSON. The app then sends
+completions in 'poll' and 'pall' replies as CBOR too, flagging the
+reply frames. Only definite lengths, text strings, numbers, booleans,
+null, arrays and maps with text keys are used.
+
+Drops built from AHDropRequest fields may carry the content hashes of
+their "file:" URLs, which apps may use to skip content they already
+have, and otherwise ignore:
+
+    "contentHashes": {"file:///mix.wav": "xxh64:<16 hex digits>"}
+
 */
 
+// Expose posix_spawn, clock_gettime et.c. also in strict C modes
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "allihoopa.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
+
+// Platform types, used by the cross platform code
+
+typedef void (*ThreadEntry)(void* argument);
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef struct {
+    HANDLE handle;
+    ThreadEntry entry;
+    void* argument;
+} Thread;
+
+typedef SRWLOCK Mutex;
+#define MutexInitializer SRWLOCK_INIT
+
+typedef struct {
+    HANDLE event;
+} Signal;
+
+typedef HANDLE AppHandle;
+#define NoAppHandle NULL
+
+#else
+#include <pthread.h>
+#include <sys/types.h>
+
+typedef struct {
+    pthread_t handle;
+    ThreadEntry entry;
+    void* argument;
+} Thread;
+
+typedef pthread_mutex_t Mutex;
+#define MutexInitializer PTHREAD_MUTEX_INITIALIZER
+
+// An eventfd on Linux, a pipe elsewhere
+typedef struct {
+    int readFD;
+    int writeFD;
+} Signal;
+
+typedef int AppHandle;
+#define NoAppHandle -1
 
-#if DEBUG
-#define TRACE(msg) fprintf(stderr, "%s\n", msg)
-#define TRACEF(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define atomicExchangePointer(target, value) \
+    _InterlockedExchangePointer((void* volatile*) (target), (value))
+#define atomicLoadPointer(source) \
+    _InterlockedCompareExchangePointer((void* volatile*) (source), 0, 0)
+#define atomicStorePointer(target, value) \
+    ((void) _InterlockedExchangePointer((void* volatile*) (target), (value)))
+#define atomicLoadInt(source) \
+    _InterlockedCompareExchange((long volatile*) (source), 0, 0)
+#define atomicStoreInt(target, value) \
+    ((void) _InterlockedExchange((long volatile*) (target), (value)))
+#define atomicLoadInt64(source) \
+    _InterlockedCompareExchange64((long long volatile*) (source), 0, 0)
+#define atomicStoreInt64(target, value) \
+    ((void) _InterlockedExchange64((long long volatile*) (target), (value)))
+#define atomicIncrementInt(target) \
+    ((unsigned int) _InterlockedIncrement((long volatile*) (target)))
+#define atomicDecrementInt(target) \
+    ((unsigned int) _InterlockedDecrement((long volatile*) (target)))
+#define atomicCompareExchangeInt(target, expected, value) \
+    (_InterlockedCompareExchange((long volatile*) (target), (value), (expected)) == (expected))
+#define atomicFence() MemoryBarrier()
+#define ThreadLocal __declspec(thread)
+#else
+#define atomicExchangePointer(target, value) \
+    __atomic_exchange_n((target), (value), __ATOMIC_ACQ_REL)
+#define atomicLoadPointer(source) __atomic_load_n((source), __ATOMIC_ACQUIRE)
+#define atomicStorePointer(target, value) __atomic_store_n((target), (value), __ATOMIC_RELEASE)
+#define atomicLoadInt(source) __atomic_load_n((source), __ATOMIC_ACQUIRE)
+#define atomicStoreInt(target, value) __atomic_store_n((target), (value), __ATOMIC_RELEASE)
+#define atomicLoadInt64(source) __atomic_load_n((source), __ATOMIC_RELAXED)
+#define atomicStoreInt64(target, value) __atomic_store_n((target), (value), __ATOMIC_RELAXED)
+#define atomicIncrementInt(target) __atomic_add_fetch((target), 1, __ATOMIC_RELAXED)
+#define atomicDecrementInt(target) __atomic_sub_fetch((target), 1, __ATOMIC_RELAXED)
+#define atomicCompareExchangeInt(target, expected, value) \
+    __sync_bool_compare_and_swap((target), (expected), (value))
+#define atomicFence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define ThreadLocal __thread
+#endif
+
+#define FrameHeaderSize 8
+#define FrameHeaderSizeV2 12
+// Frame flags, only in version 2 headers
+#define FrameFlagCBOR 0x01
+#define MaxAppBuffers 4
+
+#ifdef _WIN32
+// The launched app and the pipes to it
+typedef struct {
+    HANDLE process;
+    HANDLE inputWrite;
+    HANDLE inputRead;
+    HANDLE outputWrite;
+    HANDLE outputRead;
+    // A one byte read kept pending while waiting for the app, see waitForAppData
+    OVERLAPPED readAhead;
+    int readAheadState;
+    char readAheadByte;
+    // Frames are coalesced here, WriteFileGather does not work on pipes
+    char frame[FrameHeaderSizeV2 + AHMaxRequestBody];
+} Transport;
+
+enum ReadAheadState {
+    ReadAheadNone,
+    ReadAheadPending,
+    ReadAheadDone,
+};
+
+#define TransportInitializer {0, 0, 0, 0, 0, {0}, ReadAheadNone, 0, {0}}
 #else
-#define TRACE(msg)
-#define TRACEF(...)
+// The launched app and the socket to it
+typedef struct {
+    pid_t pid;
+    int socketFD;
+} Transport;
+
+#define TransportInitializer {0, -1}
 #endif
 
+// Memory mapped into both the SDK and the app
+typedef struct {
+    char* data;
+    size_t size;
+    AppHandle handle;
+} SharedMemory;
+
+// One part of a frame, written to the app in a single gathered write
+typedef struct {
+    const char* data;
+    size_t length;
+} AppBuffer;
+
+// A whole file mapped read only
+typedef struct {
+    const char* data;
+    size_t size;
+} MappedFile;
+
 // Platform specifics with different implementations below
-static int readFromApp(char* data, size_t length);
-static int writeToApp(const char* data, size_t length);
+// Launches the app unless already running, setting oLaunchMS to when it was launched
+static int initAppConnection(long long* oLaunchMS);
+// Checks without blocking whether the app has exited, closing the connection if so
+static int appIsRunning();
+/*
+ * Reads and writes fail with AHErrorTimeout once deadlineMS has passed,
+ * see monotonicMS. Reads set oBytesRead also when failing, so that a
+ * timed out read can be picked up where it left off. Writes only time
+ * out when nothing has been written, the connection is closed otherwise.
+ */
+static int readFromApp(char* data, size_t length, size_t* oBytesRead, long long deadlineMS);
+// passHandle is sent along with the data where supported, NoAppHandle otherwise
+static int writeToApp(const AppBuffer* buffers, int bufferCount, AppHandle passHandle, long long deadlineMS);
+static void closeAppConnection();
+
+static int createSharedMemory(SharedMemory* memory, size_t size);
+static void destroySharedMemory(SharedMemory* memory);
+/*
+ * Prepares a handle for sending to the app. Either sets oPassHandle to
+ * send along with the frame, or sets oAppHandle to a handle already
+ * duplicated into the app, to send in the frame body.
+ */
+static int shareHandleWithApp(AppHandle handle, AppHandle* oPassHandle, long long* oAppHandle);
+// Duplicates a host file handle, and gets the file size
+static int duplicateFile(AHFileHandle file, AppHandle* oHandle, size_t* oLength);
+static void closeAppHandle(AppHandle handle);
+
+// Paths are utf-8, files that are empty or can't be mapped are AHErrorInvalidRequest
+static int mapFile(const char* path, MappedFile* oFile);
+static void unmapFile(MappedFile* file);
+// Maps the first length bytes of an open file, which stays open
+static int mapAppHandle(AppHandle file, size_t length, MappedFile* oFile);
+// Creates or replaces the file with the buffers written one after another
+static int writeFile(const char* path, const AppBuffer* buffers, int bufferCount);
+// Creates the file if needed, and writes the data at its end in one write
+static int appendFile(const char* path, const char* data, size_t length);
+// Replaces the file at toPath, if any
+static int renameFile(const char* fromPath, const char* toPath);
+// The system temp directory, where the app looks for "file:" URLs by default
+static void getTempDirectory(char* buffer, size_t bufferSize);
+// Fails with AHErrorInvalidRequest for anything but a regular file
+static int statFile(const char* path, long long* oSize, long long* oModifiedNS);
+// Nanoseconds on the clock file modification times are taken from
+static long long wallClockNS();
+
+static long long monotonicMS();
+static long long monotonicUS();
+static int startThread(Thread* thread, ThreadEntry entry, void* argument);
+static void joinThread(Thread* thread);
+static void initMutex(Mutex* mutex);
+static void destroyMutex(Mutex* mutex);
+static void lockMutex(Mutex* mutex);
+static void unlockMutex(Mutex* mutex);
+static int createSignal(Signal* signal);
+static void destroySignal(Signal* signal);
+static void raiseSignal(Signal* signal);
+static void clearSignal(Signal* signal);
+/*
+ * Returns non-zero when there is data to read from the app. Otherwise
+ * returns zero when the signal is raised, which also clears it, or when
+ * the timeout passes. The signal is optional.
+ */
+static int waitForAppData(Signal* signal, int timeoutMS);
 
 // Local cross platform glue
+static int sendRequest(
+    short int requestID,
+    const char command[4],
+    const char* data, size_t dataLength,
+    AppHandle passHandle,
+    unsigned int sendFlags, int* oSlot
+);
+static int awaitReply(int slot, const char** oBody, size_t* oBodyLength);
+static int readReply(int* oSlot, size_t* oBodyLength);
+static void failInFlight(int errorCode);
 static int callApp(
     short int requestID,
-    const char* command,
+    const char command[4],
     const char* data, size_t dataLength,
     const char** oBody, size_t* oBodyLength
 );
+static void countStat(long long* stat, long long amount);
+static void traceEvent(const char command[4], short int requestID, size_t bytes, int result);
+
+// Optional app features, as reported in the 'init' reply
+enum AppCapabilities {
+    CapabilityPollBatch = 1 << 0,
+    CapabilityNotify = 1 << 1,
+    CapabilitySharedMemory = 1 << 2,
+    CapabilityStemHandles = 1 << 3,
+    CapabilityFrameV2 = 1 << 4,
+    CapabilityChunkedStems = 1 << 5,
+    // Negotiated with 'vers', not listed in the 'init' reply
+    CapabilityCBOR = 1 << 6,
+};
+
+// Internal AHCallFlags, for drops whose body is CBOR rather than JSON
+#define CallCBORBody (1u << 16)
+
+enum SendFlags {
+    // Return once written, the reply is handled when it arrives
+    SendPipelined = 1 << 0,
+    // Only with CapabilityCBOR
+    SendCBOR = 1 << 1,
+};
+
+#define SharedMemorySize AHMaxLargeRequestBody
+// Utf-8 file paths, including the terminator
+#define MaxPathLength 1024
+#define DefaultTimeoutMS (1000 * 5)
+// How long a closed app may take to exit before it is terminated
+#define AppExitTimeoutMS 1000
+
+#define MaxJournalDrops 16
+#define MinJournalCapacity 256
+// Drops that keep going down with the app are given up on
+#define MaxReplays 3
+#define MinRestartDelayMS 250
+#define MaxRestartDelayMS (1000 * 30)
+// Restarts back off until the app has stayed up this long
+#define StableAppMS (1000 * 60)
+
+enum InFlightState {
+    InFlightFree = 0,
+    // Nobody waits for the reply, failures are reported on next poll
+    InFlightPipelined,
+    // A caller is blocked waiting for the reply
+    InFlightAwaited,
+    // The reply for an awaited request has arrived
+    InFlightDone,
+    // A poll whose caller timed out, its completions are kept for the next poll
+    InFlightLatePoll,
+};
+
+// A request written to the app, waiting for its reply
+typedef struct {
+    short int requestID;
+    unsigned char state;
+    unsigned int sequence;
+    int result;
+    // For the latency stats
+    unsigned char statCommand;
+    long long sentUS;
+} InFlight;
+
+#define MaxFailedRequests 64
+
+// A pipelined request that failed after its caller had returned
+typedef struct {
+    short int requestID;
+    int errorCode;
+} FailedRequest;
+
+// A drop kept for replay until its completion has been seen
+typedef struct {
+    short int requestID;
+    int replays;
+    // CallCBORBody, if set
+    unsigned int flags;
+    size_t dataLength;
+    // Kept when the drop is forgotten, and reused by later drops that fit
+    char* data;
+    size_t capacity;
+} JournalDrop;
+
+// The hash of a stem sent in chunks, kept until its transfer is done
+typedef struct {
+    // Zero for a free entry
+    short int requestID;
+    char name[AHMaxStemNameLength + 1];
+    size_t length;
+    unsigned long long hash;
+} StemHash;
+
+#define MaxStemHashes (2 * AHMaxStems)
+
+enum StatCommand {
+    StatInit,
+    StatDrop,
+    StatPoll,
+    StatQuit,
+    StatOther,
+    StatCommandCount
+};
+
+// Bucket i counts latencies below 2^i microseconds, the last one all the rest
+#define LatencyBuckets 24
+
+typedef struct {
+    long long calls;
+    long long failures;
+    long long latencyUS[LatencyBuckets];
+} CommandStats;
+
+/*
+ * Only written by the thread talking to the app, and read by AHgetStats
+ * from any thread. Counters are updated with atomic stores, so readers
+ * never see torn values, without needing read-modify-write operations.
+ */
+typedef struct {
+    CommandStats commands[StatCommandCount];
+    long long bytesOut;
+    long long bytesIn;
+    long long timeouts;
+    long long launches;
+    long long restarts;
+} Stats;
+
+// Per connection state, buffers are kept between calls
+typedef struct {
+    int capabilities;
+    // Reply bodies are received here, valid until the next call to the app
+    char* replyBuffer;
+    // The frame being received, kept when a read times out half way
+    char replyHeader[FrameHeaderSizeV2];
+    size_t replyReceived;
+    // Of the last reply received
+    unsigned char replyFlags;
+    // The body of a reply to a poll that timed out, until the next poll
+    char* lateReply;
+    size_t lateReplyLength;
+    unsigned char lateReplyFlags;
+    // Switched to 2 by 'vers', back to 1 when the app is launched
+    int frameVersion;
+    // CBOR completions are converted to JSON here for the host
+    char* transcodeBuffer;
+    // Drops built from AHDropRequest fields are encoded here, and converted
+    // to JSON in the other buffer for apps that don't take CBOR
+    char* fieldsBuffer;
+    char* fieldsJSONBuffer;
+
+    unsigned short pipelineDepth;
+    InFlight inFlight[AHMaxPipelineDepth];
+    int inFlightCount;
+    unsigned int inFlightSequence;
+
+    FailedRequest failed[MaxFailedRequests];
+    int failedCount;
+
+    // Set by a successful 'init', cleared on 'quit'
+    int sessionActive;
+    // Set by 'note' frames, cleared when polling
+    int completionsAvailable;
+    // Set while polling the app, for handlers that poll again
+    int polling;
+
+    // For large request bodies, when the app supports it
+    SharedMemory sharedMemory;
+
+    // From "timeoutMs" in the setup data
+    unsigned int timeoutMS;
+    // Shared by all reads and writes for the current call, see startCall
+    long long deadlineMS;
+
+    // When the app was last launched, until its 'init' has been replied to
+    long long launchMS;
+    // From launch until the reply to 'init', read by AHgetLaunchTime from any thread
+    int launchToReadyMS;
+
+    // Replayed to the app when it has died, see superviseApp. Cleared on 'quit'.
+    char* journalSetupData;
+    size_t journalSetupDataLength;
+    JournalDrop journal[MaxJournalDrops];
+    int journalCount;
+    int replaying;
+    int restartDelayMS;
+    long long restartMS;
+    long long nextRestartMS;
+
+    // Of chunked transfers that may be resumed, see stemHashOf
+    StemHash stemHashes[MaxStemHashes];
+    int nextStemHash;
+
+    Stats stats;
+} Connection;
+
+static void* defaultAlloc(size_t size, void* userData) {
+    (void) userData;
+    return malloc(size);
+}
+
+static void defaultFree(void* memory, void* userData) {
+    (void) userData;
+    free(memory);
+}
+
+static AHAllocFunction allocHook = defaultAlloc;
+static AHFreeFunction freeHook = defaultFree;
+static void* allocHookUserData = 0;
+
+static void* allocate(size_t size) {
+    return allocHook(size, allocHookUserData);
+}
+
+static void release(void* memory) {
+    if (memory != 0) {
+        freeHook(memory, allocHookUserData);
+    }
+}
+
+// Writes JSON text, or CBOR, or only measures it when data is zero
+typedef struct {
+    char* data;
+    size_t length;
+} JSONWriter;
+
+// A file URL of a drop and the hash of its content, see AHCallHashContent
+typedef struct {
+    const char* url;
+    char hash[AHContentHashLength];
+} ContentHash;
+
+// A drop's file URLs, at most the stems, preview, cover and attachments
+#define MaxContentHashes (3 + AHMaxAttachments)
+
+// Receives completions, either for the host handler or for the IO thread queue
+typedef void (*CompletionSink)(void* sinkData, const char* completion, unsigned short length);
+
+static int pollCompletions(CompletionSink sink, void* sinkData);
+static int pollRound(CompletionSink sink, void* sinkData, int* oMore);
+static void parseCompletion(const char* response, size_t responseLength, AHCompletion* oCompletion);
+static int findMember(AHSpan object, const char* key, AHSpan* oValue);
+static int hasListItem(const char* body, size_t bodyLength, const char* key, const char* item);
+static int parseInteger(AHSpan text, long* oValue);
+static int transcodeCBOR(const char* data, size_t length, JSONWriter* writer);
+static void startCall(unsigned int timeoutMS);
+static void addFailedRequest(short int requestID, int errorCode);
+static void reportFailedRequests(CompletionSink sink, void* sinkData);
+static int superviseApp();
+static void journalSetup(const char* setupData, size_t setupDataLength);
+static void journalDrop(const char* dropData, size_t dropDataLength, short int requestID, unsigned int flags);
+static int isJournaled(short int requestID);
+static void forgetDrop(short int requestID);
+static void clearJournal();
+static void forgetCompleted(void* sinkData, const char* completion, unsigned short length);
+static void transcodeCompletion(void* sinkData, const char* completion, unsigned short length);
+static void rememberTmpDir(const char* setupData, size_t setupDataLength);
+static int fillFromStem(AHDropRequest* request, unsigned int flags, char* previewURLBuffer, size_t bufferSize);
+static int hashRequestFiles(const AHDropRequest* request, ContentHash* oHashes, int* oHashCount);
+static unsigned long long readLE64(const unsigned char* data);
+static unsigned long long hashData(const unsigned char* data, size_t length);
+static void recordProgress(short int requestID, const char* stage, size_t stageLength,
+    long long done, long long total);
+
+// Forgets journaled drops as their completions pass by, see forgetCompleted
+typedef struct {
+    CompletionSink sink;
+    void* sinkData;
+} JournalSink;
+
+// Turns CBOR completions into JSON, see transcodeCompletion
+typedef struct {
+    CompletionSink sink;
+    void* sinkData;
+    int result;
+} TranscodingSink;
+
+// A stem handed to the app as a handle, prepared on the calling thread
+typedef struct {
+    char name[AHMaxStemNameLength + 1];
+    size_t length;
+    // In memory stems are copied into shared memory, files are duplicated
+    SharedMemory memory;
+    AppHandle file;
+} StemHandoff;
+
+// A request queued for the IO thread
+typedef struct Submission {
+    struct Submission* next;
+    char command[4];
+    short int requestID;
+    AHCallOptions options;
+    size_t dataLength;
+    char* data;
+    StemHandoff* stems;
+    int stemCount;
+} Submission;
+
+/*
+ * Completions collected by the IO thread, length prefixed like 'pall'
+ * replies. Completions are never split across the end of the ring, a
+ * zero length marks the rest of it as unused.
+ */
+typedef struct {
+    char* data;
+    size_t size;
+    // Bytes collected, handed to a host handler, and done with so far,
+    // positions are modulo the size
+    size_t collected;
+    size_t claimed;
+    size_t delivered;
+    // Deliveries under way, the claimed bytes are done with once none are
+    int deliveries;
+    // Whether the completion signal has been raised since the last delivery
+    int signalled;
+} CompletionRing;
+
+#define PriorityCount (AHPriorityHigh - AHPriorityLow + 1)
+#define MaxPendingCancels 16
+
+/*
+ * The optional IO thread owns the connection while running. API calls
+ * hand it requests through a lock-free multi producer, single consumer
+ * queue, from which it sorts drops into lists by priority, with at most
+ * queueLimit drops queued. AHcancel stops drops through a set of pending
+ * cancels. Completions go back through a ring guarded by a mutex.
+ */
+typedef struct {
+    Thread thread;
+    Signal wake;
+    // Raised while there are collected completions
+    Signal completionSignal;
+    int running;
+    int stopRequested;
+    unsigned int pollIntervalMS;
+
+    // Producers push at the head, the IO thread pops at the tail
+    Submission* head;
+    Submission* tail;
+    Submission stub;
+
+    // Drops taken off the queue by the IO thread, by priority, lowest first
+    Submission* queued[PriorityCount];
+    Submission* lastQueued[PriorityCount];
+    // An AHsetup or AHclose waiting for the drops queued before it
+    Submission* barrier;
+    // Drops queued and not yet handled, bounded by queueLimit
+    int queuedCount;
+    int queueLimit;
+    /*
+     * Request IDs of AHcancel calls the IO thread hasn't got to yet, zero
+     * for a free entry, so that a drop being sent can stop. Each entry is
+     * freed when its cancel is handled, before any drop queued after it.
+     */
+    int cancelRequestIDs[MaxPendingCancels];
+
+    Mutex completionMutex;
+    CompletionRing completions;
+    size_t completionRingSize;
+} IOThread;
+
+// Launch and setup started by AHprewarm, waited for by the next API call
+typedef struct {
+    Thread thread;
+    int running;
+    int result;
+    char* setupData;
+    size_t setupDataLength;
+} Prewarm;
+
+#define MaxProgressEntries 16
+#define MaxProgressStageLength 15
+
+typedef struct {
+    // Zero for a free entry
+    short int requestID;
+    // Raised when updated, lowered once delivered
+    int updated;
+    unsigned int sequence;
+    char stage[MaxProgressStageLength + 1];
+    long long done;
+    long long total;
+} ProgressEntry;
+
+/*
+ * The latest progress per request, recorded by whichever thread owns the
+ * connection, and delivered on the thread that polls for it.
+ */
+typedef struct {
+    Mutex mutex;
+    unsigned int sequence;
+    ProgressEntry entries[MaxProgressEntries];
+} ProgressTable;
+
+// "tmpDir" from the setup data, set and read from any of the host's threads
+typedef struct {
+    Mutex mutex;
+    char tmpDir[MaxPathLength];
+} FileSettings;
+
+/*
+ * One session with the app, see AHcreateContext. Sessions don't share
+ * any state, so each can be driven from its own thread.
+ */
+struct AHContext {
+    Connection connection;
+    Transport transport;
+    IOThread ioThread;
+    Prewarm prewarm;
+    ProgressTable progress;
+    FileSettings files;
+};
+
+#define ContextInitializer { \
+    .connection = { \
+        .pipelineDepth = 1, \
+        .frameVersion = 1, \
+        .timeoutMS = DefaultTimeoutMS, \
+        .launchToReadyMS = -1, \
+    }, \
+    .transport = TransportInitializer, \
+    .ioThread = { \
+        .queueLimit = AHDefaultQueuedRequests, \
+        .completionMutex = MutexInitializer, \
+        .completionRingSize = AHDefaultCompletionRingSize, \
+    }, \
+    .progress = { \
+        .mutex = MutexInitializer, \
+    }, \
+    .files = { \
+        .mutex = MutexInitializer, \
+    }, \
+}
+
+// Used by the functions without a context argument
+static AHContext defaultContext = ContextInitializer;
+// Contexts created and not yet destroyed, besides the default one
+static int contextCount = 0;
+
+/*
+ * The context of the API call, IO thread or prewarm thread running on
+ * this thread. Set on entry to each API call, and restored after calling
+ * back into the host, which may make calls with other contexts.
+ */
+static ThreadLocal AHContext* context;
+
+static int setupApp(const char* setupData, size_t setupDataLength);
+static int dropToApp(const char* dropData, size_t dropDataLength, short int requestID, unsigned int flags);
+static int quitApp();
+static int dropWithStems(const char* dropData, size_t dropDataLength, short int requestID,
+    StemHandoff* stems, int stemCount);
+static int prepareStems(const AHStem* stems, int stemCount, StemHandoff* oHandoffs);
+static void releaseStems(StemHandoff* stems, int stemCount);
+static int sendStemChunks(short int requestID, const StemHandoff* stems, int stemCount);
+static int submit(const char command[4], short int requestID, const char* data, size_t dataLength,
+    const AHCallOptions* options, const StemHandoff* stems, int stemCount);
+static int readPendingReplies();
+static void ioThreadMain(void* argument);
+static void deliverCompletions(CompletionSink sink, void* sinkData);
+static void releaseCompletionRing();
+static int isCancelled(short int requestID);
+static void prewarmMain(void* argument);
+static int finishPrewarm();
+static int dropWithOptions(const char* dropData, size_t dropDataLength, short int requestID,
+    const AHCallOptions* options);
 
 // Exported functions
 
-int AHsetup(const char* setupData, short unsigned int setupDataLength) {
-    if (setupData == NULL || setupDataLength == 0) {
+int AHcreateContext(AHContext** oContext) {
+    if (oContext == 0) {
         return AHErrorInvalidRequest;
     }
-    return callApp(0, "init", setupData, setupDataLength, 0, 0);
+    *oContext = 0;
+
+    static const AHContext initial = ContextInitializer;
+    AHContext* created = (AHContext*) allocate(sizeof(AHContext));
+    if (created == 0) {
+        return AHErrorOutOfMemory;
+    }
+    *created = initial;
+    initMutex(&created->ioThread.completionMutex);
+    initMutex(&created->progress.mutex);
+    initMutex(&created->files.mutex);
+
+    atomicIncrementInt(&contextCount);
+    *oContext = created;
+    return 0;
 }
 
-int AHdrop(const char* dropData, short unsigned int dropDataLength, short int requestID) {
-    if (dropData == NULL || dropDataLength == 0 || requestID == 0) {
+int AHdestroyContext(AHContext* ctx) {
+    if (ctx == NULL || ctx == &defaultContext) {
         return AHErrorInvalidRequest;
     }
-    return callApp(requestID, "drop", dropData, dropDataLength, 0, 0);
-}
+    context = ctx;
+    if (context->ioThread.running) {
+        // Requests already queued are handled before the thread stops
+        AHstopIOThreadCtx(context);
+    }
+    finishPrewarm();
+    startCall(0);
+    int result = quitApp();
+    releaseCompletionRing();
 
-int AHclose() {
-    // Since we are closing down the app, ignore but return failed quit requests
-    int result = callApp(0, "quit", 0, 0, 0, 0);
+    destroyMutex(&ctx->ioThread.completionMutex);
+    destroyMutex(&ctx->progress.mutex);
+    destroyMutex(&ctx->files.mutex);
+    release(ctx);
+    context = 0;
+    atomicDecrementInt(&contextCount);
     return result;
 }
 
-int AHpollCompletedRequests(AHCompletionHandler handler) {
-    int moreResults = 0;
+int AHsetup(const char* setupData, short unsigned int setupDataLength) {
+    return AHsetupCtx(&defaultContext, setupData, setupDataLength);
+}
 
-    do {
-        const char* body = 0;
-        size_t bodyLength = 0;
+int AHsetupCtx(AHContext* ctx, const char* setupData, short unsigned int setupDataLength) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (setupData == NULL || setupDataLength == 0) {
+        return AHErrorInvalidRequest;
+    }
+    rememberTmpDir(setupData, setupDataLength);
+    // Set up again whatever happened, which is quick with the app already launched
+    finishPrewarm();
+    if (context->ioThread.running) {
+        return submit("init", 0, setupData, setupDataLength, 0, 0, 0);
+    }
+    startCall(0);
+    return setupApp(setupData, setupDataLength);
+}
 
-        int pollResult = callApp(0, "poll", 0, 0, &body, &bodyLength);
-        if(pollResult == 0) {
-            if(bodyLength > AHMaxRequestBody) {
-                return AHErrorCommsFailure;
-            }
-            if(bodyLength != 0) {
-                handler(body, bodyLength);
-                moreResults = 1;
-            }
-            else {
-                moreResults = 0;
-            }
-        }
-        else {
-            return pollResult;
-        }
-    } while(moreResults);
+int AHprewarm(const char* setupData, short unsigned int setupDataLength) {
+    return AHprewarmCtx(&defaultContext, setupData, setupDataLength);
+}
+
+int AHprewarmCtx(AHContext* ctx, const char* setupData, short unsigned int setupDataLength) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (setupData == NULL || setupDataLength == 0) {
+        return AHErrorInvalidRequest;
+    }
+    if (context->prewarm.running) {
+        return AHErrorInvalidRequest;
+    }
+    rememberTmpDir(setupData, setupDataLength);
+    // Already asynchronous
+    if (context->ioThread.running) {
+        return AHsetupCtx(context, setupData, setupDataLength);
+    }
+
+    context->prewarm.setupData = allocate(setupDataLength);
+    if (context->prewarm.setupData == 0) {
+        return AHErrorOutOfMemory;
+    }
+    memcpy(context->prewarm.setupData, setupData, setupDataLength);
+    context->prewarm.setupDataLength = setupDataLength;
 
+    if (startThread(&context->prewarm.thread, prewarmMain, context)) {
+        release(context->prewarm.setupData);
+        context->prewarm.setupData = 0;
+        return AHErrorUnknownError;
+    }
+    context->prewarm.running = 1;
     return 0;
 }
 
-const char* AHerrorCodeToMessage(int errorCode) {
-    switch(errorCode) {
-        case AHErrorCommsFailure:
-            return "App communication failure";
-        case AHErrorInvalidRequest:
-            return "Invalid request";
-        case AHErrorLaunchFailure:
-            return "App launch failure";
-        case AHErrorOutOfMemory:
-            return "Out of memory";
-        case AHErrorUnknownError:
-        default:
-            return "Unknown error";
+int AHgetLaunchTime(unsigned int* oLaunchToReadyMS) {
+    return AHgetLaunchTimeCtx(&defaultContext, oLaunchToReadyMS);
+}
+
+int AHgetLaunchTimeCtx(AHContext* ctx, unsigned int* oLaunchToReadyMS) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (oLaunchToReadyMS == NULL) {
+        return AHErrorInvalidRequest;
     }
+    int launchToReadyMS = atomicLoadInt(&context->connection.launchToReadyMS);
+    if (launchToReadyMS < 0) {
+        return AHErrorInvalidRequest;
+    }
+    *oLaunchToReadyMS = (unsigned int) launchToReadyMS;
+    return 0;
 }
 
-static int callApp(
-    short int requestID,
-    const char command[4],
-    const char* data, size_t dataLength,
-    const char** oBody, size_t* oBodyLength)
+int AHdrop(const char* dropData, short unsigned int dropDataLength, short int requestID) {
+    return AHdropCtx(&defaultContext, dropData, dropDataLength, requestID);
+}
+
+int AHdropCtx(AHContext* ctx, const char* dropData, short unsigned int dropDataLength,
+    short int requestID)
 {
-    if(command == 0){
+    return AHdropWithOptionsCtx(ctx, dropData, dropDataLength, requestID, NULL);
+}
+
+int AHdropWithOptions(const char* dropData, short unsigned int dropDataLength, short int requestID,
+    const AHCallOptions* options)
+{
+    return AHdropWithOptionsCtx(&defaultContext, dropData, dropDataLength, requestID, options);
+}
+
+int AHdropWithOptionsCtx(AHContext* ctx, const char* dropData, short unsigned int dropDataLength,
+    short int requestID, const AHCallOptions* options)
+{
+    if (ctx == NULL) {
         return AHErrorInvalidRequest;
     }
-
-    if(data == 0 && dataLength != 0){
+    context = ctx;
+    if (dropData == NULL || dropDataLength == 0 || requestID == 0) {
         return AHErrorInvalidRequest;
     }
-
-    if(data != 0 && dataLength == 0){
+    if (options != NULL && (options->flags & ~AHCallFireAndForget) != 0) {
         return AHErrorInvalidRequest;
     }
+    return dropWithOptions(dropData, dropDataLength, requestID, options);
+}
 
-    if(dataLength > AHMaxRequestBody){
+// Also takes the internal CallCBORBody flag
+static int dropWithOptions(const char* dropData, size_t dropDataLength, short int requestID,
+    const AHCallOptions* options)
+{
+    if (options != NULL && (options->priority < AHPriorityLow || options->priority > AHPriorityHigh)) {
         return AHErrorInvalidRequest;
     }
-
-    int result = writeToApp(command, 4);
-    if (result) {
+    int result = finishPrewarm();
+    if (result != 0) {
         return result;
     }
-    result = writeToApp((char*) &requestID, 2);
-    if (result) {
-        return result;
+    if (context->ioThread.running) {
+        return submit("drop", requestID, dropData, dropDataLength, options, 0, 0);
     }
-    result = writeToApp((char*) &dataLength, 2);
-    if (result) {
+    result = superviseApp();
+    if (result != 0) {
         return result;
     }
-    result = writeToApp(data, dataLength);
-    if (result) {
-        return result;
+    unsigned int flags = options != NULL ? options->flags : 0;
+    startCall(options != NULL ? options->timeoutMS : 0);
+    result = dropToApp(dropData, dropDataLength, requestID, flags);
+    if (result == 0) {
+        journalDrop(dropData, dropDataLength, requestID, flags);
     }
+    return result;
+}
 
-    char reply[4] = {6, 6, 6, 6};
-    result = readFromApp(&reply[0], 4);
-    if (result) {
-        return result;
-    }
+int AHdropStems(const char* dropData, short unsigned int dropDataLength, short int requestID,
+    const AHStem* stems, int stemCount)
+{
+    return AHdropStemsCtx(&defaultContext, dropData, dropDataLength, requestID, stems, stemCount);
+}
 
-    short int responseID = 0;
-    result = readFromApp((char*) &responseID, 2);
-    if (result) {
-        return result;
+int AHdropStemsCtx(AHContext* ctx, const char* dropData, short unsigned int dropDataLength,
+    short int requestID, const AHStem* stems, int stemCount)
+{
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
     }
-
-    if (responseID != requestID) {
-        TRACE("Request / response mismatch");
+    context = ctx;
+    if (dropData == NULL || dropDataLength == 0 || requestID == 0) {
+        return AHErrorInvalidRequest;
+    }
+    if (stems == NULL || stemCount < 1 || stemCount > AHMaxStems) {
+        return AHErrorInvalidRequest;
+    }
+    int result = finishPrewarm();
+    if (result != 0) {
+        return result;
+    }
+    // Don't copy the audio for nothing, the IO thread checks once it knows
+    if (!context->ioThread.running && !(context->connection.capabilities & (CapabilityStemHandles | CapabilityChunkedStems))) {
+        return AHErrorNotSupported;
+    }
+
+    StemHandoff handoffs[AHMaxStems];
+    result = prepareStems(stems, stemCount, handoffs);
+    if (result != 0) {
+        return result;
+    }
+
+    if (context->ioThread.running) {
+        result = submit("drop", requestID, dropData, dropDataLength, 0, handoffs, stemCount);
+        if (result != 0) {
+            releaseStems(handoffs, stemCount);
+        }
+        return result;
+    }
+    result = superviseApp();
+    if (result != 0) {
+        releaseStems(handoffs, stemCount);
+        return result;
+    }
+    startCall(0);
+    return dropWithStems(dropData, dropDataLength, requestID, handoffs, stemCount);
+}
+
+int AHdropLarge(const char* dropData, size_t dropDataLength, short int requestID) {
+    return AHdropLargeCtx(&defaultContext, dropData, dropDataLength, requestID);
+}
+
+int AHdropLargeCtx(AHContext* ctx, const char* dropData, size_t dropDataLength,
+    short int requestID)
+{
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (dropData == NULL || dropDataLength == 0 || requestID == 0) {
+        return AHErrorInvalidRequest;
+    }
+    if (dropDataLength > AHMaxLargeRequestBody) {
+        return AHErrorInvalidRequest;
+    }
+    if (dropDataLength <= AHMaxRequestBody) {
+        return AHdropWithOptionsCtx(context, dropData, (short unsigned int) dropDataLength, requestID, NULL);
+    }
+    int result = finishPrewarm();
+    if (result != 0) {
+        return result;
+    }
+    if (context->ioThread.running) {
+        return submit("drop", requestID, dropData, dropDataLength, 0, 0, 0);
+    }
+    result = superviseApp();
+    if (result != 0) {
+        return result;
+    }
+    startCall(0);
+    return dropToApp(dropData, dropDataLength, requestID, 0);
+}
+
+int AHsetPipelineDepth(unsigned short depth) {
+    return AHsetPipelineDepthCtx(&defaultContext, depth);
+}
+
+int AHsetPipelineDepthCtx(AHContext* ctx, unsigned short depth) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (depth < 1 || depth > AHMaxPipelineDepth) {
+        return AHErrorInvalidRequest;
+    }
+    finishPrewarm();
+    context->connection.pipelineDepth = depth;
+    return 0;
+}
+
+int AHclose() {
+    return AHcloseCtx(&defaultContext);
+}
+
+int AHcloseCtx(AHContext* ctx) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    // Closing anyway, a failed setup doesn't matter
+    finishPrewarm();
+    if (context->ioThread.running) {
+        return submit("quit", 0, 0, 0, 0, 0, 0);
+    }
+    startCall(0);
+    int result = quitApp();
+    releaseCompletionRing();
+    return result;
+}
+
+static void callHandler(void* sinkData, const char* completion, unsigned short length) {
+    AHCompletionHandler handler = *(AHCompletionHandler*) sinkData;
+    // The host may call into another context from its handler
+    AHContext* current = context;
+    handler(completion, length);
+    context = current;
+}
+
+int AHpollCompletedRequests(AHCompletionHandler handler) {
+    return AHpollCompletedRequestsCtx(&defaultContext, handler);
+}
+
+int AHpollCompletedRequestsCtx(AHContext* ctx, AHCompletionHandler handler) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (handler == 0) {
+        return AHErrorInvalidRequest;
+    }
+    return pollCompletions(callHandler, &handler);
+}
+
+typedef struct {
+    AHCompletionInfoHandler handler;
+    void* userData;
+} InfoHandler;
+
+static void callInfoHandler(void* sinkData, const char* completion, unsigned short length) {
+    InfoHandler* infoHandler = (InfoHandler*) sinkData;
+    AHCompletion parsed;
+    parseCompletion(completion, length, &parsed);
+    AHContext* current = context;
+    infoHandler->handler(&parsed, infoHandler->userData);
+    context = current;
+}
+
+int AHpollCompletions(AHCompletionInfoHandler handler, void* userData) {
+    return AHpollCompletionsCtx(&defaultContext, handler, userData);
+}
+
+int AHpollCompletionsCtx(AHContext* ctx, AHCompletionInfoHandler handler, void* userData) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (handler == 0) {
+        return AHErrorInvalidRequest;
+    }
+    InfoHandler infoHandler = {handler, userData};
+    return pollCompletions(callInfoHandler, &infoHandler);
+}
+
+int AHgetCompletionValue(const AHCompletion* completion, const char* key, AHSpan* oValue) {
+    if (completion == NULL || key == NULL || oValue == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    return findMember(completion->data, key, oValue);
+}
+
+static int pollCompletions(CompletionSink sink, void* sinkData) {
+    int prewarmResult = finishPrewarm();
+    if (prewarmResult != 0) {
+        return prewarmResult;
+    }
+
+    // Completions collected by the IO thread, also after it has stopped
+    if (context->ioThread.completions.data != 0) {
+        deliverCompletions(sink, sinkData);
+    }
+    if (context->ioThread.running) {
+        return 0;
+    }
+    // The poll the handler was called from goes on with the rest
+    if (context->connection.polling) {
+        return 0;
+    }
+    context->connection.polling = 1;
+
+    int result = superviseApp();
+    int more = result == 0;
+    startCall(0);
+
+    // The app tells when there is something to poll for
+    if (more && (context->connection.capabilities & CapabilityNotify)) {
+        result = readPendingReplies();
+        more = context->connection.completionsAvailable;
+    }
+
+    while (result == 0 && more) {
+        result = pollRound(sink, sinkData, &more);
+    }
+
+    // Includes failures picked up while waiting for the poll replies
+    reportFailedRequests(sink, sinkData);
+    context->connection.polling = 0;
+    return result;
+}
+
+int AHstartIOThread(unsigned int pollIntervalMS) {
+    return AHstartIOThreadCtx(&defaultContext, pollIntervalMS);
+}
+
+int AHstartIOThreadCtx(AHContext* ctx, unsigned int pollIntervalMS) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (context->ioThread.running || pollIntervalMS == 0) {
+        return AHErrorInvalidRequest;
+    }
+    // The IO thread reports a failed setup like any other, see ioThreadMain
+    int prewarmResult = finishPrewarm();
+    if (prewarmResult != 0) {
+        addFailedRequest(0, prewarmResult);
+    }
+
+    CompletionRing* ring = &context->ioThread.completions;
+    if (ring->data == 0) {
+        ring->data = allocate(context->ioThread.completionRingSize);
+        if (ring->data == 0) {
+            return AHErrorOutOfMemory;
+        }
+        ring->size = context->ioThread.completionRingSize;
+    }
+
+    if (createSignal(&context->ioThread.wake)) {
+        return AHErrorUnknownError;
+    }
+    if (createSignal(&context->ioThread.completionSignal)) {
+        destroySignal(&context->ioThread.wake);
+        return AHErrorUnknownError;
+    }
+
+    context->ioThread.stub.next = 0;
+    context->ioThread.head = &context->ioThread.stub;
+    context->ioThread.tail = &context->ioThread.stub;
+    context->ioThread.stopRequested = 0;
+    context->ioThread.queuedCount = 0;
+    memset(context->ioThread.cancelRequestIDs, 0, sizeof(context->ioThread.cancelRequestIDs));
+    context->ioThread.pollIntervalMS = pollIntervalMS;
+
+    if (startThread(&context->ioThread.thread, ioThreadMain, context)) {
+        destroySignal(&context->ioThread.wake);
+        destroySignal(&context->ioThread.completionSignal);
+        return AHErrorUnknownError;
+    }
+
+    context->ioThread.running = 1;
+    return 0;
+}
+
+int AHstopIOThread() {
+    return AHstopIOThreadCtx(&defaultContext);
+}
+
+int AHstopIOThreadCtx(AHContext* ctx) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (!context->ioThread.running) {
+        return AHErrorInvalidRequest;
+    }
+
+    atomicStoreInt(&context->ioThread.stopRequested, 1);
+    raiseSignal(&context->ioThread.wake);
+    joinThread(&context->ioThread.thread);
+    destroySignal(&context->ioThread.wake);
+    destroySignal(&context->ioThread.completionSignal);
+    context->ioThread.running = 0;
+    return 0;
+}
+
+int AHsetQueueLimits(unsigned int maxQueuedRequests, size_t completionRingSize) {
+    return AHsetQueueLimitsCtx(&defaultContext, maxQueuedRequests, completionRingSize);
+}
+
+int AHsetQueueLimitsCtx(AHContext* ctx, unsigned int maxQueuedRequests, size_t completionRingSize) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (context->ioThread.running || maxQueuedRequests == 0 || maxQueuedRequests > 0x7fffffff
+        || completionRingSize < AHMinCompletionRingSize) {
+        return AHErrorInvalidRequest;
+    }
+    // Collected completions would be lost with the ring
+    CompletionRing* ring = &context->ioThread.completions;
+    if (ring->collected != ring->delivered) {
+        return AHErrorInvalidRequest;
+    }
+
+    if (ring->data != 0 && ring->size != completionRingSize) {
+        releaseCompletionRing();
+    }
+    context->ioThread.queueLimit = (int) maxQueuedRequests;
+    context->ioThread.completionRingSize = completionRingSize;
+    return 0;
+}
+
+int AHcancel(short int requestID) {
+    return AHcancelCtx(&defaultContext, requestID);
+}
+
+int AHcancelCtx(AHContext* ctx, short int requestID) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (requestID == 0) {
+        return AHErrorInvalidRequest;
+    }
+    if (!context->ioThread.running) {
+        return AHErrorNotSupported;
+    }
+    /*
+     * Stops a drop being sent right away, the queued drops once the IO
+     * thread gets to it. Should all entries be taken, only queued drops
+     * are cancelled.
+     */
+    int entry = -1;
+    for (int i = 0; i < MaxPendingCancels && entry < 0; i++) {
+        if (atomicCompareExchangeInt(&context->ioThread.cancelRequestIDs[i], 0, requestID)) {
+            entry = i;
+        }
+    }
+    int result = submit("cncl", requestID, (const char*) &entry, sizeof(entry), 0, 0, 0);
+    if (result != 0 && entry >= 0) {
+        atomicStoreInt(&context->ioThread.cancelRequestIDs[entry], 0);
+    }
+    return result;
+}
+
+int AHgetCompletionHandle(AHWaitHandle* oHandle) {
+    return AHgetCompletionHandleCtx(&defaultContext, oHandle);
+}
+
+int AHgetCompletionHandleCtx(AHContext* ctx, AHWaitHandle* oHandle) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (!context->ioThread.running || oHandle == 0) {
+        return AHErrorInvalidRequest;
+    }
+#ifdef _WIN32
+    *oHandle = context->ioThread.completionSignal.event;
+#else
+    *oHandle = context->ioThread.completionSignal.readFD;
+#endif
+    return 0;
+}
+
+/*
+ * Hands each completion in a block of length prefixed completions
+ * to the sink, as packed in 'pall' replies and by the IO thread.
+ */
+static int forEachCompletion(const char* data, size_t length, CompletionSink sink, void* sinkData) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    size_t offset = 0;
+
+    while (offset < length) {
+        if (offset + 2 > length) {
+            return AHErrorCommsFailure;
+        }
+        size_t completionLength = bytes[offset] | (bytes[offset + 1] << 8);
+        offset += 2;
+        if (completionLength == 0 || offset + completionLength > length) {
+            return AHErrorCommsFailure;
+        }
+        sink(sinkData, &data[offset], (unsigned short) completionLength);
+        offset += completionLength;
+    }
+
+    return 0;
+}
+
+/*
+ * Gets the reply to a poll. A poll that timed out is not sent again, its
+ * reply is picked up instead, or taken from where it was kept if it has
+ * already been read, so that the completions in it aren't lost.
+ */
+static int awaitPoll(int batch, const char** oBody, size_t* oBodyLength, unsigned char* oFlags) {
+    if (context->connection.lateReplyLength != 0) {
+        *oBody = context->connection.lateReply;
+        *oBodyLength = context->connection.lateReplyLength;
+        *oFlags = context->connection.lateReplyFlags;
+        context->connection.lateReplyLength = 0;
+        return 0;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < AHMaxPipelineDepth && slot == -1; i++) {
+        if (context->connection.inFlight[i].state == InFlightLatePoll) {
+            slot = i;
+        }
+    }
+    if (slot == -1) {
+        int result = sendRequest(0, batch ? "pall" : "poll", 0, 0, NoAppHandle, 0, &slot);
+        if (result != 0) {
+            return result;
+        }
+    }
+    else {
+        context->connection.inFlight[slot].state = InFlightAwaited;
+    }
+
+    int result = awaitReply(slot, oBody, oBodyLength);
+    if (result == AHErrorTimeout) {
+        context->connection.inFlight[slot].state = InFlightLatePoll;
+    }
+    *oFlags = context->connection.replyFlags;
+    return result;
+}
+
+/*
+ * Fetches completed requests with one round trip to the app.
+ * Uses 'pall', which packs as many completions as fit into each reply,
+ * when supported.
+ */
+static int pollRound(CompletionSink sink, void* sinkData, int* oMore) {
+    // Only look at completions when there are drops to forget
+    JournalSink journalSink = {sink, sinkData};
+    if (context->connection.journalCount != 0) {
+        sink = forgetCompleted;
+        sinkData = &journalSink;
+    }
+
+    const char* body = 0;
+    size_t bodyLength = 0;
+    unsigned char replyFlags = 0;
+    int batch = (context->connection.capabilities & CapabilityPollBatch) != 0;
+
+    *oMore = 0;
+    // Notifications arriving from here on are for completions this poll may miss
+    context->connection.completionsAvailable = 0;
+
+    int pollResult = awaitPoll(batch, &body, &bodyLength, &replyFlags);
+    if (pollResult != 0) {
+        return pollResult;
+    }
+    if (body == 0) {
+        return 0;
+    }
+
+    TranscodingSink transcodingSink = {sink, sinkData, 0};
+    if (replyFlags & FrameFlagCBOR) {
+        sink = transcodeCompletion;
+        sinkData = &transcodingSink;
+    }
+
+    if (!batch) {
+        sink(sinkData, body, (unsigned short) bodyLength);
+        *oMore = 1;
+        return transcodingSink.result;
+    }
+
+    if (bodyLength < 2) {
         return AHErrorCommsFailure;
     }
+    const unsigned char* data = (const unsigned char*) body;
+    *oMore = (data[0] | (data[1] << 8)) != 0;
 
-    short unsigned int replyBodyLength = 0;
-    result = readFromApp((char*) &replyBodyLength, 2);
-    if (result) {
+    int result = forEachCompletion(&body[2], bodyLength - 2, sink, sinkData);
+    return result != 0 ? result : transcodingSink.result;
+}
+
+int AHsetAllocator(AHAllocFunction allocFunction, AHFreeFunction freeFunction, void* userData) {
+    if ((allocFunction == 0) != (freeFunction == 0)) {
+        return AHErrorInvalidRequest;
+    }
+    context = &defaultContext;
+    finishPrewarm();
+    // Memory must be released by the same allocator that allocated it, so
+    // the allocator is fixed while any context holds memory
+    if (defaultContext.connection.replyBuffer != 0 || defaultContext.connection.journalSetupData != 0
+        || defaultContext.connection.fieldsBuffer != 0 || defaultContext.connection.fieldsJSONBuffer != 0
+        || defaultContext.ioThread.completions.data != 0 || defaultContext.ioThread.running
+        || atomicLoadInt(&contextCount) != 0) {
+        return AHErrorInvalidRequest;
+    }
+
+    allocHook = allocFunction != 0 ? allocFunction : defaultAlloc;
+    freeHook = freeFunction != 0 ? freeFunction : defaultFree;
+    allocHookUserData = userData;
+    return 0;
+}
+
+static void reportFailedRequests(CompletionSink sink, void* sinkData) {
+    FailedRequest failed[MaxFailedRequests];
+    int failedCount = context->connection.failedCount;
+    memcpy(failed, context->connection.failed, sizeof(FailedRequest) * failedCount);
+    context->connection.failedCount = 0;
+
+    for (int i = 0; i < failedCount; i++) {
+        char completion[64];
+        int length = snprintf(completion, sizeof(completion),
+            "{\"requestID\": %d, \"data\": {\"error\": %d}}",
+            failed[i].requestID, failed[i].errorCode);
+        sink(sinkData, completion, (unsigned short) length);
+    }
+}
+
+/*
+ * Completes a JSON object body for a frame carrying a handle, started
+ * in body by the caller with length bytes and no closing brace.
+ */
+static int finishHandleBody(char* body, size_t capacity, int length, AppHandle handle,
+    size_t* oBodyLength, AppHandle* oPassHandle)
+{
+    if (length < 0 || (size_t) length >= capacity) {
+        return AHErrorUnknownError;
+    }
+
+    long long appHandle = -1;
+    int result = shareHandleWithApp(handle, oPassHandle, &appHandle);
+    if (result != 0) {
+        return result;
+    }
+
+    int end = appHandle >= 0
+        ? snprintf(&body[length], capacity - length, ", \"handle\": %lld}", appHandle)
+        : snprintf(&body[length], capacity - length, "}");
+    if (end < 0 || (size_t) end >= capacity - length) {
+        return AHErrorUnknownError;
+    }
+
+    *oBodyLength = length + end;
+    return 0;
+}
+
+static int shareMemoryWithApp() {
+    if (context->connection.sharedMemory.data == 0) {
+        int result = createSharedMemory(&context->connection.sharedMemory, SharedMemorySize);
+        if (result != 0) {
+            return result;
+        }
+    }
+
+    char body[128];
+    int length = snprintf(body, sizeof(body), "{\"size\": %llu",
+        (unsigned long long) context->connection.sharedMemory.size);
+    size_t bodyLength = 0;
+    AppHandle passHandle = NoAppHandle;
+    int result = finishHandleBody(body, sizeof(body), length, context->connection.sharedMemory.handle,
+        &bodyLength, &passHandle);
+    if (result != 0) {
         return result;
     }
 
-    if(replyBodyLength > 0){
-        char* body = malloc(replyBodyLength);
-        if(body == 0){
-            return AHErrorOutOfMemory;
-        }
-        int bodyResult = readFromApp(body, replyBodyLength);
+    int slot = 0;
+    result = sendRequest(0, "shmm", body, bodyLength, passHandle, 0, &slot);
+    if (result != 0) {
+        return result;
+    }
+    return awaitReply(slot, 0, 0);
+}
+
+/*
+ * Sends a body above the frame limit through shared memory. Always waits
+ * for the reply, since the region is reused by the next large body.
+ */
+static int dropShared(const char* dropData, size_t dropDataLength, short int requestID) {
+    if (!(context->connection.capabilities & CapabilitySharedMemory)) {
+        return AHErrorNotSupported;
+    }
+    if (dropDataLength > context->connection.sharedMemory.size) {
+        return AHErrorInvalidRequest;
+    }
+
+    memcpy(context->connection.sharedMemory.data, dropData, dropDataLength);
+
+    unsigned char reference[16];
+    unsigned long long offset = 0;
+    unsigned long long length = dropDataLength;
+    for (int i = 0; i < 8; i++) {
+        reference[i] = (unsigned char) (offset >> (8 * i));
+        reference[8 + i] = (unsigned char) (length >> (8 * i));
+    }
+
+    int slot = 0;
+    int result = sendRequest(requestID, "sdrp", (const char*) reference, sizeof(reference), NoAppHandle, 0, &slot);
+    if (result != 0) {
+        return result;
+    }
+    return awaitReply(slot, 0, 0);
+}
+
+/*
+ * Starts the deadline for the reads and writes of a call,
+ * zero for the timeout from the setup data.
+ */
+static void startCall(unsigned int timeoutMS) {
+    // The clock counts whole milliseconds, one more keeps calls from timing out early
+    context->connection.deadlineMS = monotonicMS() + 1 + (timeoutMS != 0 ? timeoutMS : context->connection.timeoutMS);
+}
+
+/*
+ * Switches to version 2 frames, and agrees on body encodings. An app
+ * that turns it down is talked to as before.
+ */
+static int negotiateFrameVersion() {
+    static const char request[] = "{\"version\": 2, \"encodings\": [\"cbor\"]}";
+    const char* body = 0;
+    size_t bodyLength = 0;
+
+    int result = callApp(0, "vers", request, sizeof(request) - 1, &body, &bodyLength);
+    if (result == AHRequestFailed) {
+        return 0;
+    }
+    if (result != 0) {
+        // Without the reply, there is no knowing which frames the app sends next
+        closeAppConnection();
+        return result;
+    }
+
+    context->connection.frameVersion = 2;
+    context->connection.capabilities &= ~CapabilityCBOR;
+    if (body != 0 && hasListItem(body, bodyLength, "encodings", "cbor")) {
+        context->connection.capabilities |= CapabilityCBOR;
+    }
+    return 0;
+}
+
+static int setupApp(const char* setupData, size_t setupDataLength) {
+    const char* body = 0;
+    size_t bodyLength = 0;
+
+    AHSpan setup = {setupData, setupDataLength};
+    AHSpan value;
+    long timeoutMS = 0;
+    if (findMember(setup, "timeoutMs", &value) == 0 && parseInteger(value, &timeoutMS) == 0 && timeoutMS > 0) {
+        context->connection.timeoutMS = (unsigned int) timeoutMS;
+        startCall(0);
+    }
+
+    int result = callApp(0, "init", setupData, setupDataLength, &body, &bodyLength);
+    context->connection.capabilities = 0;
+    if (body != 0 && hasListItem(body, bodyLength, "capabilities", "pollBatch")) {
+        context->connection.capabilities |= CapabilityPollBatch;
+    }
+    if (body != 0 && hasListItem(body, bodyLength, "capabilities", "notify")) {
+        context->connection.capabilities |= CapabilityNotify;
+    }
+    if (body != 0 && hasListItem(body, bodyLength, "capabilities", "sharedMemory")) {
+        context->connection.capabilities |= CapabilitySharedMemory;
+    }
+    if (body != 0 && hasListItem(body, bodyLength, "capabilities", "stemHandles")) {
+        context->connection.capabilities |= CapabilityStemHandles;
+    }
+    if (body != 0 && hasListItem(body, bodyLength, "capabilities", "frameV2")) {
+        context->connection.capabilities |= CapabilityFrameV2;
+    }
+    if (body != 0 && hasListItem(body, bodyLength, "capabilities", "chunkedStems")) {
+        context->connection.capabilities |= CapabilityChunkedStems;
+    }
+
+    if (result == 0 && (context->connection.capabilities & CapabilityFrameV2)) {
+        result = negotiateFrameVersion();
+    }
+
+    if (result == 0 && (context->connection.capabilities & CapabilitySharedMemory)) {
+        // Large bodies won't work without it, but everything else will
+        if (shareMemoryWithApp() != 0) {
+            context->connection.capabilities &= ~CapabilitySharedMemory;
+        }
+    }
+
+    if (result == 0 && context->connection.launchMS != 0) {
+        int launchToReadyMS = (int) (monotonicMS() - context->connection.launchMS);
+        atomicStoreInt(&context->connection.launchToReadyMS, launchToReadyMS);
+        context->connection.launchMS = 0;
+    }
+
+    if (result == 0) {
+        journalSetup(setupData, setupDataLength);
+    }
+
+    context->connection.sessionActive = result == 0;
+    // Pick up anything that completed before the app knew to notify
+    context->connection.completionsAvailable = 1;
+    return result;
+}
+
+// Sends a CBOR drop as JSON, to an app that doesn't take CBOR
+static int dropAsJSON(const char* dropData, size_t dropDataLength, short int requestID, unsigned int flags) {
+    JSONWriter writer = {0, 0};
+    if (transcodeCBOR(dropData, dropDataLength, &writer) != 0) {
+        return AHErrorInvalidRequest;
+    }
+    // Only the thread talking to the app gets here, so the buffer is free.
+    // JSON that doesn't fit a frame is rare enough to allocate for.
+    char* json = 0;
+    if (writer.length <= AHMaxRequestBody) {
+        if (context->connection.fieldsJSONBuffer == 0) {
+            context->connection.fieldsJSONBuffer = allocate(AHMaxRequestBody);
+        }
+        json = context->connection.fieldsJSONBuffer;
+    }
+    else {
+        json = allocate(writer.length);
+    }
+    if (json == 0) {
+        return AHErrorOutOfMemory;
+    }
+    writer.data = json;
+    writer.length = 0;
+    transcodeCBOR(dropData, dropDataLength, &writer);
+
+    int result = dropToApp(json, writer.length, requestID, flags);
+    if (json != context->connection.fieldsJSONBuffer) {
+        release(json);
+    }
+    return result;
+}
+
+static int dropToApp(const char* dropData, size_t dropDataLength, short int requestID, unsigned int flags) {
+    if ((flags & CallCBORBody) && !(context->connection.capabilities & CapabilityCBOR)) {
+        return dropAsJSON(dropData, dropDataLength, requestID, flags & ~CallCBORBody);
+    }
+    // Version 2 frames carry large bodies when there is no shared memory
+    if (dropDataLength > AHMaxRequestBody
+        && ((context->connection.capabilities & CapabilitySharedMemory) || context->connection.frameVersion < 2)) {
+        return dropShared(dropData, dropDataLength, requestID);
+    }
+
+    // With pipelining, return as soon as the request is written
+    int pipelined = context->connection.pipelineDepth > 1 || (flags & AHCallFireAndForget);
+    unsigned int sendFlags = (pipelined ? SendPipelined : 0) | ((flags & CallCBORBody) ? SendCBOR : 0);
+    int slot = 0;
+    int result = sendRequest(requestID, "drop", dropData, dropDataLength, NoAppHandle, sendFlags, &slot);
+    if (result != 0 || pipelined) {
+        return result;
+    }
+    return awaitReply(slot, 0, 0);
+}
+
+/*
+ * Copies in memory stems into shared memory, and duplicates stem files,
+ * so the caller may reuse its buffers and handles as soon as the call
+ * returns. The copy is the only one, the app maps the audio directly.
+ */
+static int prepareStems(const AHStem* stems, int stemCount, StemHandoff* oHandoffs) {
+    for (int i = 0; i < stemCount; i++) {
+        const AHStem* stem = &stems[i];
+        StemHandoff* handoff = &oHandoffs[i];
+        int result = 0;
+
+        size_t nameLength = stem->name != 0 ? strlen(stem->name) : 0;
+        int validName = nameLength != 0 && nameLength <= AHMaxStemNameLength;
+        for (size_t c = 0; validName && c < nameLength; c++) {
+            char ch = stem->name[c];
+            validName = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+                || (ch >= '0' && ch <= '9') || ch == '-' || ch == '_';
+        }
+
+        handoff->memory.data = 0;
+        handoff->file = NoAppHandle;
+        if (!validName) {
+            result = AHErrorInvalidRequest;
+        }
+        else if (stem->data != 0) {
+            result = stem->dataLength != 0
+                ? createSharedMemory(&handoff->memory, stem->dataLength)
+                : AHErrorInvalidRequest;
+            if (result == 0) {
+                memcpy(handoff->memory.data, stem->data, stem->dataLength);
+                handoff->length = stem->dataLength;
+            }
+        }
+        else {
+            result = duplicateFile(stem->file, &handoff->file, &handoff->length);
+        }
+
+        if (result != 0) {
+            releaseStems(oHandoffs, i);
+            return result;
+        }
+        memcpy(handoff->name, stem->name, nameLength + 1);
+    }
+    return 0;
+}
+
+static void releaseStems(StemHandoff* stems, int stemCount) {
+    for (int i = 0; i < stemCount; i++) {
+        if (stems[i].memory.data != 0) {
+            destroySharedMemory(&stems[i].memory);
+        }
+        else {
+            closeAppHandle(stems[i].file);
+        }
+    }
+}
+
+/*
+ * Sends a 'stem' frame per stem, or the audio itself to apps that take it
+ * in chunks, followed by the drop itself. The stem handles are released
+ * once sent, the app holds its own references.
+ */
+static int dropWithStems(const char* dropData, size_t dropDataLength, short int requestID,
+    StemHandoff* stems, int stemCount)
+{
+    int result = 0;
+    int chunked = !(context->connection.capabilities & CapabilityStemHandles);
+    if (chunked && !(context->connection.capabilities & CapabilityChunkedStems)) {
+        result = AHErrorNotSupported;
+    }
+    else if (dropDataLength > AHMaxRequestBody) {
+        result = AHErrorInvalidRequest;
+    }
+    else if (chunked) {
+        result = sendStemChunks(requestID, stems, stemCount);
+    }
+
+    int pipelined = context->connection.pipelineDepth > 1;
+    for (int i = 0; i < stemCount && result == 0 && !chunked; i++) {
+        AppHandle handle = stems[i].memory.data != 0 ? stems[i].memory.handle : stems[i].file;
+
+        char body[128];
+        int length = snprintf(body, sizeof(body), "{\"name\": \"%s\", \"length\": %llu",
+            stems[i].name, (unsigned long long) stems[i].length);
+        size_t bodyLength = 0;
+        AppHandle passHandle = NoAppHandle;
+        result = finishHandleBody(body, sizeof(body), length, handle, &bodyLength, &passHandle);
+        if (result != 0) {
+            break;
+        }
+
+        int slot = 0;
+        result = sendRequest(requestID, "stem", body, bodyLength, passHandle,
+            pipelined ? SendPipelined : 0, &slot);
+        if (result == 0 && !pipelined) {
+            result = awaitReply(slot, 0, 0);
+        }
+    }
+    releaseStems(stems, stemCount);
+
+    if (result != 0) {
+        return result;
+    }
+    return dropToApp(dropData, dropDataLength, requestID, 0);
+}
+
+static int quitApp() {
+    // Nothing to replay once the app is told to quit
+    clearJournal();
+
+    // Since we are closing down the app, ignore but return failed quit requests
+    int result = appIsRunning() ? callApp(0, "quit", 0, 0, 0, 0) : 0;
+    closeAppConnection();
+    // Including requests whose callers timed out, no replies will come now
+    failInFlight(AHErrorCommsFailure);
+    context->connection.capabilities = 0;
+    context->connection.frameVersion = 1;
+    context->connection.sessionActive = 0;
+    context->connection.completionsAvailable = 0;
+    context->connection.launchMS = 0;
+    release(context->connection.replyBuffer);
+    context->connection.replyBuffer = 0;
+    release(context->connection.lateReply);
+    context->connection.lateReply = 0;
+    context->connection.lateReplyLength = 0;
+    release(context->connection.transcodeBuffer);
+    context->connection.transcodeBuffer = 0;
+    release(context->connection.fieldsBuffer);
+    context->connection.fieldsBuffer = 0;
+    release(context->connection.fieldsJSONBuffer);
+    context->connection.fieldsJSONBuffer = 0;
+    if (context->connection.sharedMemory.data != 0) {
+        destroySharedMemory(&context->connection.sharedMemory);
+    }
+    return result;
+}
+
+/// Supervisor
+
+/*
+ * Relaunches the app if it has died since it was set up, and replays the
+ * setup and the drops whose completions have not been seen yet. While
+ * the app keeps dying, relaunches back off exponentially, and calls fail
+ * with AHErrorCommsFailure in between.
+ */
+static int superviseApp() {
+    if (context->connection.journalSetupData == 0 || context->connection.replaying || appIsRunning()) {
+        return 0;
+    }
+
+    long long nowMS = monotonicMS();
+    if (nowMS < context->connection.nextRestartMS) {
+        return AHErrorCommsFailure;
+    }
+    if (nowMS - context->connection.restartMS > StableAppMS) {
+        context->connection.restartDelayMS = MinRestartDelayMS;
+    }
+    context->connection.restartMS = nowMS;
+    context->connection.nextRestartMS = nowMS + context->connection.restartDelayMS;
+    context->connection.restartDelayMS = context->connection.restartDelayMS * 2 < MaxRestartDelayMS
+        ? context->connection.restartDelayMS * 2 : MaxRestartDelayMS;
+
+    traceEvent("rstr", 0, 0, 0);
+    countStat(&context->connection.stats.restarts, 1);
+    // Journaled requests in flight are replayed rather than reported
+    failInFlight(AHErrorCommsFailure);
+    context->connection.sessionActive = 0;
+    context->connection.replaying = 1;
+
+    // The replay has a deadline of its own, the caller's is kept
+    long long deadlineMS = context->connection.deadlineMS;
+    startCall(0);
+
+    int result = setupApp(context->connection.journalSetupData, context->connection.journalSetupDataLength);
+    for (int i = 0; result == 0 && i < context->connection.journalCount; i++) {
+        JournalDrop* drop = &context->connection.journal[i];
+        if (++drop->replays > MaxReplays) {
+            // Also removes it from the journal
+            addFailedRequest(drop->requestID, AHErrorCommsFailure);
+            i--;
+            continue;
+        }
+        result = dropToApp(drop->data, drop->dataLength, drop->requestID, AHCallFireAndForget | drop->flags);
+    }
+
+    context->connection.replaying = 0;
+    context->connection.deadlineMS = deadlineMS;
+    return result;
+}
+
+static void journalSetup(const char* setupData, size_t setupDataLength) {
+    if (context->connection.replaying) {
+        return;
+    }
+    // Without a copy, the app is not relaunched
+    release(context->connection.journalSetupData);
+    context->connection.journalSetupData = allocate(setupDataLength);
+    if (context->connection.journalSetupData != 0) {
+        memcpy(context->connection.journalSetupData, setupData, setupDataLength);
+        context->connection.journalSetupDataLength = setupDataLength;
+    }
+}
+
+// Moves the drop out of the journal, keeping its buffer after the journaled drops
+static void forgetJournaled(int index) {
+    JournalDrop forgotten = context->connection.journal[index];
+    memmove(&context->connection.journal[index], &context->connection.journal[index + 1],
+        sizeof(JournalDrop) * (context->connection.journalCount - index - 1));
+    context->connection.journalCount--;
+    context->connection.journal[context->connection.journalCount] = forgotten;
+}
+
+static void journalDrop(const char* dropData, size_t dropDataLength, short int requestID, unsigned int flags) {
+    if (context->connection.replaying || context->connection.journalSetupData == 0) {
+        return;
+    }
+
+    if (context->connection.journalCount == MaxJournalDrops) {
+        // The oldest drop is the most likely to have completed unnoticed
+        forgetJournaled(0);
+    }
+
+    // Steady state drops of similar sizes don't allocate, capacities are powers of two
+    JournalDrop* drop = &context->connection.journal[context->connection.journalCount];
+    if (drop->capacity < dropDataLength) {
+        size_t capacity = MinJournalCapacity;
+        while (capacity < dropDataLength) {
+            capacity *= 2;
+        }
+        char* data = allocate(capacity);
+        if (data == 0) {
+            return;
+        }
+        release(drop->data);
+        drop->data = data;
+        drop->capacity = capacity;
+    }
+    memcpy(drop->data, dropData, dropDataLength);
+
+    context->connection.journalCount++;
+    drop->requestID = requestID;
+    drop->replays = 0;
+    drop->flags = flags & CallCBORBody;
+    drop->dataLength = dropDataLength;
+}
+
+static int isJournaled(short int requestID) {
+    for (int i = 0; i < context->connection.journalCount; i++) {
+        if (context->connection.journal[i].requestID == requestID) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Forgets the oldest journaled drop with the ID, as the app completes drops in order
+static void forgetDrop(short int requestID) {
+    for (int i = 0; i < context->connection.journalCount; i++) {
+        if (context->connection.journal[i].requestID == requestID) {
+            forgetJournaled(i);
+            return;
+        }
+    }
+}
+
+static void clearJournal() {
+    for (int i = 0; i < MaxJournalDrops; i++) {
+        release(context->connection.journal[i].data);
+        context->connection.journal[i].data = 0;
+        context->connection.journal[i].capacity = 0;
+    }
+    context->connection.journalCount = 0;
+    release(context->connection.journalSetupData);
+    context->connection.journalSetupData = 0;
+    context->connection.journalSetupDataLength = 0;
+    context->connection.restartMS = 0;
+    context->connection.nextRestartMS = 0;
+}
+
+// Passes completions on, forgetting the journaled drops they complete
+static void forgetCompleted(void* sinkData, const char* completion, unsigned short length) {
+    JournalSink* next = (JournalSink*) sinkData;
+    AHSpan response = {completion, length};
+    AHSpan value;
+    long requestID = 0;
+    if (findMember(response, "requestID", &value) == 0 && parseInteger(value, &requestID) == 0) {
+        forgetDrop((short int) requestID);
+    }
+    next->sink(next->sinkData, completion, length);
+}
+
+/// Prewarm
+
+static void prewarmMain(void* argument) {
+    context = (AHContext*) argument;
+    startCall(0);
+    context->prewarm.result = setupApp(context->prewarm.setupData, context->prewarm.setupDataLength);
+}
+
+/*
+ * Waits for the launch and setup started by AHprewarm, if any.
+ * Returns the setup result once, to the first call to wait for it.
+ */
+static int finishPrewarm() {
+    if (!context->prewarm.running) {
+        return 0;
+    }
+    joinThread(&context->prewarm.thread);
+    context->prewarm.running = 0;
+    release(context->prewarm.setupData);
+    context->prewarm.setupData = 0;
+    return context->prewarm.result;
+}
+
+/// IO thread
+
+static void pushSubmission(Submission* submission) {
+    submission->next = 0;
+    Submission* previous = atomicExchangePointer(&context->ioThread.head, submission);
+    atomicStorePointer(&previous->next, submission);
+}
+
+/*
+ * Queues a request for the IO thread, can be called from any thread.
+ * The data is copied, since the call returns before it is sent. The
+ * IO thread takes over the stem handles.
+ */
+static int submit(const char command[4], short int requestID, const char* data, size_t dataLength,
+    const AHCallOptions* options, const StemHandoff* stems, int stemCount)
+{
+    // Only drops count towards the limit, setting up, closing and cancelling always get through
+    int isDrop = memcmp(command, "drop", 4) == 0;
+    if (isDrop && (int) atomicIncrementInt(&context->ioThread.queuedCount) > context->ioThread.queueLimit) {
+        atomicDecrementInt(&context->ioThread.queuedCount);
+        return AHErrorWouldBlock;
+    }
+
+    size_t stemsSize = sizeof(StemHandoff) * stemCount;
+    Submission* submission = allocate(sizeof(Submission) + stemsSize + dataLength);
+    if (submission == 0) {
+        if (isDrop) {
+            atomicDecrementInt(&context->ioThread.queuedCount);
+        }
+        return AHErrorOutOfMemory;
+    }
+
+    memcpy(submission->command, command, 4);
+    submission->requestID = requestID;
+    if (options != 0) {
+        submission->options = *options;
+    }
+    else {
+        memset(&submission->options, 0, sizeof(submission->options));
+    }
+    submission->stems = (StemHandoff*) (submission + 1);
+    submission->stemCount = stemCount;
+    if (stemCount != 0) {
+        memcpy(submission->stems, stems, stemsSize);
+    }
+    submission->dataLength = dataLength;
+    submission->data = (char*) submission->stems + stemsSize;
+    if (dataLength != 0) {
+        memcpy(submission->data, data, dataLength);
+    }
+
+    pushSubmission(submission);
+    raiseSignal(&context->ioThread.wake);
+    return 0;
+}
+
+/*
+ * Pops the oldest queued request, only called by the IO thread.
+ * Returns zero when the queue is empty, or when a producer is half way
+ * through a push. In the latter case, the producer raises the wake
+ * signal once done.
+ */
+static Submission* nextSubmission() {
+    Submission* tail = context->ioThread.tail;
+    Submission* next = atomicLoadPointer(&tail->next);
+
+    if (tail == &context->ioThread.stub) {
+        if (next == 0) {
+            return 0;
+        }
+        context->ioThread.tail = next;
+        tail = next;
+        next = atomicLoadPointer(&next->next);
+    }
+
+    if (next != 0) {
+        context->ioThread.tail = next;
+        return tail;
+    }
+
+    if (tail != atomicLoadPointer(&context->ioThread.head)) {
+        return 0;
+    }
+
+    // Put the stub back, so the last submission can be taken off the queue
+    pushSubmission(&context->ioThread.stub);
+    next = atomicLoadPointer(&tail->next);
+    if (next != 0) {
+        context->ioThread.tail = next;
+        return tail;
+    }
+    return 0;
+}
+
+static void releaseSubmission(Submission* submission) {
+    if (memcmp(submission->command, "drop", 4) == 0) {
+        atomicDecrementInt(&context->ioThread.queuedCount);
+    }
+    release(submission);
+}
+
+static int isCancelled(short int requestID) {
+    if (!context->ioThread.running) {
+        return 0;
+    }
+    for (int i = 0; i < MaxPendingCancels; i++) {
+        if (atomicLoadInt(&context->ioThread.cancelRequestIDs[i]) == requestID) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Takes queued drops off the queue, and reports them as cancelled
+static void cancelQueued(short int requestID, int entry) {
+    for (int priority = 0; priority < PriorityCount; priority++) {
+        Submission** link = &context->ioThread.queued[priority];
+        Submission* previous = 0;
+        while (*link != 0) {
+            Submission* submission = *link;
+            if (submission->requestID != requestID) {
+                previous = submission;
+                link = &submission->next;
+                continue;
+            }
+
+            *link = submission->next;
+            if (context->ioThread.lastQueued[priority] == submission) {
+                context->ioThread.lastQueued[priority] = previous;
+            }
+            releaseStems(submission->stems, submission->stemCount);
+            addFailedRequest(requestID, AHErrorCancelled);
+            releaseSubmission(submission);
+        }
+    }
+
+    // A drop being sent has been stopped by now, if it was to be
+    if (entry >= 0) {
+        atomicStoreInt(&context->ioThread.cancelRequestIDs[entry], 0);
+    }
+}
+
+/*
+ * Picks the next request for the IO thread to handle. Drops are taken
+ * off the queue as they come, and handled by priority, but an AHsetup or
+ * AHclose waits for the drops queued before it, and holds up the rest.
+ */
+static Submission* nextQueued() {
+    Submission* submission = 0;
+    while (context->ioThread.barrier == 0 && (submission = nextSubmission()) != 0) {
+        if (memcmp(submission->command, "cncl", 4) == 0) {
+            int entry;
+            memcpy(&entry, submission->data, sizeof(entry));
+            cancelQueued(submission->requestID, entry);
+            release(submission);
+        }
+        else if (memcmp(submission->command, "drop", 4) == 0) {
+            int priority = submission->options.priority - AHPriorityLow;
+            submission->next = 0;
+            if (context->ioThread.queued[priority] == 0) {
+                context->ioThread.queued[priority] = submission;
+            }
+            else {
+                context->ioThread.lastQueued[priority]->next = submission;
+            }
+            context->ioThread.lastQueued[priority] = submission;
+        }
+        else {
+            context->ioThread.barrier = submission;
+        }
+    }
+
+    for (int priority = PriorityCount - 1; priority >= 0; priority--) {
+        submission = context->ioThread.queued[priority];
+        if (submission != 0) {
+            context->ioThread.queued[priority] = submission->next;
+            return submission;
+        }
+    }
+
+    submission = context->ioThread.barrier;
+    context->ioThread.barrier = 0;
+    return submission;
+}
+
+static void handleSubmission(const Submission* submission) {
+    int result = 0;
+    startCall(submission->options.timeoutMS);
+
+    if (memcmp(submission->command, "init", 4) == 0) {
+        result = setupApp(submission->data, submission->dataLength);
+    }
+    else if (memcmp(submission->command, "drop", 4) == 0) {
+        // The cancel may be held up behind an AHsetup or AHclose
+        result = isCancelled(submission->requestID) ? AHErrorCancelled : superviseApp();
+        if (result != 0) {
+            releaseStems(submission->stems, submission->stemCount);
+        }
+        else if (submission->stemCount != 0) {
+            // Not journaled, the stem handles are gone once sent
+            result = dropWithStems(submission->data, submission->dataLength, submission->requestID,
+                submission->stems, submission->stemCount);
+        }
+        else {
+            result = dropToApp(submission->data, submission->dataLength, submission->requestID,
+                submission->options.flags);
+            if (result == 0 && submission->dataLength <= AHMaxRequestBody) {
+                journalDrop(submission->data, submission->dataLength, submission->requestID,
+                    submission->options.flags);
+            }
+        }
+    }
+    else if (memcmp(submission->command, "quit", 4) == 0) {
+        result = quitApp();
+    }
+
+    // The caller has already returned, so failures are reported as completions
+    if (result != 0) {
+        addFailedRequest(submission->requestID, result);
+    }
+}
+
+static size_t completionRoom() {
+    lockMutex(&context->ioThread.completionMutex);
+    CompletionRing* ring = &context->ioThread.completions;
+    size_t room = ring->size - (ring->collected - ring->delivered);
+    unlockMutex(&context->ioThread.completionMutex);
+    return room;
+}
+
+static void queueCompletion(void* sinkData, const char* completion, unsigned short length) {
+    (void) sinkData;
+    lockMutex(&context->ioThread.completionMutex);
+    CompletionRing* ring = &context->ioThread.completions;
+    size_t position = ring->collected % ring->size;
+    size_t unused = ring->size - position < 2u + length ? ring->size - position : 0;
+
+    if (ring->collected + unused + 2 + length - ring->delivered <= ring->size) {
+        if (unused >= 2) {
+            ring->data[position] = 0;
+            ring->data[position + 1] = 0;
+        }
+        position = (position + unused) % ring->size;
+        ring->data[position] = (char) (length & 0xff);
+        ring->data[position + 1] = (char) (length >> 8);
+        memcpy(&ring->data[position + 2], completion, length);
+        ring->collected += unused + 2 + length;
+        if (!ring->signalled) {
+            raiseSignal(&context->ioThread.completionSignal);
+            ring->signalled = 1;
+        }
+    }
+    else {
+        traceEvent("full", 0, length, AHErrorOutOfMemory);
+    }
+    unlockMutex(&context->ioThread.completionMutex);
+}
+
+// Room for a full reply, and for what is left unused at the end of the ring
+static int hasRoomForReply() {
+    return completionRoom() >= 2 * (AHMaxRequestBody + 2);
+}
+
+/*
+ * Polls the app while there is room for a full reply. When the buffer
+ * fills up, the completions wait in the app until the host has polled.
+ */
+static void collectCompletions() {
+    int more = context->connection.sessionActive;
+
+    while (more && hasRoomForReply()) {
+        int result = pollRound(queueCompletion, 0, &more);
+        if (result != 0) {
+            // Don't relaunch the app by polling it, wait for the next AHsetup
+            addFailedRequest(0, result);
+            context->connection.sessionActive = result == AHErrorTimeout;
+            break;
+        }
+    }
+}
+
+static void collectFailedRequests() {
+    if (context->connection.failedCount != 0 && completionRoom() >= (MaxFailedRequests + 1) * (64 + 2)) {
+        reportFailedRequests(queueCompletion, 0);
+    }
+}
+
+/*
+ * Reads replies and notifications that have already arrived,
+ * without sending anything to the app.
+ */
+static int readPendingReplies() {
+    while (waitForAppData(0, 0)) {
+        int replySlot = 0;
+        size_t bodyLength = 0;
+        int result = readReply(&replySlot, &bodyLength);
+        if (result) {
+            failInFlight(result);
+            return result;
+        }
+    }
+    return 0;
+}
+
+static void ioThreadMain(void* argument) {
+    context = (AHContext*) argument;
+    long long nextPollMS = 0;
+
+    for (;;) {
+        Submission* submission = 0;
+        while ((submission = nextQueued()) != 0) {
+            handleSubmission(submission);
+            releaseSubmission(submission);
+        }
+
+        // No more requests are queued once stop has been requested
+        if (atomicLoadInt(&context->ioThread.stopRequested)) {
+            break;
+        }
+
+        // Notifying apps are only polled when they have something, others at intervals.
+        // Either way, the app is checked on at intervals.
+        int notify = (context->connection.capabilities & CapabilityNotify) != 0;
+        long long nowMS = monotonicMS();
+        int due = nowMS >= nextPollMS;
+        if (due) {
+            // Queued drops are failed while the app is down, nothing to report here
+            superviseApp();
+        }
+        if (notify ? context->connection.completionsAvailable : due) {
+            startCall(0);
+            collectCompletions();
+        }
+        if (due) {
+            nextPollMS = nowMS + context->ioThread.pollIntervalMS;
+        }
+        collectFailedRequests();
+
+        long long timeoutMS = nextPollMS - monotonicMS();
+        if (notify && context->connection.completionsAvailable && hasRoomForReply()) {
+            timeoutMS = 0;
+        }
+
+        if (waitForAppData(&context->ioThread.wake, timeoutMS > 0 ? (int) timeoutMS : 0) == 0) {
+            continue;
+        }
+
+        // Notifications and replies to pipelined drops
+        startCall(0);
+        int result = readPendingReplies();
+        if (result != 0) {
+            addFailedRequest(0, result);
+            context->connection.sessionActive = result == AHErrorTimeout;
+        }
+    }
+
+    // Report what happened to requests handled after the last poll
+    startCall(0);
+    collectCompletions();
+    collectFailedRequests();
+}
+
+/*
+ * Hands the collected completions to the sink. The IO thread keeps
+ * collecting meanwhile, into the rest of the ring. No lock is held while
+ * the sink runs, so that host handlers may poll again, and the bytes
+ * handed out stay in place until every delivery under way is over.
+ */
+static void deliverCompletions(CompletionSink sink, void* sinkData) {
+    CompletionRing* ring = &context->ioThread.completions;
+
+    lockMutex(&context->ioThread.completionMutex);
+    size_t delivered = ring->claimed;
+    size_t collected = ring->collected;
+    ring->claimed = collected;
+    ring->deliveries++;
+    if (context->ioThread.running) {
+        clearSignal(&context->ioThread.completionSignal);
+    }
+    ring->signalled = 0;
+    unlockMutex(&context->ioThread.completionMutex);
+
+    const unsigned char* bytes = (const unsigned char*) ring->data;
+    while (delivered != collected) {
+        size_t position = delivered % ring->size;
+        size_t length = ring->size - position >= 2 ? bytes[position] | (bytes[position + 1] << 8) : 0;
+        if (length == 0) {
+            delivered += ring->size - position;
+            continue;
+        }
+        sink(sinkData, &ring->data[position + 2], (unsigned short) length);
+        delivered += 2 + length;
+    }
+
+    lockMutex(&context->ioThread.completionMutex);
+    int any = 0;
+    if (--ring->deliveries == 0) {
+        any = ring->claimed != ring->delivered;
+        ring->delivered = ring->claimed;
+    }
+    unlockMutex(&context->ioThread.completionMutex);
+
+    // There is room for more completions, don't wait for the next poll interval
+    if (any && context->ioThread.running) {
+        raiseSignal(&context->ioThread.wake);
+    }
+}
+
+// Kept while being delivered, for a handler that closes the app
+static void releaseCompletionRing() {
+    if (context->ioThread.completions.deliveries != 0) {
+        return;
+    }
+    release(context->ioThread.completions.data);
+    context->ioThread.completions.data = 0;
+    context->ioThread.completions.size = 0;
+    context->ioThread.completions.collected = 0;
+    context->ioThread.completions.claimed = 0;
+    context->ioThread.completions.delivered = 0;
+}
+
+/// Completion parsing
+
+/*
+ * Just enough of a JSON tokenizer to pick members out of completions
+ * in place, without allocating. Values are skipped over rather than
+ * validated, and string escapes are left as they are.
+ */
+typedef struct {
+    const char* at;
+    const char* end;
+} JSONCursor;
+
+static void skipSpace(JSONCursor* cursor) {
+    while (cursor->at < cursor->end
+        && (*cursor->at == ' ' || *cursor->at == '\t' || *cursor->at == '\n' || *cursor->at == '\r')) {
+        cursor->at++;
+    }
+}
+
+// Sets oContents to the string between the quotes
+static int skipString(JSONCursor* cursor, AHSpan* oContents) {
+    if (cursor->at == cursor->end || *cursor->at != '"') {
+        return AHErrorCommsFailure;
+    }
+    const char* start = ++cursor->at;
+    while (cursor->at < cursor->end && *cursor->at != '"') {
+        cursor->at += *cursor->at == '\\' ? 2 : 1;
+    }
+    if (cursor->at >= cursor->end) {
+        return AHErrorCommsFailure;
+    }
+    oContents->data = start;
+    oContents->length = cursor->at - start;
+    cursor->at++;
+    return 0;
+}
+
+// Sets oValue to the value text, or the contents of a string value
+static int skipValue(JSONCursor* cursor, AHSpan* oValue) {
+    skipSpace(cursor);
+    if (cursor->at == cursor->end) {
+        return AHErrorCommsFailure;
+    }
+    if (*cursor->at == '"') {
+        return skipString(cursor, oValue);
+    }
+
+    const char* start = cursor->at;
+    int depth = 0;
+    while (cursor->at < cursor->end) {
+        char c = *cursor->at;
+        if (c == '"') {
+            AHSpan contents;
+            if (skipString(cursor, &contents) != 0) {
+                return AHErrorCommsFailure;
+            }
+            continue;
+        }
+        if (c == '{' || c == '[') {
+            depth++;
+        }
+        else if (c == '}' || c == ']') {
+            if (depth == 0) {
+                break;
+            }
+            depth--;
+        }
+        else if (depth == 0 && (c == ',' || c == ' ' || c == '\t' || c == '\n' || c == '\r')) {
+            break;
+        }
+        cursor->at++;
+        if (depth == 0 && (c == '}' || c == ']')) {
+            break;
+        }
+    }
+    if (depth != 0 || cursor->at == start) {
+        return AHErrorCommsFailure;
+    }
+
+    oValue->data = start;
+    oValue->length = cursor->at - start;
+    return 0;
+}
+
+static int findMember(AHSpan object, const char* key, AHSpan* oValue) {
+    JSONCursor cursor = {object.data, object.data + object.length};
+    size_t keyLength = strlen(key);
+
+    skipSpace(&cursor);
+    if (cursor.at == cursor.end || *cursor.at != '{') {
+        return AHErrorCommsFailure;
+    }
+    cursor.at++;
+
+    for (;;) {
+        skipSpace(&cursor);
+        if (cursor.at < cursor.end && *cursor.at == '}') {
+            return AHErrorInvalidRequest;
+        }
+
+        AHSpan name;
+        AHSpan value;
+        if (skipString(&cursor, &name) != 0) {
+            return AHErrorCommsFailure;
+        }
+        skipSpace(&cursor);
+        if (cursor.at == cursor.end || *cursor.at != ':') {
+            return AHErrorCommsFailure;
+        }
+        cursor.at++;
+        if (skipValue(&cursor, &value) != 0) {
+            return AHErrorCommsFailure;
+        }
+
+        if (name.length == keyLength && memcmp(name.data, key, keyLength) == 0) {
+            *oValue = value;
+            return 0;
+        }
+
+        skipSpace(&cursor);
+        if (cursor.at < cursor.end && *cursor.at == ',') {
+            cursor.at++;
+        }
+        else if (cursor.at == cursor.end || *cursor.at != '}') {
+            return AHErrorCommsFailure;
+        }
+    }
+}
+
+/*
+ * Whether the array member key of a reply has the string item, so that
+ * the same name elsewhere in the reply isn't mistaken for it.
+ */
+static int hasListItem(const char* body, size_t bodyLength, const char* key, const char* item) {
+    AHSpan reply = {body, bodyLength};
+    AHSpan list;
+    if (findMember(reply, key, &list) != 0) {
+        return 0;
+    }
+
+    JSONCursor cursor = {list.data, list.data + list.length};
+    size_t itemLength = strlen(item);
+    if (cursor.at == cursor.end || *cursor.at != '[') {
+        return 0;
+    }
+    cursor.at++;
+
+    for (;;) {
+        skipSpace(&cursor);
+        if (cursor.at == cursor.end || *cursor.at == ']') {
+            return 0;
+        }
+
+        int isString = *cursor.at == '"';
+        AHSpan value;
+        if (skipValue(&cursor, &value) != 0) {
+            return 0;
+        }
+        if (isString && value.length == itemLength && memcmp(value.data, item, itemLength) == 0) {
+            return 1;
+        }
+
+        skipSpace(&cursor);
+        if (cursor.at < cursor.end && *cursor.at == ',') {
+            cursor.at++;
+        }
+        else if (cursor.at == cursor.end || *cursor.at != ']') {
+            return 0;
+        }
+    }
+}
+
+// Up to 18 digits, enough for offsets into stems of any size
+static int parseInteger64(AHSpan text, long long* oValue) {
+    size_t i = text.length != 0 && text.data[0] == '-' ? 1 : 0;
+    if (i == text.length) {
+        return AHErrorCommsFailure;
+    }
+
+    long long value = 0;
+    for (size_t digit = i; digit < text.length; digit++) {
+        if (text.data[digit] < '0' || text.data[digit] > '9' || value > 99999999999999999LL) {
+            return AHErrorCommsFailure;
+        }
+        value = value * 10 + (text.data[digit] - '0');
+    }
+
+    *oValue = i == 1 ? -value : value;
+    return 0;
+}
+
+// Fits a 32 bit long
+static int parseInteger(AHSpan text, long* oValue) {
+    long long value = 0;
+    if (parseInteger64(text, &value) != 0 || value < -0x7fffffffLL || value > 0x7fffffffLL) {
+        return AHErrorCommsFailure;
+    }
+    *oValue = (long) value;
+    return 0;
+}
+
+/*
+ * Completions that can't be made sense of are still handed on, with
+ * the response as is, but without a request ID and with a failure status.
+ */
+static void parseCompletion(const char* response, size_t responseLength, AHCompletion* oCompletion) {
+    AHSpan whole = {response, responseLength};
+    AHSpan value;
+    long requestID = 0;
+
+    oCompletion->response = whole;
+    oCompletion->requestID = 0;
+    oCompletion->status = AHErrorCommsFailure;
+    oCompletion->data.data = 0;
+    oCompletion->data.length = 0;
+
+    if (findMember(whole, "requestID", &value) != 0 || parseInteger(value, &requestID) != 0
+        || requestID < -32768 || requestID > 32767) {
+        return;
+    }
+    if (findMember(whole, "data", &oCompletion->data) != 0) {
+        return;
+    }
+    oCompletion->requestID = (short int) requestID;
+
+    // Requests the SDK failed to make have an error code, see reportFailedRequests,
+    // and any other error the app reports, such as a message, fails the request
+    long errorCode = 0;
+    oCompletion->status = 0;
+    if (findMember(oCompletion->data, "error", &value) == 0) {
+        if (parseInteger(value, &errorCode) != 0) {
+            oCompletion->status = AHRequestFailed;
+        }
+        else if (errorCode != 0) {
+            oCompletion->status = (int) errorCode;
+        }
+    }
+}
+
+/// Drop request builder
+
+static void writeRaw(JSONWriter* writer, const char* text, size_t length) {
+    if (writer->data != 0) {
+        memcpy(&writer->data[writer->length], text, length);
+    }
+    writer->length += length;
+}
+
+static void writeText(JSONWriter* writer, const char* text) {
+    writeRaw(writer, text, strlen(text));
+}
+
+static void writeStringSpan(JSONWriter* writer, const char* text, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    writeRaw(writer, "\"", 1);
+
+    // Copy runs of characters that need no escaping in one go
+    const char* run = text;
+    const char* end = &text[length];
+    for (const char* c = text; c != end; c++) {
+        unsigned char ch = (unsigned char) *c;
+        if (ch >= 0x20 && ch != '"' && ch != '\\') {
+            continue;
+        }
+        writeRaw(writer, run, c - run);
+        run = c + 1;
+
+        char escape[6] = {'\\', (char) ch};
+        size_t escapeLength = 2;
+        switch (ch) {
+            case '"': case '\\': break;
+            case '\b': escape[1] = 'b'; break;
+            case '\f': escape[1] = 'f'; break;
+            case '\n': escape[1] = 'n'; break;
+            case '\r': escape[1] = 'r'; break;
+            case '\t': escape[1] = 't'; break;
+            default:
+                memcpy(&escape[1], "u00", 3);
+                escape[4] = hex[ch >> 4];
+                escape[5] = hex[ch & 15];
+                escapeLength = 6;
+        }
+        writeRaw(writer, escape, escapeLength);
+    }
+    writeRaw(writer, run, end - run);
+
+    writeRaw(writer, "\"", 1);
+}
+
+static void writeString(JSONWriter* writer, const char* text) {
+    writeStringSpan(writer, text, strlen(text));
+}
+
+static void writeInteger(JSONWriter* writer, long long value) {
+    char text[24];
+    char* end = &text[sizeof(text)];
+    char* start = end;
+    unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long) value : (unsigned long long) value;
+    do {
+        *--start = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) {
+        *--start = '-';
+    }
+    writeRaw(writer, start, end - start);
+}
+
+static void writeNumber(JSONWriter* writer, double value) {
+    char text[32];
+    int length = snprintf(text, sizeof(text), "%.9g", value);
+    // The host may have set a locale with a decimal comma
+    for (int i = 0; i < length; i++) {
+        if (text[i] == ',') {
+            text[i] = '.';
+        }
+    }
+    writeRaw(writer, text, length);
+}
+
+static void writeStringField(JSONWriter* writer, const char* separator, const char* name, const char* value) {
+    writeText(writer, separator);
+    writeString(writer, name);
+    writeRaw(writer, ": ", 2);
+    writeString(writer, value);
+}
+
+static void writeMusicalMetadata(JSONWriter* writer, const AHDropRequest* request) {
+    writeText(writer, ", \"musicalMetadata\": {\"lengthMicroseconds\": ");
+    writeInteger(writer, request->lengthMicroseconds);
+
+    if (request->tempo != 0) {
+        writeText(writer, ", \"tempo\": {\"fixed\": ");
+        writeNumber(writer, request->tempo);
+        writeRaw(writer, "}", 1);
+    }
+
+    if (request->loopEndMicroseconds != 0) {
+        writeText(writer, ", \"loop\": {\"startMicroSeconds\": ");
+        writeInteger(writer, request->loopStartMicroseconds);
+        writeText(writer, ", \"endMicroSeconds\": ");
+        writeInteger(writer, request->loopEndMicroseconds);
+        writeRaw(writer, "}", 1);
+    }
+
+    if (request->timeSignatureUpper != 0 && request->timeSignatureLower != 0) {
+        writeText(writer, ", \"timeSignature\": {\"fixed\": {\"upper\": ");
+        writeInteger(writer, request->timeSignatureUpper);
+        writeText(writer, ", \"lower\": ");
+        writeInteger(writer, request->timeSignatureLower);
+        writeRaw(writer, "}}", 2);
+    }
+
+    static const char* const modes[] = {"", "UNKNOWN", "ATONAL", "TONAL"};
+    if (request->tonalityMode != AHTonalityNotSet) {
+        writeText(writer, ", \"tonality\": {\"mode\": ");
+        writeString(writer, modes[request->tonalityMode]);
+    }
+    if (request->tonalityMode == AHTonalityTonal) {
+        writeText(writer, ", \"scale\": [");
+        for (int i = 0; i < 12; i++) {
+            writeText(writer, i == 0 ? "" : ", ");
+            writeText(writer, request->scale[i] ? "true" : "false");
+        }
+        writeText(writer, "], \"root\": ");
+        writeInteger(writer, request->tonalityRoot);
+    }
+    if (request->tonalityMode != AHTonalityNotSet) {
+        writeRaw(writer, "}", 1);
+    }
+
+    writeRaw(writer, "}", 1);
+}
+
+static void writeDropRequest(JSONWriter* writer, const AHDropRequest* request) {
+    writeStringField(writer, "{\"stems\": {", "mixStemURL", request->mixStemURL);
+
+    writeStringField(writer, "}, \"presentation\": {", "title", request->title);
+    if (request->previewURL != 0) {
+        writeStringField(writer, ", ", "previewURL", request->previewURL);
+    }
+    if (request->coverImageURL != 0) {
+        writeStringField(writer, ", ", "coverImageURL", request->coverImageURL);
+    }
+    writeRaw(writer, "}", 1);
+
+    if (request->basedOnPieceCount != 0) {
+        writeText(writer, ", \"attribution\": {\"basedOnPieces\": [");
+        for (int i = 0; i < request->basedOnPieceCount; i++) {
+            writeText(writer, i == 0 ? "" : ", ");
+            writeString(writer, request->basedOnPieces[i]);
+        }
+        writeRaw(writer, "]}", 2);
+    }
+
+    writeMusicalMetadata(writer, request);
+
+    if (request->attachmentCount != 0) {
+        writeText(writer, ", \"attachments\": [");
+        for (int i = 0; i < request->attachmentCount; i++) {
+            writeStringField(writer, i == 0 ? "{" : ", {", "mimeType", request->attachments[i].mimeType);
+            writeStringField(writer, ", ", "dataURL", request->attachments[i].dataURL);
+            writeRaw(writer, "}", 1);
+        }
+        writeRaw(writer, "]", 1);
+    }
+
+    writeRaw(writer, "}", 1);
+}
+
+static int isValidDropRequest(const AHDropRequest* request) {
+    if (request->mixStemURL == 0 || request->title == 0 || request->lengthMicroseconds <= 0) {
+        return 0;
+    }
+    // Neither NaN nor infinity can be written as JSON
+    if (request->tempo != request->tempo || request->tempo - request->tempo != 0) {
+        return 0;
+    }
+    if (request->tonalityMode < AHTonalityNotSet || request->tonalityMode > AHTonalityTonal) {
+        return 0;
+    }
+    // The app refuses keys it can't name
+    if (request->tonalityMode == AHTonalityTonal) {
+        if (request->tonalityRoot < 0 || request->tonalityRoot > 11) {
+            return 0;
+        }
+        for (int i = 0; i < 12; i++) {
+            if (request->scale[i] > 1) {
+                return 0;
+            }
+        }
+    }
+
+    if (request->basedOnPieceCount < 0 || request->basedOnPieceCount > AHMaxBasedOnPieces) {
+        return 0;
+    }
+    for (int i = 0; i < request->basedOnPieceCount; i++) {
+        if (request->basedOnPieces[i] == 0) {
+            return 0;
+        }
+    }
+
+    if (request->attachmentCount < 0 || request->attachmentCount > AHMaxAttachments) {
+        return 0;
+    }
+    for (int i = 0; i < request->attachmentCount; i++) {
+        if (request->attachments[i].mimeType == 0 || request->attachments[i].dataURL == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int AHbuildDropRequest(const AHDropRequest* request, char* buffer, size_t bufferSize,
+    short unsigned int* oLength)
+{
+    if (request == NULL || buffer == NULL || oLength == NULL || !isValidDropRequest(request)) {
+        return AHErrorInvalidRequest;
+    }
+
+    // Measure first, so nothing is written unless it all fits
+    JSONWriter writer = {0, 0};
+    writeDropRequest(&writer, request);
+    if (writer.length > AHMaxRequestBody || writer.length > bufferSize) {
+        return AHErrorInvalidRequest;
+    }
+
+    writer.data = buffer;
+    writer.length = 0;
+    writeDropRequest(&writer, request);
+
+    *oLength = (short unsigned int) writer.length;
+    return 0;
+}
+
+/// CBOR
+
+// Major types
+enum CBORType {
+    CBORUnsigned,
+    CBORNegative,
+    CBORBytes,
+    CBORText,
+    CBORArray,
+    CBORMap,
+    CBORTag,
+    CBORSimple,
+};
+
+// Deeper bodies are rejected rather than risking the stack
+#define MaxCBORNesting 32
+
+static void writeCBORHead(JSONWriter* writer, int type, unsigned long long value) {
+    unsigned char head[9];
+    size_t length = 1;
+    if (value < 24) {
+        head[0] = (unsigned char) (type << 5 | value);
+    }
+    else {
+        // 1, 2, 4 or 8 bytes of big endian argument
+        int size = value <= 0xff ? 1 : value <= 0xffff ? 2 : value <= 0xffffffffULL ? 4 : 8;
+        head[0] = (unsigned char) (type << 5 | (size == 1 ? 24 : size == 2 ? 25 : size == 4 ? 26 : 27));
+        for (int i = 0; i < size; i++) {
+            head[1 + i] = (unsigned char) (value >> (8 * (size - 1 - i)));
+        }
+        length += size;
+    }
+    writeRaw(writer, (const char*) head, length);
+}
+
+static void writeCBORText(JSONWriter* writer, const char* text) {
+    size_t length = strlen(text);
+    writeCBORHead(writer, CBORText, length);
+    writeRaw(writer, text, length);
+}
+
+static void writeCBORInteger(JSONWriter* writer, long long value) {
+    if (value < 0) {
+        writeCBORHead(writer, CBORNegative, (unsigned long long) (-1 - value));
+    }
+    else {
+        writeCBORHead(writer, CBORUnsigned, (unsigned long long) value);
+    }
+}
+
+static void writeCBORNumber(JSONWriter* writer, double value) {
+    unsigned long long bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    unsigned char number[9] = {CBORSimple << 5 | 27};
+    for (int i = 0; i < 8; i++) {
+        number[1 + i] = (unsigned char) (bits >> (8 * (7 - i)));
+    }
+    writeRaw(writer, (const char*) number, sizeof(number));
+}
+
+static void writeCBORBoolean(JSONWriter* writer, int value) {
+    unsigned char simple = (unsigned char) (CBORSimple << 5 | (value ? 21 : 20));
+    writeRaw(writer, (const char*) &simple, 1);
+}
+
+static void writeCBORTextField(JSONWriter* writer, const char* name, const char* value) {
+    writeCBORText(writer, name);
+    writeCBORText(writer, value);
+}
+
+// The same structure as writeMusicalMetadata
+static void writeMusicalMetadataCBOR(JSONWriter* writer, const AHDropRequest* request) {
+    int hasTimeSignature = request->timeSignatureUpper != 0 && request->timeSignatureLower != 0;
+    writeCBORHead(writer, CBORMap, 1 + (request->tempo != 0) + (request->loopEndMicroseconds != 0)
+        + hasTimeSignature + (request->tonalityMode != AHTonalityNotSet));
+    writeCBORText(writer, "lengthMicroseconds");
+    writeCBORInteger(writer, request->lengthMicroseconds);
+
+    if (request->tempo != 0) {
+        writeCBORText(writer, "tempo");
+        writeCBORHead(writer, CBORMap, 1);
+        writeCBORText(writer, "fixed");
+        writeCBORNumber(writer, request->tempo);
+    }
+
+    if (request->loopEndMicroseconds != 0) {
+        writeCBORText(writer, "loop");
+        writeCBORHead(writer, CBORMap, 2);
+        writeCBORText(writer, "startMicroSeconds");
+        writeCBORInteger(writer, request->loopStartMicroseconds);
+        writeCBORText(writer, "endMicroSeconds");
+        writeCBORInteger(writer, request->loopEndMicroseconds);
+    }
+
+    if (hasTimeSignature) {
+        writeCBORText(writer, "timeSignature");
+        writeCBORHead(writer, CBORMap, 1);
+        writeCBORText(writer, "fixed");
+        writeCBORHead(writer, CBORMap, 2);
+        writeCBORText(writer, "upper");
+        writeCBORInteger(writer, request->timeSignatureUpper);
+        writeCBORText(writer, "lower");
+        writeCBORInteger(writer, request->timeSignatureLower);
+    }
+
+    static const char* const modes[] = {"", "UNKNOWN", "ATONAL", "TONAL"};
+    if (request->tonalityMode != AHTonalityNotSet) {
+        int tonal = request->tonalityMode == AHTonalityTonal;
+        writeCBORText(writer, "tonality");
+        writeCBORHead(writer, CBORMap, tonal ? 3 : 1);
+        writeCBORTextField(writer, "mode", modes[request->tonalityMode]);
+        if (tonal) {
+            writeCBORText(writer, "scale");
+            writeCBORHead(writer, CBORArray, 12);
+            for (int i = 0; i < 12; i++) {
+                writeCBORBoolean(writer, request->scale[i]);
+            }
+            writeCBORText(writer, "root");
+            writeCBORInteger(writer, request->tonalityRoot);
+        }
+    }
+}
+
+// The same structure as writeDropRequest
+static void writeDropRequestCBOR(JSONWriter* writer, const AHDropRequest* request,
+    const ContentHash* hashes, int hashCount)
+{
+    writeCBORHead(writer, CBORMap, 3 + (request->basedOnPieceCount != 0) + (request->attachmentCount != 0)
+        + (hashCount != 0));
+
+    writeCBORText(writer, "stems");
+    writeCBORHead(writer, CBORMap, 1);
+    writeCBORTextField(writer, "mixStemURL", request->mixStemURL);
+
+    writeCBORText(writer, "presentation");
+    writeCBORHead(writer, CBORMap, 1 + (request->previewURL != 0) + (request->coverImageURL != 0));
+    writeCBORTextField(writer, "title", request->title);
+    if (request->previewURL != 0) {
+        writeCBORTextField(writer, "previewURL", request->previewURL);
+    }
+    if (request->coverImageURL != 0) {
+        writeCBORTextField(writer, "coverImageURL", request->coverImageURL);
+    }
+
+    if (request->basedOnPieceCount != 0) {
+        writeCBORText(writer, "attribution");
+        writeCBORHead(writer, CBORMap, 1);
+        writeCBORText(writer, "basedOnPieces");
+        writeCBORHead(writer, CBORArray, request->basedOnPieceCount);
+        for (int i = 0; i < request->basedOnPieceCount; i++) {
+            writeCBORText(writer, request->basedOnPieces[i]);
+        }
+    }
+
+    writeCBORText(writer, "musicalMetadata");
+    writeMusicalMetadataCBOR(writer, request);
+
+    if (request->attachmentCount != 0) {
+        writeCBORText(writer, "attachments");
+        writeCBORHead(writer, CBORArray, request->attachmentCount);
+        for (int i = 0; i < request->attachmentCount; i++) {
+            writeCBORHead(writer, CBORMap, 2);
+            writeCBORTextField(writer, "mimeType", request->attachments[i].mimeType);
+            writeCBORTextField(writer, "dataURL", request->attachments[i].dataURL);
+        }
+    }
+
+    if (hashCount != 0) {
+        writeCBORText(writer, "contentHashes");
+        writeCBORHead(writer, CBORMap, hashCount);
+        for (int i = 0; i < hashCount; i++) {
+            writeCBORTextField(writer, hashes[i].url, hashes[i].hash);
+        }
+    }
+}
+
+typedef struct {
+    const unsigned char* data;
+    size_t length;
+    size_t offset;
+} CBORCursor;
+
+static int readCBORHead(CBORCursor* cursor, int* oType, int* oInfo, unsigned long long* oValue) {
+    if (cursor->offset >= cursor->length) {
+        return AHErrorCommsFailure;
+    }
+    unsigned char initial = cursor->data[cursor->offset++];
+    *oType = initial >> 5;
+    *oInfo = initial & 0x1f;
+
+    if (*oInfo < 24) {
+        *oValue = (unsigned long long) *oInfo;
+        return 0;
+    }
+    // Indefinite lengths are not used
+    if (*oInfo > 27) {
+        return AHErrorCommsFailure;
+    }
+    int size = 1 << (*oInfo - 24);
+    if (cursor->length - cursor->offset < (size_t) size) {
+        return AHErrorCommsFailure;
+    }
+    *oValue = 0;
+    for (int i = 0; i < size; i++) {
+        *oValue = *oValue << 8 | cursor->data[cursor->offset++];
+    }
+    return 0;
+}
+
+static double decodeHalf(unsigned int half) {
+    unsigned long long exponent = (half >> 10) & 0x1f;
+    unsigned long long mantissa = half & 0x3ff;
+    double value = 0;
+    if (exponent == 0) {
+        // Subnormal, exact as a double
+        value = (double) mantissa / (1 << 24);
+    }
+    else {
+        // Rebias the exponent, infinity and NaN keep theirs all ones
+        unsigned long long bits = (exponent == 31 ? 0x7ffULL : exponent - 15 + 1023) << 52 | mantissa << 42;
+        memcpy(&value, &bits, sizeof(value));
+    }
+    return (half & 0x8000) ? -value : value;
+}
+
+static void writeFloat(JSONWriter* writer, double value) {
+    // Neither NaN nor infinity can be written as JSON
+    if (value != value || value - value != 0) {
+        writeText(writer, "null");
+    }
+    else {
+        writeNumber(writer, value);
+    }
+}
+
+static int transcodeValue(CBORCursor* cursor, JSONWriter* writer, int depth) {
+    int type = 0;
+    int info = 0;
+    unsigned long long value = 0;
+    if (depth > MaxCBORNesting || readCBORHead(cursor, &type, &info, &value) != 0) {
+        return AHErrorCommsFailure;
+    }
+
+    switch (type) {
+        case CBORUnsigned:
+            if (value > 0x7fffffffffffffffULL) {
+                writeNumber(writer, (double) value);
+            }
+            else {
+                writeInteger(writer, (long long) value);
+            }
+            return 0;
+        case CBORNegative:
+            if (value > 0x7fffffffffffffffULL) {
+                writeNumber(writer, -1.0 - (double) value);
+            }
+            else {
+                writeInteger(writer, -1 - (long long) value);
+            }
+            return 0;
+        case CBORText:
+            if (value > cursor->length - cursor->offset) {
+                return AHErrorCommsFailure;
+            }
+            writeStringSpan(writer, (const char*) &cursor->data[cursor->offset], (size_t) value);
+            cursor->offset += (size_t) value;
+            return 0;
+        case CBORArray:
+        case CBORMap:
+            // Each item takes at least a byte, which bounds the loop
+            if (value > cursor->length - cursor->offset) {
+                return AHErrorCommsFailure;
+            }
+            writeRaw(writer, type == CBORArray ? "[" : "{", 1);
+            for (unsigned long long i = 0; i < value; i++) {
+                if (i != 0) {
+                    writeRaw(writer, ", ", 2);
+                }
+                if (type == CBORMap) {
+                    // Keys must be text
+                    if (cursor->offset >= cursor->length || cursor->data[cursor->offset] >> 5 != CBORText) {
+                        return AHErrorCommsFailure;
+                    }
+                    if (transcodeValue(cursor, writer, depth + 1) != 0) {
+                        return AHErrorCommsFailure;
+                    }
+                    writeRaw(writer, ": ", 2);
+                }
+                if (transcodeValue(cursor, writer, depth + 1) != 0) {
+                    return AHErrorCommsFailure;
+                }
+            }
+            writeRaw(writer, type == CBORArray ? "]" : "}", 1);
+            return 0;
+        case CBORTag:
+            // No tags are defined, the tagged value is used as it is
+            return transcodeValue(cursor, writer, depth + 1);
+        case CBORSimple:
+            switch (info) {
+                case 20: writeText(writer, "false"); return 0;
+                case 21: writeText(writer, "true"); return 0;
+                case 22: case 23: writeText(writer, "null"); return 0;
+                case 25:
+                    writeFloat(writer, decodeHalf((unsigned int) value));
+                    return 0;
+                case 26: {
+                    unsigned int bits = (unsigned int) value;
+                    float single = 0;
+                    memcpy(&single, &bits, sizeof(single));
+                    writeFloat(writer, single);
+                    return 0;
+                }
+                case 27: {
+                    double number = 0;
+                    memcpy(&number, &value, sizeof(number));
+                    writeFloat(writer, number);
+                    return 0;
+                }
+            }
+            return AHErrorCommsFailure;
+    }
+    // Byte strings have no JSON equivalent
+    return AHErrorCommsFailure;
+}
+
+// Writes a CBOR body as JSON, failing unless it is exactly one value
+static int transcodeCBOR(const char* data, size_t length, JSONWriter* writer) {
+    CBORCursor cursor = {(const unsigned char*) data, length, 0};
+    int result = transcodeValue(&cursor, writer, 0);
+    if (result == 0 && cursor.offset != length) {
+        result = AHErrorCommsFailure;
+    }
+    return result;
+}
+
+// Hands CBOR completions on as JSON, to keep the completion API the same
+static void transcodeCompletion(void* sinkData, const char* completion, unsigned short length) {
+    TranscodingSink* transcoding = (TranscodingSink*) sinkData;
+    JSONWriter writer = {0, 0};
+    if (transcodeCBOR(completion, length, &writer) != 0 || writer.length > AHMaxRequestBody) {
+        transcoding->result = AHErrorCommsFailure;
+        return;
+    }
+    if (context->connection.transcodeBuffer == 0) {
+        context->connection.transcodeBuffer = allocate(AHMaxRequestBody);
+        if (context->connection.transcodeBuffer == 0) {
+            transcoding->result = AHErrorOutOfMemory;
+            return;
+        }
+    }
+    writer.data = context->connection.transcodeBuffer;
+    writer.length = 0;
+    transcodeCBOR(completion, length, &writer);
+    transcoding->sink(transcoding->sinkData, context->connection.transcodeBuffer, (unsigned short) writer.length);
+}
+
+int AHdropFields(const AHDropRequest* request, short int requestID, const AHCallOptions* options) {
+    return AHdropFieldsCtx(&defaultContext, request, requestID, options);
+}
+
+int AHdropFieldsCtx(AHContext* ctx, const AHDropRequest* request, short int requestID,
+    const AHCallOptions* options)
+{
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    unsigned int stemFlags = AHCallGeneratePreview | AHCallInspectStem | AHCallAnalyzeStem | AHCallHashContent;
+    if (request == NULL || requestID == 0) {
+        return AHErrorInvalidRequest;
+    }
+    if (options != NULL && (options->flags & ~(AHCallFireAndForget | stemFlags)) != 0) {
+        return AHErrorInvalidRequest;
+    }
+
+    // Filled in before validating, as the length may come from the stem
+    AHDropRequest filled;
+    char previewURL[MaxPathLength];
+    if (options != NULL && (options->flags & (stemFlags & ~AHCallHashContent)) != 0) {
+        filled = *request;
+        int result = fillFromStem(&filled, options->flags, previewURL, sizeof(previewURL));
+        if (result != 0) {
+            return result;
+        }
+        request = &filled;
+    }
+    if (!isValidDropRequest(request)) {
+        return AHErrorInvalidRequest;
+    }
+
+    ContentHash hashes[MaxContentHashes];
+    int hashCount = 0;
+    if (options != NULL && (options->flags & AHCallHashContent)) {
+        int result = hashRequestFiles(request, hashes, &hashCount);
+        if (result != 0) {
+            return result;
+        }
+    }
+
+    // Always CBOR here, it's turned into JSON later for apps that don't take it
+    JSONWriter writer = {0, 0};
+    writeDropRequestCBOR(&writer, request, hashes, hashCount);
+    if (writer.length > AHMaxRequestBody) {
+        return AHErrorInvalidRequest;
+    }
+    /*
+     * With the IO thread, drops may be made from several threads at once,
+     * and the request is copied when queued anyway. Otherwise the body is
+     * encoded into a buffer kept with the connection.
+     */
+    int sharedBuffer = !context->ioThread.running;
+    if (sharedBuffer && context->connection.fieldsBuffer == 0) {
+        context->connection.fieldsBuffer = allocate(AHMaxRequestBody);
+    }
+    writer.data = sharedBuffer ? context->connection.fieldsBuffer : allocate(writer.length);
+    if (writer.data == 0) {
+        return AHErrorOutOfMemory;
+    }
+    writer.length = 0;
+    writeDropRequestCBOR(&writer, request, hashes, hashCount);
+
+    AHCallOptions cborOptions = {0, CallCBORBody, AHPriorityNormal};
+    if (options != NULL) {
+        cborOptions.timeoutMS = options->timeoutMS;
+        cborOptions.priority = options->priority;
+        cborOptions.flags |= options->flags & ~stemFlags;
+    }
+    int result = dropWithOptions(writer.data, writer.length, requestID, &cborOptions);
+    if (!sharedBuffer) {
+        release(writer.data);
+    }
+    return result;
+}
+
+/// Stats
+
+// Only called by the thread talking to the app, so no other thread writes the counter
+static void countStat(long long* stat, long long amount) {
+    atomicStoreInt64(stat, *stat + amount);
+}
+
+static int statCommandOf(const char command[4]) {
+    if (memcmp(command, "init", 4) == 0) {
+        return StatInit;
+    }
+    if (memcmp(command, "drop", 4) == 0 || memcmp(command, "sdrp", 4) == 0) {
+        return StatDrop;
+    }
+    if (memcmp(command, "poll", 4) == 0 || memcmp(command, "pall", 4) == 0) {
+        return StatPoll;
+    }
+    if (memcmp(command, "quit", 4) == 0) {
+        return StatQuit;
+    }
+    return StatOther;
+}
+
+// Counts the latency of a request from when it was written until its reply was read
+static void recordReply(const InFlight* request, int requestResult) {
+    CommandStats* stats = &context->connection.stats.commands[request->statCommand];
+    long long latencyUS = monotonicUS() - request->sentUS;
+
+    int bucket = 0;
+    while (bucket < LatencyBuckets - 1 && latencyUS >= (1LL << bucket)) {
+        bucket++;
+    }
+    countStat(&stats->latencyUS[bucket], 1);
+
+    if (requestResult != 0) {
+        countStat(&stats->failures, 1);
+    }
+}
+
+/*
+ * The latency that the given fraction of replies, in per mille, came in
+ * under. Rounded up to the upper bound of the histogram bucket it falls in.
+ */
+static long long latencyPercentile(const CommandStats* command, long long replies, int perMille) {
+    long long rank = (replies * perMille + 999) / 1000;
+    long long seen = 0;
+    int bucket = 0;
+    while (bucket < LatencyBuckets - 1) {
+        seen += command->latencyUS[bucket];
+        if (seen >= rank) {
+            break;
+        }
+        bucket++;
+    }
+    return 1LL << bucket;
+}
+
+static void writeStats(JSONWriter* writer, const Stats* stats, int launchToReadyMS) {
+    static const char* commandNames[StatCommandCount] = {"init", "drop", "poll", "quit", "other"};
+
+    writeText(writer, "{\"commands\": {");
+    for (int i = 0; i < StatCommandCount; i++) {
+        const CommandStats* command = &stats->commands[i];
+        if (i != 0) {
+            writeText(writer, ", ");
+        }
+        writeString(writer, commandNames[i]);
+        writeText(writer, ": {\"calls\": ");
+        writeInteger(writer, command->calls);
+        writeText(writer, ", \"failures\": ");
+        writeInteger(writer, command->failures);
+        writeText(writer, ", \"latencyUs\": [");
+        for (int bucket = 0; bucket < LatencyBuckets; bucket++) {
+            if (bucket != 0) {
+                writeText(writer, ", ");
+            }
+            writeInteger(writer, command->latencyUS[bucket]);
+        }
+        writeText(writer, "]");
+
+        long long replies = 0;
+        for (int bucket = 0; bucket < LatencyBuckets; bucket++) {
+            replies += command->latencyUS[bucket];
+        }
+        static const char* percentileNames[] = {"p50Us", "p99Us", "p999Us"};
+        static const int percentiles[] = {500, 990, 999};
+        for (int p = 0; p < 3; p++) {
+            writeText(writer, ", ");
+            writeString(writer, percentileNames[p]);
+            writeText(writer, ": ");
+            if (replies == 0) {
+                writeText(writer, "null");
+            }
+            else {
+                writeInteger(writer, latencyPercentile(command, replies, percentiles[p]));
+            }
+        }
+        writeText(writer, "}");
+    }
+    writeText(writer, "}, \"bytesOut\": ");
+    writeInteger(writer, stats->bytesOut);
+    writeText(writer, ", \"bytesIn\": ");
+    writeInteger(writer, stats->bytesIn);
+    writeText(writer, ", \"timeouts\": ");
+    writeInteger(writer, stats->timeouts);
+    writeText(writer, ", \"launches\": ");
+    writeInteger(writer, stats->launches);
+    writeText(writer, ", \"restarts\": ");
+    writeInteger(writer, stats->restarts);
+    writeText(writer, ", \"launchToReadyMs\": ");
+    if (launchToReadyMS < 0) {
+        writeText(writer, "null");
+    }
+    else {
+        writeInteger(writer, launchToReadyMS);
+    }
+    writeText(writer, "}");
+}
+
+int AHgetStats(char* buffer, size_t bufferSize, size_t* oLength) {
+    return AHgetStatsCtx(&defaultContext, buffer, bufferSize, oLength);
+}
+
+int AHgetStatsCtx(AHContext* ctx, char* buffer, size_t bufferSize, size_t* oLength) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (buffer == NULL || oLength == NULL) {
+        return AHErrorInvalidRequest;
+    }
+
+    // A snapshot, the counters keep changing while it is written out. Stats only holds counters.
+    Stats stats;
+    const long long* source = (const long long*) &context->connection.stats;
+    long long* target = (long long*) &stats;
+    for (size_t i = 0; i < sizeof(Stats) / sizeof(long long); i++) {
+        target[i] = atomicLoadInt64(&source[i]);
+    }
+    int launchToReadyMS = atomicLoadInt(&context->connection.launchToReadyMS);
+
+    JSONWriter writer = {0, 0};
+    writeStats(&writer, &stats, launchToReadyMS);
+    *oLength = writer.length;
+    if (writer.length > bufferSize) {
+        return AHErrorInvalidRequest;
+    }
+
+    writer.data = buffer;
+    writer.length = 0;
+    writeStats(&writer, &stats, launchToReadyMS);
+    return 0;
+}
+
+/// Trace
+
+// Must be a power of two
+#define TraceEvents 1024
+
+typedef struct {
+    // Number of the event in the slot, zero while it is being written
+    unsigned int sequence;
+    char command[4];
+    short int requestID;
+    int result;
+    unsigned int bytes;
+    long long timeUS;
+} TraceEvent;
+
+// The most recent events, recorded from any thread without locking
+static TraceEvent traceRing[TraceEvents];
+static unsigned int traceSequence = 0;
+
+static void traceEvent(const char command[4], short int requestID, size_t bytes, int result) {
+    unsigned int sequence = atomicIncrementInt(&traceSequence);
+    TraceEvent* event = &traceRing[sequence & (TraceEvents - 1)];
+
+    // Readers skip the slot until the sequence number is set again
+    atomicStoreInt(&event->sequence, 0);
+    atomicFence();
+    memcpy(event->command, command, 4);
+    event->requestID = requestID;
+    event->result = result;
+    event->bytes = (unsigned int) bytes;
+    event->timeUS = monotonicUS();
+    atomicStoreInt(&event->sequence, sequence);
+}
+
+// Copies the event with the given sequence number, if it is still in the ring
+static int readTraceEvent(unsigned int sequence, TraceEvent* oEvent) {
+    const TraceEvent* event = &traceRing[sequence & (TraceEvents - 1)];
+    if ((unsigned int) atomicLoadInt(&event->sequence) != sequence) {
+        return 0;
+    }
+    memcpy(oEvent, event, sizeof(TraceEvent));
+    atomicFence();
+    return (unsigned int) atomicLoadInt(&event->sequence) == sequence;
+}
+
+// Longest line written for an event, with every field at its widest
+#define TraceLineLength 64
+
+static void writeTraceEvent(JSONWriter* writer, const TraceEvent* event) {
+    char command[4];
+    for (int i = 0; i < 4; i++) {
+        // Garbage from a broken connection is kept on one line
+        command[i] = event->command[i] >= 0x20 && event->command[i] < 0x7f ? event->command[i] : '?';
+    }
+    writeInteger(writer, event->timeUS);
+    writeRaw(writer, " ", 1);
+    writeRaw(writer, command, 4);
+    writeRaw(writer, " ", 1);
+    writeInteger(writer, event->requestID);
+    writeRaw(writer, " ", 1);
+    writeInteger(writer, event->bytes);
+    writeRaw(writer, " ", 1);
+    writeInteger(writer, event->result);
+    writeRaw(writer, "\n", 1);
+}
+
+int AHdumpTrace(char* buffer, size_t bufferSize, size_t* oLength) {
+    if (buffer == NULL || oLength == NULL) {
+        return AHErrorInvalidRequest;
+    }
+
+    /*
+     * Newest first, stopping at events that have been overwritten since.
+     * Each is formatted on the stack and put before the previous one at
+     * the end of the buffer, so dumping needs no memory and can't fail
+     * under allocator pressure.
+     */
+    unsigned int last = atomicLoadInt(&traceSequence);
+    size_t start = bufferSize;
+    for (unsigned int count = 0; count < TraceEvents && last - count != 0; count++) {
+        TraceEvent event;
+        if (!readTraceEvent(last - count, &event)) {
+            break;
+        }
+        char line[TraceLineLength];
+        JSONWriter writer = {line, 0};
+        writeTraceEvent(&writer, &event);
+        if (writer.length > start) {
+            break;
+        }
+        start -= writer.length;
+        memcpy(&buffer[start], line, writer.length);
+    }
+
+    memmove(buffer, &buffer[start], bufferSize - start);
+    *oLength = bufferSize - start;
+    return 0;
+}
+
+/// Stem audio
+
+// Output frames per chunk of work, about a second
+#define PreviewChunkFrames AHPreviewSampleRate
+// Worker threads for previews and analysis, including the calling thread
+#define StemThreads 4
+#define MaxWaveChannels 32
+
+enum WaveFormat {
+    WavePCM = 1,
+    WaveFloat = 3,
+    // The actual format is in the first two bytes of the subformat GUID
+    WaveExtensible = 0xFFFE,
+};
+
+typedef struct {
+    // WavePCM or WaveFloat
+    int format;
+    int channels;
+    unsigned int sampleRate;
+    int bitsPerSample;
+    size_t blockAlign;
+    const unsigned char* samples;
+    size_t frameCount;
+    // The first loop from the sampler chunk, end exclusive, both zero without one
+    size_t loopStart;
+    size_t loopEnd;
+} WaveAudio;
+
+// One preview rendered in chunks, claimed by whichever thread gets to them first
+typedef struct {
+    const WaveAudio* wave;
+    // Source frames to preview
+    size_t sourceFrames;
+    // Source frames per output frame, and the resampling kernel half width
+    double ratio;
+    double width;
+    size_t frames;
+    // Source frames needed for a chunk, at most
+    size_t bufferFrames;
+    // 16 bit little endian samples
+    unsigned char* output;
+    unsigned int chunkCount;
+    unsigned int nextChunk;
+    int failed;
+} PreviewJob;
+
+static int hexValue(char hex) {
+    return hex >= '0' && hex <= '9' ? hex - '0'
+        : hex >= 'a' && hex <= 'f' ? hex - 'a' + 10
+        : hex >= 'A' && hex <= 'F' ? hex - 'A' + 10 : -1;
+}
+
+// Copies the contents of a JSON string, undoing escapes, null terminated
+static int copyJSONString(AHSpan text, char* buffer, size_t bufferSize) {
+    size_t length = 0;
+    for (size_t i = 0; i < text.length; i++) {
+        unsigned long c = (unsigned char) text.data[i];
+        if (c == '\\' && i + 1 < text.length) {
+            char escape = text.data[++i];
+            c = escape == 'b' ? '\b' : escape == 'f' ? '\f' : escape == 'n' ? '\n'
+                : escape == 'r' ? '\r' : escape == 't' ? '\t' : (unsigned char) escape;
+            if (escape == 'u') {
+                if (i + 4 >= text.length) {
+                    return AHErrorInvalidRequest;
+                }
+                c = 0;
+                for (int digit = 0; digit < 4; digit++) {
+                    int value = hexValue(text.data[++i]);
+                    if (value < 0) {
+                        return AHErrorInvalidRequest;
+                    }
+                    c = c << 4 | value;
+                }
+                // Paths don't need surrogate pairs
+                if (c >= 0xD800 && c <= 0xDFFF) {
+                    return AHErrorInvalidRequest;
+                }
+                if (c >= 0x80) {
+                    int extra = c >= 0x800 ? 2 : 1;
+                    if (length + extra + 1 >= bufferSize) {
+                        return AHErrorInvalidRequest;
+                    }
+                    buffer[length++] = (char) (extra == 2 ? 0xE0 | c >> 12 : 0xC0 | c >> 6);
+                    if (extra == 2) {
+                        buffer[length++] = (char) (0x80 | (c >> 6 & 0x3F));
+                    }
+                    c = 0x80 | (c & 0x3F);
+                }
+            }
+        }
+        if (c == 0 || length + 1 >= bufferSize) {
+            return AHErrorInvalidRequest;
+        }
+        buffer[length++] = (char) c;
+    }
+    buffer[length] = 0;
+    return 0;
+}
+
+// Called with each setup, on the calling thread, as previews don't involve the app
+static void rememberTmpDir(const char* setupData, size_t setupDataLength) {
+    AHSpan setup = {setupData, setupDataLength};
+    AHSpan value;
+    char tmpDir[MaxPathLength];
+    if (findMember(setup, "tmpDir", &value) != 0 || copyJSONString(value, tmpDir, sizeof(tmpDir)) != 0) {
+        tmpDir[0] = 0;
+    }
+
+    lockMutex(&context->files.mutex);
+    memcpy(context->files.tmpDir, tmpDir, strlen(tmpDir) + 1);
+    unlockMutex(&context->files.mutex);
+}
+
+/*
+ * Resolves a "file:" URL in the context's tmpDir, as the app does. The
+ * URL path is percent decoded, and may not climb out of tmpDir with "..".
+ */
+static int filePathOf(const char* url, char* buffer, size_t bufferSize) {
+    if (strncmp(url, "file://", 7) != 0 || url[7] != '/') {
+        return AHErrorInvalidRequest;
+    }
+
+    lockMutex(&context->files.mutex);
+    size_t length = strlen(context->files.tmpDir);
+    if (length < bufferSize) {
+        memcpy(buffer, context->files.tmpDir, length);
+    }
+    unlockMutex(&context->files.mutex);
+    if (length == 0) {
+        getTempDirectory(buffer, bufferSize);
+        length = strlen(buffer);
+    }
+    else if (length >= bufferSize) {
+        return AHErrorInvalidRequest;
+    }
+    while (length > 0 && (buffer[length - 1] == '/' || buffer[length - 1] == '\\')) {
+        length--;
+    }
+
+    size_t segment = length;
+    for (const char* at = url + 7; ; at++) {
+        char c = *at;
+        if (c == '%') {
+            int high = hexValue(at[1]);
+            int low = high < 0 ? -1 : hexValue(at[2]);
+            if (low < 0) {
+                return AHErrorInvalidRequest;
+            }
+            c = (char) (high << 4 | low);
+            at += 2;
+            if (c == 0) {
+                return AHErrorInvalidRequest;
+            }
+        }
+        if (c == 0 || c == '/' || c == '\\') {
+            if (length - segment == 3 && memcmp(buffer + segment, "/..", 3) == 0) {
+                return AHErrorInvalidRequest;
+            }
+            segment = length;
+        }
+        if (length + 1 >= bufferSize) {
+            return AHErrorInvalidRequest;
+        }
+        buffer[length++] = c == '\\' ? '/' : c;
+        if (c == 0) {
+            return 0;
+        }
+    }
+}
+
+static unsigned int readLE16(const unsigned char* data) {
+    return data[0] | (unsigned int) data[1] << 8;
+}
+
+static unsigned long readLE32(const unsigned char* data) {
+    return data[0] | (unsigned long) data[1] << 8 | (unsigned long) data[2] << 16 | (unsigned long) data[3] << 24;
+}
+
+static void writeLE32(unsigned char* data, unsigned long value) {
+    data[0] = (unsigned char) value;
+    data[1] = (unsigned char) (value >> 8);
+    data[2] = (unsigned char) (value >> 16);
+    data[3] = (unsigned char) (value >> 24);
+}
+
+/*
+ * Finds the format and sample data in a RIFF WAVE file, only touching
+ * the chunk headers. Chunks other than "fmt ", "data" and "smpl" are
+ * skipped, and a data chunk that runs past the end of the file, as left
+ * by some recorders, is cut short.
+ */
+static int parseWave(const char* data, size_t size, WaveAudio* oWave) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    if (size < 12 || memcmp(bytes, "RIFF", 4) != 0 || memcmp(bytes + 8, "WAVE", 4) != 0) {
+        return AHErrorInvalidAudio;
+    }
+
+    const unsigned char* format = 0;
+    const unsigned char* sampler = 0;
+    size_t dataLength = 0;
+    oWave->samples = 0;
+    for (size_t at = 12; at + 8 <= size; ) {
+        const unsigned char* chunk = bytes + at;
+        size_t chunkLength = readLE32(chunk + 4);
+        size_t available = size - at - 8;
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            if (chunkLength < 16 || chunkLength > available) {
+                return AHErrorInvalidAudio;
+            }
+            format = chunk + 8;
+            oWave->format = (int) readLE16(format);
+            if (oWave->format == WaveExtensible && chunkLength >= 40) {
+                oWave->format = (int) readLE16(format + 24);
+            }
+        }
+        else if (memcmp(chunk, "data", 4) == 0) {
+            oWave->samples = chunk + 8;
+            dataLength = chunkLength < available ? chunkLength : available;
+        }
+        // Loops are listed after 36 bytes of sampler details, 24 bytes each
+        else if (memcmp(chunk, "smpl", 4) == 0 && chunkLength >= 36 + 24 && chunkLength <= available
+            && readLE32(chunk + 8 + 28) != 0) {
+            sampler = chunk + 8 + 36;
+        }
+        if (chunkLength > available) {
+            break;
+        }
+        // Chunks are padded to an even length
+        at += 8 + chunkLength + (chunkLength & 1);
+    }
+    if (format == 0 || oWave->samples == 0) {
+        return AHErrorInvalidAudio;
+    }
+
+    oWave->channels = (int) readLE16(format + 2);
+    oWave->sampleRate = (unsigned int) readLE32(format + 4);
+    oWave->blockAlign = readLE16(format + 12);
+    oWave->bitsPerSample = (int) readLE16(format + 14);
+
+    int bits = oWave->bitsPerSample;
+    int supported = oWave->format == WavePCM ? bits == 8 || bits == 16 || bits == 24 || bits == 32
+        : oWave->format == WaveFloat && bits == 32;
+    if (!supported || oWave->channels < 1 || oWave->channels > MaxWaveChannels
+        || oWave->sampleRate == 0 || oWave->sampleRate > 1000000
+        || oWave->blockAlign != (size_t) oWave->channels * (bits / 8)) {
+        return AHErrorInvalidAudio;
+    }
+
+    oWave->frameCount = dataLength / oWave->blockAlign;
+    if (oWave->frameCount == 0) {
+        return AHErrorInvalidAudio;
+    }
+
+    // The last frame is part of the loop, a loop outside the audio is left out
+    oWave->loopStart = 0;
+    oWave->loopEnd = 0;
+    if (sampler != 0) {
+        unsigned long start = readLE32(sampler + 8);
+        unsigned long end = readLE32(sampler + 12);
+        if (start <= end && end < oWave->frameCount) {
+            oWave->loopStart = start;
+            oWave->loopEnd = end + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Mixes source frames down to mono floats. The format is picked outside
+ * the loops, leaving each inner loop simple enough for the compiler to
+ * vectorize, one channel at a time.
+ */
+static void mixDown(const WaveAudio* wave, size_t first, size_t count, float* out) {
+    size_t stride = wave->blockAlign;
+    int sampleBytes = wave->bitsPerSample / 8;
+    for (size_t i = 0; i < count; i++) {
+        out[i] = 0.0f;
+    }
+
+    for (int channel = 0; channel < wave->channels; channel++) {
+        const unsigned char* in = wave->samples + first * stride + channel * sampleBytes;
+        if (wave->format == WaveFloat) {
+            for (size_t i = 0; i < count; i++) {
+                // Built from bytes, the file is little endian whatever the host is
+                unsigned int bits = (unsigned int) readLE32(in + i * stride);
+                float value;
+                memcpy(&value, &bits, sizeof(value));
+                // Infinities and NaNs would spoil the whole kernel
+                out[i] += value - value == 0.0f ? value : 0.0f;
+            }
+        }
+        else if (sampleBytes == 1) {
+            for (size_t i = 0; i < count; i++) {
+                out[i] += (float) ((int) in[i * stride] - 128) * (1.0f / 128);
+            }
+        }
+        else if (sampleBytes == 2) {
+            for (size_t i = 0; i < count; i++) {
+                const unsigned char* sample = in + i * stride;
+                int value = (int) ((sample[0] | sample[1] << 8) ^ 0x8000) - 0x8000;
+                out[i] += (float) value * (1.0f / 32768);
+            }
+        }
+        else if (sampleBytes == 3) {
+            for (size_t i = 0; i < count; i++) {
+                const unsigned char* sample = in + i * stride;
+                long value = (long) ((sample[0] | sample[1] << 8 | (unsigned long) sample[2] << 16) ^ 0x800000) - 0x800000;
+                out[i] += (float) value * (1.0f / 8388608);
+            }
+        }
+        else {
+            for (size_t i = 0; i < count; i++) {
+                long long value = (long long) (readLE32(in + i * stride) ^ 0x80000000UL) - 0x80000000LL;
+                out[i] += (float) value * (1.0f / 2147483648.0f);
+            }
+        }
+    }
+
+    float scale = 1.0f / wave->channels;
+    for (size_t i = 0; i < count; i++) {
+        out[i] *= scale;
+    }
+}
+
+static long long floorToInteger(double value) {
+    long long integer = (long long) value;
+    return (double) integer > value ? integer - 1 : integer;
+}
+
+// The source frames the kernel reaches from an output frame, clamped to the preview
+static void sourceRangeOf(const PreviewJob* job, size_t frame, long long* oFirst, long long* oLast) {
+    double center = (frame + 0.5) * job->ratio - 0.5;
+    long long first = floorToInteger(center - job->width) + 1;
+    long long last = floorToInteger(center + job->width);
+    *oFirst = first < 0 ? 0 : first;
+    *oLast = last >= (long long) job->sourceFrames ? (long long) job->sourceFrames - 1 : last;
+}
+
+/*
+ * Resamples with a triangle kernel, as wide as an output frame when
+ * downsampling so that it also filters out what the lower rate can't
+ * hold, then converts to 16 bit samples.
+ */
+static void renderChunk(PreviewJob* job, unsigned int chunk, float* buffer) {
+    size_t firstFrame = (size_t) chunk * PreviewChunkFrames;
+    size_t endFrame = firstFrame + PreviewChunkFrames < job->frames ? firstFrame + PreviewChunkFrames : job->frames;
+
+    long long sourceFirst, sourceLast, unused;
+    sourceRangeOf(job, firstFrame, &sourceFirst, &unused);
+    sourceRangeOf(job, endFrame - 1, &unused, &sourceLast);
+    mixDown(job->wave, (size_t) sourceFirst, (size_t) (sourceLast - sourceFirst + 1), buffer);
+
+    float inverseWidth = (float) (1.0 / job->width);
+    for (size_t frame = firstFrame; frame < endFrame; frame++) {
+        long long first, last;
+        sourceRangeOf(job, frame, &first, &last);
+        float center = (float) ((frame + 0.5) * job->ratio - 0.5 - sourceFirst);
+
+        float sum = 0.0f;
+        float weights = 0.0f;
+        for (long long source = first - sourceFirst; source <= last - sourceFirst; source++) {
+            float distance = (float) source - center;
+            float weight = 1.0f - (distance < 0 ? -distance : distance) * inverseWidth;
+            sum += buffer[source] * weight;
+            weights += weight;
+        }
+
+        float value = weights > 0.0f ? sum / weights : 0.0f;
+        value = value > 1.0f ? 1.0f : value < -1.0f ? -1.0f : value;
+        int sample = (int) (value * 32767.0f + (value < 0.0f ? -0.5f : 0.5f));
+        job->output[frame * 2] = (unsigned char) sample;
+        job->output[frame * 2 + 1] = (unsigned char) (sample >> 8);
+    }
+}
+
+// Runs entry on the calling thread and up to StemThreads - 1 more, for as many as there are chunks
+static void runWorkers(ThreadEntry entry, void* job, unsigned int chunkCount) {
+    Thread threads[StemThreads - 1];
+    int threadCount = 0;
+    while (threadCount < StemThreads - 1 && (unsigned int) threadCount + 1 < chunkCount
+        && startThread(&threads[threadCount], entry, job) == 0) {
+        threadCount++;
+    }
+    entry(job);
+    for (int i = 0; i < threadCount; i++) {
+        joinThread(&threads[i]);
+    }
+}
+
+static void previewWorker(void* argument) {
+    PreviewJob* job = (PreviewJob*) argument;
+    float* buffer = allocate(job->bufferFrames * sizeof(float));
+    if (buffer == 0) {
+        atomicStoreInt(&job->failed, 1);
+        return;
+    }
+
+    for (;;) {
+        unsigned int chunk = atomicIncrementInt(&job->nextChunk) - 1;
+        if (chunk >= job->chunkCount) {
+            break;
+        }
+        renderChunk(job, chunk, buffer);
+    }
+    release(buffer);
+}
+
+// Renders the preview samples, with a WAV header in front
+static int renderPreview(const WaveAudio* wave, unsigned char** oData, size_t* oLength) {
+    PreviewJob job;
+    memset(&job, 0, sizeof(job));
+    unsigned int sampleRate = wave->sampleRate < AHPreviewSampleRate ? wave->sampleRate : AHPreviewSampleRate;
+    size_t maxSourceFrames = (size_t) wave->sampleRate * AHPreviewSeconds;
+    job.wave = wave;
+    job.sourceFrames = wave->frameCount < maxSourceFrames ? wave->frameCount : maxSourceFrames;
+    job.ratio = (double) wave->sampleRate / sampleRate;
+    job.width = job.ratio > 1.0 ? job.ratio : 1.0;
+    job.frames = (size_t) ((unsigned long long) job.sourceFrames * sampleRate / wave->sampleRate);
+    if (job.frames == 0) {
+        return AHErrorInvalidAudio;
+    }
+    job.bufferFrames = (size_t) (PreviewChunkFrames * job.ratio + 2 * job.width) + 4;
+    job.chunkCount = (unsigned int) ((job.frames + PreviewChunkFrames - 1) / PreviewChunkFrames);
+
+    size_t dataLength = job.frames * 2;
+    unsigned char* data = allocate(44 + dataLength);
+    if (data == 0) {
+        return AHErrorOutOfMemory;
+    }
+    memcpy(data, "RIFF", 4);
+    writeLE32(data + 4, (unsigned long) (36 + dataLength));
+    memcpy(data + 8, "WAVEfmt ", 8);
+    writeLE32(data + 16, 16);
+    // PCM, mono
+    writeLE32(data + 20, 1 | 1UL << 16);
+    writeLE32(data + 24, sampleRate);
+    writeLE32(data + 28, sampleRate * 2UL);
+    // 2 byte frames, 16 bit
+    writeLE32(data + 32, 2 | 16UL << 16);
+    memcpy(data + 36, "data", 4);
+    writeLE32(data + 40, (unsigned long) dataLength);
+    job.output = data + 44;
+
+    runWorkers(previewWorker, &job, job.chunkCount);
+
+    // A worker short of memory leaves its chunk to the others, unless none could start
+    if (atomicLoadInt(&job.failed) && (unsigned int) atomicLoadInt(&job.nextChunk) <= job.chunkCount) {
+        release(data);
+        return AHErrorOutOfMemory;
+    }
+    *oData = data;
+    *oLength = 44 + dataLength;
+    return 0;
+}
+
+// Frames as whole microseconds, rounded to nearest
+static long long microsecondsOf(const WaveAudio* wave, size_t frames) {
+    return (long long) (((unsigned long long) frames * 1000000 + wave->sampleRate / 2) / wave->sampleRate);
+}
+
+// Integer samples are summed exactly in blocks, few enough not to overflow
+#define LevelBlockSamples 65536
+
+/*
+ * Finds the peak and RMS level of all channels in one pass. As with
+ * mixDown, each format has a loop of its own, simple enough for the
+ * compiler to vectorize. 32 bit samples are measured to 24 bits.
+ */
+static void measureLevels(const WaveAudio* wave, double* oPeak, double* oRMS) {
+    const unsigned char* in = wave->samples;
+    size_t count = wave->frameCount * wave->channels;
+    int sampleBytes = wave->bitsPerSample / 8;
+    double sumSquares = 0.0;
+    double peak = 0.0;
+
+    if (wave->format == WaveFloat) {
+        for (size_t i = 0; i < count; i++) {
+            unsigned int bits = (unsigned int) readLE32(in + i * 4);
+            float value;
+            memcpy(&value, &bits, sizeof(value));
+            value = value - value == 0.0f ? value : 0.0f;
+            double magnitude = value < 0.0f ? -value : value;
+            peak = magnitude > peak ? magnitude : peak;
+            sumSquares += (double) value * value;
+        }
+    }
+    else {
+        double fullScale = sampleBytes == 1 ? 128.0 : sampleBytes == 2 ? 32768.0 : 8388608.0;
+        long maxMagnitude = 0;
+        for (size_t block = 0; block < count; block += LevelBlockSamples) {
+            size_t end = block + LevelBlockSamples < count ? block + LevelBlockSamples : count;
+            long long blockSquares = 0;
+            long blockMax = 0;
+            if (sampleBytes == 1) {
+                for (size_t i = block; i < end; i++) {
+                    long value = (long) in[i] - 128;
+                    long magnitude = value < 0 ? -value : value;
+                    blockMax = magnitude > blockMax ? magnitude : blockMax;
+                    blockSquares += (long long) value * value;
+                }
+            }
+            else if (sampleBytes == 2) {
+                for (size_t i = block; i < end; i++) {
+                    const unsigned char* sample = in + i * 2;
+                    long value = (long) ((sample[0] | sample[1] << 8) ^ 0x8000) - 0x8000;
+                    long magnitude = value < 0 ? -value : value;
+                    blockMax = magnitude > blockMax ? magnitude : blockMax;
+                    blockSquares += (long long) value * value;
+                }
+            }
+            else {
+                // The top three bytes of 24 and 32 bit samples alike
+                size_t skip = (size_t) sampleBytes - 3;
+                for (size_t i = block; i < end; i++) {
+                    const unsigned char* sample = in + i * sampleBytes + skip;
+                    long value = (long) ((sample[0] | sample[1] << 8 | (unsigned long) sample[2] << 16) ^ 0x800000) - 0x800000;
+                    long magnitude = value < 0 ? -value : value;
+                    blockMax = magnitude > blockMax ? magnitude : blockMax;
+                    blockSquares += (long long) value * value;
+                }
+            }
+            sumSquares += (double) blockSquares;
+            maxMagnitude = blockMax > maxMagnitude ? blockMax : maxMagnitude;
+        }
+        peak = maxMagnitude / fullScale;
+        sumSquares /= fullScale * fullScale;
+    }
+
+    *oPeak = peak;
+    *oRMS = sqrt(sumSquares / count);
+}
+
+
+// Maps a "file:" stem and finds its audio, see filePathOf
+static int mapWave(const char* url, MappedFile* oFile, WaveAudio* oWave) {
+    char path[MaxPathLength];
+    int result = filePathOf(url, path, sizeof(path));
+    if (result == 0) {
+        result = mapFile(path, oFile);
+    }
+    if (result == 0) {
+        result = parseWave(oFile->data, oFile->size, oWave);
+        if (result != 0) {
+            unmapFile(oFile);
+        }
+    }
+    return result;
+}
+
+static int writePreview(const WaveAudio* wave, const char* stemURL, char* previewURLBuffer, size_t bufferSize) {
+    // Next to the stem, swapping the extension of the last path segment
+    const char* name = strrchr(stemURL, '/');
+    const char* extension = name != 0 ? strrchr(name, '.') : 0;
+    size_t baseLength = extension != 0 ? (size_t) (extension - stemURL) : strlen(stemURL);
+    const char suffix[] = "-preview.wav";
+    if (baseLength + sizeof(suffix) > bufferSize) {
+        return AHErrorInvalidRequest;
+    }
+    memcpy(previewURLBuffer, stemURL, baseLength);
+    memcpy(previewURLBuffer + baseLength, suffix, sizeof(suffix));
+
+    char previewPath[MaxPathLength];
+    int result = filePathOf(previewURLBuffer, previewPath, sizeof(previewPath));
+    if (result != 0) {
+        return result;
+    }
+
+    unsigned char* preview = 0;
+    size_t previewLength = 0;
+    result = renderPreview(wave, &preview, &previewLength);
+    if (result == 0) {
+        AppBuffer buffer = {(const char*) preview, previewLength};
+        result = writeFile(previewPath, &buffer, 1);
+        release(preview);
+    }
+    return result;
+}
+
+int AHgeneratePreview(const char* stemURL, char* previewURLBuffer, size_t bufferSize) {
+    return AHgeneratePreviewCtx(&defaultContext, stemURL, previewURLBuffer, bufferSize);
+}
+
+int AHgeneratePreviewCtx(AHContext* ctx, const char* stemURL, char* previewURLBuffer, size_t bufferSize) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (stemURL == NULL || previewURLBuffer == NULL) {
+        return AHErrorInvalidRequest;
+    }
+
+    MappedFile stem;
+    WaveAudio wave;
+    int result = mapWave(stemURL, &stem, &wave);
+    if (result == 0) {
+        result = writePreview(&wave, stemURL, previewURLBuffer, bufferSize);
+        unmapFile(&stem);
+    }
+    return result;
+}
+
+int AHinspectStem(const char* stemURL, AHStemInfo* oInfo) {
+    return AHinspectStemCtx(&defaultContext, stemURL, oInfo);
+}
+
+int AHinspectStemCtx(AHContext* ctx, const char* stemURL, AHStemInfo* oInfo) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (stemURL == NULL || oInfo == NULL) {
+        return AHErrorInvalidRequest;
+    }
+
+    MappedFile stem;
+    WaveAudio wave;
+    int result = mapWave(stemURL, &stem, &wave);
+    if (result != 0) {
+        return result;
+    }
+
+    oInfo->sampleRate = wave.sampleRate;
+    oInfo->channels = wave.channels;
+    oInfo->bitsPerSample = wave.bitsPerSample;
+    oInfo->isFloat = wave.format == WaveFloat;
+    oInfo->frameCount = (long long) wave.frameCount;
+    oInfo->lengthMicroseconds = microsecondsOf(&wave, wave.frameCount);
+    oInfo->loopStartMicroseconds = microsecondsOf(&wave, wave.loopStart);
+    oInfo->loopEndMicroseconds = microsecondsOf(&wave, wave.loopEnd);
+    measureLevels(&wave, &oInfo->peak, &oInfo->rms);
+    unmapFile(&stem);
+    return 0;
+}
+
+// Analysis works on a mono mixdown at about this rate, enough for chroma up to ChromaMaxHz
+#define AnalysisRate 11025
+// Samples per STFT frame, a power of two, and between frames
+#define AnalysisWindow 2048
+#define AnalysisHop 256
+#define AnalysisChunkHops 128
+#define MinTempo 70.0
+#define MaxTempo 180.0
+#define ChromaMinHz 65.0
+#define ChromaMaxHz 4200.0
+// Below these, the beat or key is too weak to put in a drop
+#define MinTempoConfidence 0.5
+#define MinTonalityConfidence 0.7
+
+// STFT of the whole mixdown, in chunks of frames, claimed as with PreviewJob
+typedef struct {
+    const WaveAudio* wave;
+    // Source frames averaged into one analysis sample
+    size_t decimation;
+    size_t samples;
+    size_t hops;
+    float window[AnalysisWindow];
+    // One turn around the circle, for the window and FFT twiddles
+    float cosines[AnalysisWindow];
+    float sines[AnalysisWindow];
+    unsigned short bitReversed[AnalysisWindow];
+    // Pitch class, C being zero, of each bin, or -1 outside the chroma range
+    signed char pitchClasses[AnalysisWindow / 2 + 1];
+    // Spectral flux of each frame, and the chroma of each chunk
+    float* onsets;
+    float* chroma;
+    unsigned int chunkCount;
+    unsigned int nextChunk;
+    long long deadlineMS;
+    int failed;
+} AnalysisJob;
+
+// Major and minor key profiles, by Krumhansl and Kessler, from the root up
+static const float majorProfile[12] = {6.35f, 2.23f, 3.48f, 2.33f, 4.38f, 4.09f, 2.52f, 5.19f, 2.39f, 3.66f, 2.29f, 2.88f};
+static const float minorProfile[12] = {6.33f, 2.68f, 3.52f, 5.38f, 2.60f, 3.53f, 2.54f, 4.75f, 3.98f, 2.69f, 3.34f, 3.17f};
+static const unsigned char majorScale[12] = {1, 0, 1, 0, 1, 1, 0, 1, 0, 1, 0, 1};
+static const unsigned char minorScale[12] = {1, 0, 1, 1, 0, 1, 0, 1, 1, 0, 1, 0};
+
+static void prepareAnalysis(AnalysisJob* job) {
+    const float angle = 2 * 3.14159265358979323846f / AnalysisWindow;
+    for (int i = 0; i < AnalysisWindow; i++) {
+        job->cosines[i] = cosf(angle * (float) i);
+        job->sines[i] = sinf(angle * (float) i);
+        job->window[i] = 0.5f - 0.5f * job->cosines[i];
+    }
+
+    int bits = 0;
+    while ((1 << bits) < AnalysisWindow) {
+        bits++;
+    }
+    for (int i = 0; i < AnalysisWindow; i++) {
+        int reversed = 0;
+        for (int bit = 0; bit < bits; bit++) {
+            reversed |= (i >> bit & 1) << (bits - 1 - bit);
+        }
+        job->bitReversed[i] = (unsigned short) reversed;
+    }
+
+    // Notes are numbered as in MIDI, where 69 is A at 440 Hz, and each reaches up a quarter tone
+    const double semitone = 1.0594630943592953;
+    double noteTop = 440.0 * 1.0293022366434921;
+    int note = 69;
+    while (noteTop / semitone > ChromaMinHz) {
+        noteTop /= semitone;
+        note--;
+    }
+    double rate = (double) job->wave->sampleRate / job->decimation;
+    for (int bin = 0; bin <= AnalysisWindow / 2; bin++) {
+        double frequency = bin * rate / AnalysisWindow;
+        job->pitchClasses[bin] = -1;
+        if (frequency >= ChromaMinHz && frequency <= ChromaMaxHz) {
+            while (frequency >= noteTop) {
+                noteTop *= semitone;
+                note++;
+            }
+            job->pitchClasses[bin] = (signed char) (note % 12);
+        }
+    }
+}
+
+// In place radix 2 FFT, with loops simple enough for the compiler to vectorize
+static void transform(const AnalysisJob* job, float* real, float* imaginary) {
+    for (int i = 0; i < AnalysisWindow; i++) {
+        int j = job->bitReversed[i];
+        if (j > i) {
+            float swap = real[i];
+            real[i] = real[j];
+            real[j] = swap;
+            swap = imaginary[i];
+            imaginary[i] = imaginary[j];
+            imaginary[j] = swap;
+        }
+    }
+
+    for (int size = 2; size <= AnalysisWindow; size *= 2) {
+        int half = size / 2;
+        int step = AnalysisWindow / size;
+        for (int start = 0; start < AnalysisWindow; start += size) {
+            float* realA = real + start;
+            float* imaginaryA = imaginary + start;
+            float* realB = realA + half;
+            float* imaginaryB = imaginaryA + half;
+            for (int k = 0; k < half; k++) {
+                float twiddleReal = job->cosines[k * step];
+                float twiddleImaginary = -job->sines[k * step];
+                float productReal = realB[k] * twiddleReal - imaginaryB[k] * twiddleImaginary;
+                float productImaginary = realB[k] * twiddleImaginary + imaginaryB[k] * twiddleReal;
+                realB[k] = realA[k] - productReal;
+                imaginaryB[k] = imaginaryA[k] - productImaginary;
+                realA[k] += productReal;
+                imaginaryA[k] += productImaginary;
+            }
+        }
+    }
+}
+
+// Working memory of one analysis thread
+typedef struct {
+    float* samples;
+    float real[AnalysisWindow];
+    float imaginary[AnalysisWindow];
+    float spectrum[AnalysisWindow / 2 + 1];
+    float previous[AnalysisWindow / 2 + 1];
+} AnalysisBuffers;
+
+static size_t analysisBufferSamples() {
+    return (size_t) AnalysisChunkHops * AnalysisHop + AnalysisWindow;
+}
+
+// Log compressed magnitudes of the frame starting at sample offset in buffers->samples
+static void analyzeFrame(const AnalysisJob* job, AnalysisBuffers* buffers, size_t offset) {
+    const float* in = buffers->samples + offset;
+    for (int i = 0; i < AnalysisWindow; i++) {
+        buffers->real[i] = in[i] * job->window[i];
+        buffers->imaginary[i] = 0.0f;
+    }
+    transform(job, buffers->real, buffers->imaginary);
+
+    // Scaled so that a full scale sine is about 1000, like log(1 + 1000 |X|) on magnitudes
+    const float scale = (1000.0f / (AnalysisWindow / 2)) * (1000.0f / (AnalysisWindow / 2));
+    for (int bin = 0; bin <= AnalysisWindow / 2; bin++) {
+        float power = buffers->real[bin] * buffers->real[bin] + buffers->imaginary[bin] * buffers->imaginary[bin];
+        buffers->spectrum[bin] = 0.5f * log2f(1.0f + power * scale);
+    }
+}
+
+static void analyzeChunk(AnalysisJob* job, unsigned int chunk, AnalysisBuffers* buffers) {
+    size_t firstHop = (size_t) chunk * AnalysisChunkHops;
+    size_t endHop = firstHop + AnalysisChunkHops < job->hops ? firstHop + AnalysisChunkHops : job->hops;
+    // The frame before the chunk too, for the flux of its first frame
+    size_t startHop = firstHop > 0 ? firstHop - 1 : 0;
+    size_t first = startHop * AnalysisHop;
+    size_t count = (endHop - 1) * AnalysisHop + AnalysisWindow - first;
+    size_t available = first + count <= job->samples ? count : job->samples - first;
+
+    // Mixed down, then averaged in place, padding the last frames with silence
+    float* samples = buffers->samples;
+    mixDown(job->wave, first * job->decimation, available * job->decimation, samples);
+    float scale = 1.0f / job->decimation;
+    for (size_t i = 0; i < available; i++) {
+        float sum = 0.0f;
+        for (size_t j = 0; j < job->decimation; j++) {
+            sum += samples[i * job->decimation + j];
+        }
+        samples[i] = sum * scale;
+    }
+    for (size_t i = available; i < count; i++) {
+        samples[i] = 0.0f;
+    }
+
+    float chroma[12] = {0};
+    for (size_t hop = startHop; hop < endHop; hop++) {
+        memcpy(buffers->previous, buffers->spectrum, sizeof(buffers->previous));
+        analyzeFrame(job, buffers, (hop - startHop) * AnalysisHop);
+        if (hop < firstHop) {
+            continue;
+        }
+
+        float flux = 0.0f;
+        for (int bin = 1; bin <= AnalysisWindow / 2; bin++) {
+            float rise = buffers->spectrum[bin] - buffers->previous[bin];
+            flux += rise > 0.0f ? rise : 0.0f;
+        }
+        job->onsets[hop] = hop > 0 ? flux : 0.0f;
+
+        // Only peaks, as the bins either side of one leak into the neighbouring pitch classes
+        for (int bin = 1; bin < AnalysisWindow / 2; bin++) {
+            const float* spectrum = buffers->spectrum;
+            if (job->pitchClasses[bin] >= 0 && spectrum[bin] > spectrum[bin - 1] && spectrum[bin] >= spectrum[bin + 1]) {
+                chroma[job->pitchClasses[bin]] += spectrum[bin];
+            }
+        }
+    }
+    memcpy(job->chroma + (size_t) chunk * 12, chroma, sizeof(chroma));
+}
+
+static void analysisWorker(void* argument) {
+    AnalysisJob* job = (AnalysisJob*) argument;
+    AnalysisBuffers* buffers = allocate(sizeof(AnalysisBuffers));
+    float* samples = allocate(analysisBufferSamples() * job->decimation * sizeof(float));
+    if (buffers == 0 || samples == 0) {
+        if (buffers != 0) {
+            release(buffers);
+        }
+        if (samples != 0) {
+            release(samples);
+        }
+        atomicStoreInt(&job->failed, 1);
+        return;
+    }
+    buffers->samples = samples;
+
+    // Every chunk claimed is finished, so those done are always the first ones
+    while (monotonicMS() < job->deadlineMS) {
+        unsigned int chunk = atomicIncrementInt(&job->nextChunk) - 1;
+        if (chunk >= job->chunkCount) {
+            break;
+        }
+        analyzeChunk(job, chunk, buffers);
+    }
+    release(samples);
+    release(buffers);
+}
+
+// The autocorrelation at a fractional lag, in between those worked out
+static double correlationAt(const double* correlations, double lag) {
+    size_t below = (size_t) lag;
+    double fraction = lag - below;
+    return correlations[below] * (1.0 - fraction) + correlations[below + 1] * fraction;
+}
+
+/*
+ * Picks the beat period by autocorrelating the onset strength, after
+ * taking out its local average, over the lags from MaxTempo to MinTempo.
+ * Each lag is helped by onsets half a beat and two beats on, as beats
+ * divide in two and group in twos, and mildly by being near 120 BPM.
+ * This keeps the beat from being mistaken for a multiple of a fast
+ * subdivision that most onsets fall on.
+ */
+static void estimateTempo(const float* onsets, size_t hops, double framesPerSecond, AHStemAnalysis* oAnalysis) {
+    oAnalysis->tempo = 0.0;
+    oAnalysis->tempoConfidence = 0.0;
+    size_t minLag = (size_t) (60.0 * framesPerSecond / MaxTempo);
+    size_t maxLag = (size_t) (60.0 * framesPerSecond / MinTempo) + 1;
+    // At least four beats at the slowest tempo
+    if (minLag < 2 || hops < 4 * maxLag) {
+        return;
+    }
+
+    size_t lagCount = 2 * maxLag + 4;
+    float* novelty = allocate(hops * sizeof(float));
+    double* correlations = allocate(lagCount * sizeof(double));
+    if (novelty == 0 || correlations == 0) {
+        if (novelty != 0) {
+            release(novelty);
+        }
+        if (correlations != 0) {
+            release(correlations);
+        }
+        return;
+    }
+
+    const size_t reach = 8;
+    double sum = 0.0;
+    for (size_t i = 0; i < reach; i++) {
+        sum += onsets[i];
+    }
+    for (size_t i = 0; i < hops; i++) {
+        if (i + reach < hops) {
+            sum += onsets[i + reach];
+        }
+        if (i > reach) {
+            sum -= onsets[i - reach - 1];
+        }
+        size_t from = i > reach ? i - reach : 0;
+        size_t to = i + reach < hops ? i + reach : hops - 1;
+        float rise = onsets[i] - (float) (sum / (to - from + 1));
+        novelty[i] = rise > 0.0f ? rise : 0.0f;
+    }
+    for (size_t lag = 0; lag < lagCount; lag++) {
+        double correlation = 0.0;
+        for (size_t i = 0; i + lag < hops; i++) {
+            correlation += (double) novelty[i] * novelty[i + lag];
+        }
+        correlations[lag] = correlation / (hops - lag);
+    }
+    release(novelty);
+
+    double scores[3] = {0, 0, 0};
+    double scoreSum = 0.0;
+    double best = 0.0;
+    double bestLag = 0.0;
+    for (size_t lag = minLag - 1; lag <= maxLag + 1; lag++) {
+        double octaves = log2(60.0 * framesPerSecond / lag / 120.0);
+        double score = correlations[lag] + 0.5 * correlationAt(correlations, lag * 0.5)
+            + 0.5 * correlations[2 * lag];
+        score *= 1.0 - 0.5 * octaves * octaves;
+        scores[0] = scores[1];
+        scores[1] = scores[2];
+        scores[2] = score;
+        scoreSum += score;
+        // The peak in the middle of the last three, moved to where a parabola through them peaks
+        if (lag > minLag && scores[1] > best && scores[1] >= scores[0] && scores[1] >= scores[2]) {
+            double curve = scores[0] - 2 * scores[1] + scores[2];
+            double shift = curve < 0.0 ? 0.5 * (scores[0] - scores[2]) / curve : 0.0;
+            best = scores[1];
+            bestLag = lag - 1 + shift;
+        }
+    }
+    release(correlations);
+
+    // How far the peak stands out over the average lag, which a steady beat leaves far behind
+    if (bestLag > 0.0 && best > 0.0) {
+        double mean = scoreSum / (maxLag - minLag + 3);
+        oAnalysis->tempo = 60.0 * framesPerSecond / bestLag;
+        oAnalysis->tempoConfidence = mean < best ? 1.0 - mean / best : 0.0;
+    }
+}
+
+// Correlates the chroma with each major and minor key profile, keeping the closest
+static void estimateTonality(const double chroma[12], AHStemAnalysis* oAnalysis) {
+    oAnalysis->tonalityMode = AHTonalityUnknown;
+    oAnalysis->tonalityRoot = 0;
+    oAnalysis->tonalityConfidence = 0.0;
+    memset(oAnalysis->scale, 0, sizeof(oAnalysis->scale));
+
+    double chromaMean = 0.0;
+    for (int i = 0; i < 12; i++) {
+        chromaMean += chroma[i] / 12;
+    }
+
+    for (int minor = 0; minor < 2; minor++) {
+        const float* profile = minor ? minorProfile : majorProfile;
+        double profileMean = 0.0;
+        for (int i = 0; i < 12; i++) {
+            profileMean += profile[i] / 12.0;
+        }
+        for (int root = 0; root < 12; root++) {
+            double product = 0.0;
+            double chromaSquares = 0.0;
+            double profileSquares = 0.0;
+            for (int i = 0; i < 12; i++) {
+                double x = chroma[(root + i) % 12] - chromaMean;
+                double y = profile[i] - profileMean;
+                product += x * y;
+                chromaSquares += x * x;
+                profileSquares += y * y;
+            }
+            double correlation = chromaSquares > 0.0 ? product / sqrt(chromaSquares * profileSquares) : 0.0;
+            if (correlation > oAnalysis->tonalityConfidence) {
+                oAnalysis->tonalityConfidence = correlation;
+                oAnalysis->tonalityRoot = root;
+                memcpy(oAnalysis->scale, minor ? minorScale : majorScale, sizeof(oAnalysis->scale));
+            }
+        }
+    }
+    if (oAnalysis->tonalityConfidence >= MinTonalityConfidence) {
+        oAnalysis->tonalityMode = AHTonalityTonal;
+    }
+}
+
+/*
+ * Estimates tempo and key from as much of the start of the stem as can
+ * be analyzed within budgetMS. Chunks of STFT frames are spread across
+ * threads, and the estimates made from those finished in time.
+ */
+static int analyzeWave(const WaveAudio* wave, unsigned int budgetMS, AHStemAnalysis* oAnalysis) {
+    long long startUS = monotonicUS();
+    AnalysisJob* job = allocate(sizeof(AnalysisJob));
+    if (job == 0) {
+        return AHErrorOutOfMemory;
+    }
+    memset(job, 0, sizeof(*job));
+
+    size_t maxFrames = (size_t) wave->sampleRate * AHMaxAnalysisSeconds;
+    size_t frames = wave->frameCount < maxFrames ? wave->frameCount : maxFrames;
+    job->wave = wave;
+    job->decimation = (wave->sampleRate + AnalysisRate / 2) / AnalysisRate;
+    job->decimation = job->decimation > 0 ? job->decimation : 1;
+    job->samples = frames / job->decimation;
+    job->hops = job->samples / AnalysisHop + 1;
+    job->chunkCount = (unsigned int) ((job->hops + AnalysisChunkHops - 1) / AnalysisChunkHops);
+    job->deadlineMS = monotonicMS() + (budgetMS != 0 ? budgetMS : AHDefaultAnalysisBudgetMS);
+    job->onsets = allocate(job->hops * sizeof(float));
+    job->chroma = allocate((size_t) job->chunkCount * 12 * sizeof(float));
+
+    int result = 0;
+    if (job->onsets == 0 || job->chroma == 0) {
+        result = AHErrorOutOfMemory;
+    }
+    else {
+        prepareAnalysis(job);
+        runWorkers(analysisWorker, job, job->chunkCount);
+        unsigned int chunksDone = (unsigned int) atomicLoadInt(&job->nextChunk);
+        chunksDone = chunksDone < job->chunkCount ? chunksDone : job->chunkCount;
+        if (atomicLoadInt(&job->failed) && chunksDone == 0) {
+            result = AHErrorOutOfMemory;
+        }
+        else {
+            size_t hopsDone = (size_t) chunksDone * AnalysisChunkHops;
+            hopsDone = hopsDone < job->hops ? hopsDone : job->hops;
+            double chroma[12] = {0};
+            for (unsigned int chunk = 0; chunk < chunksDone; chunk++) {
+                for (int i = 0; i < 12; i++) {
+                    chroma[i] += job->chroma[chunk * 12 + i];
+                }
+            }
+
+            double rate = (double) wave->sampleRate / job->decimation;
+            estimateTempo(job->onsets, hopsDone, rate / AnalysisHop, oAnalysis);
+            estimateTonality(chroma, oAnalysis);
+            size_t samplesDone = hopsDone * AnalysisHop < job->samples ? hopsDone * AnalysisHop : job->samples;
+            oAnalysis->analyzedMicroseconds = microsecondsOf(wave, samplesDone * job->decimation);
+        }
+    }
+
+    if (job->onsets != 0) {
+        release(job->onsets);
+    }
+    if (job->chroma != 0) {
+        release(job->chroma);
+    }
+    release(job);
+    oAnalysis->elapsedMicroseconds = monotonicUS() - startUS;
+    return result;
+}
+
+int AHanalyzeStem(const char* stemURL, unsigned int budgetMS, AHStemAnalysis* oAnalysis) {
+    return AHanalyzeStemCtx(&defaultContext, stemURL, budgetMS, oAnalysis);
+}
+
+int AHanalyzeStemCtx(AHContext* ctx, const char* stemURL, unsigned int budgetMS, AHStemAnalysis* oAnalysis) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (stemURL == NULL || oAnalysis == NULL) {
+        return AHErrorInvalidRequest;
+    }
+
+    MappedFile stem;
+    WaveAudio wave;
+    int result = mapWave(stemURL, &stem, &wave);
+    if (result == 0) {
+        result = analyzeWave(&wave, budgetMS, oAnalysis);
+        unmapFile(&stem);
+    }
+    return result;
+}
+
+/*
+ * Fills in what AHdropFields was asked to from the "file:" mix stem.
+ * The length is filled in when not set, as is the loop from the sampler
+ * chunk, and a length or loop that doesn't fit the audio is refused.
+ * Only looks at chunk headers, not the samples, unless making a preview
+ * or analyzing. Estimates that aren't confident enough are left out.
+ */
+static int fillFromStem(AHDropRequest* request, unsigned int flags, char* previewURLBuffer, size_t bufferSize) {
+    int makePreview = (flags & AHCallGeneratePreview) && request->previewURL == 0;
+    int analyze = (flags & AHCallAnalyzeStem)
+        && (request->tempo == 0.0 || request->tonalityMode == AHTonalityNotSet);
+    if (!(flags & AHCallInspectStem) && !makePreview && !analyze) {
+        return 0;
+    }
+    if (request->mixStemURL == 0) {
+        return AHErrorInvalidRequest;
+    }
+
+    MappedFile stem;
+    WaveAudio wave;
+    int result = mapWave(request->mixStemURL, &stem, &wave);
+    if (result != 0) {
+        return result;
+    }
+
+    if (flags & AHCallInspectStem) {
+        long long length = microsecondsOf(&wave, wave.frameCount);
+        // Hosts may round either way, but not be off by a whole frame
+        long long frameMicroseconds = (1000000 + wave.sampleRate - 1) / wave.sampleRate;
+        if (request->lengthMicroseconds == 0) {
+            request->lengthMicroseconds = length;
+        }
+        if (request->loopEndMicroseconds == 0 && wave.loopEnd != 0) {
+            request->loopStartMicroseconds = microsecondsOf(&wave, wave.loopStart);
+            request->loopEndMicroseconds = microsecondsOf(&wave, wave.loopEnd);
+        }
+
+        long long difference = request->lengthMicroseconds - length;
+        if (difference > frameMicroseconds || difference < -frameMicroseconds) {
+            result = AHErrorInvalidRequest;
+        }
+        if (request->loopEndMicroseconds != 0 && (request->loopStartMicroseconds < 0
+                || request->loopStartMicroseconds >= request->loopEndMicroseconds
+                || request->loopEndMicroseconds > length + frameMicroseconds)) {
+            result = AHErrorInvalidRequest;
+        }
+    }
+
+    AHStemAnalysis analysis;
+    if (result == 0 && analyze) {
+        result = analyzeWave(&wave, 0, &analysis);
+    }
+    if (result == 0 && analyze) {
+        if (request->tempo == 0.0 && analysis.tempo > 0.0 && analysis.tempoConfidence >= MinTempoConfidence) {
+            request->tempo = analysis.tempo;
+        }
+        if (request->tonalityMode == AHTonalityNotSet && analysis.tonalityMode == AHTonalityTonal) {
+            request->tonalityMode = AHTonalityTonal;
+            memcpy(request->scale, analysis.scale, sizeof(request->scale));
+            request->tonalityRoot = analysis.tonalityRoot;
+        }
+    }
+
+    if (result == 0 && makePreview) {
+        result = writePreview(&wave, request->mixStemURL, previewURLBuffer, bufferSize);
+        if (result == 0) {
+            request->previewURL = previewURLBuffer;
+        }
+    }
+    unmapFile(&stem);
+    return result;
+}
+
+/// Content hashes
+
+// In tmpDir, one "<hash> <size> <modified> <recorded> <path hash>" line each time a file is hashed
+#define HashIndexURL "file:///allihoopa-hashes"
+#define MaxHashIndexEntries 256
+// Appended to until it has this many lines, then compacted
+#define MaxHashIndexLines (2 * MaxHashIndexEntries)
+#define HashIndexLineLength 128
+// Files modified this close to being hashed may change again unnoticed, within the timestamp resolution
+#define RacyModificationNS (2000LL * 1000 * 1000)
+
+#define HashPrime1 0x9E3779B185EBCA87ULL
+#define HashPrime2 0xC2B2AE3D27D4EB4FULL
+#define HashPrime3 0x165667B19E3779F9ULL
+#define HashPrime4 0x85EBCA77C2B2AE63ULL
+#define HashPrime5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    unsigned long long contentHash;
+    unsigned long long pathHash;
+    long long size;
+    long long modifiedNS;
+    long long recordedNS;
+} HashIndexEntry;
+
+// Serializes reading and rewriting the index within the process, as contexts may share a tmpDir
+static Mutex hashIndexMutex = MutexInitializer;
+
+static unsigned long long readLE64(const unsigned char* data) {
+    return (unsigned long long) readLE32(data) | (unsigned long long) readLE32(data + 4) << 32;
+}
+
+static unsigned long long rotateLeft(unsigned long long value, int bits) {
+    return value << bits | value >> (64 - bits);
+}
+
+static unsigned long long hashRound(unsigned long long accumulator, unsigned long long input) {
+    return rotateLeft(accumulator + input * HashPrime2, 31) * HashPrime1;
+}
+
+static unsigned long long hashMerge(unsigned long long hash, unsigned long long accumulator) {
+    return (hash ^ hashRound(0, accumulator)) * HashPrime1 + HashPrime4;
+}
+
+/*
+ * XXH64 with a zero seed. Its four lanes are independent of each other,
+ * so the main loop runs at memory speed without SIMD intrinsics.
+ */
+static unsigned long long hashData(const unsigned char* data, size_t length) {
+    const unsigned char* end = data + length;
+    unsigned long long hash;
+    if (length >= 32) {
+        unsigned long long lanes[4] = {HashPrime1 + HashPrime2, HashPrime2, 0, 0 - HashPrime1};
+        for (; end - data >= 32; data += 32) {
+            for (int lane = 0; lane < 4; lane++) {
+                lanes[lane] = hashRound(lanes[lane], readLE64(data + lane * 8));
+            }
+        }
+        hash = rotateLeft(lanes[0], 1) + rotateLeft(lanes[1], 7) + rotateLeft(lanes[2], 12) + rotateLeft(lanes[3], 18);
+        for (int lane = 0; lane < 4; lane++) {
+            hash = hashMerge(hash, lanes[lane]);
+        }
+    }
+    else {
+        hash = HashPrime5;
+    }
+
+    hash += length;
+    for (; end - data >= 8; data += 8) {
+        hash = rotateLeft(hash ^ hashRound(0, readLE64(data)), 27) * HashPrime1 + HashPrime4;
+    }
+    if (end - data >= 4) {
+        hash = rotateLeft(hash ^ readLE32(data) * HashPrime1, 23) * HashPrime2 + HashPrime3;
+        data += 4;
+    }
+    for (; data < end; data++) {
+        hash = rotateLeft(hash ^ *data * HashPrime5, 11) * HashPrime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HashPrime2;
+    hash ^= hash >> 29;
+    hash *= HashPrime3;
+    return hash ^ hash >> 32;
+}
+
+/*
+ * Reads the index oldest first. Lines that don't parse, as left by a
+ * process that stopped mid write, are skipped. Past the limit, which
+ * other processes appending at the same time can take the index over,
+ * the oldest lines are dropped.
+ */
+static int readHashIndex(const char* indexPath, HashIndexEntry* entries) {
+    MappedFile index;
+    if (mapFile(indexPath, &index) != 0) {
+        return 0;
+    }
+
+    int count = 0;
+    const char* at = index.data;
+    const char* end = index.data + index.size;
+    while (at < end) {
+        const char* lineEnd = memchr(at, '\n', (size_t) (end - at));
+        if (lineEnd == 0) {
+            break;
+        }
+        char line[128];
+        size_t lineLength = (size_t) (lineEnd - at);
+        HashIndexEntry entry;
+        if (lineLength < sizeof(line)) {
+            memcpy(line, at, lineLength);
+            line[lineLength] = 0;
+            if (sscanf(line, "%16llx %lld %lld %lld %16llx", &entry.contentHash, &entry.size,
+                    &entry.modifiedNS, &entry.recordedNS, &entry.pathHash) == 5) {
+                if (count == MaxHashIndexLines) {
+                    memmove(entries, entries + 1, (MaxHashIndexLines - 1) * sizeof(HashIndexEntry));
+                    count--;
+                }
+                entries[count++] = entry;
+            }
+        }
+        at = lineEnd + 1;
+    }
+    unmapFile(&index);
+    return count;
+}
+
+static size_t formatHashIndexLine(const HashIndexEntry* entry, char* line) {
+    return (size_t) snprintf(line, HashIndexLineLength, "%016llx %lld %lld %lld %016llx\n",
+        entry->contentHash, entry->size, entry->modifiedNS, entry->recordedNS, entry->pathHash);
+}
+
+/*
+ * Appends the entry, which then takes over from the file's earlier ones.
+ * Once the index has as many lines as it reads, it is compacted to the
+ * latest entry of the most recently hashed files instead, written to a
+ * temporary file and renamed over the index so that readers never see
+ * it half written.
+ */
+static void recordHashIndexEntry(const char* indexPath, const HashIndexEntry* entry, HashIndexEntry* entries) {
+    char line[HashIndexLineLength];
+    int count = readHashIndex(indexPath, entries);
+    if (count < MaxHashIndexLines) {
+        // Only costs a hash pass next time if this fails
+        appendFile(indexPath, line, formatHashIndexLine(entry, line));
+        return;
+    }
+
+    // Newest first, then turned around so that the newest is last again
+    int kept = 0;
+    entries[kept++] = *entry;
+    for (int i = count - 1; i >= 0 && kept < MaxHashIndexEntries; i--) {
+        int seen = 0;
+        for (int j = 0; j < kept && !seen; j++) {
+            seen = entries[j].pathHash == entries[i].pathHash;
+        }
+        if (!seen) {
+            entries[kept++] = entries[i];
+        }
+    }
+    char* text = allocate((size_t) kept * HashIndexLineLength);
+    if (text == 0) {
+        return;
+    }
+    size_t length = 0;
+    for (int i = kept - 1; i >= 0; i--) {
+        length += formatHashIndexLine(&entries[i], text + length);
+    }
+
+    char temporaryPath[MaxPathLength];
+    if ((size_t) snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", indexPath) < sizeof(temporaryPath)) {
+        AppBuffer buffer = {text, length};
+        if (writeFile(temporaryPath, &buffer, 1) == 0) {
+            renameFile(temporaryPath, indexPath);
+        }
+    }
+    release(text);
+}
+
+/*
+ * Hashes a "file:" URL's content through a memory mapping. Files whose
+ * size and modification time haven't changed since they were last
+ * hashed, in any session, are looked up in the index in tmpDir instead.
+ */
+static int hashFileContent(const char* url, unsigned long long* oHash) {
+    char path[MaxPathLength];
+    char indexPath[MaxPathLength];
+    int result = filePathOf(url, path, sizeof(path));
+    if (result == 0) {
+        result = filePathOf(HashIndexURL, indexPath, sizeof(indexPath));
+    }
+    long long size = 0;
+    long long modifiedNS = 0;
+    if (result == 0) {
+        result = statFile(path, &size, &modifiedNS);
+    }
+    if (result != 0) {
+        return result;
+    }
+
+    HashIndexEntry* entries = allocate(MaxHashIndexLines * sizeof(HashIndexEntry));
+    if (entries == 0) {
+        return AHErrorOutOfMemory;
+    }
+    unsigned long long pathHash = hashData((const unsigned char*) path, strlen(path));
+
+    // The latest entry for the file is the one that counts
+    lockMutex(&hashIndexMutex);
+    int count = readHashIndex(indexPath, entries);
+    unlockMutex(&hashIndexMutex);
+    for (int i = count - 1; i >= 0; i--) {
+        if (entries[i].pathHash != pathHash) {
+            continue;
+        }
+        if (entries[i].size == size && entries[i].modifiedNS == modifiedNS
+            && entries[i].modifiedNS < entries[i].recordedNS - RacyModificationNS) {
+            *oHash = entries[i].contentHash;
+            release(entries);
+            return 0;
+        }
+        break;
+    }
+
+    long long recordedNS = wallClockNS();
+    unsigned long long hash = hashData((const unsigned char*) "", 0);
+    if (size != 0) {
+        MappedFile file;
+        result = mapFile(path, &file);
+        if (result != 0) {
+            release(entries);
+            return result;
+        }
+        hash = hashData((const unsigned char*) file.data, file.size);
+        size = (long long) file.size;
+        unmapFile(&file);
+    }
+
+    HashIndexEntry entry = {hash, pathHash, size, modifiedNS, recordedNS};
+    lockMutex(&hashIndexMutex);
+    recordHashIndexEntry(indexPath, &entry, entries);
+    unlockMutex(&hashIndexMutex);
+
+    release(entries);
+    *oHash = hash;
+    return 0;
+}
+
+int AHhashContent(const char* url, char* hashBuffer, size_t bufferSize) {
+    return AHhashContentCtx(&defaultContext, url, hashBuffer, bufferSize);
+}
+
+int AHhashContentCtx(AHContext* ctx, const char* url, char* hashBuffer, size_t bufferSize) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (url == NULL || hashBuffer == NULL || bufferSize < AHContentHashLength) {
+        return AHErrorInvalidRequest;
+    }
+    unsigned long long hash = 0;
+    int result = hashFileContent(url, &hash);
+    if (result == 0) {
+        snprintf(hashBuffer, bufferSize, "xxh64:%016llx", hash);
+    }
+    return result;
+}
+
+// Hashes each distinct "file:" URL in the request, see AHCallHashContent
+static int hashRequestFiles(const AHDropRequest* request, ContentHash* oHashes, int* oHashCount) {
+    const char* urls[MaxContentHashes] = {request->mixStemURL, request->previewURL, request->coverImageURL};
+    int urlCount = 3;
+    for (int i = 0; i < request->attachmentCount; i++) {
+        urls[urlCount++] = request->attachments[i].dataURL;
+    }
+
+    *oHashCount = 0;
+    for (int i = 0; i < urlCount; i++) {
+        int seen = urls[i] == 0 || strncmp(urls[i], "file:", 5) != 0;
+        for (int j = 0; j < *oHashCount && !seen; j++) {
+            seen = strcmp(oHashes[j].url, urls[i]) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+        int result = AHhashContent(urls[i], oHashes[*oHashCount].hash, AHContentHashLength);
+        if (result != 0) {
+            return result;
+        }
+        oHashes[(*oHashCount)++].url = urls[i];
+    }
+    return 0;
+}
+
+/// Chunked stems
+
+// Chunks fill a version 1 frame, or a larger frame where the app takes them
+#define StemChunkSize (60 * 1024)
+#define LargeStemChunkSize (1024 * 1024)
+// Stem name, offset and checksum
+#define ChunkHeaderSize (1 + AHMaxStemNameLength + 16)
+#define MaxChunkAttempts 3
+
+static void writeLE64(unsigned char* data, unsigned long long value) {
+    writeLE32(data, (unsigned long) (value & 0xffffffffUL));
+    writeLE32(data + 4, (unsigned long) (value >> 32));
+}
+
+/*
+ * Hashes a stem once per transfer. A transfer resumed with the same
+ * request ID takes the stems to be unchanged, as AHdropStems asks.
+ */
+static unsigned long long stemHashOf(short int requestID, const StemHandoff* stem, const char* data) {
+    for (int i = 0; i < MaxStemHashes; i++) {
+        StemHash* known = &context->connection.stemHashes[i];
+        if (known->requestID == requestID && known->length == stem->length && strcmp(known->name, stem->name) == 0) {
+            return known->hash;
+        }
+    }
+
+    // Replaces the oldest, which belongs to a transfer that was given up on
+    StemHash* known = &context->connection.stemHashes[context->connection.nextStemHash];
+    context->connection.nextStemHash = (context->connection.nextStemHash + 1) % MaxStemHashes;
+    known->requestID = requestID;
+    memcpy(known->name, stem->name, sizeof(known->name));
+    known->length = stem->length;
+    known->hash = hashData((const unsigned char*) data, stem->length);
+    return known->hash;
+}
+
+static void forgetStemHashes(short int requestID) {
+    for (int i = 0; i < MaxStemHashes; i++) {
+        if (context->connection.stemHashes[i].requestID == requestID) {
+            context->connection.stemHashes[i].requestID = 0;
+        }
+    }
+}
+
+/*
+ * Asks the app how much of a stem it already has from an earlier attempt
+ * with the same request ID. Starts over on anything but a chunk boundary.
+ */
+static int resumeOffsetOf(short int requestID, const StemHandoff* stem, const char* data,
+    size_t chunkSize, size_t* oOffset)
+{
+    char body[192];
+    int length = snprintf(body, sizeof(body),
+        "{\"name\": \"%s\", \"length\": %llu, \"chunkSize\": %llu, \"hash\": \"xxh64:%016llx\"}",
+        stem->name, (unsigned long long) stem->length, (unsigned long long) chunkSize,
+        stemHashOf(requestID, stem, data));
+    if (length < 0 || (size_t) length >= sizeof(body)) {
+        return AHErrorUnknownError;
+    }
+
+    const char* reply = 0;
+    size_t replyLength = 0;
+    int result = callApp(requestID, "rsum", body, (size_t) length, &reply, &replyLength);
+    if (result != 0) {
+        return result;
+    }
+
+    *oOffset = 0;
+    AHSpan response = {reply, replyLength};
+    AHSpan value;
+    long long offset = 0;
+    if (reply != 0 && findMember(response, "offset", &value) == 0
+        && parseInteger64(value, &offset) == 0 && offset > 0 && (unsigned long long) offset <= stem->length
+        && ((size_t) offset % chunkSize == 0 || (size_t) offset == stem->length)) {
+        *oOffset = (size_t) offset;
+    }
+    return 0;
+}
+
+// Sends one chunk, again when the app finds that it doesn't match its checksum
+static int sendChunk(short int requestID, const StemHandoff* stem, const char* data,
+    size_t offset, size_t length, char* frame)
+{
+    size_t nameLength = strlen(stem->name);
+    unsigned char* header = (unsigned char*) frame;
+    header[0] = (unsigned char) nameLength;
+    memcpy(&header[1], stem->name, nameLength);
+    writeLE64(&header[1 + nameLength], offset);
+    writeLE64(&header[9 + nameLength], hashData((const unsigned char*) &data[offset], length));
+    memcpy(&header[17 + nameLength], &data[offset], length);
+
+    int result = AHRequestFailed;
+    for (int attempt = 0; attempt < MaxChunkAttempts && result == AHRequestFailed; attempt++) {
+        int slot = 0;
+        result = sendRequest(requestID, "chnk", frame, 17 + nameLength + length, NoAppHandle, 0, &slot);
+        if (result == 0) {
+            result = awaitReply(slot, 0, 0);
+        }
+    }
+    return result;
+}
+
+/*
+ * Sends the part of each stem that the app doesn't have yet, one chunk
+ * at a time, so that a failed transfer can be resumed from the last chunk
+ * the app has checked. In memory stems are read from their shared memory
+ * copy, files are mapped. All chunks share the deadline of the call, and
+ * a transfer that runs out of time resumes when the call is made again.
+ */
+static int sendStemChunks(short int requestID, const StemHandoff* stems, int stemCount) {
+    size_t chunkSize = context->connection.frameVersion >= 2 ? LargeStemChunkSize : StemChunkSize;
+    char* frame = allocate(ChunkHeaderSize + chunkSize);
+    if (frame == 0) {
+        return AHErrorOutOfMemory;
+    }
+
+    long long total = 0;
+    for (int i = 0; i < stemCount; i++) {
+        total += (long long) stems[i].length;
+    }
+    long long done = 0;
+
+    int result = 0;
+    for (int i = 0; i < stemCount && result == 0; i++) {
+        const StemHandoff* stem = &stems[i];
+        MappedFile file = {0, 0};
+        const char* data = stem->memory.data;
+        if (data == 0) {
+            result = mapAppHandle(stem->file, stem->length, &file);
+            data = file.data;
+        }
+
+        size_t offset = 0;
+        if (result == 0) {
+            result = resumeOffsetOf(requestID, stem, data, chunkSize, &offset);
+        }
+        if (result == 0) {
+            done += (long long) offset;
+            recordProgress(requestID, "transfer", 8, done, total);
+        }
+
+        while (result == 0 && offset < stem->length) {
+            if (isCancelled(requestID)) {
+                result = AHErrorCancelled;
+                break;
+            }
+            size_t length = stem->length - offset < chunkSize ? stem->length - offset : chunkSize;
+            result = sendChunk(requestID, stem, data, offset, length, frame);
+            if (result == 0) {
+                offset += length;
+                done += (long long) length;
+                recordProgress(requestID, "transfer", 8, done, total);
+            }
+        }
+
+        if (file.data != 0) {
+            unmapFile(&file);
+        }
+    }
+
+    if (result == 0) {
+        forgetStemHashes(requestID);
+    }
+    release(frame);
+    return result;
+}
+
+/// Progress
+
+// Takes over the entry for the request, a free entry, or the least recently updated one
+static void recordProgress(short int requestID, const char* stage, size_t stageLength,
+    long long done, long long total)
+{
+    if (stageLength > MaxProgressStageLength) {
+        stageLength = MaxProgressStageLength;
+    }
+
+    lockMutex(&context->progress.mutex);
+    ProgressEntry* entry = 0;
+    ProgressEntry* oldest = &context->progress.entries[0];
+    for (int i = 0; i < MaxProgressEntries && entry == 0; i++) {
+        ProgressEntry* candidate = &context->progress.entries[i];
+        if (candidate->requestID == requestID) {
+            entry = candidate;
+        }
+        else if (oldest->requestID != 0
+            && (candidate->requestID == 0 || (int) (candidate->sequence - oldest->sequence) < 0)) {
+            oldest = candidate;
+        }
+    }
+    if (entry == 0) {
+        entry = oldest;
+    }
+
+    entry->requestID = requestID;
+    entry->updated = 1;
+    entry->sequence = context->progress.sequence++;
+    memcpy(entry->stage, stage, stageLength);
+    entry->stage[stageLength] = 0;
+    entry->done = done;
+    entry->total = total;
+    unlockMutex(&context->progress.mutex);
+}
+
+int AHpollProgress(AHProgressHandler handler, void* userData) {
+    return AHpollProgressCtx(&defaultContext, handler, userData);
+}
+
+int AHpollProgressCtx(AHContext* ctx, AHProgressHandler handler, void* userData) {
+    if (ctx == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    context = ctx;
+    if (handler == 0) {
+        return AHErrorInvalidRequest;
+    }
+    int result = finishPrewarm();
+    if (result != 0) {
+        return result;
+    }
+
+    // The IO thread reads 'prog' frames as they come, otherwise pick up those waiting
+    if (!context->ioThread.running && context->connection.sessionActive && appIsRunning()) {
+        startCall(0);
+        result = readPendingReplies();
+    }
+
+    ProgressEntry updated[MaxProgressEntries];
+    int updatedCount = 0;
+    lockMutex(&context->progress.mutex);
+    for (int i = 0; i < MaxProgressEntries; i++) {
+        ProgressEntry* entry = &context->progress.entries[i];
+        if (entry->requestID != 0 && entry->updated) {
+            updated[updatedCount++] = *entry;
+            entry->updated = 0;
+            // Finished, nothing more to report
+            if (entry->done >= entry->total) {
+                entry->requestID = 0;
+            }
+        }
+    }
+    unlockMutex(&context->progress.mutex);
+
+    for (int i = 0; i < updatedCount; i++) {
+        AHProgress report = {updated[i].requestID, updated[i].stage, updated[i].done, updated[i].total};
+        handler(&report, userData);
+    }
+    return result;
+}
+
+const char* AHerrorCodeToMessage(int errorCode) {
+    switch(errorCode) {
+        case AHErrorCommsFailure:
+            return "App communication failure";
+        case AHErrorInvalidRequest:
+            return "Invalid request";
+        case AHErrorLaunchFailure:
+            return "App launch failure";
+        case AHErrorOutOfMemory:
+            return "Out of memory";
+        case AHErrorNotSupported:
+            return "Not supported by the app";
+        case AHErrorTimeout:
+            return "Timed out waiting for the app";
+        case AHErrorInvalidAudio:
+            return "Unsupported or damaged audio file";
+        case AHErrorWouldBlock:
+            return "Too many requests queued";
+        case AHErrorCancelled:
+            return "Request cancelled";
+        case AHErrorUnknownError:
+        default:
+            return "Unknown error";
+    }
+}
+
+static void addFailedRequest(short int requestID, int errorCode) {
+    forgetDrop(requestID);
+    if (context->connection.failedCount == MaxFailedRequests) {
+        // Like the app response queue, the oldest report is overwritten
+        memmove(&context->connection.failed[0], &context->connection.failed[1],
+            sizeof(FailedRequest) * (MaxFailedRequests - 1));
+        context->connection.failedCount--;
+    }
+    context->connection.failed[context->connection.failedCount].requestID = requestID;
+    context->connection.failed[context->connection.failedCount].errorCode = errorCode;
+    context->connection.failedCount++;
+}
+
+// Keeps the reply to a poll that timed out, for the next poll to deliver
+static int keepLateReply(size_t bodyLength) {
+    if (context->connection.lateReply == 0) {
+        context->connection.lateReply = allocate(AHMaxRequestBody);
+        if (context->connection.lateReply == 0) {
+            return AHErrorOutOfMemory;
+        }
+    }
+    memcpy(context->connection.lateReply, context->connection.replyBuffer, bodyLength);
+    context->connection.lateReplyLength = bodyLength;
+    context->connection.lateReplyFlags = context->connection.replyFlags;
+    // Also with apps that notify, there is something to poll for now
+    context->connection.completionsAvailable = 1;
+    return 0;
+}
+
+static void releaseInFlight(int slot) {
+    context->connection.inFlight[slot].state = InFlightFree;
+    context->connection.inFlightCount--;
+}
+
+/*
+ * Called when the connection is broken or out of sync,
+ * no more replies are expected for requests in flight.
+ */
+static void failInFlight(int errorCode) {
+    // A timeout leaves the connection as it is, replies may still arrive
+    if (errorCode == AHErrorTimeout) {
+        return;
+    }
+    context->connection.replyReceived = 0;
+    for (int slot = 0; slot < AHMaxPipelineDepth; slot++) {
+        // Journaled drops are replayed once the app has been relaunched
+        if (context->connection.inFlight[slot].state == InFlightPipelined
+            && !(errorCode == AHErrorCommsFailure && isJournaled(context->connection.inFlight[slot].requestID))) {
+            addFailedRequest(context->connection.inFlight[slot].requestID, errorCode);
+        }
+        context->connection.inFlight[slot].state = InFlightFree;
+    }
+    context->connection.inFlightCount = 0;
+}
+
+/*
+ * Reads one reply and hands it to the oldest request in flight with
+ * the same ID. The app replies in order to requests with the same ID.
+ */
+static int readReply(int* oSlot, size_t* oBodyLength) {
+    const char* reply = context->connection.replyHeader;
+    size_t bytesRead = 0;
+    size_t headerSize = context->connection.frameVersion >= 2 ? FrameHeaderSizeV2 : FrameHeaderSize;
+
+    if (context->connection.replyReceived < headerSize) {
+        int result = readFromApp(&context->connection.replyHeader[context->connection.replyReceived],
+            headerSize - context->connection.replyReceived, &bytesRead, context->connection.deadlineMS);
+        context->connection.replyReceived += bytesRead;
+        if (result) {
+            traceEvent("recv", 0, context->connection.replyReceived, result);
+            if (result == AHErrorTimeout) {
+                countStat(&context->connection.stats.timeouts, 1);
+            }
+            return result;
+        }
+    }
+
+    const unsigned char* bytes = (const unsigned char*) reply;
+    short int responseID = (short int) (bytes[4] | (bytes[5] << 8));
+    size_t replyBodyLength = 0;
+    unsigned char replyFlags = 0;
+    if (context->connection.frameVersion >= 2) {
+        replyFlags = bytes[7];
+        for (int i = 0; i < 4; i++) {
+            replyBodyLength |= (size_t) bytes[8 + i] << (8 * i);
+        }
+        // Nothing after this frame can be trusted to be in sync
+        if (bytes[6] != 2 || replyBodyLength > AHMaxRequestBody) {
+            traceEvent(reply, responseID, replyBodyLength, AHErrorCommsFailure);
+            context->connection.replyReceived = 0;
+            closeAppConnection();
+            return AHErrorCommsFailure;
+        }
+    }
+    else {
+        replyBodyLength = bytes[6] | (bytes[7] << 8);
+    }
+
+    if(replyBodyLength > 0){
+        if (context->connection.replyBuffer == 0) {
+            context->connection.replyBuffer = allocate(AHMaxRequestBody);
+            if (context->connection.replyBuffer == 0) {
+                return AHErrorOutOfMemory;
+            }
+        }
+
+        // The body must be read even when not wanted, to stay in sync
+        size_t bodyReceived = context->connection.replyReceived - headerSize;
+        int bodyResult = readFromApp(&context->connection.replyBuffer[bodyReceived], replyBodyLength - bodyReceived,
+            &bytesRead, context->connection.deadlineMS);
+        context->connection.replyReceived += bytesRead;
+        if (bodyResult != 0){
+            traceEvent("recv", responseID, context->connection.replyReceived, bodyResult);
+            if (bodyResult == AHErrorTimeout) {
+                countStat(&context->connection.stats.timeouts, 1);
+            }
+            return bodyResult;
+        }
+    }
+    context->connection.replyReceived = 0;
+    context->connection.replyFlags = replyFlags;
+    countStat(&context->connection.stats.bytesIn, headerSize + replyBodyLength);
+
+    if (memcmp(reply, "prog", 4) == 0) {
+        traceEvent(reply, responseID, headerSize + replyBodyLength, 0);
+        // Unsolicited, reports on a request the app is still handling
+        const unsigned char* body = (const unsigned char*) context->connection.replyBuffer;
+        if (responseID != 0 && replyBodyLength >= 16) {
+            recordProgress(responseID, (const char*) &body[16], replyBodyLength - 16,
+                (long long) readLE64(body), (long long) readLE64(&body[8]));
+        }
+        *oSlot = -1;
+        *oBodyLength = 0;
+        return 0;
+    }
+
+    if (memcmp(reply, "note", 4) == 0) {
+        traceEvent(reply, responseID, headerSize + replyBodyLength, 0);
+        // Unsolicited, not a reply to any request
+        context->connection.completionsAvailable = 1;
+        *oSlot = -1;
+        *oBodyLength = 0;
+        return 0;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < AHMaxPipelineDepth; i++) {
+        InFlight* candidate = &context->connection.inFlight[i];
+        if ((candidate->state == InFlightPipelined || candidate->state == InFlightAwaited
+                || candidate->state == InFlightLatePoll)
+            && candidate->requestID == responseID
+            && (slot == -1 || (int) (candidate->sequence - context->connection.inFlight[slot].sequence) < 0)) {
+            slot = i;
+        }
+    }
+
+    if (slot == -1) {
+        // Request / response mismatch
+        traceEvent(reply, responseID, headerSize + replyBodyLength, AHErrorCommsFailure);
+        return AHErrorCommsFailure;
+    }
+
+    int requestResult = memcmp(reply, "okay", 4) == 0 ? 0 : AHRequestFailed;
+    traceEvent(reply, responseID, headerSize + replyBodyLength, requestResult);
+    recordReply(&context->connection.inFlight[slot], requestResult);
+
+    if (context->connection.inFlight[slot].state == InFlightPipelined) {
+        if (requestResult != 0) {
+            addFailedRequest(responseID, requestResult);
+        }
+        releaseInFlight(slot);
+    }
+    else if (context->connection.inFlight[slot].state == InFlightLatePoll) {
+        int keepResult = requestResult == 0 && replyBodyLength > 0 ? keepLateReply(replyBodyLength) : 0;
+        releaseInFlight(slot);
+        if (keepResult != 0) {
+            return keepResult;
+        }
+    }
+    else {
+        context->connection.inFlight[slot].state = InFlightDone;
+        context->connection.inFlight[slot].result = requestResult;
+    }
+
+    *oSlot = slot;
+    *oBodyLength = replyBodyLength;
+    return 0;
+}
+
+static int sendRequest(
+    short int requestID,
+    const char command[4],
+    const char* data, size_t dataLength,
+    AppHandle passHandle,
+    unsigned int sendFlags, int* oSlot)
+{
+    if(command == 0){
+        return AHErrorInvalidRequest;
+    }
+
+    if(data == 0 && dataLength != 0){
+        return AHErrorInvalidRequest;
+    }
+
+    if(data != 0 && dataLength == 0){
+        return AHErrorInvalidRequest;
+    }
+
+    if(dataLength > AHMaxLargeRequestBody){
+        return AHErrorInvalidRequest;
+    }
+
+    // Check that the app is alive once per call, not once per write
+    long long launchMS = 0;
+    int result = initAppConnection(&launchMS);
+    if (result || launchMS != 0) {
+        traceEvent("lnch", requestID, 0, result);
+    }
+    if (result) {
+        return result;
+    }
+    if (launchMS != 0) {
+        // A new app starts out with version 1 frames
+        context->connection.launchMS = launchMS;
+        context->connection.frameVersion = 1;
+        context->connection.capabilities &= ~CapabilityCBOR;
+        context->connection.replyReceived = 0;
+        countStat(&context->connection.stats.launches, 1);
+    }
+    if (dataLength > AHMaxRequestBody && context->connection.frameVersion < 2) {
+        return AHErrorInvalidRequest;
+    }
+
+    int pipelined = (sendFlags & SendPipelined) != 0;
+    // Pipelined requests are limited by the pipeline depth, others only need a slot.
+    // Without pipelining, only fire and forget drops are pipelined, and they don't wait.
+    int limit = pipelined && context->connection.pipelineDepth > 1 ? context->connection.pipelineDepth : AHMaxPipelineDepth;
+    while (context->connection.inFlightCount >= limit) {
+        int replySlot = 0;
+        size_t bodyLength = 0;
+        result = readReply(&replySlot, &bodyLength);
+        if (result) {
+            failInFlight(result);
+            return result;
+        }
+    }
+
+    char header[FrameHeaderSizeV2];
+    size_t headerSize = FrameHeaderSize;
+    memcpy(&header[0], command, 4);
+    header[4] = (char) (requestID & 0xff);
+    header[5] = (char) ((unsigned short) requestID >> 8);
+    if (context->connection.frameVersion >= 2) {
+        headerSize = FrameHeaderSizeV2;
+        header[6] = 2;
+        header[7] = (sendFlags & SendCBOR) ? FrameFlagCBOR : 0;
+        for (int i = 0; i < 4; i++) {
+            header[8 + i] = (char) (dataLength >> (8 * i));
+        }
+    }
+    else {
+        header[6] = (char) (dataLength & 0xff);
+        header[7] = (char) (dataLength >> 8);
+    }
+
+    // Send the whole frame at once, so the app never wakes up on a partial frame
+    AppBuffer frame[2] = {
+        {header, headerSize},
+        {data, dataLength}
+    };
+    result = writeToApp(frame, dataLength != 0 ? 2 : 1, passHandle, context->connection.deadlineMS);
+    traceEvent(command, requestID, headerSize + dataLength, result);
+    if (result) {
+        if (result == AHErrorTimeout) {
+            countStat(&context->connection.stats.timeouts, 1);
+        }
+        failInFlight(result);
+        return result;
+    }
+    countStat(&context->connection.stats.bytesOut, headerSize + dataLength);
+
+    int slot = 0;
+    while (context->connection.inFlight[slot].state != InFlightFree) {
+        slot++;
+    }
+
+    context->connection.inFlight[slot].requestID = requestID;
+    context->connection.inFlight[slot].state = pipelined ? InFlightPipelined : InFlightAwaited;
+    context->connection.inFlight[slot].sequence = context->connection.inFlightSequence++;
+    context->connection.inFlight[slot].statCommand = (unsigned char) statCommandOf(command);
+    context->connection.inFlight[slot].sentUS = monotonicUS();
+    context->connection.inFlightCount++;
+    countStat(&context->connection.stats.commands[statCommandOf(command)].calls, 1);
+
+    *oSlot = slot;
+    return 0;
+}
+
+/*
+ * Reads replies until the one for the given slot arrives. Replies
+ * to pipelined requests sent earlier are handled along the way.
+ */
+static int awaitReply(int slot, const char** oBody, size_t* oBodyLength) {
+    while (context->connection.inFlight[slot].state != InFlightDone) {
+        int replySlot = 0;
+        size_t bodyLength = 0;
+
+        int result = readReply(&replySlot, &bodyLength);
+        if (result == AHErrorTimeout) {
+            /*
+             * Left for a later call to pick up the reply, and to report it
+             * if the request failed. Polls are picked up by the next poll,
+             * see awaitPoll.
+             */
+            context->connection.inFlight[slot].state = InFlightPipelined;
+            return result;
+        }
+        if (result) {
+            releaseInFlight(slot);
+            failInFlight(result);
+            return result;
+        }
+
+        if (replySlot == slot && bodyLength > 0 && oBody != 0) {
+            *oBody = context->connection.replyBuffer;
+            *oBodyLength = bodyLength;
+        }
+    }
+
+    int result = context->connection.inFlight[slot].result;
+    releaseInFlight(slot);
+    return result;
+}
+
+static int callApp(
+    short int requestID,
+    const char command[4],
+    const char* data, size_t dataLength,
+    const char** oBody, size_t* oBodyLength)
+{
+    int slot = 0;
+    int result = sendRequest(requestID, command, data, dataLength, NoAppHandle, 0, &slot);
+    if (result) {
+        return result;
+    }
+    return awaitReply(slot, oBody, oBodyLength);
+}
+
+
+/// Platform specific implementations
+
+#ifdef _WIN32
+
+
+/*
+ * Creates a pipe where the SDK's end is overlapped, since this is not
+ * possible with the regular CreatePipe call. The server end is the SDK's,
+ * reading with PIPE_ACCESS_INBOUND or writing with PIPE_ACCESS_OUTBOUND,
+ * and the client end is the app's.
+ * This makes it possible to add timeouts to pipe reads and writes,
+ * avoiding inter process deadlocks.
+ */
+static int createOverlappedPipe(
+    HANDLE* oServerHandle,
+    HANDLE* oClientHandle,
+    DWORD serverAccess,
+    SECURITY_ATTRIBUTES* securityAttributes
+)
+{
+    static unsigned int pipeSerial = 0;
+    char pipeName[MAX_PATH];
+
+    sprintf(pipeName, "\\\\.\\Pipe\\Allihoopa.%08x.%08x",
+        (unsigned int) GetCurrentProcessId(),
+        atomicIncrementInt(&pipeSerial));
+    
+    const int numPipes = 1;
+    const int bufferSize = 8192;
+    const int defaultTimeoutMS = 100;
+
+    *oServerHandle = CreateNamedPipe(
+        pipeName,
+        serverAccess | FILE_FLAG_OVERLAPPED,
+        PIPE_TYPE_BYTE | PIPE_WAIT,
+        numPipes,
+        bufferSize,
+        bufferSize,
+        defaultTimeoutMS,
+        securityAttributes
+    );
+
+    if(*oServerHandle == INVALID_HANDLE_VALUE){
+        *oServerHandle = 0;
+        return 0;
+    }
+
+    *oClientHandle = CreateFile(
+        pipeName,
+        serverAccess == PIPE_ACCESS_INBOUND ? GENERIC_WRITE : GENERIC_READ,
+        0, // not shared
+        securityAttributes,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL // no template file
+    );
+
+    if(*oClientHandle == INVALID_HANDLE_VALUE) {
+        CloseHandle(*oServerHandle);
+        *oServerHandle = 0;
+        *oClientHandle = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+static void closePipeHandle(HANDLE* handle) {
+    if (*handle != 0) {
+        CloseHandle(*handle);
+        *handle = 0;
+    }
+}
+
+// Takes the outcome of the read started by waitForAppData, once its event is raised
+static void finishReadAhead() {
+    DWORD bytesRead = 0;
+    BOOL readResult = GetOverlappedResult(context->transport.outputRead, &context->transport.readAhead,
+        &bytesRead, FALSE);
+    context->transport.readAheadState = readResult && bytesRead == 1 ? ReadAheadDone : ReadAheadNone;
+}
+
+/*
+ * Stops the read started by waitForAppData, which must be over before
+ * its pipe is closed. A byte it has read is lost with the connection.
+ */
+static void cancelReadAhead() {
+    if (context->transport.readAheadState == ReadAheadPending) {
+        DWORD bytesRead = 0;
+        CancelIoEx(context->transport.outputRead, &context->transport.readAhead);
+        GetOverlappedResult(context->transport.outputRead, &context->transport.readAhead, &bytesRead, TRUE);
+    }
+    context->transport.readAheadState = ReadAheadNone;
+    if (context->transport.readAhead.hEvent != NULL) {
+        CloseHandle(context->transport.readAhead.hEvent);
+        context->transport.readAhead.hEvent = NULL;
+    }
+}
+
+static int initAppConnection(long long* oLaunchMS) {
+    if (context->transport.process != 0) {
+        DWORD exitCode = 0;
+        if (GetExitCodeProcess(context->transport.process, &exitCode) && exitCode == STILL_ACTIVE) {
+            return 0;
+        }
+        
+        TerminateProcess(context->transport.process, 0);
+        CloseHandle(context->transport.process);
+        context->transport.process = 0;
+    }
+
+    *oLaunchMS = monotonicMS();
+
+    SECURITY_ATTRIBUTES securityAttributes;
+    securityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
+    securityAttributes.bInheritHandle = TRUE;
+    securityAttributes.lpSecurityDescriptor = NULL;
+
+    cancelReadAhead();
+    closePipeHandle(&context->transport.inputRead);
+    closePipeHandle(&context->transport.inputWrite);
+    closePipeHandle(&context->transport.outputRead);
+    closePipeHandle(&context->transport.outputWrite);
+
+    if(!createOverlappedPipe(&context->transport.inputWrite, &context->transport.inputRead,
+        PIPE_ACCESS_OUTBOUND, &securityAttributes)){
+        return AHErrorLaunchFailure;
+    }
+
+    if(!SetHandleInformation(context->transport.inputWrite, HANDLE_FLAG_INHERIT, 0)) {
+        return AHErrorLaunchFailure;
+    }
+
+    if(!createOverlappedPipe(&context->transport.outputRead, &context->transport.outputWrite,
+        PIPE_ACCESS_INBOUND, &securityAttributes)){
+        return AHErrorLaunchFailure;
+    }
+
+    if(!SetHandleInformation(context->transport.outputRead, HANDLE_FLAG_INHERIT, 0)) {
+        return AHErrorLaunchFailure;
+    }
+
+    PROCESS_INFORMATION processInfo;
+    ZeroMemory(&processInfo, sizeof(PROCESS_INFORMATION));
+
+    STARTUPINFO startupInfo;
+    ZeroMemory(&startupInfo, sizeof(STARTUPINFO));
+    startupInfo.cb = sizeof(STARTUPINFO);
+    startupInfo.hStdOutput = context->transport.outputWrite;
+    // ??? Cannot get redirection to work, using direct console writes from App instead
+    //startupInfo.hStdError = stdErrorHandle;
+    startupInfo.hStdInput = context->transport.inputRead;
+    startupInfo.dwFlags |= STARTF_USESTDHANDLES;
+    startupInfo.dwFlags |= STARTF_USESHOWWINDOW;
+    startupInfo.wShowWindow = SW_SHOWDEFAULT;
+
+    char* cmdLine = "allihoopa.exe -pipe";
+
+    BOOL result = CreateProcess(
+        NULL,       // app name
+        cmdLine,    // commandline
+        NULL,       // security attributes
+        NULL,       // thread security attributes
+        TRUE,       // inherit handles
+        0,          // creation flags
+        NULL,       // use parent environment
+        NULL,       // use parent's cwd
+        &startupInfo,
+        &processInfo
+        );
+    
+    if(!result) {
+        return AHErrorLaunchFailure;
+    }
+
+    context->transport.process = processInfo.hProcess;
+    CloseHandle(processInfo.hThread);
+
+    return 0;
+}
+
+static void closeAppConnection() {
+    // The app exits when its input pipe is closed, an app that doesn't is terminated
+    closePipeHandle(&context->transport.inputWrite);
+    if (context->transport.process != 0) {
+        if (WaitForSingleObject(context->transport.process, AppExitTimeoutMS) != WAIT_OBJECT_0) {
+            TerminateProcess(context->transport.process, 0);
+            WaitForSingleObject(context->transport.process, AppExitTimeoutMS);
+        }
+        CloseHandle(context->transport.process);
+        context->transport.process = 0;
+    }
+    cancelReadAhead();
+    closePipeHandle(&context->transport.inputRead);
+    closePipeHandle(&context->transport.outputRead);
+    closePipeHandle(&context->transport.outputWrite);
+}
+
+static int appIsRunning() {
+    return context->transport.process != 0 && WaitForSingleObject(context->transport.process, 0) == WAIT_TIMEOUT;
+}
+
+static int writeToApp(const AppBuffer* buffers, int bufferCount, AppHandle passHandle, long long deadlineMS) {
+    // Handles are duplicated into the app instead, see shareHandleWithApp
+    (void) passHandle;
+
+    // WriteFileGather does not work on pipes, coalesce into one write instead.
+    // Large version 2 frames are written a buffer at a time.
+    size_t totalLength = 0;
+    for (int i = 0; i < bufferCount; i++) {
+        totalLength += buffers[i].length;
+    }
+    AppBuffer coalesced = {context->transport.frame, 0};
+    if (totalLength <= sizeof(context->transport.frame)) {
+        for (int i = 0; i < bufferCount; i++) {
+            memcpy(&context->transport.frame[coalesced.length], buffers[i].data, buffers[i].length);
+            coalesced.length += buffers[i].length;
+        }
+        buffers = &coalesced;
+        bufferCount = 1;
+    }
+
+    int ahResult = 0;
+    OVERLAPPED overlapInfo;
+    ZeroMemory(&overlapInfo, sizeof(OVERLAPPED));
+    // We will wait for this event to get signalled on completion
+    overlapInfo.hEvent = CreateEvent(
+        NULL,
+        TRUE, // manual reset
+        FALSE, // initial state, not triggered
+        NULL);
+
+    if(overlapInfo.hEvent == NULL) {
+        return AHErrorUnknownError;
+    }
+
+    size_t totalBytesWritten = 0;
+    for (int i = 0; i < bufferCount && ahResult == 0; i++) {
+        const char* data = buffers[i].data;
+        size_t written = 0;
+
+        // Writes wait for the app to read once the pipe buffer is full
+        while (ahResult == 0 && written != buffers[i].length) {
+            DWORD bytesWritten = 0;
+            ResetEvent(overlapInfo.hEvent);
+
+            BOOL writeResult = WriteFile(context->transport.inputWrite, &data[written],
+                (DWORD) (buffers[i].length - written), 0, &overlapInfo);
+            if (!writeResult && GetLastError() != ERROR_IO_PENDING) {
+                ahResult = AHErrorCommsFailure;
+                break;
+            }
+
+            long long timeoutMS = deadlineMS - monotonicMS();
+            if (timeoutMS < 0) {
+                timeoutMS = 0;
+            }
+
+            int waitResult = WaitForSingleObject(overlapInfo.hEvent, (DWORD) timeoutMS);
+            if (waitResult != WAIT_OBJECT_0) {
+                // The write must be over before its buffer and event go away
+                CancelIoEx(context->transport.inputWrite, &overlapInfo);
+                ahResult = AHErrorTimeout;
+            }
+
+            BOOL overlappedResult = GetOverlappedResult(
+                context->transport.inputWrite,
+                &overlapInfo,
+                &bytesWritten,
+                ahResult != 0 // only block to wait for the cancel
+            );
+            if (!overlappedResult && ahResult == 0) {
+                ahResult = AHErrorCommsFailure;
+            }
+            written += bytesWritten;
+            totalBytesWritten += bytesWritten;
+        }
+    }
+
+    CloseHandle(overlapInfo.hEvent);
+    if (ahResult == AHErrorTimeout && totalBytesWritten != 0) {
+        // The app would take the rest of the frame for the start of the next
+        closeAppConnection();
+        return AHErrorCommsFailure;
+    }
+    if (ahResult == AHErrorCommsFailure) {
+        closeAppConnection();
+    }
+    return ahResult;
+}
+
+static int readFromApp(char* data, size_t length, size_t* oBytesRead, long long deadlineMS) {
+    *oBytesRead = 0;
+    if (context->transport.readAheadState == ReadAheadPending) {
+        long long timeoutMS = deadlineMS - monotonicMS();
+        if (WaitForSingleObject(context->transport.readAhead.hEvent,
+                timeoutMS > 0 ? (DWORD) timeoutMS : 0) != WAIT_OBJECT_0) {
+            return AHErrorTimeout;
+        }
+        finishReadAhead();
+        if (context->transport.readAheadState != ReadAheadDone) {
+            return AHErrorCommsFailure;
+        }
+    }
+    if (context->transport.readAheadState == ReadAheadDone && length != 0) {
+        data[0] = context->transport.readAheadByte;
+        context->transport.readAheadState = ReadAheadNone;
+        *oBytesRead = 1;
+    }
+
+    {
+        int ahResult = 0;
+        OVERLAPPED overlapInfo;
+        ZeroMemory(&overlapInfo, sizeof(OVERLAPPED));
+        // We will wait for this event to get signalled on completion
+        overlapInfo.hEvent = CreateEvent(
+            NULL,
+            TRUE, // manual reset
+            FALSE, // initial state, not triggered
+            NULL);
+
+        if(overlapInfo.hEvent == NULL) {
+            return AHErrorUnknownError;
+        }
+
+        // Pipe reads may return with less than asked for
+        while (ahResult == 0 && *oBytesRead != length) {
+            DWORD bytesRead = 0;
+            ResetEvent(overlapInfo.hEvent);
+
+            BOOL readResult = ReadFile(context->transport.outputRead, &data[*oBytesRead],
+                (DWORD) (length - *oBytesRead), 0, &overlapInfo);
+            if (!readResult && GetLastError() != ERROR_IO_PENDING) {
+                ahResult = AHErrorCommsFailure;
+                break;
+            }
+
+            long long timeoutMS = deadlineMS - monotonicMS();
+            if (timeoutMS < 0) {
+                timeoutMS = 0;
+            }
+
+            int waitResult = WaitForSingleObject(overlapInfo.hEvent, (DWORD) timeoutMS);
+            if (waitResult != WAIT_OBJECT_0) {
+                // The read must be over before its buffer and event go away
+                CancelIoEx(context->transport.outputRead, &overlapInfo);
+                ahResult = AHErrorTimeout;
+            }
+
+            BOOL overlappedResult = GetOverlappedResult(
+                context->transport.outputRead,
+                &overlapInfo,
+                &bytesRead,
+                ahResult != 0 // only block to wait for the cancel
+            );
+            if (!overlappedResult && ahResult == 0) {
+                ahResult = AHErrorCommsFailure;
+            }
+            *oBytesRead += bytesRead;
+        }
+
+        CloseHandle(overlapInfo.hEvent);
+        return ahResult;
+    }
+}
+
+static int createSharedMemory(SharedMemory* memory, size_t size) {
+    unsigned long long size64 = size;
+    memory->handle = CreateFileMapping(
+        INVALID_HANDLE_VALUE, // backed by the paging file
+        NULL,
+        PAGE_READWRITE,
+        (DWORD) (size64 >> 32),
+        (DWORD) size64,
+        NULL // anonymous, the handle is duplicated into the app
+    );
+    if (memory->handle == NULL) {
+        return AHErrorOutOfMemory;
+    }
+
+    memory->data = MapViewOfFile(memory->handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (memory->data == NULL) {
+        CloseHandle(memory->handle);
+        memory->handle = NULL;
+        return AHErrorOutOfMemory;
+    }
+
+    memory->size = size;
+    return 0;
+}
+
+static void destroySharedMemory(SharedMemory* memory) {
+    UnmapViewOfFile(memory->data);
+    CloseHandle(memory->handle);
+    memory->data = 0;
+    memory->size = 0;
+    memory->handle = NULL;
+}
+
+static int shareHandleWithApp(AppHandle handle, AppHandle* oPassHandle, long long* oAppHandle) {
+    HANDLE appHandle = NULL;
+    if (!DuplicateHandle(GetCurrentProcess(), handle,
+            context->transport.process, &appHandle, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        return AHErrorCommsFailure;
+    }
+
+    *oPassHandle = NoAppHandle;
+    *oAppHandle = (long long) (ULONG_PTR) appHandle;
+    return 0;
+}
+
+static int duplicateFile(AHFileHandle file, AppHandle* oHandle, size_t* oLength) {
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        return AHErrorInvalidRequest;
+    }
+
+    HANDLE handle = NULL;
+    if (!DuplicateHandle(GetCurrentProcess(), file,
+            GetCurrentProcess(), &handle, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        return AHErrorInvalidRequest;
+    }
+
+    *oHandle = handle;
+    *oLength = (size_t) size.QuadPart;
+    return 0;
+}
+
+static void closeAppHandle(AppHandle handle) {
+    CloseHandle(handle);
+}
+
+static int toWidePath(const char* path, WCHAR* buffer, int bufferLength) {
+    return MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, path, -1, buffer, bufferLength) == 0;
+}
+
+static int mapFile(const char* path, MappedFile* oFile) {
+    WCHAR widePath[MaxPathLength];
+    if (toWidePath(path, widePath, MaxPathLength)) {
+        return AHErrorInvalidRequest;
+    }
+
+    HANDLE file = CreateFileW(widePath, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return AHErrorInvalidRequest;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0
+        || (unsigned long long) size.QuadPart > (size_t) -1) {
+        CloseHandle(file);
+        return AHErrorInvalidRequest;
+    }
+
+    // The view keeps both the mapping and the file open
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (data == NULL) {
+        return AHErrorInvalidRequest;
+    }
+
+    oFile->data = data;
+    oFile->size = (size_t) size.QuadPart;
+    return 0;
+}
+
+static int mapAppHandle(AppHandle file, size_t length, MappedFile* oFile) {
+    if (length == 0) {
+        return AHErrorInvalidRequest;
+    }
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        return AHErrorInvalidRequest;
+    }
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, length);
+    CloseHandle(mapping);
+    if (data == NULL) {
+        return AHErrorInvalidRequest;
+    }
+
+    oFile->data = data;
+    oFile->size = length;
+    return 0;
+}
+
+static void unmapFile(MappedFile* file) {
+    UnmapViewOfFile(file->data);
+    file->data = 0;
+    file->size = 0;
+}
+
+static int writeFile(const char* path, const AppBuffer* buffers, int bufferCount) {
+    WCHAR widePath[MaxPathLength];
+    if (toWidePath(path, widePath, MaxPathLength)) {
+        return AHErrorInvalidRequest;
+    }
+
+    HANDLE file = CreateFileW(widePath, GENERIC_WRITE, 0, NULL,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return AHErrorInvalidRequest;
+    }
+
+    for (int i = 0; i < bufferCount; i++) {
+        size_t written = 0;
+        while (written < buffers[i].length) {
+            size_t remaining = buffers[i].length - written;
+            DWORD bytesWritten = 0;
+            if (!WriteFile(file, buffers[i].data + written,
+                    remaining > 0x40000000 ? 0x40000000 : (DWORD) remaining, &bytesWritten, NULL)) {
+                CloseHandle(file);
+                DeleteFileW(widePath);
+                return AHErrorInvalidRequest;
+            }
+            written += bytesWritten;
+        }
+    }
+
+    return CloseHandle(file) ? 0 : AHErrorInvalidRequest;
+}
+
+static int appendFile(const char* path, const char* data, size_t length) {
+    WCHAR widePath[MaxPathLength];
+    if (toWidePath(path, widePath, MaxPathLength)) {
+        return AHErrorInvalidRequest;
+    }
+
+    // Without FILE_WRITE_DATA, every write goes to the end of the file
+    HANDLE file = CreateFileW(widePath, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return AHErrorInvalidRequest;
+    }
+    DWORD bytesWritten = 0;
+    int result = WriteFile(file, data, (DWORD) length, &bytesWritten, NULL) && bytesWritten == length
+        ? 0 : AHErrorInvalidRequest;
+    CloseHandle(file);
+    return result;
+}
+
+static int renameFile(const char* fromPath, const char* toPath) {
+    WCHAR wideFromPath[MaxPathLength];
+    WCHAR wideToPath[MaxPathLength];
+    if (toWidePath(fromPath, wideFromPath, MaxPathLength) || toWidePath(toPath, wideToPath, MaxPathLength)
+        || !MoveFileExW(wideFromPath, wideToPath, MOVEFILE_REPLACE_EXISTING)) {
+        return AHErrorInvalidRequest;
+    }
+    return 0;
+}
+
+static void getTempDirectory(char* buffer, size_t bufferSize) {
+    WCHAR widePath[MAX_PATH + 1];
+    DWORD length = GetTempPathW(MAX_PATH + 1, widePath);
+    if (length == 0 || length > MAX_PATH
+        || WideCharToMultiByte(CP_UTF8, 0, widePath, -1, buffer, (int) bufferSize, NULL, NULL) == 0) {
+        memcpy(buffer, ".", 2);
+    }
+}
+
+// File times count 100 nanosecond intervals since 1601
+static long long nanosecondsOf(FILETIME time) {
+    return (long long) ((unsigned long long) time.dwHighDateTime << 32 | time.dwLowDateTime) * 100;
+}
+
+static int statFile(const char* path, long long* oSize, long long* oModifiedNS) {
+    WCHAR widePath[MaxPathLength];
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (toWidePath(path, widePath, MaxPathLength)
+        || !GetFileAttributesExW(widePath, GetFileExInfoStandard, &info)
+        || (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        return AHErrorInvalidRequest;
+    }
+    *oSize = (long long) ((unsigned long long) info.nFileSizeHigh << 32 | info.nFileSizeLow);
+    *oModifiedNS = nanosecondsOf(info.ftLastWriteTime);
+    return 0;
+}
+
+static long long wallClockNS() {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return nanosecondsOf(now);
+}
+
+static long long monotonicMS() {
+    return (long long) GetTickCount64();
+}
+
+static long long monotonicUS() {
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart / frequency.QuadPart * 1000000
+        + now.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+}
+
+static DWORD WINAPI threadTrampoline(LPVOID argument) {
+    Thread* thread = (Thread*) argument;
+    thread->entry(thread->argument);
+    return 0;
+}
+
+static int startThread(Thread* thread, ThreadEntry entry, void* argument) {
+    thread->entry = entry;
+    thread->argument = argument;
+    thread->handle = CreateThread(NULL, 0, threadTrampoline, thread, 0, NULL);
+    return thread->handle == NULL;
+}
+
+static void joinThread(Thread* thread) {
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    thread->handle = NULL;
+}
+
+static void initMutex(Mutex* mutex) {
+    InitializeSRWLock(mutex);
+}
+
+static void destroyMutex(Mutex* mutex) {
+    (void) mutex;
+}
+
+static void lockMutex(Mutex* mutex) {
+    AcquireSRWLockExclusive(mutex);
+}
+
+static void unlockMutex(Mutex* mutex) {
+    ReleaseSRWLockExclusive(mutex);
+}
+
+static int createSignal(Signal* signal) {
+    signal->event = CreateEvent(
+        NULL,
+        TRUE, // manual reset, stays raised until cleared
+        FALSE, // initial state, not triggered
+        NULL);
+    return signal->event == NULL;
+}
+
+static void destroySignal(Signal* signal) {
+    CloseHandle(signal->event);
+    signal->event = NULL;
+}
+
+static void raiseSignal(Signal* signal) {
+    SetEvent(signal->event);
+}
+
+static void clearSignal(Signal* signal) {
+    ResetEvent(signal->event);
+}
+
+/*
+ * Pipes can't be waited on together with events, so a one byte read is
+ * started instead, and its event waited on. The read stays pending when
+ * the wait is over first, and readFromApp takes the byte once it is in.
+ * A broken pipe counts as data, for the next read to report.
+ */
+static int waitForAppData(Signal* signal, int timeoutMS) {
+    Transport* transport = &context->transport;
+    if (transport->outputRead == 0) {
+        if (signal == 0) {
+            Sleep((DWORD) timeoutMS);
+        }
+        else if (WaitForSingleObject(signal->event, (DWORD) timeoutMS) == WAIT_OBJECT_0) {
+            ResetEvent(signal->event);
+        }
+        return 0;
+    }
+
+    if (transport->readAheadState == ReadAheadNone) {
+        if (transport->readAhead.hEvent == NULL) {
+            transport->readAhead.hEvent = CreateEvent(
+                NULL,
+                TRUE, // manual reset
+                FALSE, // initial state, not triggered
+                NULL);
+            if (transport->readAhead.hEvent == NULL) {
+                return 1;
+            }
+        }
+        ResetEvent(transport->readAhead.hEvent);
+        if (!ReadFile(transport->outputRead, &transport->readAheadByte, 1, 0, &transport->readAhead)
+            && GetLastError() != ERROR_IO_PENDING) {
+            return 1;
+        }
+        transport->readAheadState = ReadAheadPending;
+    }
+
+    if (transport->readAheadState == ReadAheadPending) {
+        HANDLE events[2] = {transport->readAhead.hEvent, signal != 0 ? signal->event : NULL};
+        DWORD waitResult = WaitForMultipleObjects(signal != 0 ? 2 : 1, events, FALSE, (DWORD) timeoutMS);
+        if (waitResult == WAIT_OBJECT_0 + 1) {
+            ResetEvent(signal->event);
+            return 0;
+        }
+        if (waitResult != WAIT_OBJECT_0) {
+            return 0;
+        }
+        finishReadAhead();
+    }
+    return 1;
+}
+
+#endif // _WIN32
+
+#if defined(__APPLE__) || defined(__linux__)
+
+#ifdef __APPLE__
+#include "TargetConditionals.h"
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+/*
+ * The app is launched directly using posix_spawn, without a shell,
+ * and talks to us over a socket pair connected to its stdin and stdout.
+ * Define ALLIHOOPA_APP_PATH to launch a different binary, for example
+ * a stand-in app when measuring round trip latency.
+ */
+#ifndef ALLIHOOPA_APP_PATH
+#define ALLIHOOPA_APP_PATH "./allihoopa"
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+extern char** environ;
+
+
+/*
+ * Returns non-zero once the app has exited, or has already been reaped
+ * by the host, polling until the timeout passes.
+ */
+static int waitForAppExit(pid_t pid, long long timeoutMS) {
+    long long deadlineMS = monotonicMS() + timeoutMS;
+    struct timespec pause = {0, 1000 * 1000};
+    for (;;) {
+        int status = 0;
+        pid_t waitResult = waitpid(pid, &status, WNOHANG);
+        if (waitResult == pid || (waitResult == -1 && errno != EINTR)) {
+            return 1;
+        }
+        if (monotonicMS() >= deadlineMS) {
+            return 0;
+        }
+        nanosleep(&pause, 0);
+    }
+}
+
+static void closeAppConnection() {
+    if (context->transport.socketFD != -1) {
+        close(context->transport.socketFD);
+        context->transport.socketFD = -1;
+    }
+    if (context->transport.pid != 0) {
+        // The app exits when its end of the socket is closed, an app that
+        // doesn't is terminated, and then killed, rather than hang the host
+        pid_t pid = context->transport.pid;
+        context->transport.pid = 0;
+        if (waitForAppExit(pid, AppExitTimeoutMS)) {
+            return;
+        }
+        kill(pid, SIGTERM);
+        if (waitForAppExit(pid, AppExitTimeoutMS)) {
+            return;
+        }
+        kill(pid, SIGKILL);
+        int status = 0;
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+static int appIsRunning() {
+    if (context->transport.socketFD == -1) {
+        return 0;
+    }
+
+    int status = 0;
+    pid_t waitResult = waitpid(context->transport.pid, &status, WNOHANG);
+    if (waitResult == context->transport.pid) {
+        context->transport.pid = 0;
+        closeAppConnection();
+        return 0;
+    }
+    // Also when the host reaps children itself, then exits are noticed on read
+    return 1;
+}
+
+static int setupSocket(int fd, int nonBlocking) {
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        return -1;
+    }
+    if (nonBlocking && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+        return -1;
+    }
+#ifdef SO_NOSIGPIPE
+    {
+        int on = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) == -1) {
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+static int initAppConnection(long long* oLaunchMS) {
+    if (context->transport.socketFD != -1) {
+        return 0;
+    }
+
+    *oLaunchMS = monotonicMS();
+
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+        return AHErrorLaunchFailure;
+    }
+
+    // The child end is dup'ed onto stdin / stdout, which clears close-on-exec
+    if (setupSocket(sockets[0], 1) || setupSocket(sockets[1], 0)) {
+        close(sockets[0]);
+        close(sockets[1]);
+        return AHErrorLaunchFailure;
+    }
+
+    posix_spawn_file_actions_t fileActions;
+    if (posix_spawn_file_actions_init(&fileActions) != 0) {
+        close(sockets[0]);
+        close(sockets[1]);
+        return AHErrorLaunchFailure;
+    }
+    posix_spawn_file_actions_adddup2(&fileActions, sockets[1], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fileActions, sockets[1], STDOUT_FILENO);
+
+    char* argv[] = {(char*) ALLIHOOPA_APP_PATH, (char*) "-pipe", 0};
+    pid_t pid = 0;
+    int spawnResult = posix_spawn(&pid, ALLIHOOPA_APP_PATH, &fileActions, 0, argv, environ);
+
+    posix_spawn_file_actions_destroy(&fileActions);
+    close(sockets[1]);
+
+    if (spawnResult != 0) {
+        close(sockets[0]);
+        return spawnResult == ENOENT ? AHErrorAppNotFound : AHErrorLaunchFailure;
+    }
+
+    context->transport.pid = pid;
+    context->transport.socketFD = sockets[0];
+
+    return 0;
+}
+
+static long long monotonicMS() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static long long monotonicUS() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-        if (bodyResult != 0){
-            free(body);
-            return bodyResult;
+static int waitForApp(short events, long long deadlineMS) {
+    struct pollfd pollFor = {
+        context->transport.socketFD,
+        events,
+        0
+    };
+
+    for (;;) {
+        long long timeoutMS = deadlineMS - monotonicMS();
+        if (timeoutMS < 0) {
+            timeoutMS = 0;
         }
 
-        // debug print body here ?
+        int pollResult = poll(&pollFor, 1, (int) timeoutMS);
 
-        if (oBody != 0) {
-            *oBody = body;
-            *oBodyLength = replyBodyLength;
+        if (pollResult == 1) {
+            // Errors and hangups are picked up by the following read or write
+            return 0;
         }
-        else {
-            free(body);
+        else if (pollResult == 0) {
+            return AHErrorTimeout;
+        }
+        else if (errno != EINTR) {
+            return AHErrorCommsFailure;
         }
     }
+}
 
-    static union {
-        char chars[4];
-        int code;
-    } AOK = {
-        {'o', 'k', 'a', 'y'}
-    };
+static int readFromApp(char* data, size_t length, size_t* oBytesRead, long long deadlineMS) {
+    size_t totalBytesRead = 0;
+    *oBytesRead = 0;
 
-    TRACEF("Reply: %.4s, %X, %X\n", reply, *(int*) reply, AOK.code);
-    if (*(int*) reply != AOK.code) {
-        return AHRequestFailed;
+    while (totalBytesRead != length) {
+        ssize_t readResult = read(context->transport.socketFD, &data[totalBytesRead], length - totalBytesRead);
+
+        if (readResult > 0) {
+            totalBytesRead += readResult;
+            *oBytesRead = totalBytesRead;
+        }
+        else if (readResult == 0) {
+            closeAppConnection();
+            return AHErrorCommsFailure;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            int waitResult = waitForApp(POLLIN, deadlineMS);
+            if (waitResult) {
+                return waitResult;
+            }
+        }
+        else if (errno != EINTR) {
+            closeAppConnection();
+            return AHErrorCommsFailure;
+        }
     }
 
-    // All OK!
     return 0;
 }
 
+static int writeToApp(const AppBuffer* buffers, int bufferCount, AppHandle passHandle, long long deadlineMS) {
+    struct iovec vectors[MaxAppBuffers];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = vectors;
 
-/// Platform specific implementations
-
-#ifdef _WIN32
-#include <windows.h>
-
-static HANDLE appProcessHandle = 0;
-static HANDLE appInputWriteHandle = 0;
-static HANDLE appInputReadHandle = 0;
-static HANDLE appOutputWriteHandle = 0;
-static HANDLE appOutputReadHandle = 0;
-
-/*
- * Creates a pipe with overlapped read, since this is not possible
- * with the regular CreatePipe call.
- * This makes it possible to add timeouts to pipe read, avoiding
- * inter process deadlocks.
- */
-static int createPipeWithOverlappedRead(
-    HANDLE* oReadHandle,
-    HANDLE* oWriteHandle,
-    SECURITY_ATTRIBUTES* securityAttributes
-)
-{
-    static int pipeSerial = 0;
-    char pipeName[MAX_PATH];
-
-    sprintf(pipeName, "\\\\.\\Pipe\\Allihoopa.%08x.%08x",
-        GetCurrentProcessId(),
-        pipeSerial++);
-    
-    const int numPipes = 1;
-    const int bufferSize = 8192;
-    const int defaultTimeoutMS = 100;
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
 
-    *oReadHandle = CreateNamedPipe(
-        pipeName,
-        PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED,
-        PIPE_TYPE_BYTE | PIPE_WAIT,
-        numPipes,
-        bufferSize,
-        bufferSize,
-        defaultTimeoutMS,
-        securityAttributes
-    );
+    if (passHandle != NoAppHandle) {
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr* controlHeader = CMSG_FIRSTHDR(&message);
+        controlHeader->cmsg_level = SOL_SOCKET;
+        controlHeader->cmsg_type = SCM_RIGHTS;
+        controlHeader->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(controlHeader), &passHandle, sizeof(int));
+    }
 
-    if(!*oReadHandle){
-        return 0;
+    for (int i = 0; i < bufferCount; i++) {
+        if (message.msg_iovlen == MaxAppBuffers) {
+            return AHErrorInvalidRequest;
+        }
+        if (buffers[i].length != 0) {
+            vectors[message.msg_iovlen].iov_base = (void*) buffers[i].data;
+            vectors[message.msg_iovlen].iov_len = buffers[i].length;
+            message.msg_iovlen++;
+        }
     }
 
-    *oWriteHandle = CreateFile(
-        pipeName,
-        GENERIC_WRITE,
-        0, // not shared
-        securityAttributes,
-        OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL // no template file
-    );
+    size_t totalBytesWritten = 0;
 
-    if(*oWriteHandle == INVALID_HANDLE_VALUE) {
-        CloseHandle(*oReadHandle);
-        *oReadHandle = 0;
-        *oWriteHandle = 0;
-        return 0;
-    }
+    while (message.msg_iovlen > 0) {
+        ssize_t writeResult = sendmsg(context->transport.socketFD, &message, SEND_FLAGS);
 
-    return 1;
-}
+        if (writeResult >= 0) {
+            totalBytesWritten += writeResult;
 
-static int initAppConnection() {
-    TRACE("initAppConnection");
-    if (appProcessHandle != 0) {
-        DWORD exitCode = 0;
-        if (GetExitCodeProcess(appProcessHandle, &exitCode) && exitCode == STILL_ACTIVE) {
-            TRACE("initAppConnection: reusing live app");
-            return 0;
+            // The descriptor goes along with the first bytes
+            message.msg_control = 0;
+            message.msg_controllen = 0;
+
+            // Skip past everything written so far
+            size_t bytesWritten = writeResult;
+            while (message.msg_iovlen > 0 && bytesWritten >= message.msg_iov->iov_len) {
+                bytesWritten -= message.msg_iov->iov_len;
+                message.msg_iov++;
+                message.msg_iovlen--;
+            }
+            if (message.msg_iovlen > 0) {
+                message.msg_iov->iov_base = (char*) message.msg_iov->iov_base + bytesWritten;
+                message.msg_iov->iov_len -= bytesWritten;
+            }
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            int waitResult = waitForApp(POLLOUT, deadlineMS);
+            if (waitResult == AHErrorTimeout && totalBytesWritten != 0) {
+                // The app would take the rest of the frame for the start of the next
+                closeAppConnection();
+                return AHErrorCommsFailure;
+            }
+            if (waitResult) {
+                return waitResult;
+            }
+        }
+        else if (errno != EINTR) {
+            closeAppConnection();
+            return AHErrorCommsFailure;
         }
-        
-        TerminateProcess(appProcessHandle, 0);
-        CloseHandle(appProcessHandle);
-        appProcessHandle = 0;
     }
 
-    SECURITY_ATTRIBUTES securityAttributes;
-    securityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
-    securityAttributes.bInheritHandle = TRUE;
-    securityAttributes.lpSecurityDescriptor = NULL;
+    return 0;
+}
 
-    if (appInputReadHandle != 0) {
-        CloseHandle(appInputReadHandle);
-        appInputReadHandle = 0;
-    }
-    if (appInputWriteHandle != 0) {
-        CloseHandle(appInputWriteHandle);
-        appInputWriteHandle = 0;
-    }
-    if (appOutputReadHandle != 0) {
-        CloseHandle(appOutputReadHandle);
-        appOutputReadHandle = 0;
+static int createSharedMemory(SharedMemory* memory, size_t size) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    int fd = memfd_create("allihoopa", MFD_CLOEXEC);
+#else
+    // Anonymous once unlinked, the descriptor is all the app needs
+    static unsigned int serial = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "/allihoopa.%ld.%u", (long) getpid(), atomicIncrementInt(&serial));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd != -1) {
+        shm_unlink(name);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
     }
-    if (appOutputWriteHandle != 0) {
-        CloseHandle(appOutputWriteHandle);
-        appOutputWriteHandle = 0;
+#endif
+    if (fd == -1) {
+        return AHErrorOutOfMemory;
     }
 
-    if(!CreatePipe(&appInputReadHandle, &appInputWriteHandle, &securityAttributes, 0)){
-        TRACE("Failed to create app input pipe");
-        return AHErrorLaunchFailure;
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        return AHErrorOutOfMemory;
     }
 
-    if(!SetHandleInformation(appInputWriteHandle, HANDLE_FLAG_INHERIT, 0)) {
-        return AHErrorLaunchFailure;
+    void* data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return AHErrorOutOfMemory;
     }
 
-    if(!createPipeWithOverlappedRead(&appOutputReadHandle, &appOutputWriteHandle, &securityAttributes)){
-        TRACE("Failed to create app output pipe");
-        return AHErrorLaunchFailure;
+    memory->data = data;
+    memory->size = size;
+    memory->handle = fd;
+    return 0;
+}
+
+static void destroySharedMemory(SharedMemory* memory) {
+    munmap(memory->data, memory->size);
+    close(memory->handle);
+    memory->data = 0;
+    memory->size = 0;
+    memory->handle = NoAppHandle;
+}
+
+static int shareHandleWithApp(AppHandle handle, AppHandle* oPassHandle, long long* oAppHandle) {
+    *oPassHandle = handle;
+    *oAppHandle = -1;
+    return 0;
+}
+
+static int duplicateFile(AHFileHandle file, AppHandle* oHandle, size_t* oLength) {
+    struct stat info;
+    if (fstat(file, &info) == -1 || !S_ISREG(info.st_mode)) {
+        return AHErrorInvalidRequest;
     }
 
-    if(!SetHandleInformation(appOutputReadHandle, HANDLE_FLAG_INHERIT, 0)) {
-        return AHErrorLaunchFailure;
+    int fd = fcntl(file, F_DUPFD_CLOEXEC, 0);
+    if (fd == -1) {
+        return AHErrorInvalidRequest;
     }
 
-    PROCESS_INFORMATION processInfo;
-    ZeroMemory(&processInfo, sizeof(PROCESS_INFORMATION));
+    *oHandle = fd;
+    *oLength = (size_t) info.st_size;
+    return 0;
+}
 
-    STARTUPINFO startupInfo;
-    ZeroMemory(&startupInfo, sizeof(STARTUPINFO));
-    startupInfo.cb = sizeof(STARTUPINFO);
-    startupInfo.hStdOutput = appOutputWriteHandle;
-    // ??? Cannot get redirection to work, using direct console writes from App instead
-    //startupInfo.hStdError = stdErrorHandle;
-    startupInfo.hStdInput = appInputReadHandle;
-    startupInfo.dwFlags |= STARTF_USESTDHANDLES;
-    startupInfo.dwFlags |= STARTF_USESHOWWINDOW;
-    startupInfo.wShowWindow = SW_SHOWDEFAULT;
+static void closeAppHandle(AppHandle handle) {
+    close(handle);
+}
 
-    char* cmdLine = "allihoopa.exe -pipe";
+static int mapFile(const char* path, MappedFile* oFile) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return AHErrorInvalidRequest;
+    }
 
-    BOOL result = CreateProcess(
-        NULL,       // app name
-        cmdLine,    // commandline
-        NULL,       // security attributes
-        NULL,       // thread security attributes
-        TRUE,       // inherit handles
-        0,          // creation flags
-        NULL,       // use parent environment
-        NULL,       // use parent's cwd
-        &startupInfo,
-        &processInfo
-        );
-    
-    if(!result) {
-        return AHErrorLaunchFailure;
+    struct stat info;
+    if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+        close(fd);
+        return AHErrorInvalidRequest;
     }
 
-    appProcessHandle = processInfo.hProcess;
-    CloseHandle(processInfo.hThread);
+    // The mapping keeps the file open
+    void* data = mmap(0, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return AHErrorInvalidRequest;
+    }
 
+    oFile->data = data;
+    oFile->size = (size_t) info.st_size;
     return 0;
 }
 
-static int writeToApp(const char* data, size_t length) {
-    TRACE("writeToApp");
-    {
-        int result = initAppConnection();
-        if (result != 0) {
-            return result;
-        }
+static int mapAppHandle(AppHandle file, size_t length, MappedFile* oFile) {
+    if (length == 0) {
+        return AHErrorInvalidRequest;
     }
-    {
-        DWORD bytesWritten = 0;
-        BOOL result = WriteFile(appInputWriteHandle, data, length, &bytesWritten, 0);
-        if ((bytesWritten != length) || !result){
-            return AHErrorCommsFailure;
-        } else {
-            return 0;
-        }
+    void* data = mmap(0, length, PROT_READ, MAP_PRIVATE, file, 0);
+    if (data == MAP_FAILED) {
+        return AHErrorInvalidRequest;
     }
-}
 
-static int readFromApp(char* data, size_t length) {
-    TRACE("readFromApp");
-    {
-        int result = initAppConnection();
-        if (result != 0) {
-            return result;
-        }
-    }
-    {
-        int ahResult = 0;
-        OVERLAPPED overlapInfo;
-        ZeroMemory(&overlapInfo, sizeof(OVERLAPPED));
-        // We will wait for this event to get signalled on completion
-        overlapInfo.hEvent = CreateEvent(
-            NULL,
-            TRUE, // manual reset
-            FALSE, // initial state, not triggered
-            NULL);
+    oFile->data = data;
+    oFile->size = length;
+    return 0;
+}
 
-        if(overlapInfo.hEvent == NULL) {
-            return AHErrorUnknownError;
-        }
+static void unmapFile(MappedFile* file) {
+    munmap((void*) file->data, file->size);
+    file->data = 0;
+    file->size = 0;
+}
 
-        BOOL readResult = ReadFile(appOutputReadHandle, data, length, 0, &overlapInfo);
-        if (!readResult) {
-            if (GetLastError() == ERROR_IO_PENDING) {
-                DWORD bytesRead = 0;
-                int timeoutMS = 1000 * 5;
+static int writeFile(const char* path, const AppBuffer* buffers, int bufferCount) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return AHErrorInvalidRequest;
+    }
 
-                int waitResult = WaitForSingleObject(overlapInfo.hEvent, timeoutMS);
-                if (waitResult != WAIT_OBJECT_0) {
-                    ahResult = AHErrorCommsFailure;
-                }
-                else {
-                    BOOL overlappedResult = GetOverlappedResult(
-                        appOutputReadHandle,
-                        &overlapInfo,
-                        &bytesRead,
-                        FALSE // don't block since we waited above
-                    );
-                    if (!overlappedResult) {
-                        // Check GetLastError() == WAIT_TIMEOUT here ?
-                        ahResult = AHErrorCommsFailure;
-                    }
-                }
-            } else {
-                ahResult = AHErrorCommsFailure;
+    for (int i = 0; i < bufferCount; i++) {
+        size_t written = 0;
+        while (written < buffers[i].length) {
+            ssize_t result = write(fd, buffers[i].data + written, buffers[i].length - written);
+            if (result > 0) {
+                written += (size_t) result;
+            }
+            else if (errno != EINTR) {
+                close(fd);
+                unlink(path);
+                return AHErrorInvalidRequest;
             }
         }
+    }
 
-        CloseHandle(overlapInfo.hEvent);
-        return ahResult;
+    return close(fd) == 0 ? 0 : AHErrorInvalidRequest;
+}
+
+static int appendFile(const char* path, const char* data, size_t length) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return AHErrorInvalidRequest;
     }
+    ssize_t written;
+    do {
+        written = write(fd, data, length);
+    } while (written == -1 && errno == EINTR);
+    close(fd);
+    return written == (ssize_t) length ? 0 : AHErrorInvalidRequest;
 }
 
-#endif // _WIN32
+static int renameFile(const char* fromPath, const char* toPath) {
+    return rename(fromPath, toPath) == 0 ? 0 : AHErrorInvalidRequest;
+}
+
+static void getTempDirectory(char* buffer, size_t bufferSize) {
+    const char* tmpDir = getenv("TMPDIR");
+    if (tmpDir == 0 || tmpDir[0] == 0 || strlen(tmpDir) >= bufferSize) {
+        tmpDir = "/tmp";
+    }
+    memcpy(buffer, tmpDir, strlen(tmpDir) + 1);
+}
 
+static int statFile(const char* path, long long* oSize, long long* oModifiedNS) {
+    struct stat info;
+    if (stat(path, &info) == -1 || !S_ISREG(info.st_mode)) {
+        return AHErrorInvalidRequest;
+    }
 #ifdef __APPLE__
-#include "TargetConditionals.h"
-#ifdef TARGET_OS_MAC
+    struct timespec modified = info.st_mtimespec;
+#else
+    struct timespec modified = info.st_mtim;
+#endif
+    *oSize = (long long) info.st_size;
+    *oModifiedNS = (long long) modified.tv_sec * 1000000000 + modified.tv_nsec;
+    return 0;
+}
 
-#include <stdio.h>
-#include <fcntl.h>
-#include <poll.h>
-#include <unistd.h>
-#include <errno.h>
+static long long wallClockNS() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-static FILE* appPipe = 0;
-static int appPipeFD = 0;
+static void* threadTrampoline(void* argument) {
+    Thread* thread = (Thread*) argument;
+    thread->entry(thread->argument);
+    return 0;
+}
 
-static int initAppConnection() {
-    if (appPipe != 0) {
-        return 0;
-    }
+static int startThread(Thread* thread, ThreadEntry entry, void* argument) {
+    thread->entry = entry;
+    thread->argument = argument;
+    return pthread_create(&thread->handle, 0, threadTrampoline, thread) != 0;
+}
 
-    appPipe = popen("./allihoopa -pipe", "r+");
-    if (appPipe == 0){
-        return AHErrorLaunchFailure;
-    }
-    appPipeFD = fileno(appPipe);
-    if(fcntl(appPipeFD, F_SETFL, O_NONBLOCK) == -1) {
-        // The app will be launched and left running
-        return AHErrorLaunchFailure;
-    }
+static void joinThread(Thread* thread) {
+    pthread_join(thread->handle, 0);
+}
 
-    return 0;
+static void initMutex(Mutex* mutex) {
+    pthread_mutex_init(mutex, 0);
 }
 
-static int waitForData() {
-    struct pollfd pollFor = {
-        appPipeFD,
-        POLLIN,
-        POLLIN
-    };
+static void destroyMutex(Mutex* mutex) {
+    pthread_mutex_destroy(mutex);
+}
+
+static void lockMutex(Mutex* mutex) {
+    pthread_mutex_lock(mutex);
+}
 
-    int timeoutMS = 1000 * 5;
-    int pollResult = poll(&pollFor, 1, timeoutMS);
+static void unlockMutex(Mutex* mutex) {
+    pthread_mutex_unlock(mutex);
+}
 
-    if (pollResult == 1) {
-        // one descriptor ready!
-        return 0;
-    }
-    else if(pollResult == 0){
-        TRACE("poll timeout!");
-        return AHErrorCommsFailure;
+static int createSignal(Signal* signal) {
+#ifdef __linux__
+    signal->readFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    signal->writeFD = signal->readFD;
+    return signal->readFD == -1;
+#else
+    int fds[2];
+    if (pipe(fds) == -1) {
+        return 1;
     }
-    else {
-        TRACE("poll failed!");
-        return AHErrorCommsFailure;
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
     }
+    signal->readFD = fds[0];
+    signal->writeFD = fds[1];
+    return 0;
+#endif
 }
 
-static int readFromApp(char* data, size_t length) {
-    int result = initAppConnection();
-    if (result) {
-        return result;
+static void destroySignal(Signal* signal) {
+    if (signal->writeFD != signal->readFD) {
+        close(signal->writeFD);
     }
-    
-    size_t totalBytesRead = 0;
-
-    do {
-        size_t bytesWanted = length - totalBytesRead;
-        size_t readResult = read(appPipeFD, &data[totalBytesRead], bytesWanted);
-
-        if (readResult != bytesWanted) {
-            if (readResult == 0) {
-                // EOF!?
-                pclose(appPipe);
-                appPipe = 0;
-                appPipeFD = 0;
-                return AHErrorCommsFailure;
-            }
-            else if (readResult == -1) {
-                if (errno == EAGAIN) {
-                    int waitResult = waitForData();
-                    if (waitResult) {
-                        return waitResult;
-                    }
-                }
-                else if (errno == EINVAL) {
-                    return AHErrorCommsFailure;
-                }
-                else if (errno == EFAULT) {
-                    return AHErrorUnknownError;
-                }
-                else {
-                    return AHErrorCommsFailure;
-                }
-            }
-            else {
-                totalBytesRead += readResult;
-            }
-        } else {
-            totalBytesRead += readResult;
-        }
-    }while(totalBytesRead != length);
+    close(signal->readFD);
+    signal->readFD = -1;
+    signal->writeFD = -1;
+}
 
-    return 0;
+static void raiseSignal(Signal* signal) {
+    // Eventfds take 8 byte counters, a full pipe is already raised
+    unsigned long long one = 1;
+    ssize_t written = write(signal->writeFD, &one, sizeof(one));
+    (void) written;
 }
 
-static int writeToApp(const char* data, size_t length) {
-    int result = initAppConnection();
-    if (result) {
-        return result;
+static void clearSignal(Signal* signal) {
+    char drain[64];
+    while (read(signal->readFD, drain, sizeof(drain)) > 0) {
     }
+}
 
-    size_t bytesWritten = write(appPipeFD, data, length);
-    if (bytesWritten != length) {
-        return AHErrorCommsFailure;
+static int waitForAppData(Signal* signal, int timeoutMS) {
+    // Negative descriptors are ignored by poll
+    struct pollfd pollFor[2] = {
+        {context->transport.socketFD, POLLIN, 0},
+        {signal != 0 ? signal->readFD : -1, POLLIN, 0}
+    };
+
+    if (poll(pollFor, 2, timeoutMS) <= 0) {
+        return 0;
+    }
+    if (pollFor[0].revents != 0) {
+        // Hangups and errors are picked up by the following read
+        return 1;
     }
+    clearSignal(signal);
     return 0;
 }
 
-#endif // TARGET_OS_MAC
-#endif // DARWIN
+#endif // __APPLE__ || __linux__
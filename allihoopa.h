@@ -10,6 +10,9 @@ Copyright 2018 Allihoopa AB
 
 #ifndef ALLIHOOPA_H
 #define ALLIHOOPA_H
+
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -23,11 +26,89 @@ extern "C" {
     {
         "appID": "<appid>",
         "appKey": "<appkey>",
-        "tmpDir": "[optional tempDir where file: - urls are referenced, defaults to system tempdir]"
+        "tmpDir": "[optional tempDir where file: - urls are referenced, defaults to system tempdir]",
+        "timeoutMs": [optional time in milliseconds a call may wait for the app, defaults to 5000]
     }
+
+    Once set up, the app is relaunched if it dies, and set up again with
+    the same data. Drops of up to AHMaxRequestBody bytes, without stems,
+    are sent again until their completions have been polled, except when
+    the app has kept dying with them. Relaunches back off exponentially,
+    and calls fail with AHErrorCommsFailure in between. AHclose stops this.
 */
 int AHsetup(const char* setupData, short unsigned int setupDataLength);
 
+/*
+    Starts the app and sets it up in the background, instead of AHsetup,
+    so that launching the app doesn't block the caller.
+
+    Other API calls wait for the setup to finish. If it failed, the first
+    call to wait for it fails with its error code, except for AHsetup and
+    AHclose. With the IO thread running, this is the same as AHsetup.
+
+    returns zero if the setup was started, non-zero error code on failure
+*/
+int AHprewarm(const char* setupData, short unsigned int setupDataLength);
+
+/*
+    Gets the time from when the app was last launched until it had
+    replied to the setup request, for tracking startup times.
+
+    returns zero on success, AHErrorInvalidRequest if the app has not
+    been set up yet
+*/
+int AHgetLaunchTime(unsigned int* oLaunchToReadyMS);
+
+/*
+    Writes a JSON snapshot of the SDK's counters into buffer, for
+    telemetry. Can be called from any thread. The snapshot looks like:
+
+    {"commands": {"init": {"calls": 1, "failures": 0, "latencyUs": [...],
+                           "p50Us": 256, "p99Us": 512, "p999Us": 512},
+        "drop": {...}, "poll": {...}, "quit": {...}, "other": {...}},
+     "bytesOut": 1234, "bytesIn": 567, "timeouts": 0, "launches": 1,
+     "restarts": 0, "launchToReadyMs": 250}
+
+    "latencyUs" is a histogram of the time from writing a request until
+    its reply was read. Entry i counts replies that took less than 2^i
+    microseconds, and at least 2^(i-1), the last entry counts all slower
+    replies. "p50Us", "p99Us" and "p999Us" are the latencies that 50%,
+    99% and 99.9% of replies came in under, rounded up to a power of two,
+    or null before the first reply. "restarts" counts relaunches of the
+    app after it died, "launchToReadyMs" is null until the app has been
+    set up.
+
+    The buffer is not null terminated. oLength is set to the length of
+    the snapshot, also when the buffer is too small.
+
+    returns zero on success, AHErrorInvalidRequest if the buffer is too small
+*/
+int AHgetStats(char* buffer, size_t bufferSize, size_t* oLength);
+
+/*
+    Writes the most recent trace events as text into buffer, for
+    diagnosing communication problems after a failure. The SDK always
+    records the last 1024 events in memory, at little cost. Can be called
+    from any thread, and allocates nothing, so it works also when the
+    allocator is failing.
+
+    Each event is one line, oldest first:
+
+        <microseconds> <command> <request ID> <bytes> <result code>
+
+    Microseconds are from a monotonic clock. Commands are those of the
+    frames written to and read from the app ("drop", "okay", ...), "recv"
+    for a failed read, "lnch" for an app launch, "rstr" for a relaunch
+    after the app died, and "full" for a completion dropped because the
+    IO thread's completion ring was full.
+
+    If the buffer is too small, only the newest events that fit are
+    written. The buffer is not null terminated.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHdumpTrace(char* buffer, size_t bufferSize, size_t* oLength);
+
 /*
     Initiates a drop request
 
@@ -38,6 +119,336 @@ int AHsetup(const char* setupData, short unsigned int setupDataLength);
 */
 int AHdrop(const char* dropData, short unsigned int dropDataLength, short int requestID);
 
+enum AHCallFlags {
+    // Return once the request is written, see AHdropWithOptions
+    AHCallFireAndForget = 1 << 0,
+    // Generate a preview from the mix stem, only for AHdropFields
+    AHCallGeneratePreview = 1 << 1,
+    // Fill in and check the length and loop from the mix stem, only for AHdropFields
+    AHCallInspectStem = 1 << 2,
+    // Estimate missing tempo and tonality from the mix stem, only for AHdropFields
+    AHCallAnalyzeStem = 1 << 3,
+    // Send content hashes of "file:" URLs, only for AHdropFields
+    AHCallHashContent = 1 << 4,
+};
+
+// Order in which drops queued for the IO thread are sent, see AHstartIOThread
+enum AHCallPriority {
+    AHPriorityLow = -1,
+    AHPriorityNormal,
+    AHPriorityHigh,
+};
+
+typedef struct {
+    // How long the call may wait for the app, zero for "timeoutMs" from AHsetup
+    unsigned int timeoutMS;
+    // AHCallFlags
+    unsigned int flags;
+    // AHCallPriority, zero for AHPriorityNormal
+    int priority;
+} AHCallOptions;
+
+/*
+    Initiates a drop request, like AHdrop, with options for this call.
+    All reading and writing for the call shares one deadline, and the call
+    fails with AHErrorTimeout once it has passed. A drop that the app
+    then refuses is reported as a completion with an error code.
+
+    With AHCallFireAndForget, the call returns as soon as the request is
+    written, as when pipelining, see AHsetPipelineDepth. A drop that the
+    app refuses is then reported as a completion with an error code.
+
+    options - may be NULL for the defaults
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHdropWithOptions(const char* dropData, short unsigned int dropDataLength, short int requestID,
+    const AHCallOptions* options);
+
+/*
+    Initiates a drop request with data larger than AHMaxRequestBody,
+    up to AHMaxLargeRequestBody bytes.
+
+    Large request data is passed to the app through shared memory, which is
+    set up by AHsetup with apps that support it, or sent directly to apps
+    that take large frames, otherwise this fails with AHErrorNotSupported.
+    Smaller request data is sent as with AHdrop.
+
+    Large drops always wait for the app to accept the request,
+    also when pipelining.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHdropLarge(const char* dropData, size_t dropDataLength, short int requestID);
+
+#ifdef _WIN32
+typedef void* AHFileHandle;
+#else
+typedef int AHFileHandle;
+#endif
+
+/*
+    Audio data for a stem handed directly to the app, see AHdropStems.
+
+    name - letters, digits, '-' and '_', up to AHMaxStemNameLength characters
+    data, dataLength - audio file data in memory, or
+    file - an open audio file when data is NULL
+*/
+typedef struct {
+    const char* name;
+    const void* data;
+    size_t dataLength;
+    AHFileHandle file;
+} AHStem;
+
+/*
+    Initiates a drop request with up to AHMaxStems stems handed to the app
+    directly, instead of writing the audio to a file first. The drop data
+    refers to each stem by name, with a "stem:" URL:
+
+    "stems": {
+        "mixStemURL": "stem:mix"
+    }
+
+    In memory data is copied once into memory shared with the app, and
+    files are shared with the app as they are. Buffers and files may be
+    reused or closed as soon as the call returns.
+
+    Apps that can't take the handles are sent the audio instead, in fixed
+    size chunks, each checked by the app against a checksum. Progress is
+    reported with AHpollProgress. The whole transfer shares one deadline,
+    "timeoutMs" from AHsetup, which should allow for the size of the stems.
+    When the transfer fails part way, or runs out of time, call again with
+    the same request ID and unchanged stems, and only the chunks the app is
+    missing are sent.
+
+    Fails with AHErrorNotSupported when the app does not support stems
+    handed over either way, in which case the audio has to be written to
+    a file and dropped with a "file:" URL.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHdropStems(const char* dropData, short unsigned int dropDataLength, short int requestID,
+    const AHStem* stems, int stemCount);
+
+enum AHTonalityMode {
+    AHTonalityNotSet,
+    AHTonalityUnknown,
+    AHTonalityAtonal,
+    AHTonalityTonal,
+};
+
+#define AHMaxBasedOnPieces 16
+#define AHMaxAttachments 8
+
+typedef struct {
+    const char* mimeType;
+    const char* dataURL;
+} AHAttachment;
+
+/*
+    Drop request fields, for building the drop request data without a JSON
+    library, see AHbuildDropRequest. Start from a zeroed struct, strings
+    that are NULL and numbers that are zero are left out.
+
+    mixStemURL, title and lengthMicroseconds are required.
+    The loop is included when loopEndMicroseconds is set, and the time
+    signature when both parts are set. With AHTonalityTonal, tonalityRoot
+    is a semitone from 0 for C to 11 for B, and scale holds 1 or 0 for
+    whether each of the 12 semitones above root is in the scale.
+*/
+typedef struct {
+    const char* mixStemURL;
+    const char* title;
+    const char* previewURL;
+    const char* coverImageURL;
+    const char* basedOnPieces[AHMaxBasedOnPieces];
+    int basedOnPieceCount;
+    long long lengthMicroseconds;
+    double tempo;
+    long long loopStartMicroseconds;
+    long long loopEndMicroseconds;
+    int timeSignatureUpper;
+    int timeSignatureLower;
+    enum AHTonalityMode tonalityMode;
+    unsigned char scale[12];
+    int tonalityRoot;
+    AHAttachment attachments[AHMaxAttachments];
+    int attachmentCount;
+} AHDropRequest;
+
+/*
+    Serializes drop request fields into buffer as drop request data for
+    AHdrop, without allocating. Strings are escaped as needed.
+
+    The length is checked before anything is written, failing with
+    AHErrorInvalidRequest if the data would not fit in the buffer or
+    exceed AHMaxRequestBody bytes. The data is not null terminated.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHbuildDropRequest(const AHDropRequest* request, char* buffer, size_t bufferSize,
+    short unsigned int* oLength);
+
+/*
+    Initiates a drop request from drop request fields, like
+    AHdropWithOptions. Apps that support it are sent the request in a
+    compact binary encoding, which they don't need to parse as JSON text,
+    others are sent it as JSON.
+
+    With AHCallGeneratePreview, a preview is generated from a "file:"
+    mix stem with AHgeneratePreview and attached to the drop, unless the
+    request already has a previewURL. The drop fails if the preview can't
+    be generated. The host deletes the preview file, as with
+    AHgeneratePreview.
+
+    With AHCallInspectStem, a "file:" WAV mix stem is looked at before
+    sending the drop, see AHinspectStem. A lengthMicroseconds of zero is
+    then filled in from the stem, as is the loop from its sampler chunk
+    when the request has none. A length or loop that doesn't fit the
+    audio, give or take a sample, fails with AHErrorInvalidRequest
+    without reaching the app. Only the headers of the file are read.
+
+    With AHCallAnalyzeStem, a tempo of zero and a tonality mode of
+    AHTonalityNotSet are estimated from a "file:" WAV mix stem within
+    AHDefaultAnalysisBudgetMS, see AHanalyzeStem. Estimates the analysis
+    isn't confident about are left out.
+
+    With AHCallHashContent, the content of each "file:" URL in the
+    request is hashed, see AHhashContent, and sent along so that the app
+    can skip processing and uploading content it already has:
+
+    "contentHashes": {
+        "file:///mix.wav": "xxh64:0123456789abcdef"
+    }
+
+    options - may be NULL for the defaults
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHdropFields(const AHDropRequest* request, short int requestID, const AHCallOptions* options);
+
+/*
+    Generates a short preview clip from a WAV stem, without the app.
+    The first AHPreviewSeconds of the stem are mixed down to mono,
+    resampled to AHPreviewSampleRate and written as a 16 bit WAV file
+    next to the stem, with "-preview.wav" in place of its extension.
+    Longer stems are processed on several threads.
+
+    The preview file belongs to the host, like the stem, and an existing
+    one is overwritten. The SDK never deletes it: the app reads it while
+    handling the drop, so delete it along with the stem once the drop
+    has completed, see AHpollCompletions.
+
+    Like the app, "file:" URLs are resolved in "tmpDir" from the setup
+    data, or the system temp directory. Takes 8, 16, 24 and 32 bit PCM
+    and 32 bit float stems, failing with AHErrorInvalidAudio otherwise.
+    May be called from any thread, also before AHsetup.
+
+    stemURL - "file:" URL of the stem, such as "file:///mix.wav"
+    previewURLBuffer - receives the null terminated "file:" URL of the preview
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHgeneratePreview(const char* stemURL, char* previewURLBuffer, size_t bufferSize);
+
+/*
+    What AHinspectStem found in a WAV stem. Lengths are rounded to whole
+    microseconds, the loop is the first one in the sampler chunk, both
+    zero without one. Levels are linear, over all channels, where 1.0 is
+    full scale.
+*/
+typedef struct {
+    unsigned int sampleRate;
+    int channels;
+    int bitsPerSample;
+    int isFloat;
+    long long frameCount;
+    long long lengthMicroseconds;
+    long long loopStartMicroseconds;
+    long long loopEndMicroseconds;
+    double peak;
+    double rms;
+} AHStemInfo;
+
+/*
+    Reads the format, length and loop of a WAV stem, resolved as with
+    AHgeneratePreview, and measures its peak and RMS level. The file is
+    memory mapped rather than read. May be called from any thread.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHinspectStem(const char* stemURL, AHStemInfo* oInfo);
+
+/*
+    Tempo and tonality estimated by AHanalyzeStem. The tempo is in beats
+    per minute, zero when no steady beat was found. The tonality mode is
+    AHTonalityTonal when a key was found, AHTonalityUnknown otherwise,
+    with the closest key in scale and tonalityRoot either way, where a
+    root of zero is C. Confidences go from 0 to 1.
+*/
+typedef struct {
+    double tempo;
+    double tempoConfidence;
+    enum AHTonalityMode tonalityMode;
+    unsigned char scale[12];
+    int tonalityRoot;
+    double tonalityConfidence;
+    // How much of the start of the stem was analyzed within the budget
+    long long analyzedMicroseconds;
+    // How long the analysis took
+    long long elapsedMicroseconds;
+} AHStemAnalysis;
+
+/*
+    Estimates the tempo, from how regularly notes start, and the key,
+    from how much of each pitch class is heard, of a WAV stem resolved
+    as with AHgeneratePreview. At most AHMaxAnalysisSeconds from the
+    start of the stem are analyzed, spread across several threads, and
+    the analysis stops early once budgetMS has passed. May be called
+    from any thread.
+
+    budgetMS - zero for AHDefaultAnalysisBudgetMS
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHanalyzeStem(const char* stemURL, unsigned int budgetMS, AHStemAnalysis* oAnalysis);
+
+/*
+    Writes a null terminated hash of the content of a "file:" URL,
+    resolved as with AHgeneratePreview, into hashBuffer. The hash is
+    "xxh64:" followed by 16 hex digits, AHContentHashLength characters
+    including the terminator.
+
+    Hashes are kept in an index in tmpDir, so that files with the same
+    size and modification time as when they were last hashed, also in
+    an earlier session, aren't read again. May be called from any thread.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHhashContent(const char* url, char* hashBuffer, size_t bufferSize);
+
+/*
+    Sets how many requests may be sent to the app before their replies
+    have been read, one by default.
+
+    With a depth above one, AHdrop returns as soon as the request has been
+    written. A drop that the app then refuses is reported as a completion
+    from AHpollCompletedRequests, with an AHErrors code:
+
+    {
+        "requestID": 1234,
+        "data": {
+            "error": 456
+        }
+    }
+
+    depth - 1 to wait for each reply, at most AHMaxPipelineDepth
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHsetPipelineDepth(unsigned short depth);
+
 /*
     Closes the Allihoopa app.
     Further requests will open a new instance of the app.
@@ -66,9 +477,263 @@ typedef void (*AHCompletionHandler)(const char* responseData, unsigned short int
 /*
     Polls for completed requests.
     Will call the specified handler for each completed request.
+
+    When the app is too slow to reply and the poll fails with
+    AHErrorTimeout, the completions in its reply are not lost, but
+    delivered by the next poll.
+
+    The handler may make other calls, and poll again. With the IO thread
+    running, the inner poll delivers the completions collected since the
+    outer one started, otherwise it returns right away, and the outer
+    poll goes on delivering.
 */
 int AHpollCompletedRequests(AHCompletionHandler handler);
 
+// A span of text in a completion, not null terminated
+typedef struct {
+    const char* data;
+    size_t length;
+} AHSpan;
+
+/*
+    A completed request, picked out of the response without copying.
+
+    requestID: The request ID given when the request was made.
+    status: Zero on success, or an AHErrors code when the request failed.
+    Any "error" in the data other than zero fails the request, with the
+    AHErrors code of a request the SDK failed to make, or otherwise with
+    AHRequestFailed, such as for an error message from the app.
+    data: The "data" object of the response, see AHgetCompletionValue.
+    response: The whole response, as given to AHCompletionHandler.
+
+    Spans are only valid during the duration of the callback.
+*/
+typedef struct {
+    short int requestID;
+    int status;
+    AHSpan data;
+    AHSpan response;
+} AHCompletion;
+
+typedef void (*AHCompletionInfoHandler)(const AHCompletion* completion, void* userData);
+
+/*
+    Polls for completed requests, like AHpollCompletedRequests, but calls
+    the handler with the request ID and status already parsed, so hosts
+    can dispatch completions without parsing JSON.
+*/
+int AHpollCompletions(AHCompletionInfoHandler handler, void* userData);
+
+/*
+    Gets a value from the "data" object of a completion, by key.
+
+    oValue: Set to the value text. For strings, this is the text between
+    the quotes, with escape sequences left as they are.
+
+    returns zero on success, AHErrorInvalidRequest if there is no such key
+*/
+int AHgetCompletionValue(const AHCompletion* completion, const char* key, AHSpan* oValue);
+
+/*
+    Progress of a request that takes a while, such as the transfer of
+    stems to apps that take them in chunks (see AHdropStems), or work the
+    app reports on while handling a drop.
+
+    requestID: The request ID given when the request was made.
+    stage: "transfer" while stems are sent, otherwise named by the app.
+    done, total: Work done so far, out of the total. For "transfer",
+    in bytes of stem audio, including bytes the app already had.
+
+    The stage is only valid during the duration of the callback.
+*/
+typedef struct {
+    short int requestID;
+    const char* stage;
+    long long done;
+    long long total;
+} AHProgress;
+
+typedef void (*AHProgressHandler)(const AHProgress* progress, void* userData);
+
+/*
+    Polls for progress made since the last poll.
+    Will call the specified handler once per request that has made
+    progress, with the latest progress only. Completions are still
+    reported by AHpollCompletedRequests and AHpollCompletions.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHpollProgress(AHProgressHandler handler, void* userData);
+
+/*
+    Memory allocation hooks, for hosts that need to control
+    where and when the SDK allocates memory.
+
+    userData: The pointer passed to AHsetAllocator.
+*/
+typedef void* (*AHAllocFunction)(size_t size, void* userData);
+typedef void (*AHFreeFunction)(void* memory, void* userData);
+
+/*
+    Sets the functions used for all SDK memory allocation.
+    Must be called before AHsetup, or after AHclose, and while no
+    contexts created with AHcreateContext exist.
+    Passing NULL for both functions restores malloc / free.
+
+    The SDK allocates its buffers on first use and keeps them until AHclose,
+    so polling and dropping does not allocate once the connection is up.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHsetAllocator(AHAllocFunction allocFunction, AHFreeFunction freeFunction, void* userData);
+
+/*
+    Starts a background thread that owns the connection to the app.
+    Call before AHsetup, from the thread that set up the SDK.
+
+    While the thread runs, AHsetup, AHdrop, AHclose and
+    AHpollCompletedRequests may be called from any thread.
+    AHsetup, AHdrop and AHclose queue the request and return without
+    waiting for the app. A queued request that fails is reported as a
+    completion with an error code, like pipelined drops (see
+    AHsetPipelineDepth). Failed AHsetup and AHclose requests are reported
+    with request ID zero.
+
+    Queued drops are sent in order of priority, and in the order they were
+    queued within each priority, but never ahead of an earlier AHsetup or
+    AHclose. Once AHsetQueueLimits drops are queued, further drops fail
+    with AHErrorWouldBlock, rather than block until there is room.
+
+    The thread polls the app for completed requests every pollIntervalMS,
+    and collects them into a ring, so that the app's own response queue
+    doesn't fill up. AHpollCompletedRequests returns the completions
+    collected so far. Should the ring fill up, the remaining completions
+    are left in the app until the host has polled.
+
+    Any allocator set with AHsetAllocator must be thread safe,
+    since requests are copied on the calling thread.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHstartIOThread(unsigned int pollIntervalMS);
+
+/*
+    Stops the IO thread once it has handled all queued requests.
+    No other API calls may be in progress while stopping.
+    Collected completions can still be fetched with AHpollCompletedRequests.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHstopIOThread();
+
+/*
+    Sets how many drops may be queued for the IO thread, and the size in
+    bytes of the ring its completions are collected into, at least
+    AHMinCompletionRingSize. Call while the IO thread is not running, and
+    with no collected completions left to poll.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHsetQueueLimits(unsigned int maxQueuedRequests, size_t completionRingSize);
+
+/*
+    Cancels a drop queued for the IO thread before it is sent, so that it
+    doesn't take up bandwidth. Stems being sent in chunks stop at the next
+    chunk, see AHdropStems. A cancelled drop is reported as a completion
+    with AHErrorCancelled. Drops the app has already been sent are not
+    affected, and cancelling them is not reported. Neither are drops
+    made after the call, even with the same request ID.
+
+    Requires the IO thread, see AHstartIOThread.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHcancel(short int requestID);
+
+#ifdef _WIN32
+typedef void* AHWaitHandle;
+#else
+typedef int AHWaitHandle;
+#endif
+
+/*
+    Gets a handle that is raised while there are completed requests to
+    fetch with AHpollCompletedRequests, for waiting on in an event loop.
+    Requires the IO thread, see AHstartIOThread.
+
+    On Windows, the handle is an event that can be waited on.
+    Elsewhere, it is a file descriptor that polls as readable.
+    The handle is owned by the SDK, and is valid until AHstopIOThread.
+
+    With apps that notify the SDK about completed requests, the app is only
+    polled when there is something to fetch.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHgetCompletionHandle(AHWaitHandle* oHandle);
+
+/*
+    A separate session with its own app instance, connection, buffers and
+    IO thread, so that one host can drive several sessions in parallel,
+    for instance one per thread. The functions above all use a default
+    context, and each has a variant taking a context as its first
+    argument, with "Ctx" appended to its name.
+
+    Calls with different contexts may be made from different threads at
+    the same time. Calls with the same context follow the same rules as
+    those without one, see AHstartIOThread.
+
+    The allocator set with AHsetAllocator is shared by all contexts. Each
+    context resolves "file:" URLs in the "tmpDir" from its own latest
+    setup, also in AHgeneratePreviewCtx, AHinspectStemCtx,
+    AHanalyzeStemCtx and AHhashContentCtx, and contexts with the same
+    "tmpDir" share its hash index.
+*/
+typedef struct AHContext AHContext;
+
+/*
+    Creates a context, to be set up with AHsetupCtx.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHcreateContext(AHContext** oContext);
+
+/*
+    Stops the IO thread of the context, if running, and closes its app,
+    like AHcloseCtx, before releasing the context. Completions not yet
+    polled are lost.
+
+    returns zero on success, non-zero error code on failure
+*/
+int AHdestroyContext(AHContext* ctx);
+
+int AHsetupCtx(AHContext* ctx, const char* setupData, short unsigned int setupDataLength);
+int AHprewarmCtx(AHContext* ctx, const char* setupData, short unsigned int setupDataLength);
+int AHgetLaunchTimeCtx(AHContext* ctx, unsigned int* oLaunchToReadyMS);
+int AHgetStatsCtx(AHContext* ctx, char* buffer, size_t bufferSize, size_t* oLength);
+int AHdropCtx(AHContext* ctx, const char* dropData, short unsigned int dropDataLength, short int requestID);
+int AHdropWithOptionsCtx(AHContext* ctx, const char* dropData, short unsigned int dropDataLength,
+    short int requestID, const AHCallOptions* options);
+int AHdropLargeCtx(AHContext* ctx, const char* dropData, size_t dropDataLength, short int requestID);
+int AHdropStemsCtx(AHContext* ctx, const char* dropData, short unsigned int dropDataLength,
+    short int requestID, const AHStem* stems, int stemCount);
+int AHdropFieldsCtx(AHContext* ctx, const AHDropRequest* request, short int requestID,
+    const AHCallOptions* options);
+int AHsetPipelineDepthCtx(AHContext* ctx, unsigned short depth);
+int AHcloseCtx(AHContext* ctx);
+int AHpollCompletedRequestsCtx(AHContext* ctx, AHCompletionHandler handler);
+int AHpollCompletionsCtx(AHContext* ctx, AHCompletionInfoHandler handler, void* userData);
+int AHpollProgressCtx(AHContext* ctx, AHProgressHandler handler, void* userData);
+int AHstartIOThreadCtx(AHContext* ctx, unsigned int pollIntervalMS);
+int AHstopIOThreadCtx(AHContext* ctx);
+int AHsetQueueLimitsCtx(AHContext* ctx, unsigned int maxQueuedRequests, size_t completionRingSize);
+int AHcancelCtx(AHContext* ctx, short int requestID);
+int AHgetCompletionHandleCtx(AHContext* ctx, AHWaitHandle* oHandle);
+int AHgeneratePreviewCtx(AHContext* ctx, const char* stemURL, char* previewURLBuffer, size_t bufferSize);
+int AHinspectStemCtx(AHContext* ctx, const char* stemURL, AHStemInfo* oInfo);
+int AHanalyzeStemCtx(AHContext* ctx, const char* stemURL, unsigned int budgetMS, AHStemAnalysis* oAnalysis);
+int AHhashContentCtx(AHContext* ctx, const char* url, char* hashBuffer, size_t bufferSize);
+
 /*
     Converts from an AHErrors error code to a printable
     string, for logging and debugging.
@@ -83,9 +748,26 @@ enum AHErrors {
     AHErrorOutOfMemory,
     AHRequestFailed,
     AHErrorUnknownError,
+    AHErrorNotSupported,
+    AHErrorTimeout,
+    AHErrorInvalidAudio,
+    AHErrorWouldBlock,
+    AHErrorCancelled,
 };
 
 #define AHMaxRequestBody 65535
+#define AHMaxPipelineDepth 32
+#define AHMaxLargeRequestBody (8 * 1024 * 1024)
+#define AHMaxStems 8
+#define AHMaxStemNameLength 32
+#define AHPreviewSeconds 30
+#define AHPreviewSampleRate 22050
+#define AHMaxAnalysisSeconds 120
+#define AHDefaultAnalysisBudgetMS 1000
+#define AHContentHashLength 23
+#define AHDefaultQueuedRequests 100
+#define AHMinCompletionRingSize (4 * (AHMaxRequestBody + 2))
+#define AHDefaultCompletionRingSize (16 * (AHMaxRequestBody + 2))
 #define AHSDKHelpURL "https://allihoopa.com/partnerapphelp"
 
 /*
@@ -0,0 +1,367 @@
+/*
+
+Benchmarks of the SDK against the stand-in App in bench/fakeapp.c, see
+"Benchmarking" in the README. Build and run with "make bench".
+
+    bench [options] [benchmark...]
+
+    -n <count>        iterations per benchmark, 10000 by default
+    -l <count>        launches for the setup benchmark, 100 by default
+    -d <microseconds> stand-in reply delay, 0 by default
+    -p <bytes>        stand-in completion padding, 0 by default
+
+Runs all benchmarks when none are named. Latencies are per SDK call, in
+microseconds.
+
+When built with BENCH_COUNT_SYSCALLS and linked with the GNU ld options
+--wrap=read,--wrap=write,--wrap=sendmsg,--wrap=poll, as the Makefile does
+on Linux, the syscalls benchmark also counts the I/O system calls the
+SDK makes.
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "allihoopa.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+static struct {
+    int iterations;
+    int launches;
+} options = {10000, 100};
+
+static const char dropData[] = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}, "
+    "\"presentation\": {\"title\": \"Benchmark\"}}";
+
+static long long nowNS() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/// Samples
+
+typedef struct {
+    long long* durationsNS;
+    int count;
+} Samples;
+
+static Samples newSamples(int capacity) {
+    Samples samples = {malloc(sizeof(long long) * (size_t) capacity), 0};
+    return samples;
+}
+
+static void addSample(Samples* samples, long long durationNS) {
+    samples->durationsNS[samples->count++] = durationNS;
+}
+
+static int compareDurations(const void* a, const void* b) {
+    long long left = *(const long long*) a;
+    long long right = *(const long long*) b;
+    return left < right ? -1 : left > right;
+}
+
+static double percentileUS(const Samples* samples, double percentile) {
+    int index = (int) (percentile / 100.0 * samples->count);
+    if (index >= samples->count) {
+        index = samples->count - 1;
+    }
+    return samples->durationsNS[index] / 1000.0;
+}
+
+static void report(const char* name, Samples* samples) {
+    if (samples->count == 0) {
+        printf("%-24s no samples\n", name);
+        return;
+    }
+    qsort(samples->durationsNS, (size_t) samples->count, sizeof(long long), compareDurations);
+    printf("%-24s %8d %10.1f %10.1f %10.1f %10.1f\n", name, samples->count,
+        percentileUS(samples, 50), percentileUS(samples, 99), percentileUS(samples, 99.9),
+        samples->durationsNS[samples->count - 1] / 1000.0);
+    free(samples->durationsNS);
+}
+
+static int failed(const char* call, int result) {
+    if (result != 0) {
+        fprintf(stderr, "%s returned %d \"%s\"\n", call, result, AHerrorCodeToMessage(result));
+    }
+    return result != 0;
+}
+
+/// System calls
+
+static long long ioSyscalls = 0;
+
+#ifdef BENCH_COUNT_SYSCALLS
+ssize_t __real_read(int fd, void* data, size_t length);
+ssize_t __real_write(int fd, const void* data, size_t length);
+ssize_t __real_sendmsg(int fd, const struct msghdr* message, int flags);
+int __real_poll(struct pollfd* fds, nfds_t count, int timeoutMS);
+
+ssize_t __wrap_read(int fd, void* data, size_t length) {
+    ioSyscalls++;
+    return __real_read(fd, data, length);
+}
+
+ssize_t __wrap_write(int fd, const void* data, size_t length) {
+    ioSyscalls++;
+    return __real_write(fd, data, length);
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr* message, int flags) {
+    ioSyscalls++;
+    return __real_sendmsg(fd, message, flags);
+}
+
+int __wrap_poll(struct pollfd* fds, nfds_t count, int timeoutMS) {
+    ioSyscalls++;
+    return __real_poll(fds, count, timeoutMS);
+}
+#endif
+
+static void reportSyscalls(const char* name, long long syscalls, int calls) {
+#ifdef BENCH_COUNT_SYSCALLS
+    printf("%-24s %8d %10.2f I/O syscalls per call\n", name, calls, (double) syscalls / calls);
+#else
+    (void) name;
+    (void) syscalls;
+    (void) calls;
+#endif
+}
+
+/// Benchmarks
+
+static int completions = 0;
+
+static void countCompletion(const char* completion, unsigned short length) {
+    (void) completion;
+    (void) length;
+    completions++;
+}
+
+static short int requestIDFor(int iteration) {
+    return (short int) (iteration % 30000 + 1);
+}
+
+// Launch and setup of the App, until it is ready for drops
+static int benchmarkSetup() {
+    Samples samples = newSamples(options.launches);
+    for (int i = 0; i < options.launches; i++) {
+        long long startNS = nowNS();
+        int result = AHsetup("{}", 2);
+        addSample(&samples, nowNS() - startNS);
+        if (failed("AHsetup", result) || failed("AHclose", AHclose())) {
+            return 1;
+        }
+    }
+    report("AHsetup", &samples);
+    return 0;
+}
+
+// Drops waiting for their reply, each polled for right after
+static int benchmarkDropAndPoll() {
+    if (failed("AHsetup", AHsetup("{}", 2))) {
+        return 1;
+    }
+
+    Samples drops = newSamples(options.iterations);
+    Samples polls = newSamples(options.iterations);
+    Samples emptyPolls = newSamples(options.iterations);
+    completions = 0;
+    for (int i = 0; i < options.iterations; i++) {
+        long long startNS = nowNS();
+        int result = AHdrop(dropData, sizeof(dropData) - 1, requestIDFor(i));
+        addSample(&drops, nowNS() - startNS);
+        if (failed("AHdrop", result)) {
+            return 1;
+        }
+
+        startNS = nowNS();
+        result = AHpollCompletedRequests(countCompletion);
+        addSample(&polls, nowNS() - startNS);
+
+        startNS = nowNS();
+        result |= AHpollCompletedRequests(countCompletion);
+        addSample(&emptyPolls, nowNS() - startNS);
+        if (failed("AHpollCompletedRequests", result)) {
+            return 1;
+        }
+    }
+
+    report("AHdrop", &drops);
+    report("AHpollCompletedRequests", &polls);
+    report("  with nothing pending", &emptyPolls);
+    if (completions != options.iterations) {
+        fprintf(stderr, "%d drops but %d completions\n", options.iterations, completions);
+        return 1;
+    }
+    return failed("AHclose", AHclose());
+}
+
+// Drops per second, polling for completions every so often
+static int benchmarkThroughput() {
+    const int pollEvery = 64;
+    if (failed("AHsetup", AHsetup("{}", 2))) {
+        return 1;
+    }
+
+    completions = 0;
+    long long startNS = nowNS();
+    for (int i = 0; i < options.iterations; i++) {
+        if (failed("AHdrop", AHdrop(dropData, sizeof(dropData) - 1, requestIDFor(i)))) {
+            return 1;
+        }
+        if ((i + 1) % pollEvery == 0 && failed("AHpollCompletedRequests", AHpollCompletedRequests(countCompletion))) {
+            return 1;
+        }
+    }
+    while (completions < options.iterations) {
+        int before = completions;
+        if (failed("AHpollCompletedRequests", AHpollCompletedRequests(countCompletion)) || completions == before) {
+            fprintf(stderr, "%d drops but %d completions\n", options.iterations, completions);
+            return 1;
+        }
+    }
+    double seconds = (nowNS() - startNS) / 1e9;
+
+    printf("%-24s %8d drops in %.3f s, %.0f drops/s\n", "throughput", options.iterations, seconds,
+        options.iterations / seconds);
+    return failed("AHclose", AHclose());
+}
+
+/*
+ * Empty polls and drops, where each frame should take a single write,
+ * and each reply a read, plus a poll and another read when the reply
+ * isn't there yet. Then polls for many completions at once, with apps
+ * that support batches.
+ */
+static int benchmarkSyscalls() {
+    const int batchSize = 64;
+    if (failed("AHsetup", AHsetup("{}", 2))) {
+        return 1;
+    }
+
+    Samples emptyPolls = newSamples(options.iterations);
+    long long startSyscalls = ioSyscalls;
+    for (int i = 0; i < options.iterations; i++) {
+        long long startNS = nowNS();
+        int result = AHpollCompletedRequests(countCompletion);
+        addSample(&emptyPolls, nowNS() - startNS);
+        if (failed("AHpollCompletedRequests", result)) {
+            return 1;
+        }
+    }
+    long long emptyPollSyscalls = ioSyscalls - startSyscalls;
+
+    startSyscalls = ioSyscalls;
+    for (int i = 0; i < options.iterations; i++) {
+        if (failed("AHdrop", AHdrop(dropData, sizeof(dropData) - 1, requestIDFor(i)))) {
+            return 1;
+        }
+    }
+    long long dropSyscalls = ioSyscalls - startSyscalls;
+    if (failed("AHclose", AHclose())) {
+        return 1;
+    }
+
+    // The same completions fetched in batches
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", "pollBatch", 1);
+    if (failed("AHsetup", AHsetup("{}", 2))) {
+        return 1;
+    }
+    Samples batchPolls = newSamples(options.iterations / batchSize + 1);
+    long long batchPollSyscalls = 0;
+    completions = 0;
+    for (int i = 0; i < options.iterations; i++) {
+        if (failed("AHdrop", AHdrop(dropData, sizeof(dropData) - 1, requestIDFor(i)))) {
+            return 1;
+        }
+        if ((i + 1) % batchSize == 0) {
+            startSyscalls = ioSyscalls;
+            long long startNS = nowNS();
+            int result = AHpollCompletedRequests(countCompletion);
+            addSample(&batchPolls, nowNS() - startNS);
+            batchPollSyscalls += ioSyscalls - startSyscalls;
+            if (failed("AHpollCompletedRequests", result)) {
+                return 1;
+            }
+        }
+    }
+    unsetenv("ALLIHOOPA_FAKE_CAPABILITIES");
+
+    report("empty poll", &emptyPolls);
+    reportSyscalls("empty poll", emptyPollSyscalls, options.iterations);
+    reportSyscalls("drop", dropSyscalls, options.iterations);
+    char name[64];
+    snprintf(name, sizeof(name), "batched poll of %d", batchSize);
+    report(name, &batchPolls);
+    reportSyscalls(name, batchPollSyscalls, options.iterations / batchSize);
+    return failed("AHclose", AHclose());
+}
+
+typedef struct {
+    const char* name;
+    int (*run)();
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    {"setup", benchmarkSetup},
+    {"drop", benchmarkDropAndPoll},
+    {"throughput", benchmarkThroughput},
+    {"syscalls", benchmarkSyscalls},
+};
+#define BenchmarkCount ((int) (sizeof(benchmarks) / sizeof(benchmarks[0])))
+
+static void usage() {
+    fprintf(stderr, "usage: bench [-n iterations] [-l launches] [-d delay us] [-p payload bytes] [benchmark...]\n");
+    fprintf(stderr, "benchmarks:");
+    for (int i = 0; i < BenchmarkCount; i++) {
+        fprintf(stderr, " %s", benchmarks[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char** argv) {
+    int first = 1;
+    for (; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+        const char* value = argv[first + 1];
+        if (strcmp(argv[first], "-n") == 0) {
+            options.iterations = atoi(value);
+        } else if (strcmp(argv[first], "-l") == 0) {
+            options.launches = atoi(value);
+        } else if (strcmp(argv[first], "-d") == 0) {
+            setenv("ALLIHOOPA_FAKE_DELAY_US", value, 1);
+        } else if (strcmp(argv[first], "-p") == 0) {
+            setenv("ALLIHOOPA_FAKE_PAYLOAD", value, 1);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (first < argc && argv[first][0] == '-') {
+        usage();
+        return 2;
+    }
+    if (options.iterations <= 0 || options.launches <= 0) {
+        usage();
+        return 2;
+    }
+
+    printf("%-24s %8s %10s %10s %10s %10s\n", "call", "count", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (int i = 0; i < BenchmarkCount; i++) {
+        int selected = first == argc;
+        for (int j = first; j < argc; j++) {
+            selected |= strcmp(argv[j], benchmarks[i].name) == 0;
+        }
+        if (selected && benchmarks[i].run() != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
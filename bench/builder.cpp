@@ -0,0 +1,165 @@
+/*
+
+Benchmark of AHbuildDropRequest against building the same drop request
+with a general purpose JSON library, jsoncpp, see "Benchmarking" in the
+README. Build and run with "make bench-builder".
+
+    builder [iterations]
+
+Checks that both produce the same document, then reports the time and
+the number of allocations per drop request built.
+
+*/
+
+#include "allihoopa.h"
+#include <json/json.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+
+static long long allocations = 0;
+
+void* operator new(std::size_t size) {
+    allocations++;
+    void* memory = std::malloc(size != 0 ? size : 1);
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+// The fields of example/fulldrop.json, with a title that needs escaping
+static AHDropRequest exampleRequest() {
+    AHDropRequest request = {};
+    request.mixStemURL = "file:///testljeud.wav";
+    request.title = "Drop \"from\" the SDK\n";
+    request.previewURL = "file:///testljeud.wav";
+    request.coverImageURL = "file:///testcover.jpg";
+    request.basedOnPieces[0] = "pieceID_A";
+    request.basedOnPieces[1] = "pieceID_B";
+    request.basedOnPieceCount = 2;
+    request.lengthMicroseconds = 5217392;
+    request.tempo = 92.5;
+    request.loopEndMicroseconds = 5217392;
+    request.timeSignatureUpper = 4;
+    request.timeSignatureLower = 4;
+    request.tonalityMode = AHTonalityTonal;
+    const unsigned char scale[12] = {1, 0, 1, 0, 1, 1, 0, 1, 0, 1, 0, 1};
+    for (int i = 0; i < 12; i++) {
+        request.scale[i] = scale[i];
+    }
+    request.tonalityRoot = 9;
+    request.attachments[0].mimeType = "application/x-weird";
+    request.attachments[0].dataURL = "url/to/attachment/data";
+    request.attachmentCount = 1;
+    return request;
+}
+
+// The same document, built with jsoncpp
+static std::string buildWithLibrary(const AHDropRequest& request, const Json::StreamWriterBuilder& writer) {
+    Json::Value drop(Json::objectValue);
+    drop["stems"]["mixStemURL"] = request.mixStemURL;
+    Json::Value& presentation = drop["presentation"];
+    presentation["title"] = request.title;
+    presentation["previewURL"] = request.previewURL;
+    presentation["coverImageURL"] = request.coverImageURL;
+    Json::Value& pieces = drop["attribution"]["basedOnPieces"];
+    for (int i = 0; i < request.basedOnPieceCount; i++) {
+        pieces.append(request.basedOnPieces[i]);
+    }
+
+    Json::Value& metadata = drop["musicalMetadata"];
+    metadata["lengthMicroseconds"] = Json::Int64(request.lengthMicroseconds);
+    metadata["tempo"]["fixed"] = request.tempo;
+    metadata["loop"]["startMicroSeconds"] = Json::Int64(request.loopStartMicroseconds);
+    metadata["loop"]["endMicroSeconds"] = Json::Int64(request.loopEndMicroseconds);
+    metadata["timeSignature"]["fixed"]["upper"] = request.timeSignatureUpper;
+    metadata["timeSignature"]["fixed"]["lower"] = request.timeSignatureLower;
+    Json::Value& tonality = metadata["tonality"];
+    tonality["mode"] = "TONAL";
+    for (int i = 0; i < 12; i++) {
+        tonality["scale"].append(request.scale[i] != 0);
+    }
+    tonality["root"] = request.tonalityRoot;
+
+    for (int i = 0; i < request.attachmentCount; i++) {
+        Json::Value attachment(Json::objectValue);
+        attachment["mimeType"] = request.attachments[i].mimeType;
+        attachment["dataURL"] = request.attachments[i].dataURL;
+        drop["attachments"].append(attachment);
+    }
+    return Json::writeString(writer, drop);
+}
+
+static Json::Value parse(const std::string& text) {
+    Json::Value value;
+    std::string errors;
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    if (!reader->parse(text.data(), text.data() + text.size(), &value, &errors)) {
+        std::fprintf(stderr, "invalid JSON: %s\n%s\n", errors.c_str(), text.c_str());
+        std::exit(1);
+    }
+    return value;
+}
+
+static double nanosecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 100000;
+    if (iterations <= 0) {
+        std::fprintf(stderr, "usage: builder [iterations]\n");
+        return 2;
+    }
+
+    AHDropRequest request = exampleRequest();
+    Json::StreamWriterBuilder writer;
+    writer["indentation"] = "";
+    static char buffer[AHMaxRequestBody];
+    unsigned short length = 0;
+    if (AHbuildDropRequest(&request, buffer, sizeof(buffer), &length) != 0) {
+        std::fprintf(stderr, "AHbuildDropRequest failed\n");
+        return 1;
+    }
+    std::string built(buffer, length);
+    if (parse(built) != parse(buildWithLibrary(request, writer))) {
+        std::fprintf(stderr, "documents differ:\n%s\n%s\n", built.c_str(),
+            buildWithLibrary(request, writer).c_str());
+        return 1;
+    }
+
+    std::printf("%-24s %10s %14s %10s\n", "builder", "bytes", "ns per build", "allocs");
+
+    long long startAllocations = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        AHbuildDropRequest(&request, buffer, sizeof(buffer), &length);
+    }
+    double ns = nanosecondsSince(start) / iterations;
+    std::printf("%-24s %10u %14.0f %10.1f\n", "AHbuildDropRequest", length, ns,
+        double(allocations - startAllocations) / iterations);
+
+    size_t libraryLength = 0;
+    startAllocations = allocations;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        libraryLength = buildWithLibrary(request, writer).size();
+    }
+    ns = nanosecondsSince(start) / iterations;
+    std::printf("%-24s %10zu %14.0f %10.1f\n", "jsoncpp", libraryLength, ns,
+        double(allocations - startAllocations) / iterations);
+    return 0;
+}
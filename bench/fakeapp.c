@@ -0,0 +1,760 @@
+/*
+
+Stand-in for the Allihoopa App, for testing and benchmarking the SDK
+without the real App. Build the SDK with ALLIHOOPA_APP_PATH pointing to
+it, see the Makefile.
+
+It speaks the frame protocol described at the top of allihoopa.c over
+its standard input and output. Drops are accepted and completed at
+once, with completions that describe what the App received:
+
+    {"requestID": <id>, "data": {"bytes": <drop body length>,
+     "sum": <byte sum of the drop body>, "stemBytes": <stem data length>,
+     "stemSum": <byte sum of the stem data>, "payload": "xxx..."}}
+
+Drops with a negative request ID are refused with a 'fail' reply. A
+"fakeError" member of a drop is echoed as an "error" member of the data
+in JSON completions, as the App does for uploads that fail, and a
+"fakeDelayUs" member delays the reply to the drop. With the "notify"
+capability, each accepted drop is followed by a 'note' frame.
+
+Configured through the environment, which the SDK passes on:
+
+    ALLIHOOPA_FAKE_CAPABILITIES  comma separated capabilities to report
+                                 in the 'init' reply, e.g. "pollBatch,notify"
+    ALLIHOOPA_FAKE_CBOR          accept CBOR bodies when offered in 'vers'
+    ALLIHOOPA_FAKE_MESSAGE       a "message" string added to the 'init' reply
+    ALLIHOOPA_FAKE_DELAY_US      delay before each reply
+    ALLIHOOPA_FAKE_ECHO          add the drop body as it was received to
+                                 its completion, as a "drop" member
+    ALLIHOOPA_FAKE_POLL_DELAY_US delay before each 'poll' and 'pall' reply
+    ALLIHOOPA_FAKE_STARTUP_US    delay before reading the first frame
+    ALLIHOOPA_FAKE_PAYLOAD       bytes of padding added to each completion
+    ALLIHOOPA_FAKE_PROGRESS      send 'prog' frames for drops and chunks
+    ALLIHOOPA_FAKE_STATE_DIR     keep received chunk offsets here, so that
+                                 chunked stems resume across launches
+    ALLIHOOPA_FAKE_FAIL_CHUNK    fail the checksum of the n:th chunk
+    ALLIHOOPA_FAKE_EXIT_CHUNK    exit without replying on the n:th chunk
+    ALLIHOOPA_FAKE_EXIT_DROP     exit without replying on the first drop
+                                 with this request ID, once per state dir
+    ALLIHOOPA_FAKE_IGNORE_EOF    keep running when the SDK closes the pipe
+    ALLIHOOPA_FAKE_IGNORE_TERM   ignore SIGTERM
+
+POSIX only, handles are received with SCM_RIGHTS.
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../allihoopa.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define HeaderSize 8
+#define HeaderSizeV2 12
+#define MaxBody AHMaxLargeRequestBody
+#define MaxPending 8192
+#define MaxChunkedStems 16
+#define MaxStemName 255
+
+typedef struct {
+    char* data;
+    size_t length;
+} Completion;
+
+typedef struct {
+    short int requestID;
+    unsigned long long bytes;
+    unsigned long sum;
+} StemTotal;
+
+typedef struct {
+    char name[MaxStemName + 1];
+    char hash[17];
+    unsigned long long received;
+} ChunkedStem;
+
+static struct {
+    int frameVersion;
+    int cbor;
+    int passedHandle;
+    char* sharedMemory;
+    size_t sharedMemorySize;
+    int chunkCount;
+
+    Completion pending[MaxPending];
+    int pendingHead;
+    int pendingCount;
+
+    // Stem data received for the drop about to come
+    StemTotal stems;
+    ChunkedStem chunked[MaxChunkedStems];
+    int chunkedCount;
+} app;
+
+static long envNumber(const char* name) {
+    const char* value = getenv(name);
+    return value != 0 ? atol(value) : 0;
+}
+
+static void sleepUS(long microseconds) {
+    if (microseconds > 0) {
+        struct timespec duration = {microseconds / 1000000, (microseconds % 1000000) * 1000};
+        while (nanosleep(&duration, &duration) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+static unsigned long byteSum(const unsigned char* data, size_t length) {
+    unsigned long sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+static unsigned long long readLE(const unsigned char* data, int bytes) {
+    unsigned long long value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+static void writeLE(unsigned char* data, unsigned long long value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        data[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+/// XXH64, as used for chunk checksums
+
+#define Prime1 0x9E3779B185EBCA87ULL
+#define Prime2 0xC2B2AE3D27D4EB4FULL
+#define Prime3 0x165667B19E3779F9ULL
+#define Prime4 0x85EBCA77C2B2AE63ULL
+#define Prime5 0x27D4EB2F165667C5ULL
+
+static unsigned long long rotate(unsigned long long value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static unsigned long long hashRound(unsigned long long accumulator, unsigned long long input) {
+    return rotate(accumulator + input * Prime2, 31) * Prime1;
+}
+
+static unsigned long long hashData(const unsigned char* data, size_t length) {
+    const unsigned char* end = data + length;
+    unsigned long long hash;
+
+    if (length >= 32) {
+        unsigned long long lanes[4] = {Prime1 + Prime2, Prime2, 0, 0 - Prime1};
+        for (; end - data >= 32; data += 32) {
+            for (int i = 0; i < 4; i++) {
+                lanes[i] = hashRound(lanes[i], readLE(data + i * 8, 8));
+            }
+        }
+        hash = rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12) + rotate(lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = (hash ^ hashRound(0, lanes[i])) * Prime1 + Prime4;
+        }
+    } else {
+        hash = Prime5;
+    }
+
+    hash += length;
+    for (; end - data >= 8; data += 8) {
+        hash = rotate(hash ^ hashRound(0, readLE(data, 8)), 27) * Prime1 + Prime4;
+    }
+    if (end - data >= 4) {
+        hash = rotate(hash ^ readLE(data, 4) * Prime1, 23) * Prime2 + Prime3;
+        data += 4;
+    }
+    for (; data < end; data++) {
+        hash = rotate(hash ^ *data * Prime5, 11) * Prime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= Prime2;
+    hash ^= hash >> 29;
+    hash *= Prime3;
+    return hash ^ (hash >> 32);
+}
+
+/// Frames
+
+// Reads exactly length bytes, keeping any handle passed along with them
+static int readFully(void* data, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        struct iovec vector = {(char*) data + total, length - total};
+        union {
+            char buffer[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+
+        ssize_t result = recvmsg(STDIN_FILENO, &message, 0);
+        if (result == -1 && errno == ENOTSOCK) {
+            result = read(STDIN_FILENO, (char*) data + total, length - total);
+            message.msg_controllen = 0;
+        }
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return -1;
+        }
+
+        struct cmsghdr* header = message.msg_controllen != 0 ? CMSG_FIRSTHDR(&message) : 0;
+        if (header != 0 && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            memcpy(&app.passedHandle, CMSG_DATA(header), sizeof(int));
+        }
+        total += (size_t) result;
+    }
+    return 0;
+}
+
+static void writeFully(const void* data, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t result = write(STDOUT_FILENO, (const char*) data + total, length - total);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            exit(1);
+        }
+        total += (size_t) result;
+    }
+}
+
+static void reply(const char command[4], short int requestID, const void* body, size_t length, int cbor) {
+    unsigned char header[HeaderSizeV2];
+    memcpy(header, command, 4);
+    writeLE(&header[4], (unsigned short) requestID, 2);
+    if (app.frameVersion >= 2) {
+        header[6] = 2;
+        header[7] = cbor ? 0x01 : 0;
+        writeLE(&header[8], length, 4);
+        writeFully(header, HeaderSizeV2);
+    } else {
+        writeLE(&header[6], length, 2);
+        writeFully(header, HeaderSize);
+    }
+    if (length != 0) {
+        writeFully(body, length);
+    }
+}
+
+static void sendProgress(short int requestID, unsigned long long done, unsigned long long total, const char* stage) {
+    unsigned char body[16 + 15];
+    size_t stageLength = strlen(stage) < 15 ? strlen(stage) : 15;
+    writeLE(body, done, 8);
+    writeLE(&body[8], total, 8);
+    memcpy(&body[16], stage, stageLength);
+    reply("prog", requestID, body, 16 + stageLength, 0);
+}
+
+/// Completions
+
+static size_t cborHead(unsigned char* out, int major, unsigned long long value) {
+    if (value < 24) {
+        out[0] = (unsigned char) (major << 5 | value);
+        return 1;
+    }
+    int bytes = value <= 0xff ? 1 : value <= 0xffff ? 2 : value <= 0xffffffffULL ? 4 : 8;
+    out[0] = (unsigned char) (major << 5 | (bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27));
+    for (int i = 0; i < bytes; i++) {
+        out[1 + i] = (unsigned char) (value >> (8 * (bytes - 1 - i)));
+    }
+    return 1 + bytes;
+}
+
+static size_t cborText(unsigned char* out, const char* text, size_t length) {
+    size_t used = cborHead(out, 3, length);
+    memcpy(&out[used], text, length);
+    return used + length;
+}
+
+static size_t cborKeyNumber(unsigned char* out, const char* key, unsigned long long value) {
+    size_t used = cborText(out, key, strlen(key));
+    return used + cborHead(&out[used], 0, value);
+}
+
+static void queueCompletion(short int requestID, const unsigned char* drop, size_t dropLength,
+    const char* error, size_t errorLength) {
+    unsigned long long bytes = dropLength;
+    unsigned long sum = byteSum(drop, dropLength);
+    size_t echoLength = getenv("ALLIHOOPA_FAKE_ECHO") != 0 ? dropLength : 0;
+
+    if (app.pendingCount == MaxPending) {
+        // Like the real App, the oldest completion is overwritten
+        free(app.pending[app.pendingHead].data);
+        app.pendingHead = (app.pendingHead + 1) % MaxPending;
+        app.pendingCount--;
+    }
+
+    size_t payload = (size_t) envNumber("ALLIHOOPA_FAKE_PAYLOAD");
+    if (payload > AHMaxRequestBody - 256) {
+        payload = AHMaxRequestBody - 256;
+    }
+    StemTotal stems = app.stems.requestID == requestID ? app.stems : (StemTotal) {0, 0, 0};
+    app.stems.requestID = 0;
+    app.stems.bytes = 0;
+    app.stems.sum = 0;
+
+    char* data = malloc(256 + payload + errorLength + echoLength);
+    size_t length = 0;
+    if (app.cbor) {
+        unsigned char* out = (unsigned char*) data;
+        length += cborHead(&out[length], 5, 2);
+        length += cborText(&out[length], "requestID", 9);
+        length += requestID >= 0 ? cborHead(&out[length], 0, (unsigned long long) requestID)
+            : cborHead(&out[length], 1, (unsigned long long) (-1 - requestID));
+        length += cborText(&out[length], "data", 4);
+        length += cborHead(&out[length], 5, 4 + (payload != 0) + (echoLength != 0));
+        length += cborKeyNumber(&out[length], "bytes", bytes);
+        length += cborKeyNumber(&out[length], "sum", sum);
+        length += cborKeyNumber(&out[length], "stemBytes", stems.bytes);
+        length += cborKeyNumber(&out[length], "stemSum", stems.sum);
+        if (payload != 0) {
+            length += cborText(&out[length], "payload", 7);
+            length += cborHead(&out[length], 3, payload);
+            memset(&out[length], 'x', payload);
+            length += payload;
+        }
+        if (echoLength != 0) {
+            // Already CBOR
+            length += cborText(&out[length], "drop", 4);
+            memcpy(&out[length], drop, echoLength);
+            length += echoLength;
+        }
+    } else {
+        length = (size_t) sprintf(data,
+            "{\"requestID\": %d, \"data\": {\"bytes\": %llu, \"sum\": %lu, \"stemBytes\": %llu, \"stemSum\": %lu",
+            requestID, bytes, sum, stems.bytes, stems.sum);
+        if (payload != 0) {
+            length += (size_t) sprintf(&data[length], ", \"payload\": \"");
+            memset(&data[length], 'x', payload);
+            length += payload;
+            data[length++] = '"';
+        }
+        if (errorLength != 0) {
+            length += (size_t) sprintf(&data[length], ", \"error\": %.*s", (int) errorLength, error);
+        }
+        if (echoLength != 0) {
+            length += (size_t) sprintf(&data[length], ", \"drop\": ");
+            memcpy(&data[length], drop, echoLength);
+            length += echoLength;
+        }
+        length += (size_t) sprintf(&data[length], "}}");
+    }
+
+    Completion* completion = &app.pending[(app.pendingHead + app.pendingCount) % MaxPending];
+    completion->data = data;
+    completion->length = length;
+    app.pendingCount++;
+}
+
+static Completion popCompletion() {
+    Completion completion = app.pending[app.pendingHead];
+    app.pendingHead = (app.pendingHead + 1) % MaxPending;
+    app.pendingCount--;
+    return completion;
+}
+
+static void handlePoll(short int requestID) {
+    if (app.pendingCount == 0) {
+        reply("okay", requestID, 0, 0, 0);
+        return;
+    }
+    Completion completion = popCompletion();
+    reply("okay", requestID, completion.data, completion.length, app.cbor);
+    free(completion.data);
+}
+
+static void handlePollBatch(short int requestID) {
+    static unsigned char batch[AHMaxRequestBody];
+    size_t length = 2;
+    while (app.pendingCount != 0 && length + 2 + app.pending[app.pendingHead].length <= sizeof(batch)) {
+        Completion completion = popCompletion();
+        writeLE(&batch[length], completion.length, 2);
+        memcpy(&batch[length + 2], completion.data, completion.length);
+        length += 2 + completion.length;
+        free(completion.data);
+    }
+    writeLE(batch, (unsigned long long) app.pendingCount, 2);
+    reply("okay", requestID, batch, length, app.cbor && length > 2);
+}
+
+/// Stems
+
+static void addStemData(short int requestID, const unsigned char* data, size_t length) {
+    if (app.stems.requestID != requestID) {
+        app.stems.requestID = requestID;
+        app.stems.bytes = 0;
+        app.stems.sum = 0;
+    }
+    app.stems.bytes += length;
+    app.stems.sum += byteSum(data, length);
+}
+
+static unsigned long long jsonNumber(const char* body, const char* key) {
+    const char* found = strstr(body, key);
+    return found != 0 ? strtoull(found + strlen(key), 0, 10) : 0;
+}
+
+static int jsonString(const char* body, const char* key, char* out, size_t outSize) {
+    const char* found = strstr(body, key);
+    if (found == 0) {
+        return -1;
+    }
+    found += strlen(key);
+    const char* end = strchr(found, '"');
+    if (end == 0 || (size_t) (end - found) >= outSize) {
+        return -1;
+    }
+    memcpy(out, found, (size_t) (end - found));
+    out[end - found] = 0;
+    return 0;
+}
+
+static void handleStemHandle(short int requestID, const char* body) {
+    size_t length = (size_t) jsonNumber(body, "\"length\": ");
+    int handle = app.passedHandle;
+    app.passedHandle = -1;
+    if (handle == -1) {
+        reply("fail", requestID, 0, 0, 0);
+        return;
+    }
+    void* data = length != 0 ? mmap(0, length, PROT_READ, MAP_SHARED, handle, 0) : MAP_FAILED;
+    close(handle);
+    if (data == MAP_FAILED) {
+        reply("fail", requestID, 0, 0, 0);
+        return;
+    }
+    addStemData(requestID, data, length);
+    munmap(data, length);
+    reply("okay", requestID, 0, 0, 0);
+}
+
+static ChunkedStem* findChunkedStem(const char* name) {
+    for (int i = 0; i < app.chunkedCount; i++) {
+        if (strcmp(app.chunked[i].name, name) == 0) {
+            return &app.chunked[i];
+        }
+    }
+    if (app.chunkedCount == MaxChunkedStems) {
+        return 0;
+    }
+    ChunkedStem* stem = &app.chunked[app.chunkedCount++];
+    memset(stem, 0, sizeof(*stem));
+    memcpy(stem->name, name, strlen(name) + 1);
+
+    // What an earlier launch received
+    const char* stateDir = getenv("ALLIHOOPA_FAKE_STATE_DIR");
+    if (stateDir != 0) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", stateDir, name);
+        FILE* file = fopen(path, "r");
+        if (file != 0) {
+            if (fscanf(file, "%16s %llu", stem->hash, &stem->received) != 2) {
+                stem->hash[0] = 0;
+                stem->received = 0;
+            }
+            fclose(file);
+        }
+    }
+    return stem;
+}
+
+static void saveChunkedStem(const ChunkedStem* stem) {
+    const char* stateDir = getenv("ALLIHOOPA_FAKE_STATE_DIR");
+    if (stateDir != 0) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", stateDir, stem->name);
+        FILE* file = fopen(path, "w");
+        if (file != 0) {
+            fprintf(file, "%s %llu\n", stem->hash, stem->received);
+            fclose(file);
+        }
+    }
+}
+
+static void handleResume(short int requestID, const char* body) {
+    char name[MaxStemName + 1];
+    char hash[17];
+    ChunkedStem* stem = 0;
+    if (jsonString(body, "\"name\": \"", name, sizeof(name)) != 0
+        || jsonString(body, "\"hash\": \"xxh64:", hash, sizeof(hash)) != 0
+        || (stem = findChunkedStem(name)) == 0) {
+        reply("fail", requestID, 0, 0, 0);
+        return;
+    }
+
+    // A different stem with the same name starts over
+    if (strcmp(stem->hash, hash) != 0) {
+        memcpy(stem->hash, hash, sizeof(hash));
+        stem->received = 0;
+        saveChunkedStem(stem);
+    }
+
+    char offset[64];
+    int length = snprintf(offset, sizeof(offset), "{\"offset\": %llu}", stem->received);
+    reply("okay", requestID, offset, (size_t) length, 0);
+}
+
+static void handleChunk(short int requestID, const unsigned char* body, size_t length) {
+    app.chunkCount++;
+    if (app.chunkCount == envNumber("ALLIHOOPA_FAKE_EXIT_CHUNK")) {
+        exit(3);
+    }
+
+    size_t nameLength = length != 0 ? body[0] : 0;
+    if (length < 17 + nameLength) {
+        reply("fail", requestID, 0, 0, 0);
+        return;
+    }
+    char name[MaxStemName + 1];
+    memcpy(name, &body[1], nameLength);
+    name[nameLength] = 0;
+    unsigned long long offset = readLE(&body[1 + nameLength], 8);
+    unsigned long long checksum = readLE(&body[9 + nameLength], 8);
+    const unsigned char* data = &body[17 + nameLength];
+    size_t dataLength = length - 17 - nameLength;
+
+    ChunkedStem* stem = findChunkedStem(name);
+    if (stem == 0 || offset != stem->received || hashData(data, dataLength) != checksum
+        || app.chunkCount == envNumber("ALLIHOOPA_FAKE_FAIL_CHUNK")) {
+        reply("fail", requestID, 0, 0, 0);
+        return;
+    }
+
+    stem->received += dataLength;
+    saveChunkedStem(stem);
+    addStemData(requestID, data, dataLength);
+    reply("okay", requestID, 0, 0, 0);
+    if (getenv("ALLIHOOPA_FAKE_PROGRESS") != 0) {
+        sendProgress(requestID, stem->received, stem->received, "receiving");
+    }
+}
+
+/// Requests
+
+static int hasCapability(const char* capability) {
+    const char* capabilities = getenv("ALLIHOOPA_FAKE_CAPABILITIES");
+    size_t length = strlen(capability);
+    while (capabilities != 0 && *capabilities != 0) {
+        const char* end = strchr(capabilities, ',');
+        size_t itemLength = end != 0 ? (size_t) (end - capabilities) : strlen(capabilities);
+        if (itemLength == length && memcmp(capabilities, capability, length) == 0) {
+            return 1;
+        }
+        capabilities = end != 0 ? end + 1 : 0;
+    }
+    return 0;
+}
+
+static void handleInit(short int requestID) {
+    char body[512] = "{";
+    const char* message = getenv("ALLIHOOPA_FAKE_MESSAGE");
+    if (message != 0) {
+        snprintf(body, 128, "{\"message\": \"%.100s\", ", message);
+    }
+    strcat(body, "\"capabilities\": [");
+    const char* capabilities = getenv("ALLIHOOPA_FAKE_CAPABILITIES");
+    size_t length = strlen(body);
+    while (capabilities != 0 && *capabilities != 0 && length < sizeof(body) - 64) {
+        const char* end = strchr(capabilities, ',');
+        size_t itemLength = end != 0 ? (size_t) (end - capabilities) : strlen(capabilities);
+        length += (size_t) snprintf(&body[length], sizeof(body) - length, "%s\"%.*s\"",
+            body[length - 1] == '[' ? "" : ", ", (int) itemLength, capabilities);
+        capabilities = end != 0 ? end + 1 : 0;
+    }
+    length += (size_t) snprintf(&body[length], sizeof(body) - length, "]}");
+    reply("okay", requestID, body, length, 0);
+}
+
+static void handleVersion(short int requestID, const char* body) {
+    if (!hasCapability("frameV2")) {
+        reply("fail", requestID, 0, 0, 0);
+        return;
+    }
+    app.cbor = getenv("ALLIHOOPA_FAKE_CBOR") != 0 && strstr(body, "\"cbor\"") != 0;
+    const char* encodings = app.cbor ? "{\"version\": 2, \"encodings\": [\"cbor\"]}"
+        : "{\"version\": 2, \"encodings\": []}";
+    reply("okay", requestID, encodings, strlen(encodings), 0);
+    app.frameVersion = 2;
+}
+
+static void handleSharedMemory(short int requestID, const char* body) {
+    size_t size = (size_t) jsonNumber(body, "\"size\": ");
+    int handle = app.passedHandle;
+    app.passedHandle = -1;
+    void* data = handle != -1 && size != 0 ? mmap(0, size, PROT_READ, MAP_SHARED, handle, 0) : MAP_FAILED;
+    if (handle != -1) {
+        close(handle);
+    }
+    if (data == MAP_FAILED) {
+        reply("fail", requestID, 0, 0, 0);
+        return;
+    }
+    app.sharedMemory = data;
+    app.sharedMemorySize = size;
+    reply("okay", requestID, 0, 0, 0);
+}
+
+// Whether to crash on the drop, only the first time for each state dir
+static int exitOnDrop(short int requestID) {
+    const char* stateDir = getenv("ALLIHOOPA_FAKE_STATE_DIR");
+    if (getenv("ALLIHOOPA_FAKE_EXIT_DROP") == 0 || envNumber("ALLIHOOPA_FAKE_EXIT_DROP") != requestID
+        || stateDir == 0) {
+        return 0;
+    }
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/exited-%d", stateDir, requestID);
+    FILE* marker = fopen(path, "r");
+    if (marker != 0) {
+        fclose(marker);
+        return 0;
+    }
+    marker = fopen(path, "w");
+    if (marker != 0) {
+        fclose(marker);
+    }
+    return 1;
+}
+
+// The value of a member of a drop, up to the next comma or brace
+static size_t dropMember(const unsigned char* data, size_t length, const char* key, const char** oValue) {
+    size_t keyLength = strlen(key);
+    for (size_t i = 0; i + keyLength <= length; i++) {
+        if (memcmp(&data[i], key, keyLength) == 0) {
+            size_t end = i + keyLength;
+            while (end < length && data[end] != ',' && data[end] != '}') {
+                end++;
+            }
+            *oValue = (const char*) &data[i + keyLength];
+            return end - i - keyLength;
+        }
+    }
+    return 0;
+}
+
+static void acceptDrop(short int requestID, const unsigned char* data, size_t length) {
+    if (exitOnDrop(requestID)) {
+        exit(3);
+    }
+    if (requestID < 0) {
+        reply("fail", requestID, 0, 0, 0);
+        return;
+    }
+    const char* delay = 0;
+    if (dropMember(data, length, "\"fakeDelayUs\": ", &delay) != 0) {
+        sleepUS(atol(delay));
+    }
+    const char* error = 0;
+    size_t errorLength = dropMember(data, length, "\"fakeError\": ", &error);
+    queueCompletion(requestID, data, length, error, errorLength);
+    reply("okay", requestID, 0, 0, 0);
+    if (getenv("ALLIHOOPA_FAKE_PROGRESS") != 0) {
+        sendProgress(requestID, 1, 1, "upload");
+    }
+    if (hasCapability("notify")) {
+        reply("note", 0, 0, 0, 0);
+    }
+}
+
+static void handleSharedDrop(short int requestID, const unsigned char* body, size_t length) {
+    unsigned long long offset = length >= 16 ? readLE(body, 8) : 0;
+    unsigned long long dropLength = length >= 16 ? readLE(&body[8], 8) : 0;
+    if (length < 16 || app.sharedMemory == 0 || offset + dropLength > app.sharedMemorySize) {
+        reply("fail", requestID, 0, 0, 0);
+        return;
+    }
+    acceptDrop(requestID, (const unsigned char*) &app.sharedMemory[offset], (size_t) dropLength);
+}
+
+int main(int argc, char** argv) {
+    (void) argc;
+    (void) argv;
+    app.frameVersion = 1;
+    app.passedHandle = -1;
+    if (getenv("ALLIHOOPA_FAKE_IGNORE_TERM") != 0) {
+        signal(SIGTERM, SIG_IGN);
+    }
+    sleepUS(envNumber("ALLIHOOPA_FAKE_STARTUP_US"));
+
+    long delayUS = envNumber("ALLIHOOPA_FAKE_DELAY_US");
+    long pollDelayUS = envNumber("ALLIHOOPA_FAKE_POLL_DELAY_US");
+    static unsigned char body[MaxBody + 1];
+
+    for (;;) {
+        unsigned char header[HeaderSizeV2];
+        size_t bodyLength = 0;
+        if (readFully(header, app.frameVersion >= 2 ? HeaderSizeV2 : HeaderSize) != 0) {
+            break;
+        }
+        if (app.frameVersion >= 2) {
+            bodyLength = (size_t) readLE(&header[8], 4);
+        } else {
+            bodyLength = (size_t) readLE(&header[6], 2);
+        }
+        short int requestID = (short int) readLE(&header[4], 2);
+        if (bodyLength > MaxBody || (bodyLength != 0 && readFully(body, bodyLength) != 0)) {
+            break;
+        }
+        body[bodyLength] = 0;
+
+        sleepUS(delayUS);
+        const char* command = (const char*) header;
+        if (memcmp(command, "init", 4) == 0) {
+            handleInit(requestID);
+        } else if (memcmp(command, "vers", 4) == 0) {
+            handleVersion(requestID, (const char*) body);
+        } else if (memcmp(command, "shmm", 4) == 0) {
+            handleSharedMemory(requestID, (const char*) body);
+        } else if (memcmp(command, "drop", 4) == 0) {
+            acceptDrop(requestID, body, bodyLength);
+        } else if (memcmp(command, "sdrp", 4) == 0) {
+            handleSharedDrop(requestID, body, bodyLength);
+        } else if (memcmp(command, "stem", 4) == 0) {
+            handleStemHandle(requestID, (const char*) body);
+        } else if (memcmp(command, "rsum", 4) == 0) {
+            handleResume(requestID, (const char*) body);
+        } else if (memcmp(command, "chnk", 4) == 0) {
+            handleChunk(requestID, body, bodyLength);
+        } else if (memcmp(command, "poll", 4) == 0) {
+            sleepUS(pollDelayUS);
+            handlePoll(requestID);
+        } else if (memcmp(command, "pall", 4) == 0 && hasCapability("pollBatch")) {
+            sleepUS(pollDelayUS);
+            handlePollBatch(requestID);
+        } else if (memcmp(command, "quit", 4) == 0) {
+            reply("okay", requestID, 0, 0, 0);
+            break;
+        } else {
+            reply("fail", requestID, 0, 0, 0);
+        }
+    }
+
+    // Quit, or the SDK closed the pipe
+    while (getenv("ALLIHOOPA_FAKE_IGNORE_EOF") != 0) {
+        pause();
+    }
+    return 0;
+}
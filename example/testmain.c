@@ -32,6 +32,26 @@ int main() {
         }
     }
 
+    {
+        // Times the analysis AHCallAnalyzeStem runs before a drop, best of a few runs
+        const int runs = 10;
+        long long fastest = 0;
+        AHStemAnalysis analysis;
+        for (int i = 0; i < runs; i++) {
+            int result = AHanalyzeStem("file:///testljeud.wav", 0, &analysis);
+            if (result) {
+                printf("AHanalyzeStem returned %d: \"%s\"\n", result, AHerrorCodeToMessage(result));
+                return result;
+            }
+            if (i == 0 || analysis.elapsedMicroseconds < fastest) {
+                fastest = analysis.elapsedMicroseconds;
+            }
+        }
+        printf("Analyzed %lld us of audio in %lld us: %.1f BPM, root %d %s\n",
+            analysis.analyzedMicroseconds, fastest, analysis.tempo, analysis.tonalityRoot,
+            analysis.scale[3] ? "minor" : "major");
+    }
+
     waitForEnter();
 
     {
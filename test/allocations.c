@@ -0,0 +1,95 @@
+/*
+ * Steady state dropping and polling does no allocations, counted with a
+ * host allocator set with AHsetAllocator, and AHclose releases everything.
+ * Also for drops built from AHDropRequest fields, sent as JSON or CBOR.
+ */
+
+#include "check.h"
+
+typedef struct {
+    long long allocations;
+    long long releases;
+} Counters;
+
+static void* countingAlloc(size_t size, void* userData) {
+    ((Counters*) userData)->allocations++;
+    return malloc(size);
+}
+
+static void countingFree(void* memory, void* userData) {
+    if (memory != 0) {
+        ((Counters*) userData)->releases++;
+    }
+    free(memory);
+}
+
+static int completions = 0;
+
+static void countCompletion(const char* completion, unsigned short length) {
+    (void) completion;
+    (void) length;
+    completions++;
+}
+
+static void dropAndPoll(int rounds, int dropsPerRound) {
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    AHDropRequest request;
+    memset(&request, 0, sizeof(request));
+    request.mixStemURL = "file:///mix.wav";
+    request.title = "Steady";
+    request.lengthMicroseconds = 5217392;
+    request.tempo = 120;
+
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < dropsPerRound; i++) {
+            short int requestID = (short int) (i + 1);
+            if (i % 2 == 0) {
+                CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), requestID), 0);
+            }
+            else {
+                CHECK_RESULT(AHdropFields(&request, requestID, NULL), 0);
+            }
+        }
+        CHECK_RESULT(AHpollCompletedRequests(countCompletion), 0);
+    }
+}
+
+static void steadyState(const char* capabilities, int cbor) {
+    Counters counters = {0, 0};
+    CHECK_RESULT(AHsetAllocator(countingAlloc, countingFree, &counters), 0);
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", capabilities, 1);
+    setenv("ALLIHOOPA_FAKE_PAYLOAD", "1000", 1);
+    if (cbor) {
+        setenv("ALLIHOOPA_FAKE_CBOR", "1", 1);
+    }
+
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    // Buffers are allocated on first use
+    dropAndPoll(1, 8);
+    CHECK(counters.allocations != 0);
+
+    // The allocator can't change while the SDK holds memory from it
+    CHECK_RESULT(AHsetAllocator(0, 0, 0), AHErrorInvalidRequest);
+
+    long long allocations = counters.allocations;
+    completions = 0;
+    dropAndPoll(1000, 8);
+    CHECK(completions == 1000 * 8);
+    CHECK(counters.allocations == allocations);
+
+    CHECK_RESULT(AHclose(), 0);
+    CHECK(counters.releases == counters.allocations);
+    CHECK_RESULT(AHsetAllocator(0, 0, 0), 0);
+
+    unsetenv("ALLIHOOPA_FAKE_CAPABILITIES");
+    unsetenv("ALLIHOOPA_FAKE_PAYLOAD");
+    unsetenv("ALLIHOOPA_FAKE_CBOR");
+}
+
+int main() {
+    steadyState("", 0);
+    steadyState("pollBatch", 0);
+    steadyState("pollBatch,frameV2", 0);
+    steadyState("pollBatch,frameV2", 1);
+    return checkSummary("allocations");
+}
@@ -0,0 +1,197 @@
+/*
+ * Known answers from WAV stems generated here: the levels of a sine,
+ * the length and level of the preview made from it, the tempo of a
+ * click track and the key of a held triad.
+ */
+
+#include "check.h"
+#include <math.h>
+
+#define Pi 3.14159265358979323846
+
+static char tmpDir[] = "/tmp/allihoopa-test-XXXXXX";
+
+static void putLE(unsigned char* bytes, unsigned long value, int length) {
+    for (int i = 0; i < length; i++) {
+        bytes[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+// A 16 bit PCM or 32 bit float WAV file, with the same samples in each channel
+static void writeWave(const char* name, unsigned int sampleRate, int channels, int isFloat,
+    const float* samples, size_t frameCount)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", tmpDir, name);
+    FILE* file = fopen(path, "wb");
+    CHECK(file != 0);
+
+    int bytesPerSample = isFloat ? 4 : 2;
+    unsigned long dataLength = (unsigned long) (frameCount * (size_t) (channels * bytesPerSample));
+    unsigned char header[44];
+    memcpy(header, "RIFF", 4);
+    putLE(&header[4], 36 + dataLength, 4);
+    memcpy(&header[8], "WAVEfmt ", 8);
+    putLE(&header[16], 16, 4);
+    putLE(&header[20], isFloat ? 3 : 1, 2);
+    putLE(&header[22], (unsigned long) channels, 2);
+    putLE(&header[24], sampleRate, 4);
+    putLE(&header[28], sampleRate * (unsigned long) (channels * bytesPerSample), 4);
+    putLE(&header[32], (unsigned long) (channels * bytesPerSample), 2);
+    putLE(&header[34], (unsigned long) (bytesPerSample * 8), 2);
+    memcpy(&header[36], "data", 4);
+    putLE(&header[40], dataLength, 4);
+    CHECK(fwrite(header, 1, sizeof(header), file) == sizeof(header));
+
+    for (size_t frame = 0; frame < frameCount; frame++) {
+        for (int channel = 0; channel < channels; channel++) {
+            unsigned char bytes[4];
+            if (isFloat) {
+                memcpy(bytes, &samples[frame], 4);
+            }
+            else {
+                putLE(bytes, (unsigned long) lrintf(samples[frame] * 32767.0f), 2);
+            }
+            CHECK(fwrite(bytes, 1, (size_t) bytesPerSample, file) == (size_t) bytesPerSample);
+        }
+    }
+    fclose(file);
+}
+
+static float* sine(unsigned int sampleRate, double seconds, double hz, double amplitude, size_t* oFrameCount) {
+    size_t frameCount = (size_t) (sampleRate * seconds);
+    float* samples = malloc(frameCount * sizeof(float));
+    for (size_t i = 0; i < frameCount; i++) {
+        samples[i] = (float) (amplitude * sin(2 * Pi * hz * (double) i / sampleRate));
+    }
+    *oFrameCount = frameCount;
+    return samples;
+}
+
+static int near(double value, double expected, double tolerance) {
+    if (fabs(value - expected) > tolerance) {
+        fprintf(stderr, "%f, expected %f\n", value, expected);
+        return 0;
+    }
+    return 1;
+}
+
+// A 1 kHz sine at half of full scale has that peak, and an RMS level 3 dB below it
+static void sineLevels() {
+    size_t frameCount = 0;
+    float* samples = sine(48000, 2.0, 1000.0, 0.5, &frameCount);
+    writeWave("sine.wav", 48000, 2, 0, samples, frameCount);
+    writeWave("sine-float.wav", 48000, 1, 1, samples, frameCount);
+    free(samples);
+
+    AHStemInfo info;
+    CHECK_RESULT(AHinspectStem("file:///sine.wav", &info), 0);
+    CHECK(info.sampleRate == 48000 && info.channels == 2 && info.bitsPerSample == 16 && !info.isFloat);
+    CHECK(info.frameCount == 96000 && info.lengthMicroseconds == 2000000);
+    CHECK(info.loopStartMicroseconds == 0 && info.loopEndMicroseconds == 0);
+    CHECK(near(info.peak, 0.5, 0.001));
+    CHECK(near(info.rms, 0.5 / sqrt(2.0), 0.001));
+
+    CHECK_RESULT(AHinspectStem("file:///sine-float.wav", &info), 0);
+    CHECK(info.channels == 1 && info.bitsPerSample == 32 && info.isFloat);
+    CHECK(near(info.peak, 0.5, 0.0001));
+    CHECK(near(info.rms, 0.5 / sqrt(2.0), 0.0001));
+}
+
+// The first 30 seconds, as mono at 22.05 kHz, at the level of the stem
+static void previewOf(const char* name, double seconds, double expectedSeconds) {
+    size_t frameCount = 0;
+    float* samples = sine(44100, seconds, 440.0, 0.5, &frameCount);
+    writeWave(name, 44100, 2, 0, samples, frameCount);
+    free(samples);
+
+    char stemURL[64];
+    char previewURL[256];
+    snprintf(stemURL, sizeof(stemURL), "file:///%s", name);
+    CHECK_RESULT(AHgeneratePreview(stemURL, previewURL, sizeof(previewURL)), 0);
+
+    AHStemInfo info;
+    CHECK_RESULT(AHinspectStem(previewURL, &info), 0);
+    CHECK(info.sampleRate == AHPreviewSampleRate && info.channels == 1 && info.bitsPerSample == 16);
+    CHECK(near((double) info.frameCount, expectedSeconds * AHPreviewSampleRate, 1.0));
+    CHECK(near(info.peak, 0.5, 0.01));
+    CHECK(near(info.rms, 0.5 / sqrt(2.0), 0.01));
+}
+
+static void preview() {
+    previewOf("long.wav", 40.0, AHPreviewSeconds);
+    previewOf("short.wav", 10.0, 10.0);
+    char previewURL[256];
+    CHECK_RESULT(AHgeneratePreview("file:///missing.wav", previewURL, sizeof(previewURL)), AHErrorInvalidRequest);
+}
+
+// A short decaying 2 kHz burst on every beat, at 120 beats per minute
+static void clickTempo() {
+    const unsigned int sampleRate = 44100;
+    size_t frameCount = sampleRate * 20;
+    float* samples = calloc(frameCount, sizeof(float));
+    for (size_t beat = 0; beat < frameCount; beat += sampleRate / 2) {
+        for (size_t i = 0; i < sampleRate / 100 && beat + i < frameCount; i++) {
+            samples[beat + i] = (float) (0.8 * exp(-(double) i / 100.0) * sin(2 * Pi * 2000.0 * (double) i / sampleRate));
+        }
+    }
+    writeWave("clicks.wav", sampleRate, 1, 0, samples, frameCount);
+    free(samples);
+
+    AHStemAnalysis analysis;
+    CHECK_RESULT(AHanalyzeStem("file:///clicks.wav", 10000, &analysis), 0);
+    CHECK(near(analysis.tempo, 120.0, 2.0));
+    CHECK(analysis.tempoConfidence >= 0.5);
+}
+
+// The notes held together, in the octave from middle C
+static void triadKey(const char* name, const int notes[3], int root, const unsigned char scale[12]) {
+    const unsigned int sampleRate = 44100;
+    size_t frameCount = sampleRate * 8;
+    float* samples = calloc(frameCount, sizeof(float));
+    for (int note = 0; note < 3; note++) {
+        double hz = 440.0 * pow(2.0, (notes[note] - 69) / 12.0);
+        for (size_t i = 0; i < frameCount; i++) {
+            samples[i] += (float) (0.25 * sin(2 * Pi * hz * (double) i / sampleRate));
+        }
+    }
+    writeWave(name, sampleRate, 1, 0, samples, frameCount);
+    free(samples);
+
+    char url[64];
+    snprintf(url, sizeof(url), "file:///%s", name);
+    AHStemAnalysis analysis;
+    CHECK_RESULT(AHanalyzeStem(url, 10000, &analysis), 0);
+    CHECK(analysis.tonalityMode == AHTonalityTonal);
+    CHECK(analysis.tonalityRoot == root);
+    CHECK(memcmp(analysis.scale, scale, 12) == 0);
+}
+
+static void triads() {
+    static const unsigned char major[12] = {1, 0, 1, 0, 1, 1, 0, 1, 0, 1, 0, 1};
+    static const unsigned char minor[12] = {1, 0, 1, 1, 0, 1, 0, 1, 1, 0, 1, 0};
+    // C E G, C major
+    static const int cMajor[3] = {60, 64, 67};
+    triadKey("c-major.wav", cMajor, 0, major);
+    // A C E, A minor
+    static const int aMinor[3] = {57, 60, 64};
+    triadKey("a-minor.wav", aMinor, 9, minor);
+}
+
+int main() {
+    CHECK(mkdtemp(tmpDir) != 0);
+    char setup[128];
+    snprintf(setup, sizeof(setup), "{\"tmpDir\": \"%s\"}", tmpDir);
+    CHECK_RESULT(AHsetup(setup, (unsigned short) strlen(setup)), 0);
+
+    sineLevels();
+    preview();
+    clickTempo();
+    triads();
+
+    CHECK_RESULT(AHclose(), 0);
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf %s", tmpDir);
+    CHECK(system(command) == 0);
+    return checkSummary("audio");
+}
@@ -0,0 +1,76 @@
+/*
+ * AHbuildDropRequest escapes strings, and fails without writing anything
+ * when the request doesn't fit or holds a key the App can't name.
+ */
+
+#include "check.h"
+
+static AHDropRequest minimalRequest(const char* title) {
+    AHDropRequest request;
+    memset(&request, 0, sizeof(request));
+    request.mixStemURL = "file:///mix.wav";
+    request.title = title;
+    request.lengthMicroseconds = 5217392;
+    return request;
+}
+
+static int contains(const char* data, size_t length, const char* text) {
+    size_t textLength = strlen(text);
+    for (size_t i = 0; i + textLength <= length; i++) {
+        if (memcmp(&data[i], text, textLength) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main() {
+    static char buffer[AHMaxRequestBody];
+    unsigned short length = 0;
+
+    AHDropRequest request = minimalRequest("\"Quoted\" \\ tab\t line\n bell\x07 \xc3\xa5");
+    request.tempo = 92.5;
+    CHECK_RESULT(AHbuildDropRequest(&request, buffer, sizeof(buffer), &length), 0);
+    CHECK(contains(buffer, length, "\"title\": \"\\\"Quoted\\\" \\\\ tab\\t line\\n bell\\u0007 \xc3\xa5\""));
+    CHECK(contains(buffer, length, "\"mixStemURL\": \"file:///mix.wav\""));
+    CHECK(contains(buffer, length, "\"lengthMicroseconds\": 5217392"));
+    CHECK(contains(buffer, length, "\"tempo\": {\"fixed\": 92.5}"));
+    CHECK(buffer[0] == '{' && buffer[length - 1] == '}');
+
+    // One byte short, leaving the buffer as it was
+    unsigned short fullLength = length;
+    memset(buffer, 'x', sizeof(buffer));
+    length = 0;
+    CHECK_RESULT(AHbuildDropRequest(&request, buffer, fullLength - 1, &length), AHErrorInvalidRequest);
+    CHECK(buffer[0] == 'x' && length == 0);
+    CHECK_RESULT(AHbuildDropRequest(&request, buffer, fullLength, &length), 0);
+    CHECK(length == fullLength);
+
+    // Escaping counts towards AHMaxRequestBody
+    static char title[AHMaxRequestBody / 2];
+    memset(title, '"', sizeof(title) - 1);
+    request = minimalRequest(title);
+    CHECK_RESULT(AHbuildDropRequest(&request, buffer, sizeof(buffer), &length), AHErrorInvalidRequest);
+
+    // A key needs a root from C to B, and a scale of ones and zeros
+    static const unsigned char major[12] = {1, 0, 1, 0, 1, 1, 0, 1, 0, 1, 0, 1};
+    request = minimalRequest("Key");
+    request.tonalityMode = AHTonalityTonal;
+    memcpy(request.scale, major, sizeof(major));
+    request.tonalityRoot = 11;
+    CHECK_RESULT(AHbuildDropRequest(&request, buffer, sizeof(buffer), &length), 0);
+    request.tonalityRoot = -1;
+    CHECK_RESULT(AHbuildDropRequest(&request, buffer, sizeof(buffer), &length), AHErrorInvalidRequest);
+    request.tonalityRoot = 12;
+    CHECK_RESULT(AHbuildDropRequest(&request, buffer, sizeof(buffer), &length), AHErrorInvalidRequest);
+    request.tonalityRoot = 0;
+    request.scale[3] = 2;
+    CHECK_RESULT(AHbuildDropRequest(&request, buffer, sizeof(buffer), &length), AHErrorInvalidRequest);
+    // Without a key, neither is written
+    request.tonalityMode = AHTonalityAtonal;
+    CHECK_RESULT(AHbuildDropRequest(&request, buffer, sizeof(buffer), &length), 0);
+
+    request = minimalRequest(0);
+    CHECK_RESULT(AHbuildDropRequest(&request, buffer, sizeof(buffer), &length), AHErrorInvalidRequest);
+    return checkSummary("builder");
+}
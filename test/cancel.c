@@ -0,0 +1,82 @@
+/*
+ * AHcancel stops a drop being sent and takes queued drops off the queue,
+ * also when cancels follow each other or wait behind an AHsetup, and
+ * doesn't affect a later drop with the same request ID.
+ */
+
+#include "check.h"
+
+// Ten chunks, each replied to after the stand-in's delay
+#define StemLength (10 * 60 * 1024)
+
+typedef struct {
+    int count;
+    int status[4];
+} Completions;
+
+static void collect(const AHCompletion* completion, void* userData) {
+    Completions* completions = (Completions*) userData;
+    completions->count++;
+    if (completion->requestID > 0 && completion->requestID < 4) {
+        completions->status[completion->requestID] = completion->status;
+    }
+}
+
+static void waitForCompletions(Completions* completions, int count) {
+    for (int attempt = 0; attempt < 200 && completions->count < count; attempt++) {
+        CHECK_RESULT(AHpollCompletions(collect, completions), 0);
+        sleepMS(10);
+    }
+    CHECK(completions->count == count);
+}
+
+static char audio[StemLength];
+
+int main() {
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", "chunkedStems", 1);
+    setenv("ALLIHOOPA_FAKE_DELAY_US", "20000", 1);
+    CHECK_RESULT(AHstartIOThread(5), 0);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+
+    const char stemDrop[] = "{\"stems\": {\"mixStemURL\": \"stem:mix\"}}";
+    const char drop[] = "{\"stems\": {\"mixStemURL\": \"file:///mix.wav\"}}";
+    AHStem stem = {"mix", audio, sizeof(audio), 0};
+    CHECK_RESULT(AHdropStems(stemDrop, sizeof(stemDrop) - 1, 1, &stem, 1), 0);
+    CHECK_RESULT(AHdrop(drop, sizeof(drop) - 1, 2), 0);
+
+    // Drop 1 is being sent by now, and drop 2 is queued behind it
+    sleepMS(100);
+    CHECK_RESULT(AHcancel(1), 0);
+    CHECK_RESULT(AHcancel(2), 0);
+
+    Completions completions = {0, {0}};
+    waitForCompletions(&completions, 2);
+    CHECK(completions.status[1] == AHErrorCancelled);
+    CHECK(completions.status[2] == AHErrorCancelled);
+
+    // The cancels are done with, so the same request IDs go through
+    CHECK_RESULT(AHdropStems(stemDrop, sizeof(stemDrop) - 1, 1, &stem, 1), 0);
+    CHECK_RESULT(AHdrop(drop, sizeof(drop) - 1, 2), 0);
+    completions.count = 0;
+    waitForCompletions(&completions, 2);
+    CHECK(completions.status[1] == 0);
+    CHECK(completions.status[2] == 0);
+
+    // Drop 3 is queued behind drop 1, and the cancel behind the AHsetup after it
+    CHECK_RESULT(AHdropStems(stemDrop, sizeof(stemDrop) - 1, 1, &stem, 1), 0);
+    CHECK_RESULT(AHdrop(drop, sizeof(drop) - 1, 3), 0);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    CHECK_RESULT(AHcancel(3), 0);
+    completions.count = 0;
+    waitForCompletions(&completions, 2);
+    CHECK(completions.status[1] == 0);
+    CHECK(completions.status[3] == AHErrorCancelled);
+
+    CHECK_RESULT(AHcancel(0), AHErrorInvalidRequest);
+    CHECK_RESULT(AHclose(), 0);
+    CHECK_RESULT(AHstopIOThread(), 0);
+    CHECK_RESULT(AHcancel(1), AHErrorNotSupported);
+    unsetenv("ALLIHOOPA_FAKE_DELAY_US");
+    unsetenv("ALLIHOOPA_FAKE_CAPABILITIES");
+    return checkSummary("cancel");
+}
@@ -0,0 +1,86 @@
+/*
+
+Checks for the tests in this directory, which "make check" runs against
+the stand-in App in bench/fakeapp.c. Each test configures the stand-in
+through its environment before launching it with AHsetup.
+
+*/
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "allihoopa.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int checkFailures = 0;
+
+#define CHECK(condition) \
+    checkCondition((condition) != 0, #condition, __FILE__, __LINE__)
+
+// Checks an SDK call result, printing the error when it isn't the expected one
+#define CHECK_RESULT(call, expected) \
+    checkResult((call), (expected), #call, __FILE__, __LINE__)
+
+static inline void checkCondition(int passed, const char* condition, const char* file, int line) {
+    if (!passed) {
+        checkFailures++;
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, condition);
+    }
+}
+
+static inline void checkResult(int result, int expected, const char* call, const char* file, int line) {
+    if (result != expected) {
+        checkFailures++;
+        fprintf(stderr, "%s:%d: %s returned %d \"%s\", expected %d\n",
+            file, line, call, result, AHerrorCodeToMessage(result), expected);
+    }
+}
+
+// Prints the outcome, and returns the exit code for main
+static inline int checkSummary(const char* name) {
+    if (checkFailures != 0) {
+        printf("%s: %d checks failed\n", name, checkFailures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+static inline long long nowUS() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static inline void sleepMS(int milliseconds) {
+    struct timespec duration = {milliseconds / 1000, (milliseconds % 1000) * 1000000L};
+    nanosleep(&duration, 0);
+}
+
+// A number from the "data" of a completion from the stand-in, or -1
+static inline long long completionNumber(const AHCompletion* completion, const char* key) {
+    AHSpan value;
+    if (AHgetCompletionValue(completion, key, &value) != 0) {
+        return -1;
+    }
+    char text[32];
+    size_t length = value.length < sizeof(text) - 1 ? value.length : sizeof(text) - 1;
+    memcpy(text, value.data, length);
+    text[length] = 0;
+    return strtoll(text, 0, 10);
+}
+
+static inline unsigned long byteSum(const void* data, size_t length) {
+    unsigned long sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += ((const unsigned char*) data)[i];
+    }
+    return sum;
+}
+
+#endif
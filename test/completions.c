@@ -0,0 +1,74 @@
+/*
+ * Completions are picked apart in place: values are looked up by key,
+ * and an "error" from the App fails the request unless it is zero.
+ */
+
+#include "check.h"
+
+typedef struct {
+    int count;
+    int status[4];
+    long long bytes[4];
+    char payload[16];
+    char error[32];
+    int missing;
+} Completions;
+
+static void copySpan(AHSpan span, char* buffer, size_t bufferSize) {
+    size_t length = span.length < bufferSize - 1 ? span.length : bufferSize - 1;
+    memcpy(buffer, span.data, length);
+    buffer[length] = 0;
+}
+
+static void collect(const AHCompletion* completion, void* userData) {
+    Completions* completions = (Completions*) userData;
+    completions->count++;
+    if (completion->requestID < 1 || completion->requestID > 3) {
+        return;
+    }
+    completions->status[completion->requestID] = completion->status;
+    completions->bytes[completion->requestID] = completionNumber(completion, "bytes");
+
+    AHSpan value;
+    if (completion->requestID == 1 && AHgetCompletionValue(completion, "payload", &value) == 0) {
+        copySpan(value, completions->payload, sizeof(completions->payload));
+    }
+    if (completion->requestID == 2 && AHgetCompletionValue(completion, "error", &value) == 0) {
+        copySpan(value, completions->error, sizeof(completions->error));
+    }
+    completions->missing = AHgetCompletionValue(completion, "title", &value);
+}
+
+int main() {
+    setenv("ALLIHOOPA_FAKE_PAYLOAD", "5", 1);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+
+    const char* drops[] = {
+        "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}",
+        "{\"fakeError\": \"Upload failed\"}",
+        "{\"fakeError\": 0}",
+    };
+    for (short int id = 1; id <= 3; id++) {
+        CHECK_RESULT(AHdrop(drops[id - 1], (unsigned short) strlen(drops[id - 1]), id), 0);
+    }
+
+    Completions completions;
+    memset(&completions, 0, sizeof(completions));
+    CHECK_RESULT(AHpollCompletions(collect, &completions), 0);
+    CHECK(completions.count == 3);
+
+    // Strings come without their quotes
+    CHECK(completions.status[1] == 0);
+    CHECK(completions.bytes[1] == (long long) strlen(drops[0]));
+    CHECK(strcmp(completions.payload, "xxxxx") == 0);
+    CHECK(completions.missing == AHErrorInvalidRequest);
+
+    // An error message from the App fails the request, an error of zero doesn't
+    CHECK(completions.status[2] == AHRequestFailed);
+    CHECK(strcmp(completions.error, "Upload failed") == 0);
+    CHECK(completions.status[3] == 0);
+
+    CHECK_RESULT(AHclose(), 0);
+    unsetenv("ALLIHOOPA_FAKE_PAYLOAD");
+    return checkSummary("completions");
+}
@@ -0,0 +1,148 @@
+/*
+ * Contexts drive their own App each, from their own threads at the same
+ * time, and neither their completions nor their counters mix. Each
+ * resolves "file:" URLs in the tmpDir it was set up with.
+ */
+
+#include "check.h"
+#include <pthread.h>
+
+#define Sessions 2
+#define Drops 40
+#define DelayUS 5000
+
+typedef struct {
+    AHContext* ctx;
+    short int firstID;
+    int completions;
+    int strangers;
+    long dropCalls;
+} Session;
+
+static void collect(const AHCompletion* completion, void* userData) {
+    Session* session = (Session*) userData;
+    if (completion->status == 0 && completion->requestID >= session->firstID
+        && completion->requestID < session->firstID + Drops) {
+        session->completions++;
+    }
+    else {
+        session->strangers++;
+    }
+}
+
+// The default context's when ctx is zero
+static long dropCalls(AHContext* ctx) {
+    char stats[4096];
+    size_t length = 0;
+    CHECK_RESULT(ctx != 0 ? AHgetStatsCtx(ctx, stats, sizeof(stats) - 1, &length)
+        : AHgetStats(stats, sizeof(stats) - 1, &length), 0);
+    stats[length < sizeof(stats) - 1 ? length : sizeof(stats) - 1] = 0;
+
+    const char* key = "\"drop\": {\"calls\": ";
+    const char* calls = strstr(stats, key);
+    return calls != 0 ? strtol(calls + strlen(key), 0, 10) : -1;
+}
+
+static void* runSession(void* argument) {
+    Session* session = (Session*) argument;
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    for (short int i = 0; i < Drops; i++) {
+        CHECK_RESULT(AHdropCtx(session->ctx, drop, (unsigned short) strlen(drop), session->firstID + i), 0);
+    }
+    return 0;
+}
+
+static void writeTestFile(const char* dir, const char* name, const char* content) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* file = fopen(path, "wb");
+    CHECK(file != 0);
+    CHECK(fwrite(content, 1, strlen(content), file) == strlen(content));
+    fclose(file);
+}
+
+static int fileExists(const char* dir, const char* name) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* file = fopen(path, "rb");
+    if (file != 0) {
+        fclose(file);
+    }
+    return file != 0;
+}
+
+// Set up one after the other, then used in turn
+static void separateTmpDirs() {
+    char tmpDirs[Sessions][32];
+    AHContext* contexts[Sessions];
+    char hashes[Sessions][AHContentHashLength];
+    for (int i = 0; i < Sessions; i++) {
+        snprintf(tmpDirs[i], sizeof(tmpDirs[i]), "/tmp/allihoopa-test-XXXXXX");
+        CHECK(mkdtemp(tmpDirs[i]) != 0);
+        writeTestFile(tmpDirs[i], "same.txt", i == 0 ? "first" : "second");
+        writeTestFile(tmpDirs[i], i == 0 ? "first.txt" : "second.txt", "only here");
+
+        char setup[128];
+        snprintf(setup, sizeof(setup), "{\"tmpDir\": \"%s\"}", tmpDirs[i]);
+        CHECK_RESULT(AHcreateContext(&contexts[i]), 0);
+        CHECK_RESULT(AHsetupCtx(contexts[i], setup, (unsigned short) strlen(setup)), 0);
+    }
+
+    char hash[AHContentHashLength];
+    for (int i = 0; i < Sessions; i++) {
+        CHECK_RESULT(AHhashContentCtx(contexts[i], "file:///same.txt", hashes[i], sizeof(hashes[i])), 0);
+        CHECK_RESULT(AHhashContentCtx(contexts[i], i == 0 ? "file:///first.txt" : "file:///second.txt",
+            hash, sizeof(hash)), 0);
+        CHECK(AHhashContentCtx(contexts[i], i == 0 ? "file:///second.txt" : "file:///first.txt",
+            hash, sizeof(hash)) != 0);
+        // Each keeps its hash index in its own tmpDir
+        CHECK(fileExists(tmpDirs[i], "allihoopa-hashes"));
+    }
+    CHECK(strcmp(hashes[0], hashes[1]) != 0);
+
+    for (int i = 0; i < Sessions; i++) {
+        CHECK_RESULT(AHdestroyContext(contexts[i]), 0);
+        char command[128];
+        snprintf(command, sizeof(command), "rm -rf %s", tmpDirs[i]);
+        CHECK(system(command) == 0);
+    }
+}
+
+int main() {
+    setenv("ALLIHOOPA_FAKE_DELAY_US", "5000", 1);
+    Session sessions[Sessions];
+    for (int i = 0; i < Sessions; i++) {
+        memset(&sessions[i], 0, sizeof(sessions[i]));
+        sessions[i].firstID = (short int) (1 + i * 1000);
+        CHECK_RESULT(AHcreateContext(&sessions[i].ctx), 0);
+        CHECK_RESULT(AHsetupCtx(sessions[i].ctx, "{}", 2), 0);
+    }
+
+    // Each session takes Drops delays, together they don't take twice that
+    pthread_t threads[Sessions];
+    long long startUS = nowUS();
+    for (int i = 0; i < Sessions; i++) {
+        CHECK(pthread_create(&threads[i], 0, runSession, &sessions[i]) == 0);
+    }
+    for (int i = 0; i < Sessions; i++) {
+        pthread_join(threads[i], 0);
+    }
+    CHECK(nowUS() - startUS < Sessions * Drops * DelayUS * 3 / 4);
+
+    for (int i = 0; i < Sessions; i++) {
+        CHECK_RESULT(AHpollCompletionsCtx(sessions[i].ctx, collect, &sessions[i]), 0);
+        sessions[i].dropCalls = dropCalls(sessions[i].ctx);
+        CHECK(sessions[i].completions == Drops);
+        CHECK(sessions[i].strangers == 0);
+        CHECK(sessions[i].dropCalls == Drops);
+        CHECK_RESULT(AHdestroyContext(sessions[i].ctx), 0);
+    }
+
+    separateTmpDirs();
+
+    // The default context was left alone
+    CHECK(dropCalls(0) == 0);
+    CHECK_RESULT(AHsetupCtx(0, "{}", 2), AHErrorInvalidRequest);
+    unsetenv("ALLIHOOPA_FAKE_DELAY_US");
+    return checkSummary("contexts");
+}
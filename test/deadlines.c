@@ -0,0 +1,71 @@
+/*
+ * Fire and forget drops return without waiting for the App, and a drop
+ * it refuses is reported as a completion. A per call timeout fails the
+ * call once it has passed, and the drop still completes.
+ */
+
+#include "check.h"
+
+#define DelayMS 200
+
+typedef struct {
+    int count;
+    int status[8];
+    int seen[8];
+} Completions;
+
+static void collect(const AHCompletion* completion, void* userData) {
+    Completions* completions = (Completions*) userData;
+    completions->count++;
+    int slot = completion->requestID < 0 ? -completion->requestID : completion->requestID;
+    if (slot < 8) {
+        completions->seen[slot]++;
+        completions->status[slot] = completion->status;
+    }
+}
+
+static void pollFor(Completions* completions, int count) {
+    for (int attempt = 0; attempt < 10 && completions->count < count; attempt++) {
+        sleepMS(DelayMS);
+        CHECK_RESULT(AHpollCompletions(collect, completions), 0);
+    }
+    CHECK(completions->count == count);
+}
+
+int main() {
+    // Each reply takes a while
+    setenv("ALLIHOOPA_FAKE_DELAY_US", "200000", 1);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    Completions completions;
+    memset(&completions, 0, sizeof(completions));
+
+    AHCallOptions options = {0, AHCallFireAndForget, AHPriorityNormal};
+    long long startUS = nowUS();
+    CHECK_RESULT(AHdropWithOptions(drop, (unsigned short) strlen(drop), 1, &options), 0);
+    CHECK_RESULT(AHdropWithOptions(drop, (unsigned short) strlen(drop), -2, &options), 0);
+    CHECK(nowUS() - startUS < DelayMS * 1000 / 2);
+
+    pollFor(&completions, 2);
+    CHECK(completions.seen[1] == 1 && completions.status[1] == 0);
+    CHECK(completions.seen[2] == 1 && completions.status[2] == AHRequestFailed);
+
+    // Fails once the call's own deadline has passed
+    AHCallOptions hurried = {DelayMS / 4, 0, AHPriorityNormal};
+    startUS = nowUS();
+    CHECK_RESULT(AHdropWithOptions(drop, (unsigned short) strlen(drop), 3, &hurried), AHErrorTimeout);
+    long long elapsedUS = nowUS() - startUS;
+    CHECK(elapsedUS >= DelayMS * 1000 / 4 && elapsedUS < DelayMS * 1000);
+
+    // The App got the drop anyway
+    pollFor(&completions, 3);
+    CHECK(completions.seen[3] == 1 && completions.status[3] == 0);
+
+    // Flags only for AHdropFields
+    AHCallOptions preview = {0, AHCallGeneratePreview, AHPriorityNormal};
+    CHECK_RESULT(AHdropWithOptions(drop, (unsigned short) strlen(drop), 4, &preview), AHErrorInvalidRequest);
+
+    CHECK_RESULT(AHclose(), 0);
+    unsetenv("ALLIHOOPA_FAKE_DELAY_US");
+    return checkSummary("deadlines");
+}
@@ -0,0 +1,153 @@
+/*
+ * AHdropFields sends the same request as AHbuildDropRequest builds to
+ * apps that take JSON, and a smaller CBOR body to apps that take CBOR,
+ * whose completions then come back as CBOR and are turned into JSON.
+ * The CBOR body, echoed back by the App, turns into the JSON request.
+ */
+
+#include "check.h"
+
+typedef struct {
+    int count;
+    short int requestID;
+    int status;
+    long long bytes;
+    long long sum;
+    char drop[AHMaxRequestBody];
+    size_t dropLength;
+} Completions;
+
+static void collect(const AHCompletion* completion, void* userData) {
+    Completions* completions = (Completions*) userData;
+    completions->count++;
+    completions->requestID = completion->requestID;
+    completions->status = completion->status;
+    completions->bytes = completionNumber(completion, "bytes");
+    completions->sum = completionNumber(completion, "sum");
+
+    AHSpan drop;
+    completions->dropLength = 0;
+    if (AHgetCompletionValue(completion, "drop", &drop) == 0 && drop.length <= sizeof(completions->drop)) {
+        memcpy(completions->drop, drop.data, drop.length);
+        completions->dropLength = drop.length;
+    }
+}
+
+static AHDropRequest fullRequest() {
+    AHDropRequest request;
+    memset(&request, 0, sizeof(request));
+    request.mixStemURL = "file:///mix.wav";
+    request.title = "\"Quoted\" \\ tab\t \xc3\xa5";
+    request.previewURL = "file:///mix-preview.wav";
+    request.basedOnPieces[0] = "ab12";
+    request.basedOnPieceCount = 1;
+    request.lengthMicroseconds = 5217392;
+    request.tempo = 92.5;
+    request.loopEndMicroseconds = 2000000;
+    request.timeSignatureUpper = 6;
+    request.timeSignatureLower = 8;
+    request.tonalityMode = AHTonalityTonal;
+    static const unsigned char major[12] = {1, 0, 1, 0, 1, 1, 0, 1, 0, 1, 0, 1};
+    memcpy(request.scale, major, sizeof(major));
+    request.tonalityRoot = 9;
+    request.attachments[0].mimeType = "image/png";
+    request.attachments[0].dataURL = "data:image/png;base64,AAAA";
+    request.attachmentCount = 1;
+    return request;
+}
+
+// Returns the body length the app received
+static long long dropFields(const AHDropRequest* request, short int requestID) {
+    CHECK_RESULT(AHdropFields(request, requestID, NULL), 0);
+    static Completions completions;
+    memset(&completions, 0, sizeof(completions));
+    CHECK_RESULT(AHpollCompletions(collect, &completions), 0);
+    CHECK(completions.count == 1);
+    CHECK(completions.requestID == requestID);
+    CHECK(completions.status == 0);
+    return completions.bytes;
+}
+
+static void asJSON(const char* capabilities) {
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", capabilities, 1);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+
+    AHDropRequest request = fullRequest();
+    static char json[AHMaxRequestBody];
+    unsigned short jsonLength = 0;
+    CHECK_RESULT(AHbuildDropRequest(&request, json, sizeof(json), &jsonLength), 0);
+
+    CHECK_RESULT(AHdropFields(&request, 3, NULL), 0);
+    static Completions completions;
+    memset(&completions, 0, sizeof(completions));
+    CHECK_RESULT(AHpollCompletions(collect, &completions), 0);
+    CHECK(completions.count == 1 && completions.requestID == 3 && completions.status == 0);
+    CHECK(completions.bytes == jsonLength);
+    CHECK(completions.sum == (long long) byteSum(json, jsonLength));
+
+    CHECK_RESULT(AHclose(), 0);
+    unsetenv("ALLIHOOPA_FAKE_CAPABILITIES");
+}
+
+static void asCBOR() {
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", "frameV2", 1);
+    setenv("ALLIHOOPA_FAKE_CBOR", "1", 1);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+
+    AHDropRequest request = fullRequest();
+    static char json[AHMaxRequestBody];
+    unsigned short jsonLength = 0;
+    CHECK_RESULT(AHbuildDropRequest(&request, json, sizeof(json), &jsonLength), 0);
+
+    long long bytes = dropFields(&request, 4);
+    CHECK(bytes > 0 && bytes < jsonLength);
+    // Request IDs above 255 keep their byte order
+    CHECK(dropFields(&request, 0x1234) == bytes);
+
+    // Refused by the app, with the refusal as a CBOR reply
+    CHECK_RESULT(AHdropFields(&request, -5, NULL), AHRequestFailed);
+
+    // Checked before anything is sent
+    request.title = 0;
+    CHECK_RESULT(AHdropFields(&request, 6, NULL), AHErrorInvalidRequest);
+
+    CHECK_RESULT(AHclose(), 0);
+    unsetenv("ALLIHOOPA_FAKE_CAPABILITIES");
+    unsetenv("ALLIHOOPA_FAKE_CBOR");
+}
+
+static void cborKnownAnswer() {
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", "frameV2", 1);
+    setenv("ALLIHOOPA_FAKE_CBOR", "1", 1);
+    setenv("ALLIHOOPA_FAKE_ECHO", "1", 1);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+
+    AHDropRequest request = fullRequest();
+    static char json[AHMaxRequestBody];
+    unsigned short jsonLength = 0;
+    CHECK_RESULT(AHbuildDropRequest(&request, json, sizeof(json), &jsonLength), 0);
+
+    // Sent as CBOR, echoed in a CBOR completion, and handed on as JSON
+    CHECK_RESULT(AHdropFields(&request, 7, NULL), 0);
+    static Completions completions;
+    memset(&completions, 0, sizeof(completions));
+    CHECK_RESULT(AHpollCompletions(collect, &completions), 0);
+    CHECK(completions.count == 1 && completions.requestID == 7 && completions.status == 0);
+    CHECK(completions.bytes > 0 && completions.bytes < jsonLength);
+    CHECK(completions.dropLength == jsonLength);
+    CHECK(memcmp(completions.drop, json, jsonLength) == 0);
+
+    CHECK_RESULT(AHclose(), 0);
+    unsetenv("ALLIHOOPA_FAKE_CAPABILITIES");
+    unsetenv("ALLIHOOPA_FAKE_CBOR");
+    unsetenv("ALLIHOOPA_FAKE_ECHO");
+}
+
+int main() {
+    asJSON("");
+    // Offered CBOR in 'vers', but doesn't take it
+    asJSON("frameV2");
+    asCBOR();
+    cborKnownAnswer();
+    return checkSummary("fields");
+}
@@ -0,0 +1,148 @@
+/*
+ * AHhashContent gives the XXH64 of a file's content, and keeps it in an
+ * index in tmpDir that is appended to, so that unchanged files aren't
+ * read again, and compacted once it has grown.
+ */
+
+#include "check.h"
+#include <unistd.h>
+#include <sys/time.h>
+
+static char tmpDir[] = "/tmp/allihoopa-test-XXXXXX";
+
+static void writeTestFile(const char* name, const char* content, size_t length, long secondsAgo) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", tmpDir, name);
+    FILE* file = fopen(path, "wb");
+    CHECK(file != 0);
+    CHECK(fwrite(content, 1, length, file) == length);
+    fclose(file);
+
+    // Old enough to be taken from the index
+    struct timeval times[2];
+    gettimeofday(&times[0], 0);
+    times[0].tv_sec -= secondsAgo;
+    times[1] = times[0];
+    CHECK(utimes(path, times) == 0);
+}
+
+static void checkHash(const char* url, const char* expected) {
+    char hash[AHContentHashLength];
+    CHECK_RESULT(AHhashContent(url, hash, sizeof(hash)), 0);
+    if (strcmp(hash, expected) != 0) {
+        fprintf(stderr, "%s: %s, expected %s\n", url, hash, expected);
+        CHECK(strcmp(hash, expected) == 0);
+    }
+}
+
+static int indexLines() {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/allihoopa-hashes", tmpDir);
+    FILE* file = fopen(path, "r");
+    if (file == 0) {
+        return 0;
+    }
+    int lines = 0;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        lines += c == '\n';
+    }
+    fclose(file);
+    return lines;
+}
+
+// Known answers of XXH64 with a zero seed
+static void knownAnswers() {
+    static const char* const contents[] = {"", "a", "abc", "Nobody inspects the spammish repetition"};
+    static const char* const hashes[] = {
+        "xxh64:ef46db3751d8e999", "xxh64:d24ec4f1a98c6e5b",
+        "xxh64:44bc2cf5ad770999", "xxh64:fbcea83c8a378bf1"
+    };
+    for (int i = 0; i < 4; i++) {
+        char name[32];
+        char url[64];
+        snprintf(name, sizeof(name), "known%d", i);
+        snprintf(url, sizeof(url), "file:///%s", name);
+        writeTestFile(name, contents[i], strlen(contents[i]), 60);
+        checkHash(url, hashes[i]);
+    }
+
+    // Past the 32 byte blocks, with the 8, 4 and 1 byte tails
+    char sequence[103];
+    for (size_t i = 0; i < sizeof(sequence); i++) {
+        sequence[i] = (char) i;
+    }
+    writeTestFile("long", sequence, sizeof(sequence), 60);
+    checkHash("file:///long", "xxh64:ab3e7961fd618891");
+
+    char hash[AHContentHashLength];
+    CHECK_RESULT(AHhashContent("file:///missing", hash, sizeof(hash)), AHErrorInvalidRequest);
+    CHECK_RESULT(AHhashContent("file:///long", hash, sizeof(hash) - 1), AHErrorInvalidRequest);
+}
+
+static void indexedFiles() {
+    int lines = indexLines();
+    writeTestFile("mix.wav", "first", 5, 60);
+    checkHash("file:///mix.wav", "xxh64:cc98257fe4be8f5a");
+    CHECK(indexLines() == lines + 1);
+
+    // Taken from the index
+    checkHash("file:///mix.wav", "xxh64:cc98257fe4be8f5a");
+    CHECK(indexLines() == lines + 1);
+
+    // Changed, the new entry takes over
+    writeTestFile("mix.wav", "second", 6, 30);
+    checkHash("file:///mix.wav", "xxh64:ca7ffbd94d5e0037");
+    CHECK(indexLines() == lines + 2);
+    checkHash("file:///mix.wav", "xxh64:ca7ffbd94d5e0037");
+    CHECK(indexLines() == lines + 2);
+
+    // Just modified, hashed each time until the time stamp can be trusted
+    writeTestFile("fresh.wav", "first", 5, 0);
+    checkHash("file:///fresh.wav", "xxh64:cc98257fe4be8f5a");
+    checkHash("file:///fresh.wav", "xxh64:cc98257fe4be8f5a");
+    CHECK(indexLines() == lines + 4);
+}
+
+// Many files, and the same ones over and over, only keep the latest entries
+static void compaction() {
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 200; i++) {
+            char name[32];
+            char url[64];
+            snprintf(name, sizeof(name), "file%d", i);
+            snprintf(url, sizeof(url), "file:///%s", name);
+            writeTestFile(name, name, strlen(name), 60 - round);
+            char hash[AHContentHashLength];
+            CHECK_RESULT(AHhashContent(url, hash, sizeof(hash)), 0);
+            CHECK(indexLines() <= 512);
+        }
+    }
+
+    // The latest entries are still there
+    int lines = indexLines();
+    char hash[AHContentHashLength];
+    CHECK_RESULT(AHhashContent("file:///file199", hash, sizeof(hash)), 0);
+    CHECK(indexLines() == lines);
+
+    char path[128];
+    snprintf(path, sizeof(path), "%s/allihoopa-hashes.tmp", tmpDir);
+    CHECK(access(path, F_OK) != 0);
+}
+
+int main() {
+    CHECK(mkdtemp(tmpDir) != 0);
+    char setup[128];
+    snprintf(setup, sizeof(setup), "{\"tmpDir\": \"%s\"}", tmpDir);
+    CHECK_RESULT(AHsetup(setup, (unsigned short) strlen(setup)), 0);
+
+    knownAnswers();
+    indexedFiles();
+    compaction();
+
+    CHECK_RESULT(AHclose(), 0);
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf %s", tmpDir);
+    CHECK(system(command) == 0);
+    return checkSummary("hashes");
+}
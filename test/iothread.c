@@ -0,0 +1,114 @@
+/*
+ * With the IO thread running, drops can be made from several threads at
+ * once, and every one of them completes. Handlers may poll again, with
+ * or without the IO thread, and each completion is delivered once.
+ */
+
+#include "check.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define ProducerCount 4
+#define DropsPerProducer 250
+
+static void* produce(void* argument) {
+    short int firstID = (short int) (intptr_t) argument;
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    for (short int i = 0; i < DropsPerProducer; i++) {
+        int result;
+        // Waits for room when the queue is full
+        while ((result = AHdrop(drop, (unsigned short) strlen(drop), (short int) (firstID + i))) == AHErrorWouldBlock) {
+            sleepMS(1);
+        }
+        CHECK_RESULT(result, 0);
+    }
+    return 0;
+}
+
+typedef struct {
+    int count;
+    int seen[ProducerCount * DropsPerProducer + 1];
+} Completions;
+
+static void collect(const AHCompletion* completion, void* userData) {
+    Completions* completions = (Completions*) userData;
+    completions->count++;
+    if (completion->status == 0 && completion->requestID > 0
+        && completion->requestID <= ProducerCount * DropsPerProducer) {
+        completions->seen[completion->requestID]++;
+    }
+}
+
+#define NestedDrops 16
+
+static Completions nested;
+static int nestingDepth = 0;
+
+static void collectAndPollAgain(const AHCompletion* completion, void* userData) {
+    collect(completion, userData);
+    if (nestingDepth == 0) {
+        nestingDepth++;
+        CHECK_RESULT(AHpollCompletions(collectAndPollAgain, userData), 0);
+        nestingDepth--;
+    }
+}
+
+static void pollFromHandlers(int ioThread) {
+    memset(&nested, 0, sizeof(nested));
+    if (ioThread) {
+        CHECK_RESULT(AHstartIOThread(1), 0);
+    }
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    for (short int id = 1; id <= NestedDrops; id++) {
+        CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), id), 0);
+    }
+    for (int attempt = 0; attempt < 100 && nested.count < NestedDrops; attempt++) {
+        CHECK_RESULT(AHpollCompletions(collectAndPollAgain, &nested), 0);
+        sleepMS(10);
+    }
+
+    CHECK(nested.count == NestedDrops);
+    for (int id = 1; id <= NestedDrops; id++) {
+        CHECK(nested.seen[id] == 1);
+    }
+    CHECK_RESULT(AHclose(), 0);
+    if (ioThread) {
+        CHECK_RESULT(AHstopIOThread(), 0);
+    }
+}
+
+int main() {
+    // A short queue, so that the producers also wait for room
+    CHECK_RESULT(AHsetQueueLimits(16, AHMinCompletionRingSize), 0);
+    CHECK_RESULT(AHstartIOThread(1), 0);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+
+    pthread_t producers[ProducerCount];
+    for (int i = 0; i < ProducerCount; i++) {
+        pthread_create(&producers[i], 0, produce, (void*) (intptr_t) (1 + i * DropsPerProducer));
+    }
+
+    static Completions completions;
+    for (int attempt = 0; attempt < 500 && completions.count < ProducerCount * DropsPerProducer; attempt++) {
+        CHECK_RESULT(AHpollCompletions(collect, &completions), 0);
+        sleepMS(10);
+    }
+    for (int i = 0; i < ProducerCount; i++) {
+        pthread_join(producers[i], 0);
+    }
+
+    CHECK(completions.count == ProducerCount * DropsPerProducer);
+    int missing = 0;
+    for (int id = 1; id <= ProducerCount * DropsPerProducer; id++) {
+        missing += completions.seen[id] != 1;
+    }
+    CHECK(missing == 0);
+
+    CHECK_RESULT(AHclose(), 0);
+    CHECK_RESULT(AHstopIOThread(), 0);
+
+    pollFromHandlers(1);
+    pollFromHandlers(0);
+    return checkSummary("iothread");
+}
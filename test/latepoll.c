@@ -0,0 +1,69 @@
+/*
+ * Completions in the reply to a poll that timed out are delivered by the
+ * next poll, also when another call has read the reply in the meantime.
+ */
+
+#include "check.h"
+
+typedef struct {
+    int count;
+    int seen[4];
+} Completions;
+
+static void collect(const AHCompletion* completion, void* userData) {
+    Completions* completions = (Completions*) userData;
+    completions->count++;
+    if (completion->status == 0 && completion->requestID > 0 && completion->requestID < 4) {
+        completions->seen[completion->requestID]++;
+    }
+}
+
+// Each poll may time out again, the completions still get through
+static void pollFor(Completions* completions, int count) {
+    for (int attempt = 0; attempt < 5 && completions->count < count; attempt++) {
+        sleepMS(300);
+        AHpollCompletions(collect, completions);
+    }
+    CHECK(completions->count == count);
+    sleepMS(300);
+}
+
+static void latePolls(const char* capabilities) {
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", capabilities, 1);
+    // Polls take longer than the calls may
+    setenv("ALLIHOOPA_FAKE_POLL_DELAY_US", "200000", 1);
+    const char* setup = "{\"timeoutMs\": 50}";
+    CHECK_RESULT(AHsetup(setup, (unsigned short) strlen(setup)), 0);
+
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    Completions completions = {0, {0}};
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 1), 0);
+    CHECK_RESULT(AHpollCompletions(collect, &completions), AHErrorTimeout);
+    CHECK(completions.count == 0);
+
+    // Picked up by the next poll
+    sleepMS(300);
+    AHpollCompletions(collect, &completions);
+    CHECK(completions.count == 1 && completions.seen[1] == 1);
+    sleepMS(300);
+
+    // Read by a drop, and kept for the next poll
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 2), 0);
+    CHECK_RESULT(AHpollCompletions(collect, &completions), AHErrorTimeout);
+    sleepMS(300);
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 3), 0);
+    AHpollCompletions(collect, &completions);
+    CHECK(completions.count == 2 && completions.seen[2] == 1);
+    pollFor(&completions, 3);
+    CHECK(completions.seen[1] == 1 && completions.seen[3] == 1);
+
+    CHECK_RESULT(AHclose(), 0);
+    unsetenv("ALLIHOOPA_FAKE_POLL_DELAY_US");
+    unsetenv("ALLIHOOPA_FAKE_CAPABILITIES");
+}
+
+int main() {
+    latePolls("");
+    latePolls("pollBatch");
+    return checkSummary("latepoll");
+}
@@ -0,0 +1,62 @@
+/*
+ * The completion handle polls as readable once a drop has completed, and
+ * the IO thread only polls apps that notify when they have completions.
+ */
+
+#include "check.h"
+#include <poll.h>
+
+// Calls of a command in the AHgetStats snapshot
+static long commandCalls(const char* command) {
+    char stats[4096];
+    size_t length = 0;
+    CHECK_RESULT(AHgetStats(stats, sizeof(stats) - 1, &length), 0);
+    stats[length < sizeof(stats) - 1 ? length : sizeof(stats) - 1] = 0;
+
+    char key[32];
+    snprintf(key, sizeof(key), "\"%s\": {\"calls\": ", command);
+    const char* calls = strstr(stats, key);
+    return calls != 0 ? strtol(calls + strlen(key), 0, 10) : -1;
+}
+
+static int completions = 0;
+
+static void countCompletion(const AHCompletion* completion, void* userData) {
+    (void) userData;
+    completions += completion->status == 0 && completion->requestID == 1;
+}
+
+// Returns the polls made by the IO thread while idle
+static long idleAndDrop(const char* capabilities) {
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", capabilities, 1);
+    CHECK_RESULT(AHstartIOThread(5), 0);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    AHWaitHandle handle;
+    CHECK_RESULT(AHgetCompletionHandle(&handle), 0);
+
+    sleepMS(50);
+    long before = commandCalls("poll");
+    sleepMS(200);
+    long idlePolls = commandCalls("poll") - before;
+
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 1), 0);
+    struct pollfd readable = {handle, POLLIN, 0};
+    CHECK(poll(&readable, 1, 1000) == 1);
+
+    completions = 0;
+    CHECK_RESULT(AHpollCompletions(countCompletion, 0), 0);
+    CHECK(completions == 1);
+
+    CHECK_RESULT(AHclose(), 0);
+    CHECK_RESULT(AHstopIOThread(), 0);
+    unsetenv("ALLIHOOPA_FAKE_CAPABILITIES");
+    return idlePolls;
+}
+
+int main() {
+    // Polled every 5 ms when the App doesn't notify
+    CHECK(idleAndDrop("") >= 10);
+    CHECK(idleAndDrop("notify") == 0);
+    return checkSummary("notify");
+}
@@ -0,0 +1,56 @@
+/*
+ * Pipelined drops return once written, their replies are matched by
+ * request ID, and a drop the App refuses completes with an error.
+ */
+
+#include "check.h"
+
+typedef struct {
+    int count;
+    int seen[32];
+    int refusedStatus;
+} Completions;
+
+static void collect(const AHCompletion* completion, void* userData) {
+    Completions* completions = (Completions*) userData;
+    completions->count++;
+    if (completion->requestID < 0) {
+        completions->refusedStatus = completion->status;
+    } else if (completion->status == 0 && completion->requestID < 32) {
+        completions->seen[completion->requestID]++;
+    }
+}
+
+int main() {
+    // Slow replies, so that the drops are in flight at the same time
+    setenv("ALLIHOOPA_FAKE_DELAY_US", "2000", 1);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    CHECK_RESULT(AHsetPipelineDepth(16), 0);
+
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    long long startUS = nowUS();
+    for (short int id = 1; id <= 16; id++) {
+        CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), id), 0);
+    }
+    // Waiting for each reply would take at least 16 delays
+    CHECK(nowUS() - startUS < 16 * 2000);
+
+    // The App refuses drops with negative IDs
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), -1), 0);
+
+    Completions completions = {0, {0}, 0};
+    for (int attempt = 0; attempt < 40 && completions.count < 17; attempt++) {
+        CHECK_RESULT(AHpollCompletions(collect, &completions), 0);
+        sleepMS(10);
+    }
+    CHECK(completions.count == 17);
+    for (int id = 1; id <= 16; id++) {
+        CHECK(completions.seen[id] == 1);
+    }
+    CHECK(completions.refusedStatus != 0);
+
+    CHECK_RESULT(AHsetPipelineDepth(0), AHErrorInvalidRequest);
+    CHECK_RESULT(AHclose(), 0);
+    unsetenv("ALLIHOOPA_FAKE_DELAY_US");
+    return checkSummary("pipeline");
+}
@@ -0,0 +1,60 @@
+/*
+ * Apps that support it are drained of completions in one round trip,
+ * and only a name in the "capabilities" of the setup reply turns a
+ * capability on.
+ */
+
+#include "check.h"
+
+#define Drops 50
+#define PollDelayUS 10000
+
+static int completions = 0;
+
+static void countCompletion(const char* completion, unsigned short length) {
+    (void) completion;
+    (void) length;
+    completions++;
+}
+
+// Returns the microseconds it took to poll for the completions of the drops
+static long long dropAndPoll() {
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    for (short int id = 1; id <= Drops; id++) {
+        CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), id), 0);
+    }
+
+    completions = 0;
+    long long startUS = nowUS();
+    CHECK_RESULT(AHpollCompletedRequests(countCompletion), 0);
+    long long pollUS = nowUS() - startUS;
+    CHECK(completions == Drops);
+    return pollUS;
+}
+
+static long long pollWith(const char* capabilities, const char* message) {
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", capabilities, 1);
+    setenv("ALLIHOOPA_FAKE_POLL_DELAY_US", "10000", 1);
+    if (message != 0) {
+        setenv("ALLIHOOPA_FAKE_MESSAGE", message, 1);
+    }
+
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    long long pollUS = dropAndPoll();
+    CHECK_RESULT(AHclose(), 0);
+
+    unsetenv("ALLIHOOPA_FAKE_CAPABILITIES");
+    unsetenv("ALLIHOOPA_FAKE_POLL_DELAY_US");
+    unsetenv("ALLIHOOPA_FAKE_MESSAGE");
+    return pollUS;
+}
+
+int main() {
+    // One slow poll instead of one per completion
+    CHECK(pollWith("pollBatch", 0) < Drops / 2 * PollDelayUS);
+    CHECK(pollWith("", 0) >= Drops * PollDelayUS);
+
+    // The stand-in fails batched polls it hasn't offered
+    CHECK(pollWith("", "pollBatch") >= Drops * PollDelayUS);
+    return checkSummary("pollbatch");
+}
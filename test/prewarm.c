@@ -0,0 +1,99 @@
+/*
+ * AHprewarm launches the App in the background. The next call waits for
+ * the launch to finish, a failed launch is reported by that call, and
+ * AHclose waits for the launch before closing the App.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define StartupMS 300
+
+typedef struct {
+    long long allocations;
+    long long releases;
+} Counters;
+
+static void* countingAlloc(size_t size, void* userData) {
+    ((Counters*) userData)->allocations++;
+    return malloc(size);
+}
+
+static void countingFree(void* memory, void* userData) {
+    if (memory != 0) {
+        ((Counters*) userData)->releases++;
+    }
+    free(memory);
+}
+
+static int completions = 0;
+
+static void countCompletion(const char* completion, unsigned short length) {
+    (void) completion;
+    (void) length;
+    completions++;
+}
+
+static void dropWaitsForLaunch() {
+    long long startUS = nowUS();
+    CHECK_RESULT(AHprewarm("{}", 2), 0);
+    CHECK(nowUS() - startUS < StartupMS * 1000 / 2);
+    // Still launching
+    CHECK_RESULT(AHprewarm("{}", 2), AHErrorInvalidRequest);
+
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 1), 0);
+    CHECK(nowUS() - startUS >= StartupMS * 1000);
+
+    unsigned int launchMS = 0;
+    CHECK_RESULT(AHgetLaunchTime(&launchMS), 0);
+    CHECK(launchMS >= StartupMS);
+
+    completions = 0;
+    CHECK_RESULT(AHpollCompletedRequests(countCompletion), 0);
+    CHECK(completions == 1);
+    CHECK_RESULT(AHclose(), 0);
+}
+
+static void closeJoinsLaunch() {
+    Counters counters = {0, 0};
+    CHECK_RESULT(AHsetAllocator(countingAlloc, countingFree, &counters), 0);
+
+    long long startUS = nowUS();
+    CHECK_RESULT(AHprewarm("{}", 2), 0);
+    CHECK_RESULT(AHclose(), 0);
+    CHECK(nowUS() - startUS >= StartupMS * 1000);
+
+    // The launch is over, and the App it started is closed and reaped
+    CHECK(counters.allocations != 0 && counters.releases == counters.allocations);
+    CHECK_RESULT(AHsetAllocator(0, 0, 0), 0);
+    int status = 0;
+    CHECK(waitpid(-1, &status, WNOHANG) == -1 && errno == ECHILD);
+}
+
+static void failedLaunch() {
+    // The stand-in is launched by a relative path
+    char directory[1024];
+    CHECK(getcwd(directory, sizeof(directory)) != 0);
+    CHECK(chdir("/") == 0);
+    CHECK_RESULT(AHprewarm("{}", 2), 0);
+
+    // Reported by the next call, once
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 1), AHErrorAppNotFound);
+    CHECK(chdir(directory) == 0);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 2), 0);
+    CHECK_RESULT(AHclose(), 0);
+}
+
+int main() {
+    setenv("ALLIHOOPA_FAKE_STARTUP_US", "300000", 1);
+    dropWaitsForLaunch();
+    closeJoinsLaunch();
+    unsetenv("ALLIHOOPA_FAKE_STARTUP_US");
+    failedLaunch();
+    return checkSummary("prewarm");
+}
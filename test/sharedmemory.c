@@ -0,0 +1,62 @@
+/*
+ * Drops above the frame limit reach the App whole, through shared memory
+ * or as large v2 frames, and fail with apps that take neither.
+ */
+
+#include "check.h"
+
+#define LargeDropLength (3 * 1024 * 1024)
+
+typedef struct {
+    int count;
+    long long bytes;
+    long long sum;
+} Completions;
+
+static void collect(const AHCompletion* completion, void* userData) {
+    Completions* completions = (Completions*) userData;
+    completions->count++;
+    completions->bytes = completionNumber(completion, "bytes");
+    completions->sum = completionNumber(completion, "sum");
+}
+
+// A JSON drop request padded out to length
+static char* largeDrop(size_t length) {
+    const char* start = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}, \"presentation\": {\"description\": \"";
+    char* drop = malloc(length);
+    memset(drop, 'a', length);
+    memcpy(drop, start, strlen(start));
+    memcpy(&drop[length - 3], "\"}}", 3);
+    return drop;
+}
+
+static void dropLarge(const char* capabilities, int expected) {
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", capabilities, 1);
+    char* drop = largeDrop(LargeDropLength);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+
+    // Several drops, reusing the region
+    for (short int id = 1; id <= 3; id++) {
+        drop[100] = (char) ('a' + id);
+        CHECK_RESULT(AHdropLarge(drop, LargeDropLength, id), expected);
+        if (expected != 0) {
+            continue;
+        }
+        Completions completions = {0, 0, 0};
+        CHECK_RESULT(AHpollCompletions(collect, &completions), 0);
+        CHECK(completions.count == 1);
+        CHECK(completions.bytes == LargeDropLength);
+        CHECK(completions.sum == (long long) byteSum(drop, LargeDropLength));
+    }
+
+    CHECK_RESULT(AHclose(), 0);
+    free(drop);
+    unsetenv("ALLIHOOPA_FAKE_CAPABILITIES");
+}
+
+int main() {
+    dropLarge("sharedMemory", 0);
+    dropLarge("frameV2", 0);
+    dropLarge("", AHErrorNotSupported);
+    return checkSummary("sharedmemory");
+}
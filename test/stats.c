@@ -0,0 +1,98 @@
+/*
+ * AHgetStats counts calls and puts each reply latency in its histogram
+ * bucket, and the percentiles are taken from the buckets, checked with
+ * a few drops that the stand-in is slow to reply to.
+ */
+
+#include "check.h"
+
+#define Drops 100
+#define SlowDrops 2
+#define SlowUS 50000
+
+typedef struct {
+    long long calls;
+    long long latencyUS[32];
+    int buckets;
+    long long percentiles[3];
+} CommandCounts;
+
+// Picks the counts of a command out of the snapshot
+static void commandCounts(const char* command, CommandCounts* oCounts) {
+    char stats[4096];
+    size_t length = 0;
+    memset(oCounts, 0, sizeof(*oCounts));
+    CHECK_RESULT(AHgetStats(stats, sizeof(stats) - 1, &length), 0);
+    stats[length < sizeof(stats) - 1 ? length : sizeof(stats) - 1] = 0;
+
+    char key[32];
+    snprintf(key, sizeof(key), "\"%s\": {\"calls\": ", command);
+    const char* at = strstr(stats, key);
+    if (at == 0) {
+        return;
+    }
+    oCounts->calls = strtoll(at + strlen(key), 0, 10);
+
+    const char* histogram = strstr(at, "\"latencyUs\": [");
+    char* next = (char*) histogram + strlen("\"latencyUs\": [");
+    while (histogram != 0 && *next != ']' && oCounts->buckets < 32) {
+        oCounts->latencyUS[oCounts->buckets++] = strtoll(next, &next, 10);
+        next += *next == ',' ? 1 : 0;
+    }
+
+    static const char* names[] = {"\"p50Us\": ", "\"p99Us\": ", "\"p999Us\": "};
+    for (int i = 0; i < 3; i++) {
+        const char* percentile = strstr(at, names[i]);
+        oCounts->percentiles[i] = percentile != 0 ? strtoll(percentile + strlen(names[i]), 0, 10) : -1;
+    }
+}
+
+// The bucket that a latency is counted in
+static int bucketOf(long long latencyUS) {
+    int bucket = 0;
+    while ((1LL << bucket) <= latencyUS) {
+        bucket++;
+    }
+    return bucket;
+}
+
+int main() {
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+
+    CommandCounts drop;
+    commandCounts("drop", &drop);
+    CHECK(drop.calls == 0);
+    CHECK(drop.percentiles[0] == 0);
+
+    const char* fastDrop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    char slowDrop[64];
+    snprintf(slowDrop, sizeof(slowDrop), "{\"fakeDelayUs\": %d}", SlowUS);
+    for (short int id = 1; id <= Drops; id++) {
+        const char* data = id <= Drops - SlowDrops ? fastDrop : slowDrop;
+        CHECK_RESULT(AHdrop(data, (unsigned short) strlen(data), id), 0);
+    }
+
+    commandCounts("drop", &drop);
+    CHECK(drop.calls == Drops);
+    CHECK(drop.buckets > bucketOf(SlowUS));
+
+    // The slow replies took at least the delay, the fast ones a lot less
+    long long replies = 0;
+    long long slow = 0;
+    for (int bucket = 0; bucket < drop.buckets; bucket++) {
+        replies += drop.latencyUS[bucket];
+        if (bucket >= bucketOf(SlowUS)) {
+            slow += drop.latencyUS[bucket];
+        }
+    }
+    CHECK(replies == Drops);
+    CHECK(slow == SlowDrops);
+
+    // The median is a fast reply, the 99th and 99.9th percentiles are slow
+    CHECK(drop.percentiles[0] > 0 && drop.percentiles[0] < SlowUS);
+    CHECK(drop.percentiles[1] >= 1LL << bucketOf(SlowUS));
+    CHECK(drop.percentiles[2] == drop.percentiles[1]);
+
+    CHECK_RESULT(AHclose(), 0);
+    return checkSummary("stats");
+}
@@ -0,0 +1,227 @@
+/*
+ * Stems handed to the App, from memory or from a file, arrive whole, and
+ * apps that take neither handles nor chunks are turned down.
+ *
+ * Stems sent to the App in chunks arrive whole, a chunk that fails its
+ * checksum is sent again, and the transfer shares one deadline, resuming
+ * from what the App has when called again, also past the first GiB.
+ * The transfer is reported with AHpollProgress.
+ */
+
+#include "check.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+// Ten chunks of 60 KiB, with v1 frames
+#define StemLength (10 * 60 * 1024)
+
+typedef struct {
+    int count;
+    int status;
+    long long stemBytes;
+    long long stemSum;
+} Completions;
+
+static void collect(const AHCompletion* completion, void* userData) {
+    Completions* completions = (Completions*) userData;
+    completions->count++;
+    completions->status = completion->status;
+    completions->stemBytes = completionNumber(completion, "stemBytes");
+    completions->stemSum = completionNumber(completion, "stemSum");
+}
+
+static const char drop[] = "{\"stems\": {\"mixStemURL\": \"stem:mix\"}}";
+static char audio[StemLength];
+
+static int dropStem(short int requestID) {
+    AHStem stem = {"mix", audio, sizeof(audio), 0};
+    return AHdropStems(drop, sizeof(drop) - 1, requestID, &stem, 1);
+}
+
+static void checkStemArrived() {
+    Completions completions = {0, 0, 0, 0};
+    CHECK_RESULT(AHpollCompletions(collect, &completions), 0);
+    CHECK(completions.count == 1 && completions.status == 0);
+    CHECK(completions.stemBytes == StemLength);
+    CHECK(completions.stemSum == (long long) byteSum(audio, sizeof(audio)));
+}
+
+static void handedOver() {
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", "stemHandles", 1);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    CHECK_RESULT(dropStem(1), 0);
+    checkStemArrived();
+
+    char path[] = "/tmp/allihoopa-test-XXXXXX";
+    int file = mkstemp(path);
+    CHECK(file != -1);
+    CHECK(write(file, audio, sizeof(audio)) == (ssize_t) sizeof(audio));
+    AHStem stem = {"mix", 0, 0, file};
+    CHECK_RESULT(AHdropStems(drop, sizeof(drop) - 1, 2, &stem, 1), 0);
+    checkStemArrived();
+    close(file);
+    unlink(path);
+
+    // The stem name must be one the drop can refer to
+    AHStem badName = {"mix stem", audio, sizeof(audio), 0};
+    CHECK_RESULT(AHdropStems(drop, sizeof(drop) - 1, 3, &badName, 1), AHErrorInvalidRequest);
+    CHECK_RESULT(AHclose(), 0);
+
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", "", 1);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    CHECK_RESULT(dropStem(4), AHErrorNotSupported);
+    CHECK_RESULT(AHclose(), 0);
+    unsetenv("ALLIHOOPA_FAKE_CAPABILITIES");
+}
+
+// The second chunk fails its checksum once
+static void retriedChunk() {
+    setenv("ALLIHOOPA_FAKE_FAIL_CHUNK", "2", 1);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    CHECK_RESULT(dropStem(1), 0);
+    checkStemArrived();
+    CHECK_RESULT(AHclose(), 0);
+    unsetenv("ALLIHOOPA_FAKE_FAIL_CHUNK");
+}
+
+typedef struct {
+    int count;
+    short int requestID;
+    char stage[16];
+    long long done;
+    long long total;
+} Reports;
+
+static void collectProgress(const AHProgress* progress, void* userData) {
+    Reports* reports = (Reports*) userData;
+    reports->count++;
+    reports->requestID = progress->requestID;
+    snprintf(reports->stage, sizeof(reports->stage), "%s", progress->stage);
+    reports->done = progress->done;
+    reports->total = progress->total;
+}
+
+// Only the latest progress of a request is reported, and only once
+static void progress() {
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    Reports reports = {0, 0, "", 0, 0};
+    // What the first transfer left
+    CHECK_RESULT(AHpollProgress(collectProgress, &reports), 0);
+    reports.count = 0;
+    CHECK_RESULT(dropStem(3), 0);
+    CHECK_RESULT(AHpollProgress(collectProgress, &reports), 0);
+    CHECK(reports.count == 1 && reports.requestID == 3);
+    CHECK(strcmp(reports.stage, "transfer") == 0);
+    CHECK(reports.done == StemLength && reports.total == StemLength);
+    reports.count = 0;
+    CHECK_RESULT(AHpollProgress(collectProgress, &reports), 0);
+    CHECK(reports.count == 0);
+    checkStemArrived();
+    CHECK_RESULT(AHclose(), 0);
+
+    // Stages the App reports on
+    setenv("ALLIHOOPA_FAKE_PROGRESS", "1", 1);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    const char* plain = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    CHECK_RESULT(AHdrop(plain, (unsigned short) strlen(plain), 4), 0);
+    // Sent after the reply, picked up by a later poll
+    for (int attempt = 0; attempt < 10 && reports.count == 0; attempt++) {
+        sleepMS(10);
+        CHECK_RESULT(AHpollProgress(collectProgress, &reports), 0);
+    }
+    CHECK(reports.count == 1 && reports.requestID == 4);
+    CHECK(strcmp(reports.stage, "upload") == 0 && reports.done == 1 && reports.total == 1);
+    CHECK_RESULT(AHpollProgress(0, 0), AHErrorInvalidRequest);
+    CHECK_RESULT(AHclose(), 0);
+    unsetenv("ALLIHOOPA_FAKE_PROGRESS");
+}
+
+// 20 ms per reply, which the deadline for the whole transfer doesn't allow
+static void deadline(const char* stateDir) {
+    setenv("ALLIHOOPA_FAKE_DELAY_US", "20000", 1);
+    const char* setup = "{\"timeoutMs\": 150}";
+    CHECK_RESULT(AHsetup(setup, (unsigned short) strlen(setup)), 0);
+
+    long long startUS = nowUS();
+    CHECK_RESULT(dropStem(2), AHErrorTimeout);
+    CHECK(nowUS() - startUS < 300 * 1000);
+
+    // Each call gets further, resuming from the chunks the App has checked
+    int result = AHErrorTimeout;
+    for (int attempt = 0; attempt < 10 && result == AHErrorTimeout; attempt++) {
+        result = dropStem(2);
+    }
+    CHECK_RESULT(result, 0);
+    CHECK_RESULT(AHclose(), 0);
+    unsetenv("ALLIHOOPA_FAKE_DELAY_US");
+
+    char path[64];
+    snprintf(path, sizeof(path), "%s/mix", stateDir);
+    unlink(path);
+}
+
+// The App already has all but the last 2 MiB of a stem longer than 1 GiB
+#define BigStemLength (1100LL * 1024 * 1024)
+#define BigStemMissing (2 * 1024 * 1024)
+
+static void resumedBigStem(const char* stateDir) {
+    char tmpDir[] = "/tmp/allihoopa-test-XXXXXX";
+    CHECK(mkdtemp(tmpDir) != 0);
+    char path[64];
+    snprintf(path, sizeof(path), "%s/big.wav", tmpDir);
+    int file = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    CHECK(file != -1);
+    // Sparse, apart from the audio at the end
+    CHECK(ftruncate(file, BigStemLength) == 0);
+    CHECK(pwrite(file, audio, sizeof(audio), BigStemLength - BigStemMissing) == (ssize_t) sizeof(audio));
+
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", "chunkedStems,frameV2", 1);
+    char setup[128];
+    snprintf(setup, sizeof(setup), "{\"tmpDir\": \"%s\", \"timeoutMs\": 20000}", tmpDir);
+    CHECK_RESULT(AHsetup(setup, (unsigned short) strlen(setup)), 0);
+
+    char hash[AHContentHashLength];
+    CHECK_RESULT(AHhashContent("file:///big.wav", hash, sizeof(hash)), 0);
+    char statePath[64];
+    snprintf(statePath, sizeof(statePath), "%s/big", stateDir);
+    FILE* state = fopen(statePath, "w");
+    CHECK(state != 0);
+    fprintf(state, "%s %lld\n", &hash[6], BigStemLength - BigStemMissing);
+    fclose(state);
+
+    const char big[] = "{\"stems\": {\"mixStemURL\": \"stem:big\"}}";
+    AHStem stem = {"big", 0, 0, file};
+    CHECK_RESULT(AHdropStems(big, sizeof(big) - 1, 5, &stem, 1), 0);
+    Completions completions = {0, 0, 0, 0};
+    CHECK_RESULT(AHpollCompletions(collect, &completions), 0);
+    CHECK(completions.count == 1 && completions.status == 0);
+    CHECK(completions.stemBytes == BigStemMissing);
+    CHECK(completions.stemSum == (long long) byteSum(audio, sizeof(audio)));
+    CHECK_RESULT(AHclose(), 0);
+
+    close(file);
+    unlink(path);
+    unlink(statePath);
+    snprintf(path, sizeof(path), "%s/allihoopa-hashes", tmpDir);
+    unlink(path);
+    rmdir(tmpDir);
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(audio); i++) {
+        audio[i] = (char) (i * 7 + i / 251);
+    }
+    handedOver();
+
+    setenv("ALLIHOOPA_FAKE_CAPABILITIES", "chunkedStems", 1);
+    retriedChunk();
+    progress();
+
+    char stateDir[] = "/tmp/allihoopa-test-XXXXXX";
+    CHECK(mkdtemp(stateDir) != 0);
+    setenv("ALLIHOOPA_FAKE_STATE_DIR", stateDir, 1);
+    deadline(stateDir);
+    resumedBigStem(stateDir);
+    rmdir(stateDir);
+    return checkSummary("stems");
+}
@@ -0,0 +1,61 @@
+/*
+ * An App that dies is relaunched, and the drops it hadn't completed are
+ * replayed to the new one.
+ */
+
+#include "check.h"
+#include <unistd.h>
+
+typedef struct {
+    int count;
+    int seen[8];
+} Completions;
+
+static void collect(const AHCompletion* completion, void* userData) {
+    Completions* completions = (Completions*) userData;
+    completions->count++;
+    if (completion->status == 0 && completion->requestID > 0 && completion->requestID < 8) {
+        completions->seen[completion->requestID]++;
+    }
+}
+
+int main() {
+    char stateDir[] = "/tmp/allihoopa-test-XXXXXX";
+    CHECK(mkdtemp(stateDir) != 0);
+    setenv("ALLIHOOPA_FAKE_STATE_DIR", stateDir, 1);
+    setenv("ALLIHOOPA_FAKE_EXIT_DROP", "3", 1);
+
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 1), 0);
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 2), 0);
+    // The App dies on this one, which fails and so won't complete
+    CHECK(AHdrop(drop, (unsigned short) strlen(drop), 3) != 0);
+
+    // Relaunched on the next call, which replays drops 1 and 2
+    Completions completions = {0, {0}};
+    for (int attempt = 0; attempt < 20 && completions.count < 2; attempt++) {
+        AHpollCompletions(collect, &completions);
+        sleepMS(50);
+    }
+    CHECK(completions.seen[1] == 1);
+    CHECK(completions.seen[2] == 1);
+    CHECK(completions.seen[3] == 0);
+
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 4), 0);
+    completions.count = 0;
+    CHECK_RESULT(AHpollCompletions(collect, &completions), 0);
+    CHECK(completions.count == 1 && completions.seen[4] == 1);
+
+    char stats[4096];
+    size_t statsLength = 0;
+    CHECK_RESULT(AHgetStats(stats, sizeof(stats), &statsLength), 0);
+    CHECK(strstr(stats, "\"restarts\": 1") != 0);
+    CHECK_RESULT(AHclose(), 0);
+
+    char marker[64];
+    snprintf(marker, sizeof(marker), "%s/exited-3", stateDir);
+    unlink(marker);
+    rmdir(stateDir);
+    return checkSummary("supervisor");
+}
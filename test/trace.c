@@ -0,0 +1,95 @@
+/*
+ * AHdumpTrace writes the frames sent and received, oldest first, and only
+ * the newest events when the buffer is small or the ring has wrapped,
+ * also when the host allocator is out of memory.
+ */
+
+#include "check.h"
+
+static char trace[1 << 17];
+
+static size_t dumpTrace(size_t bufferSize) {
+    size_t length = 0;
+    CHECK_RESULT(AHdumpTrace(trace, bufferSize, &length), 0);
+    CHECK(length <= bufferSize);
+    trace[length] = 0;
+    return length;
+}
+
+static int lineCount(const char* text) {
+    int lines = 0;
+    for (; *text != 0; text++) {
+        lines += *text == '\n';
+    }
+    return lines;
+}
+
+static void* failingAlloc(size_t size, void* userData) {
+    (void) size;
+    (void) userData;
+    return 0;
+}
+
+static void failingFree(void* pointer, void* userData) {
+    (void) pointer;
+    (void) userData;
+}
+
+static void ignoreCompletion(const char* completion, unsigned short length) {
+    (void) completion;
+    (void) length;
+}
+
+int main() {
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 7), 0);
+    CHECK_RESULT(AHpollCompletedRequests(ignoreCompletion), 0);
+
+    size_t length = dumpTrace(sizeof(trace) - 1);
+    CHECK(strstr(trace, " lnch ") != 0);
+    CHECK(strstr(trace, " init ") != 0);
+    char dropLine[64];
+    // Frame lengths include the 8 byte header
+    snprintf(dropLine, sizeof(dropLine), " drop 7 %u 0\n", (unsigned) strlen(drop) + 8);
+    CHECK(strstr(trace, dropLine) != 0);
+    CHECK(strstr(trace, " okay 7 ") != 0);
+    CHECK(strstr(trace, " poll 0 ") != 0);
+
+    // Every line is "<microseconds> <command> <request ID> <bytes> <result code>", in order
+    long long previousUS = 0;
+    int wellFormed = 1;
+    for (const char* line = trace; *line != 0; line = strchr(line, '\n') + 1) {
+        long long us = 0;
+        char command[8];
+        int requestID = 0, result = 0;
+        unsigned long bytes = 0;
+        wellFormed &= sscanf(line, "%lld %7s %d %lu %d", &us, command, &requestID, &bytes, &result) == 5
+            && strlen(command) == 4 && us >= previousUS;
+        previousUS = us;
+    }
+    CHECK(wellFormed);
+
+    // A small buffer gets the newest whole lines
+    char full[sizeof(trace)];
+    memcpy(full, trace, length + 1);
+    size_t tailLength = dumpTrace(100);
+    CHECK(tailLength > 0 && trace[tailLength - 1] == '\n');
+    CHECK(memcmp(trace, &full[length - tailLength], tailLength) == 0);
+
+    // Only the last 1024 events are kept
+    for (int i = 0; i < 1000; i++) {
+        CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 7), 0);
+    }
+    dumpTrace(sizeof(trace) - 1);
+    CHECK(lineCount(trace) == 1024);
+
+    CHECK_RESULT(AHclose(), 0);
+
+    // Dumping takes no memory from the host
+    CHECK_RESULT(AHsetAllocator(failingAlloc, failingFree, 0), 0);
+    length = dumpTrace(sizeof(trace) - 1);
+    CHECK(lineCount(trace) == 1024 && trace[length - 1] == '\n');
+    CHECK_RESULT(AHsetAllocator(0, 0, 0), 0);
+    return checkSummary("trace");
+}
@@ -0,0 +1,87 @@
+/*
+ * Launching the App, round trips, and closing an App that won't exit.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+typedef struct {
+    int count;
+    short int requestID;
+    int status;
+    long long bytes;
+    long long sum;
+} Completions;
+
+static void collect(const AHCompletion* completion, void* userData) {
+    Completions* completions = (Completions*) userData;
+    completions->count++;
+    completions->requestID = completion->requestID;
+    completions->status = completion->status;
+    completions->bytes = completionNumber(completion, "bytes");
+    completions->sum = completionNumber(completion, "sum");
+}
+
+static void roundTrip() {
+    const char* setup = "{}";
+    CHECK_RESULT(AHsetup(setup, (unsigned short) strlen(setup)), 0);
+
+    unsigned int launchMS = 0;
+    CHECK_RESULT(AHgetLaunchTime(&launchMS), 0);
+
+    const char* drop = "{\"stems\": {\"mixStem\": \"file:///mix.wav\"}}";
+    CHECK_RESULT(AHdrop(drop, (unsigned short) strlen(drop), 7), 0);
+
+    Completions completions = {0, 0, 0, 0, 0};
+    CHECK_RESULT(AHpollCompletions(collect, &completions), 0);
+    CHECK(completions.count == 1);
+    CHECK(completions.requestID == 7);
+    CHECK(completions.status == 0);
+    CHECK(completions.bytes == (long long) strlen(drop));
+    CHECK(completions.sum == (long long) byteSum(drop, strlen(drop)));
+
+    // Nothing more to report
+    completions.count = 0;
+    CHECK_RESULT(AHpollCompletions(collect, &completions), 0);
+    CHECK(completions.count == 0);
+
+    CHECK_RESULT(AHclose(), 0);
+}
+
+static void missingApp() {
+    // The stand-in is launched by a relative path
+    char directory[1024];
+    CHECK(getcwd(directory, sizeof(directory)) != 0);
+    CHECK(chdir("/") == 0);
+    CHECK_RESULT(AHsetup("{}", 2), AHErrorAppNotFound);
+    CHECK(chdir(directory) == 0);
+}
+
+static void stuckApp() {
+    setenv("ALLIHOOPA_FAKE_IGNORE_EOF", "1", 1);
+    setenv("ALLIHOOPA_FAKE_IGNORE_TERM", "1", 1);
+    CHECK_RESULT(AHsetup("{}", 2), 0);
+
+    // Terminated and then killed, instead of hanging on the app
+    long long startUS = nowUS();
+    CHECK_RESULT(AHclose(), 0);
+    CHECK(nowUS() - startUS < 4 * 1000 * 1000);
+
+    // And reaped
+    int status = 0;
+    CHECK(waitpid(-1, &status, WNOHANG) == -1 && errno == ECHILD);
+
+    unsetenv("ALLIHOOPA_FAKE_IGNORE_EOF");
+    unsetenv("ALLIHOOPA_FAKE_IGNORE_TERM");
+}
+
+int main() {
+    roundTrip();
+    missingApp();
+    stuckApp();
+    // Relaunched after being closed
+    roundTrip();
+    return checkSummary("transport");
+}